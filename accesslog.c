@@ -0,0 +1,451 @@
+#define _POSIX_C_SOURCE 200809L
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
+
+#include "accesslog.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "error.h"
+
+#define ACCESSLOG_RINGSIZE    (1024 * 1024)  /* Bytes buffered per thread */
+#define ACCESSLOG_MAXTHREADS  256   /* Threads that can log */
+#define ACCESSLOG_MAXLINE     4096  /* Longer records are cut short */
+#define ACCESSLOG_FLUSH_MS    100   /* How often records are written out */
+
+/*
+ * Every logging thread appends formatted records to a ring of its own,
+ * which the writer thread drains. With one producer and one consumer the
+ * ring needs no locks: the owner only moves head, the writer only tail.
+ * When the ring is full, records are dropped and counted rather than
+ * making the request thread wait for the disk.
+ */
+struct ring {
+    char buf[ACCESSLOG_RINGSIZE];
+    unsigned long head __attribute__((aligned(64)));  /* End of records */
+    unsigned long tail __attribute__((aligned(64)));  /* End of written ones */
+    unsigned long dropped;
+};
+
+static struct ring *rings[ACCESSLOG_MAXTHREADS];
+static int nrings = 0;
+static __thread struct ring *self = NULL;
+
+static char *logpath = NULL;
+static enum accesslog_format logformat = ACCESSLOG_COMBINED;
+static int logfd = -1;
+static int active = 0;
+static int stopfd = -1;
+static pthread_t writer_tid;
+static volatile sig_atomic_t reopenflag = 0;
+
+/* The date of the last record, formatting it once a second is enough. */
+static __thread time_t datesec = -1;
+static __thread char datebuf[64];
+
+static void *writer_thread(void *arg);
+
+/*
+ * open_log - Open the log file for appending. "-" is standard output.
+ */
+static int open_log(void) {
+    if (strcmp(logpath, "-") == 0)
+        return dup(STDOUT_FILENO);
+    return open(logpath, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+}
+
+/*
+ * accesslog_open - Start logging requests to path in format. Returns -1
+ *     with errno set on error.
+ */
+int accesslog_open(const char *path, enum accesslog_format format) {
+    int rc;
+
+    logformat = format;
+    if ((logpath = strdup(path)) == NULL)
+        return -1;
+    if ((logfd = open_log()) < 0 || (stopfd = eventfd(0, EFD_CLOEXEC)) < 0) {
+        rc = errno;
+        accesslog_close();
+        errno = rc;
+        return -1;
+    }
+    if ((rc = pthread_create(&writer_tid, NULL, writer_thread, NULL)) != 0) {
+        close(stopfd);
+        stopfd = -1;
+        accesslog_close();
+        errno = rc;
+        return -1;
+    }
+    active = 1;
+    return 0;
+}
+
+/*
+ * accesslog_close - Write out what is left and stop logging. Threads must
+ *     no longer log when this is called.
+ */
+void accesslog_close(void) {
+    int i;
+    uint64_t one = 1;
+
+    active = 0;
+    if (stopfd >= 0) {
+        if (write(stopfd, &one, sizeof(one)) != sizeof(one))
+            unix_errq("eventfd write error");
+        pthread_join(writer_tid, NULL);
+        close(stopfd);
+        stopfd = -1;
+    }
+    if (logfd >= 0)
+        close(logfd);
+    logfd = -1;
+    for (i = 0; i < nrings; ++i)
+        free(rings[i]);
+    nrings = 0;
+    free(logpath);
+    logpath = NULL;
+}
+
+int accesslog_active(void) {
+    return active;
+}
+
+/*
+ * accesslog_register - Give the calling thread a ring to log into. Until
+ *     it is called the thread's records are dropped. Returns -1 if there
+ *     is no room.
+ */
+int accesslog_register(void) {
+    int i;
+    struct ring *r;
+
+    if (self != NULL)
+        return 0;
+    if ((r = calloc(1, sizeof(struct ring))) == NULL)
+        return -1;
+    /* A slot is only taken below the cap, so nrings never passes it. */
+    i = __atomic_load_n(&nrings, __ATOMIC_ACQUIRE);
+    do {
+        if (i >= ACCESSLOG_MAXTHREADS) {
+            free(r);
+            return -1;
+        }
+    } while (!__atomic_compare_exchange_n(&nrings, &i, i + 1, 1,
+                                          __ATOMIC_ACQ_REL,
+                                          __ATOMIC_ACQUIRE));
+    __atomic_store_n(&rings[i], r, __ATOMIC_RELEASE);
+    self = r;
+    return 0;
+}
+
+/*
+ * accesslog_reopen - Have the writer reopen the log file, after it has
+ *     been rotated. Safe to call from a signal handler.
+ */
+void accesslog_reopen(void) {
+    reopenflag = 1;
+}
+
+/*
+ * accesslog_dropped - Return how many records were dropped because a
+ *     ring was full.
+ */
+unsigned long accesslog_dropped(void) {
+    unsigned long sum = 0;
+    struct ring *r;
+    int i, n = __atomic_load_n(&nrings, __ATOMIC_ACQUIRE);
+
+    for (i = 0; i < n; ++i) {
+        if ((r = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE)) != NULL)
+            sum += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+    }
+    return sum;
+}
+
+/*
+ * A record being formatted. Appending past the end is ignored, so a
+ * record that is too long is cut short.
+ */
+struct line {
+    char buf[ACCESSLOG_MAXLINE];
+    size_t len;
+};
+
+static void put(struct line *l, const char *s, size_t n) {
+    if (n > sizeof(l->buf) - l->len)
+        n = sizeof(l->buf) - l->len;
+    memcpy(l->buf + l->len, s, n);
+    l->len += n;
+}
+
+static void put_str(struct line *l, const char *s) {
+    put(l, s, strlen(s));
+}
+
+/*
+ * put_escaped - Append s[0, n), escaping quotes, backslashes and control
+ *     characters so that a client can't forge records, as a JSON string
+ *     if json is set and like Apache does otherwise.
+ */
+static void put_escaped(struct line *l, const char *s, size_t n, int json) {
+    char esc[8];
+    size_t i, start;
+
+    for (i = start = 0; i < n; ++i) {
+        unsigned char c = s[i];
+
+        if (c != '"' && c != '\\' && c >= 0x20 && c != 0x7f)
+            continue;
+        put(l, s + start, i - start);
+        start = i + 1;
+        if (c == '"' || c == '\\')
+            snprintf(esc, sizeof(esc), "\\%c", c);
+        else
+            snprintf(esc, sizeof(esc), json ? "\\u%04x" : "\\x%02x", c);
+        put_str(l, esc);
+    }
+    put(l, s + start, n - start);
+}
+
+/*
+ * put_slice - Append a request field, or "-" if it is missing.
+ */
+static void put_slice(struct line *l, const struct http_slice *s, int json) {
+    if (s == NULL)
+        put_str(l, "-");
+    else
+        put_escaped(l, s->p, s->len, json);
+}
+
+static void put_peer(struct line *l, const struct sockaddr_storage *peer) {
+    char addr[INET6_ADDRSTRLEN];
+    const void *src = NULL;
+
+    if (peer != NULL && peer->ss_family == AF_INET)
+        src = &((const struct sockaddr_in *)peer)->sin_addr;
+    else if (peer != NULL && peer->ss_family == AF_INET6)
+        src = &((const struct sockaddr_in6 *)peer)->sin6_addr;
+    if (src == NULL || inet_ntop(peer->ss_family, src, addr, sizeof(addr)) == NULL)
+        put_str(l, "-");
+    else
+        put_str(l, addr);
+}
+
+static void put_date(struct line *l) {
+    time_t now = time(NULL);
+    struct tm tm;
+
+    if (now != datesec) {
+        localtime_r(&now, &tm);
+        strftime(datebuf, sizeof(datebuf),
+                 logformat == ACCESSLOG_JSON ? "%Y-%m-%dT%H:%M:%S%z"
+                                             : "%d/%b/%Y:%H:%M:%S %z", &tm);
+        datesec = now;
+    }
+    put_str(l, datebuf);
+}
+
+/*
+ * format_clf - Format a record in the Common or Combined Log Format.
+ */
+static void format_clf(struct line *l, const struct sockaddr_storage *peer,
+                       const struct http_request *req, int status,
+                       off_t bytes) {
+    char num[64];
+
+    put_peer(l, peer);
+    put_str(l, " - - [");
+    put_date(l);
+    put_str(l, "] \"");
+    if (req == NULL)
+        put_str(l, "-");
+    else {
+        put_escaped(l, req->method.p, req->method.len, 0);
+        put_str(l, " ");
+        put_escaped(l, req->target.p, req->target.len, 0);
+        put_str(l, " ");
+        put_escaped(l, req->version.p, req->version.len, 0);
+    }
+    if (bytes > 0)
+        snprintf(num, sizeof(num), "\" %d %lld", status, (long long)bytes);
+    else
+        snprintf(num, sizeof(num), "\" %d -", status);
+    put_str(l, num);
+
+    if (logformat == ACCESSLOG_COMBINED) {
+        put_str(l, " \"");
+        put_slice(l, req != NULL ? http_find_header(req, "Referer") : NULL, 0);
+        put_str(l, "\" \"");
+        put_slice(l, req != NULL ? http_find_header(req, "User-Agent") : NULL,
+                  0);
+        put_str(l, "\"");
+    }
+}
+
+static void format_json(struct line *l, const struct sockaddr_storage *peer,
+                        const struct http_request *req, int status,
+                        off_t bytes) {
+    char num[64];
+    const struct http_request *r = req;
+
+    put_str(l, "{\"time\": \"");
+    put_date(l);
+    put_str(l, "\", \"remote\": \"");
+    put_peer(l, peer);
+    put_str(l, "\", \"method\": \"");
+    put_slice(l, r != NULL ? &r->method : NULL, 1);
+    put_str(l, "\", \"uri\": \"");
+    put_slice(l, r != NULL ? &r->target : NULL, 1);
+    put_str(l, "\", \"protocol\": \"");
+    put_slice(l, r != NULL ? &r->version : NULL, 1);
+    snprintf(num, sizeof(num), "\", \"status\": %d, \"bytes\": %lld",
+             status, (long long)bytes);
+    put_str(l, num);
+    put_str(l, ", \"referer\": \"");
+    put_slice(l, r != NULL ? http_find_header(r, "Referer") : NULL, 1);
+    put_str(l, "\", \"user_agent\": \"");
+    put_slice(l, r != NULL ? http_find_header(r, "User-Agent") : NULL, 1);
+    put_str(l, "\"}");
+}
+
+/*
+ * accesslog_request - Log a response of status with a body of bytes to
+ *     peer. req is NULL if the request head couldn't be parsed. This
+ *     never blocks: the record is dropped if the ring is full.
+ */
+void accesslog_request(const struct sockaddr_storage *peer,
+                       const struct http_request *req, int status,
+                       off_t bytes) {
+    struct line l;
+    struct ring *r = self;
+    unsigned long tail, off, n;
+
+    if (r == NULL || !active)
+        return;
+    l.len = 0;
+    if (logformat == ACCESSLOG_JSON)
+        format_json(&l, peer, req, status, bytes);
+    else
+        format_clf(&l, peer, req, status, bytes);
+    if (l.len == sizeof(l.buf))
+        l.len--;
+    l.buf[l.len++] = '\n';
+
+    tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (l.len > ACCESSLOG_RINGSIZE - (r->head - tail)) {
+        __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    off = r->head % ACCESSLOG_RINGSIZE;
+    n = l.len < ACCESSLOG_RINGSIZE - off ? l.len : ACCESSLOG_RINGSIZE - off;
+    memcpy(r->buf + off, l.buf, n);
+    memcpy(r->buf, l.buf + n, l.len - n);
+    __atomic_store_n(&r->head, r->head + l.len, __ATOMIC_RELEASE);
+}
+
+/*
+ * flush_rings - Write out everything in the rings with as few writev(2)
+ *     calls as possible, straight from the rings. Records that can't be
+ *     written are lost, so that request threads never wait for us.
+ */
+static void flush_rings(void) {
+    struct iovec iov[2 * ACCESSLOG_MAXTHREADS], *v;
+    unsigned long heads[ACCESSLOG_MAXTHREADS], off, len;
+    int i, n, cnt = 0, pos = 0;
+    struct ring *r;
+    ssize_t written;
+
+    n = __atomic_load_n(&nrings, __ATOMIC_ACQUIRE);
+    for (i = 0; i < n; ++i) {
+        if ((r = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE)) == NULL) {
+            heads[i] = 0;
+            continue;
+        }
+        heads[i] = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        if ((len = heads[i] - r->tail) == 0)
+            continue;
+        off = r->tail % ACCESSLOG_RINGSIZE;
+        iov[cnt].iov_base = r->buf + off;
+        iov[cnt].iov_len = len < ACCESSLOG_RINGSIZE - off
+                           ? len : ACCESSLOG_RINGSIZE - off;
+        if (len > iov[cnt].iov_len) {
+            iov[cnt + 1].iov_base = r->buf;
+            iov[cnt + 1].iov_len = len - iov[cnt].iov_len;
+            cnt++;
+        }
+        cnt++;
+    }
+
+    while (pos < cnt) {
+        written = writev(logfd, iov + pos,
+                         cnt - pos < IOV_MAX ? cnt - pos : IOV_MAX);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            unix_err("access log write error");
+            break;
+        }
+        for (; pos < cnt; ++pos) {
+            v = &iov[pos];
+            if ((size_t)written < v->iov_len) {
+                v->iov_base = (char *)v->iov_base + written;
+                v->iov_len -= written;
+                break;
+            }
+            written -= v->iov_len;
+        }
+    }
+
+    for (i = 0; i < n; ++i) {
+        if ((r = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE)) != NULL)
+            __atomic_store_n(&r->tail, heads[i], __ATOMIC_RELEASE);
+    }
+}
+
+static void *writer_thread(void *arg) {
+    struct pollfd pfd;
+    sigset_t mask;
+    int rc, fd, stop = 0;
+
+    /* Block all signals. */
+    sigfillset(&mask);
+    if ((rc = pthread_sigmask(SIG_SETMASK, &mask, NULL)) != 0)
+        posix_errq(rc, "pthread_sigmask error");
+
+    pfd.fd = stopfd;
+    pfd.events = POLLIN;
+    while (!stop) {
+        if (poll(&pfd, 1, ACCESSLOG_FLUSH_MS) < 0 && errno != EINTR)
+            unix_errq("poll error");
+        stop = pfd.revents & POLLIN;
+        flush_rings();
+
+        /* Records so far went to the old file, the next go to the new. */
+        if (reopenflag) {
+            reopenflag = 0;
+            if ((fd = open_log()) < 0)
+                unix_err("cannot reopen %s", logpath);
+            else {
+                close(logfd);
+                logfd = fd;
+            }
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,25 @@
+#ifndef _ACCESSLOG_H
+#define _ACCESSLOG_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "http-parser.h"
+
+enum accesslog_format {
+    ACCESSLOG_COMMON,    /* Common Log Format */
+    ACCESSLOG_COMBINED,  /* ... with referer and user agent */
+    ACCESSLOG_JSON,      /* One JSON object per line */
+};
+
+int accesslog_open(const char *path, enum accesslog_format format);
+void accesslog_close(void);
+int accesslog_active(void);
+int accesslog_register(void);
+void accesslog_request(const struct sockaddr_storage *peer,
+                       const struct http_request *req, int status,
+                       off_t bytes);
+void accesslog_reopen(void);
+unsigned long accesslog_dropped(void);
+
+#endif
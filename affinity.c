@@ -0,0 +1,84 @@
+#define _GNU_SOURCE
+
+#include "affinity.h"
+
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49
+#endif
+
+static int sys_getcpu(unsigned *cpu, unsigned *node) {
+    return syscall(__NR_getcpu, cpu, node, NULL);
+}
+
+static int sys_set_mempolicy(int mode, const unsigned long *nodemask,
+                             unsigned long maxnode) {
+    return syscall(__NR_set_mempolicy, mode, nodemask, maxnode);
+}
+
+/*
+ * affinity_cpus - Store up to max of the CPUs we may run on in cpus, in
+ *     ascending order. Returns how many there are, at least 1, or -1
+ *     with errno set on error.
+ */
+int affinity_cpus(int *cpus, int max) {
+    cpu_set_t set;
+    int cpu, n = 0;
+
+    if (sched_getaffinity(0, sizeof(set), &set) != 0)
+        return -1;
+    for (cpu = 0; cpu < CPU_SETSIZE && cpu < AFFINITY_MAXCPUS; ++cpu) {
+        if (CPU_ISSET(cpu, &set) && n < max)
+            cpus[n++] = cpu;
+    }
+    if (n == 0) {
+        errno = ESRCH;
+        return -1;
+    }
+    return n;
+}
+
+/*
+ * affinity_pin - Keep the calling thread on cpu, and have the memory it
+ *     allocates from now on come from the NUMA node of cpu while that
+ *     has free pages. Without NUMA support in the kernel the thread is
+ *     only pinned. Returns -1 with errno set if it can't be pinned.
+ */
+int affinity_pin(int cpu) {
+    cpu_set_t set;
+    unsigned here, node;
+    unsigned long nodemask[16] = {0};
+    int rc;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if ((rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) != 0) {
+        errno = rc;
+        return -1;
+    }
+    /* We have moved to cpu by now, so the node we are on is its node. */
+    if (sys_getcpu(&here, &node) != 0
+        || node >= 8 * sizeof(nodemask))
+        return 0;
+    nodemask[node / (8 * sizeof(long))] |= 1UL << node % (8 * sizeof(long));
+    sys_set_mempolicy(MPOL_PREFERRED, nodemask, 8 * sizeof(nodemask));
+    return 0;
+}
+
+/*
+ * affinity_incoming - Ask the kernel to hand sockfd, one of a group of
+ *     SO_REUSEPORT listening sockets, the connections whose packets were
+ *     received on cpu. With the NIC's receive queues steered to CPUs by
+ *     RSS, a connection is then served where its interrupts land.
+ *     Returns -1 with errno set on error.
+ */
+int affinity_incoming(int sockfd, int cpu) {
+    return setsockopt(sockfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+}
@@ -0,0 +1,10 @@
+#ifndef _AFFINITY_H
+#define _AFFINITY_H
+
+#define AFFINITY_MAXCPUS  1024  /* CPUs beyond this are ignored */
+
+int affinity_cpus(int *cpus, int max);
+int affinity_pin(int cpu);
+int affinity_incoming(int sockfd, int cpu);
+
+#endif
@@ -0,0 +1,656 @@
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "error.h"
+#include "http-utils.h"
+
+#define MAXURLS      64
+#define MAXDEPTH     64          /* Max pipelined requests per connection */
+#define MAXEVENTS    256
+#define RBUFSIZE     (64 * 1024)
+#define WBUFSIZE     (MAXDEPTH * 512)
+#define MAXPATH      256
+
+#define CONNECTIONS  16  /* Default concurrent connections */
+#define NTHREADS     1   /* Default load generator threads */
+#define DURATION     10  /* Default seconds to run */
+#define WAIT_SERVER  5   /* Seconds to wait for the server to come up */
+
+/*
+ * Latencies go into a log-linear histogram: values below HIST_SUB get a
+ * bucket each, every power of two above is split in HIST_SUB buckets.
+ * Percentiles are thus exact to within 1/HIST_SUB, about 3%.
+ */
+#define HIST_SUBBITS  5
+#define HIST_SUB      (1 << HIST_SUBBITS)
+#define HIST_BUCKETS  ((64 - HIST_SUBBITS + 1) * HIST_SUB)
+
+struct hist {
+    unsigned long count[HIST_BUCKETS];
+    unsigned long n;
+    uint64_t sum, max;
+};
+
+struct url {
+    char path[MAXPATH];
+    int weight;
+};
+
+struct thread;
+
+/*
+ * One client connection. It sends a batch of depth requests at once and
+ * sends the next batch when all of them have been answered, so depth 1
+ * is plain request-response.
+ */
+struct client {
+    int fd;
+    struct thread *t;
+    int reqs[MAXDEPTH];        /* URL index of every request in the batch */
+    uint64_t sent[MAXDEPTH];   /* ... and when it was sent */
+    int nreqs, done;           /* Requests in the batch, answered so far */
+    int closing;               /* The server will close after this response */
+    int inbody;                /* Reading the body of a response */
+    int code;                  /* ... its status */
+    size_t bodyleft;
+    size_t resplen;
+    size_t wlen, wpos;
+    size_t rlen;
+    char wbuf[WBUFSIZE];
+    char rbuf[RBUFSIZE];
+};
+
+struct thread {
+    pthread_t tid;
+    int epollfd;
+    unsigned int seed;
+    struct client *clients;
+    int nclients;
+
+    /* Results, merged by the main thread when everybody is done. */
+    unsigned long requests;
+    unsigned long errors;
+    unsigned long connects;
+    unsigned long status[6];   /* By class, 1xx to 5xx, 0 for garbage */
+    uint64_t bytes;
+    struct hist hist;
+};
+
+static char *host = "127.0.0.1";
+static char *port = NULL;
+static int nconns = CONNECTIONS;
+static int nthreads = NTHREADS;
+static int duration = DURATION;
+static int keepalive = 1;
+static int depth = 1;
+static struct url urls[MAXURLS];
+static int nurls = 0;
+static int totalweight = 0;
+static volatile int stopflag = 0;
+
+void show_usage(const char *name);
+void add_url(const char *arg);
+void wait_server(void);
+void *bench_thread(void *arg);
+void client_connect(struct client *c);
+void client_close(struct client *c);
+void client_batch(struct client *c);
+void client_fill(struct client *c);
+int client_write(struct client *c);
+int client_read(struct client *c);
+int client_response(struct client *c);
+void hist_record(struct hist *h, uint64_t v);
+void hist_merge(struct hist *dst, const struct hist *src);
+uint64_t hist_percentile(const struct hist *h, double q);
+void print_json(FILE *fp, struct thread *total, double elapsed);
+void print_jsonstr(FILE *fp, const char *s);
+uint64_t now_ns(void);
+
+int main(int argc, char *argv[]) {
+    int opt, i, rc;
+    char *output = NULL;
+    struct thread *threads, total;
+    uint64_t start, end;
+    FILE *fp = stdout;
+
+    /* Process args. */
+    while (1) {
+        static const char *optstring = "H:p:c:n:d:P:u:o:h";
+        static const struct option longopts[] = {
+            {"host", required_argument, NULL, 'H'},
+            {"port", required_argument, NULL, 'p'},
+            {"connections", required_argument, NULL, 'c'},
+            {"threads", required_argument, NULL, 'n'},
+            {"duration", required_argument, NULL, 'd'},
+            {"pipeline", required_argument, NULL, 'P'},
+            {"no-keepalive", no_argument, NULL, 'K'},
+            {"url", required_argument, NULL, 'u'},
+            {"output", required_argument, NULL, 'o'},
+            {"help", no_argument, NULL, 'h'},
+            {NULL, no_argument, NULL, 0}};
+
+        opt = getopt_long(argc, argv, optstring, longopts, NULL);
+        if (opt == -1)
+            break;
+
+        switch (opt) {
+        case 'H': host = optarg; break;
+        case 'p': port = optarg; break;
+        case 'c':
+            if ((nconns = atoi(optarg)) <= 0)
+                app_errq("Invalid connections: %s", optarg);
+            break;
+        case 'n':
+            if ((nthreads = atoi(optarg)) <= 0)
+                app_errq("Invalid threads: %s", optarg);
+            break;
+        case 'd':
+            if ((duration = atoi(optarg)) <= 0)
+                app_errq("Invalid duration: %s", optarg);
+            break;
+        case 'P':
+            if ((depth = atoi(optarg)) <= 0 || depth > MAXDEPTH)
+                app_errq("Invalid pipeline depth (1-%d): %s", MAXDEPTH, optarg);
+            break;
+        case 'K': keepalive = 0; break;
+        case 'u': add_url(optarg); break;
+        case 'o': output = optarg; break;
+        case 'h':
+        /* 0, ?, etc. */
+        default: show_usage(argv[0]);
+        }
+    }
+
+    /* Handle illegal arguments. */
+    if (port == NULL)
+        show_usage(argv[0]);
+    if (nurls == 0)
+        add_url("/");
+    /* Without keep-alive every request has a connection of its own. */
+    if (!keepalive)
+        depth = 1;
+    if (nthreads > nconns)
+        nthreads = nconns;
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+        unix_errq("signal error");
+
+    wait_server();
+
+    /* Spread the connections over the threads and start them. */
+    if ((threads = calloc(nthreads, sizeof(struct thread))) == NULL)
+        unix_errq("calloc error");
+    start = now_ns();
+    for (i = 0; i < nthreads; ++i) {
+        threads[i].seed = i + 1;
+        threads[i].nclients = nconns / nthreads + (i < nconns % nthreads);
+        if ((rc = pthread_create(&threads[i].tid, NULL, bench_thread,
+                                 &threads[i])) != 0)
+            posix_errq(rc, "pthread_create error");
+    }
+
+    sleep(duration);
+    stopflag = 1;
+    end = now_ns();
+
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < nthreads; ++i) {
+        if ((rc = pthread_join(threads[i].tid, NULL)) != 0)
+            posix_errq(rc, "pthread_join error");
+        total.requests += threads[i].requests;
+        total.errors += threads[i].errors;
+        total.connects += threads[i].connects;
+        total.bytes += threads[i].bytes;
+        for (rc = 0; rc < 6; ++rc)
+            total.status[rc] += threads[i].status[rc];
+        hist_merge(&total.hist, &threads[i].hist);
+    }
+
+    if (output != NULL && (fp = fopen(output, "w")) == NULL)
+        unix_errq("cannot open %s", output);
+    print_json(fp, &total, (end - start) / 1e9);
+    if (fp != stdout)
+        fclose(fp);
+    free(threads);
+    return total.requests > 0 ? 0 : 1;
+}
+
+void show_usage(const char *name) {
+    printf("Usage: %s [-H HOST, --host HOST] [-p PORT, --port PORT]\n"
+           "       [-c N, --connections N] [-n N, --threads N]\n"
+           "       [-d SECS, --duration SECS] [-P N, --pipeline N]\n"
+           "       [--no-keepalive] [-u PATH[@WEIGHT], --url PATH[@WEIGHT]]...\n"
+           "       [-o FILE, --output FILE] [-h, --help]\n",
+           name);
+    exit(1);
+}
+
+/*
+ * add_url - Add a target from arg, a path optionally followed by
+ *     @weight. Every request picks a target with probability weight over
+ *     the sum of all weights.
+ */
+void add_url(const char *arg) {
+    struct url *u;
+    const char *at;
+    size_t len;
+
+    if (nurls == MAXURLS)
+        app_errq("Too many urls, at most %d", MAXURLS);
+    u = &urls[nurls];
+    if ((at = strrchr(arg, '@')) != NULL) {
+        len = at - arg;
+        u->weight = atoi(at + 1);
+    }
+    else {
+        len = strlen(arg);
+        u->weight = 1;
+    }
+    if (arg[0] != '/' || len >= sizeof(u->path) || u->weight <= 0)
+        app_errq("Invalid url: %s", arg);
+    memcpy(u->path, arg, len);
+    u->path[len] = '\0';
+    totalweight += u->weight;
+    nurls++;
+}
+
+/*
+ * wait_server - Wait until the server accepts connections, so that the
+ *     benchmark can be started right after the server.
+ */
+void wait_server(void) {
+    int fd, i;
+    struct timespec ts = {0, 100 * 1000 * 1000};
+
+    for (i = 0; i < WAIT_SERVER * 10; ++i) {
+        if ((fd = open_clientfd(host, port)) >= 0) {
+            close(fd);
+            return;
+        }
+        if (fd == -2)
+            break;
+        nanosleep(&ts, NULL);
+    }
+    app_errq("cannot connect to %s:%s", host, port);
+}
+
+void *bench_thread(void *arg) {
+    struct thread *t = arg;
+    struct epoll_event events[MAXEVENTS];
+    struct client *c;
+    int i, n;
+
+    if ((t->epollfd = epoll_create1(0)) < 0)
+        unix_errq("epoll_create1 error");
+    if ((t->clients = calloc(t->nclients, sizeof(struct client))) == NULL)
+        unix_errq("calloc error");
+    for (i = 0; i < t->nclients; ++i) {
+        c = &t->clients[i];
+        c->t = t;
+        c->fd = -1;
+        client_connect(c);
+    }
+
+    while (!stopflag) {
+        if ((n = epoll_wait(t->epollfd, events, MAXEVENTS, 100)) < 0) {
+            if (errno == EINTR)
+                continue;
+            unix_errq("epoll_wait error");
+        }
+        for (i = 0; i < n && !stopflag; ++i) {
+            c = events[i].data.ptr;
+            if (c->fd < 0)
+                continue;
+            if (client_write(c) < 0 || client_read(c) < 0) {
+                /* Answered requests are kept, the rest is lost. */
+                t->errors++;
+                client_close(c);
+                c->nreqs = c->done = 0;
+                client_connect(c);
+            }
+        }
+
+        /* Connections the server refused get another try. */
+        for (i = 0; i < t->nclients && !stopflag; ++i) {
+            if (t->clients[i].fd < 0)
+                client_connect(&t->clients[i]);
+        }
+    }
+
+    for (i = 0; i < t->nclients; ++i)
+        client_close(&t->clients[i]);
+    close(t->epollfd);
+    free(t->clients);
+    return NULL;
+}
+
+/*
+ * client_connect - Open a new connection for c and send the unanswered
+ *     rest of its batch, or a new one. On failure c->fd stays -1 and the
+ *     error is counted.
+ */
+void client_connect(struct client *c) {
+    struct epoll_event ev;
+    int one = 1;
+
+    if ((c->fd = open_clientfd(host, port)) < 0) {
+        c->fd = -1;
+        c->t->errors++;
+        return;
+    }
+    c->t->connects++;
+    if (fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK) < 0)
+        unix_errq("fcntl error");
+    if (setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0)
+        unix_errq("setsockopt error");
+
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = c;
+    if (epoll_ctl(c->t->epollfd, EPOLL_CTL_ADD, c->fd, &ev) < 0)
+        unix_errq("epoll_ctl error");
+
+    c->closing = c->inbody = 0;
+    c->rlen = 0;
+    if (c->done < c->nreqs)
+        client_fill(c);
+    else
+        client_batch(c);
+}
+
+void client_close(struct client *c) {
+    if (c->fd >= 0)
+        close(c->fd);
+    c->fd = -1;
+}
+
+/*
+ * client_batch - Pick the targets of the next batch of requests and
+ *     queue them for writing.
+ */
+void client_batch(struct client *c) {
+    int i, j, r;
+    uint64_t now = now_ns();
+
+    for (i = 0; i < depth; ++i) {
+        r = rand_r(&c->t->seed) % totalweight;
+        for (j = 0; r >= urls[j].weight; ++j)
+            r -= urls[j].weight;
+        c->reqs[i] = j;
+        c->sent[i] = now;
+    }
+    c->nreqs = depth;
+    c->done = 0;
+    client_fill(c);
+}
+
+/*
+ * client_fill - Put the unanswered requests of the batch in wbuf. A
+ *     request sent again after the server closed the connection keeps
+ *     its original send time, so the reconnect counts as latency.
+ */
+void client_fill(struct client *c) {
+    int i;
+
+    c->wlen = c->wpos = 0;
+    for (i = c->done; i < c->nreqs; ++i)
+        c->wlen += snprintf(c->wbuf + c->wlen, sizeof(c->wbuf) - c->wlen,
+                            "GET %s HTTP/1.1\r\n"
+                            "Host: %s\r\n"
+                            "%s\r\n",
+                            urls[c->reqs[i]].path, host,
+                            keepalive ? "" : "Connection: close\r\n");
+}
+
+/*
+ * client_write - Write what is left of wbuf. Returns 0 when done or when
+ *     the socket would block and -1 on error.
+ */
+int client_write(struct client *c) {
+    ssize_t n;
+
+    while (c->wpos < c->wlen) {
+        n = write(c->fd, c->wbuf + c->wpos, c->wlen - c->wpos);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        c->wpos += n;
+    }
+    return 0;
+}
+
+/*
+ * client_read - Read and account for responses until the socket would
+ *     block. Returns -1 on error, including the server closing with
+ *     requests outstanding that it didn't announce it would drop.
+ */
+int client_read(struct client *c) {
+    ssize_t n;
+    int rc;
+
+    while (1) {
+        n = read(c->fd, c->rbuf + c->rlen, sizeof(c->rbuf) - c->rlen);
+        if (n == 0)
+            return -1;
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        c->rlen += n;
+
+        while ((rc = client_response(c)) > 0) {
+            if (c->done < c->nreqs && !c->closing)
+                continue;
+            /*
+             * Reconnect if the server is closing, it may have dropped
+             * the rest of the batch. client_connect() sends what is left.
+             */
+            if (c->closing || !keepalive) {
+                client_close(c);
+                client_connect(c);
+                return 0;
+            }
+            client_batch(c);
+            if (client_write(c) < 0)
+                return -1;
+        }
+        if (rc < 0)
+            return -1;
+    }
+}
+
+/*
+ * client_response - Consume the next response in rbuf. Only the head is
+ *     buffered, the body is counted and dropped as it arrives. Returns 1
+ *     when a response is complete, 0 if more input is needed and -1 if
+ *     the response is malformed.
+ */
+int client_response(struct client *c) {
+    char *end, *line, *next;
+    size_t headlen, take;
+    struct thread *t = c->t;
+
+    if (!c->inbody) {
+        if ((end = memmem(c->rbuf, c->rlen, "\r\n\r\n", 4)) == NULL)
+            return c->rlen == sizeof(c->rbuf) ? -1 : 0;
+        if (c->done == c->nreqs)
+            return -1; /* Nothing was asked */
+        *end = '\0';
+        headlen = end + 4 - c->rbuf;
+
+        if (sscanf(c->rbuf, "HTTP/1.%*d %d", &c->code) != 1)
+            return -1;
+
+        c->bodyleft = 0;
+        for (line = c->rbuf; line != NULL; line = next) {
+            if ((next = strstr(line, "\r\n")) != NULL)
+                next += 2;
+            if (strncasecmp(line, "Content-length:", 15) == 0)
+                c->bodyleft = strtoul(line + 15, NULL, 10);
+            else if (strncasecmp(line, "Connection:", 11) == 0
+                     && strncasecmp(line + 11 + strspn(line + 11, " "),
+                                    "close", 5) == 0)
+                c->closing = 1;
+        }
+
+        c->resplen = headlen + c->bodyleft;
+        c->rlen -= headlen;
+        memmove(c->rbuf, c->rbuf + headlen, c->rlen);
+        c->inbody = 1;
+    }
+
+    take = c->rlen < c->bodyleft ? c->rlen : c->bodyleft;
+    c->bodyleft -= take;
+    c->rlen -= take;
+    memmove(c->rbuf, c->rbuf + take, c->rlen);
+    if (c->bodyleft > 0)
+        return 0;
+
+    c->inbody = 0;
+    if (!stopflag) {
+        t->requests++;
+        t->bytes += c->resplen;
+        t->status[c->code >= 100 && c->code < 600 ? c->code / 100 : 0]++;
+        hist_record(&t->hist, now_ns() - c->sent[c->done]);
+    }
+    c->done++;
+    return 1;
+}
+
+void hist_record(struct hist *h, uint64_t v) {
+    int e, idx;
+
+    if (v < HIST_SUB)
+        idx = v;
+    else {
+        e = 63 - __builtin_clzll(v);
+        idx = (e - HIST_SUBBITS + 1) * HIST_SUB
+              + ((v >> (e - HIST_SUBBITS)) & (HIST_SUB - 1));
+    }
+    h->count[idx]++;
+    h->n++;
+    h->sum += v;
+    if (v > h->max)
+        h->max = v;
+}
+
+void hist_merge(struct hist *dst, const struct hist *src) {
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; ++i)
+        dst->count[i] += src->count[i];
+    dst->n += src->n;
+    dst->sum += src->sum;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+/*
+ * hist_percentile - Return the value that a fraction q of the recorded
+ *     values doesn't exceed, rounded up to the end of its bucket.
+ */
+uint64_t hist_percentile(const struct hist *h, double q) {
+    unsigned long want, seen = 0;
+    uint64_t upper;
+    int i, e;
+
+    if (h->n == 0)
+        return 0;
+    want = (unsigned long)(q * h->n + 0.5);
+    if (want == 0)
+        want = 1;
+    for (i = 0; i < HIST_BUCKETS; ++i) {
+        if ((seen += h->count[i]) >= want)
+            break;
+    }
+    if (i < HIST_SUB)
+        upper = i;
+    else {
+        e = i / HIST_SUB + HIST_SUBBITS - 1;
+        upper = ((uint64_t)(HIST_SUB + i % HIST_SUB + 1) << (e - HIST_SUBBITS))
+                - 1;
+    }
+    return upper < h->max ? upper : h->max;
+}
+
+/*
+ * print_json - Write the results as one JSON object. Latencies are in
+ *     microseconds.
+ */
+void print_json(FILE *fp, struct thread *total, double elapsed) {
+    int i;
+    struct hist *h = &total->hist;
+
+    fprintf(fp, "{\n  \"host\": ");
+    print_jsonstr(fp, host);
+    fprintf(fp, ",\n  \"port\": ");
+    print_jsonstr(fp, port);
+    fprintf(fp, ",\n  \"connections\": %d,\n  \"threads\": %d,\n"
+                "  \"keepalive\": %s,\n  \"pipeline\": %d,\n  \"urls\": [",
+            nconns, nthreads, keepalive ? "true" : "false", depth);
+    for (i = 0; i < nurls; ++i) {
+        fprintf(fp, "%s{\"path\": ", i > 0 ? ", " : "");
+        print_jsonstr(fp, urls[i].path);
+        fprintf(fp, ", \"weight\": %d}", urls[i].weight);
+    }
+    fprintf(fp, "],\n  \"duration\": %.3f,\n  \"requests\": %lu,\n"
+                "  \"errors\": %lu,\n  \"connects\": %lu,\n",
+            elapsed, total->requests, total->errors, total->connects);
+    fprintf(fp, "  \"status\": {\"1xx\": %lu, \"2xx\": %lu, \"3xx\": %lu, "
+                "\"4xx\": %lu, \"5xx\": %lu, \"other\": %lu},\n",
+            total->status[1], total->status[2], total->status[3],
+            total->status[4], total->status[5], total->status[0]);
+    fprintf(fp, "  \"requests_per_sec\": %.1f,\n  \"bytes\": %llu,\n"
+                "  \"bytes_per_sec\": %.1f,\n",
+            total->requests / elapsed, (unsigned long long)total->bytes,
+            total->bytes / elapsed);
+    fprintf(fp, "  \"latency_us\": {\"mean\": %.1f, \"p50\": %.1f, "
+                "\"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f, "
+                "\"max\": %.1f}\n}\n",
+            h->n > 0 ? h->sum / 1e3 / h->n : 0.0,
+            hist_percentile(h, 0.5) / 1e3, hist_percentile(h, 0.9) / 1e3,
+            hist_percentile(h, 0.99) / 1e3, hist_percentile(h, 0.999) / 1e3,
+            h->max / 1e3);
+}
+
+void print_jsonstr(FILE *fp, const char *s) {
+    fputc('"', fp);
+    for (; *s != '\0'; ++s) {
+        if (*s == '"' || *s == '\\')
+            fprintf(fp, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            fprintf(fp, "\\u%04x", *s);
+        else
+            fputc(*s, fp);
+    }
+    fputc('"', fp);
+}
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
@@ -0,0 +1,332 @@
+#include "cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define CACHE_BUCKETS 1024  /* Hash buckets per shard */
+
+/*
+ * Every shard has its own lock, hash table and CLOCK ring, so threads
+ * looking up different paths rarely contend.
+ */
+struct cache_shard {
+    pthread_mutex_t mutex;
+    struct cache_entry *buckets[CACHE_BUCKETS];
+    struct cache_entry *hand;  /* CLOCK hand, NULL if the ring is empty */
+    size_t bytes;
+    size_t capacity;
+    unsigned long entries;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+};
+
+static struct cache_shard *shards = NULL;
+
+/*
+ * Bumped by every invalidation. An entry built from a file opened before
+ * an invalidation may be stale and is not inserted.
+ */
+static unsigned long generation = 0;
+
+/*
+ * hash - Hash key without the name of its variant, so that variants of a
+ *     key end up in its bucket.
+ */
+static unsigned long hash(const char *key) {
+    unsigned long h = 14695981039346656037UL; /* FNV-1a */
+
+    while (*key != '\0' && *key != CACHE_VARIANT) {
+        h ^= (unsigned char)*key++;
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+static void entry_free(struct cache_entry *e) {
+    if (e->fd >= 0)
+        close(e->fd);
+    free(e->key);
+    free(e->filename);
+    free(e->data);
+    free(e->head);
+    free(e);
+}
+
+/*
+ * unlink_nolock - Remove e from the hash table and CLOCK ring of its
+ *     shard and drop the reference the cache holds.
+ */
+static void unlink_nolock(struct cache_shard *s, struct cache_entry *e,
+                          unsigned long h) {
+    struct cache_entry **pp;
+
+    for (pp = &s->buckets[h % CACHE_BUCKETS]; *pp != e; pp = &(*pp)->hnext)
+        ;
+    *pp = e->hnext;
+
+    if (e->next == e)
+        s->hand = NULL;
+    else {
+        if (s->hand == e)
+            s->hand = e->next;
+        e->prev->next = e->next;
+        e->next->prev = e->prev;
+    }
+    s->bytes -= e->cost;
+    s->entries--;
+    cache_release(e);
+}
+
+/*
+ * evict_nolock - Run the CLOCK hand until the shard fits its capacity.
+ *     Recently referenced entries get a second chance.
+ */
+static void evict_nolock(struct cache_shard *s) {
+    struct cache_entry *victim;
+
+    while (s->bytes > s->capacity && s->hand != NULL) {
+        victim = s->hand;
+        if (victim->referenced) {
+            victim->referenced = 0;
+            s->hand = victim->next;
+            continue;
+        }
+        unlink_nolock(s, victim, hash(victim->key));
+        s->evictions++;
+    }
+}
+
+/*
+ * cache_init - Set up an empty cache holding at most capacity bytes.
+ *     Returns -1 with errno set on error.
+ */
+int cache_init(size_t capacity) {
+    int i, rc;
+
+    if ((shards = calloc(CACHE_SHARDS, sizeof(struct cache_shard))) == NULL)
+        return -1;
+    for (i = 0; i < CACHE_SHARDS; ++i) {
+        shards[i].capacity = capacity / CACHE_SHARDS;
+        if ((rc = pthread_mutex_init(&shards[i].mutex, NULL)) != 0) {
+            errno = rc;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void cache_destroy(void) {
+    int i;
+    struct cache_shard *s;
+
+    if (shards == NULL)
+        return;
+    for (i = 0; i < CACHE_SHARDS; ++i) {
+        s = &shards[i];
+        pthread_mutex_lock(&s->mutex);
+        while (s->hand != NULL)
+            unlink_nolock(s, s->hand, hash(s->hand->key));
+        pthread_mutex_unlock(&s->mutex);
+        pthread_mutex_destroy(&s->mutex);
+    }
+    free(shards);
+    shards = NULL;
+}
+
+/*
+ * cache_entry_new - Allocate an entry for key, referenced once by the
+ *     caller. Returns NULL on error.
+ */
+struct cache_entry *cache_entry_new(const char *key) {
+    struct cache_entry *e;
+
+    if ((e = calloc(1, sizeof(struct cache_entry))) == NULL)
+        return NULL;
+    if ((e->key = strdup(key)) == NULL) {
+        free(e);
+        return NULL;
+    }
+    e->fd = -1;
+    e->refcnt = 1;
+    return e;
+}
+
+/*
+ * cache_lookup - Find the entry of key. The caller must cache_release()
+ *     a returned entry. Returns NULL on a miss or if caching is off.
+ */
+struct cache_entry *cache_lookup(const char *key) {
+    unsigned long h;
+    struct cache_shard *s;
+    struct cache_entry *e;
+
+    if (shards == NULL)
+        return NULL;
+    h = hash(key);
+    s = &shards[h % CACHE_SHARDS];
+
+    pthread_mutex_lock(&s->mutex);
+    for (e = s->buckets[h % CACHE_BUCKETS]; e != NULL; e = e->hnext) {
+        if (strcmp(e->key, key) == 0)
+            break;
+    }
+    if (e != NULL) {
+        __atomic_add_fetch(&e->refcnt, 1, __ATOMIC_RELAXED);
+        e->referenced = 1;
+        s->hits++;
+    }
+    else
+        s->misses++;
+    pthread_mutex_unlock(&s->mutex);
+    return e;
+}
+
+/*
+ * cache_insert - Add e to the cache, replacing any entry with the same
+ *     key. The caller keeps its own reference. Returns -1 if e can't be
+ *     cached, which is not an error for the caller: e is too large, or
+ *     something was invalidated since e->gen was taken.
+ */
+int cache_insert(struct cache_entry *e) {
+    unsigned long h;
+    struct cache_shard *s;
+    struct cache_entry *old;
+
+    if (shards == NULL)
+        return -1;
+    e->cost = sizeof(*e) + strlen(e->key) + strlen(e->filename) + e->headlen
+              + (e->data != NULL ? (size_t)e->size
+                 : e->fd >= 0 ? CACHE_FD_COST : 0);
+    h = hash(e->key);
+    e->shard = h % CACHE_SHARDS;
+    s = &shards[e->shard];
+    if (e->cost > s->capacity)
+        return -1;
+
+    pthread_mutex_lock(&s->mutex);
+    if (__atomic_load_n(&generation, __ATOMIC_ACQUIRE) != e->gen) {
+        pthread_mutex_unlock(&s->mutex);
+        return -1;
+    }
+    for (old = s->buckets[h % CACHE_BUCKETS]; old != NULL; old = old->hnext) {
+        if (strcmp(old->key, e->key) == 0) {
+            unlink_nolock(s, old, h);
+            break;
+        }
+    }
+
+    e->hnext = s->buckets[h % CACHE_BUCKETS];
+    s->buckets[h % CACHE_BUCKETS] = e;
+    /* New entries go right behind the hand, the last place it looks. */
+    if (s->hand == NULL) {
+        e->prev = e->next = e;
+        s->hand = e;
+    }
+    else {
+        e->next = s->hand;
+        e->prev = s->hand->prev;
+        s->hand->prev->next = e;
+        s->hand->prev = e;
+    }
+    __atomic_add_fetch(&e->refcnt, 1, __ATOMIC_RELAXED);
+    s->bytes += e->cost;
+    s->entries++;
+    evict_nolock(s);
+    pthread_mutex_unlock(&s->mutex);
+    return 0;
+}
+
+/*
+ * cache_generation - Return the current generation, to be stored in the
+ *     gen of an entry before its file is looked up.
+ */
+unsigned long cache_generation(void) {
+    return __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * cache_invalidate - Drop the entry of key and those of its variants, if
+ *     any. Responses still using them are not affected.
+ */
+void cache_invalidate(const char *key) {
+    unsigned long h;
+    size_t len = strlen(key);
+    struct cache_shard *s;
+    struct cache_entry *e, *next;
+
+    if (shards == NULL)
+        return;
+    __atomic_add_fetch(&generation, 1, __ATOMIC_ACQ_REL);
+    h = hash(key);
+    s = &shards[h % CACHE_SHARDS];
+
+    pthread_mutex_lock(&s->mutex);
+    for (e = s->buckets[h % CACHE_BUCKETS]; e != NULL; e = next) {
+        next = e->hnext;
+        if (strncmp(e->key, key, len) == 0
+            && (e->key[len] == '\0' || e->key[len] == CACHE_VARIANT))
+            unlink_nolock(s, e, h);
+    }
+    pthread_mutex_unlock(&s->mutex);
+}
+
+/*
+ * cache_invalidate_prefix - Drop every entry whose key starts with prefix,
+ *     which is all of them for an empty prefix. This walks the whole
+ *     cache, so it is meant for rare events like a directory going away.
+ */
+void cache_invalidate_prefix(const char *prefix) {
+    int i;
+    size_t len = strlen(prefix);
+    unsigned long n;
+    struct cache_shard *s;
+    struct cache_entry *e, *next;
+
+    if (shards == NULL)
+        return;
+    __atomic_add_fetch(&generation, 1, __ATOMIC_ACQ_REL);
+    for (i = 0; i < CACHE_SHARDS; ++i) {
+        s = &shards[i];
+        pthread_mutex_lock(&s->mutex);
+        for (e = s->hand, n = s->entries; n > 0; e = next, --n) {
+            next = e->next;
+            if (strncmp(e->key, prefix, len) == 0)
+                unlink_nolock(s, e, hash(e->key));
+        }
+        pthread_mutex_unlock(&s->mutex);
+    }
+}
+
+/*
+ * cache_release - Drop a reference to e, freeing it with the last one.
+ */
+void cache_release(struct cache_entry *e) {
+    if (__atomic_sub_fetch(&e->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+        entry_free(e);
+}
+
+/*
+ * cache_getstats - Sum up the counters of all shards.
+ */
+void cache_getstats(struct cache_stats *st) {
+    int i;
+    struct cache_shard *s;
+
+    memset(st, 0, sizeof(*st));
+    if (shards == NULL)
+        return;
+    for (i = 0; i < CACHE_SHARDS; ++i) {
+        s = &shards[i];
+        pthread_mutex_lock(&s->mutex);
+        st->hits += s->hits;
+        st->misses += s->misses;
+        st->evictions += s->evictions;
+        st->entries += s->entries;
+        st->bytes += s->bytes;
+        pthread_mutex_unlock(&s->mutex);
+    }
+}
@@ -0,0 +1,71 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+
+#define CACHE_SHARDS   16           /* Independently locked parts */
+#define CACHE_FD_COST  (64 * 1024)  /* Budget charged for a kept-open file */
+#define CACHE_VARIANT  '\n'         /* Ends a key where a variant name starts */
+#define CACHE_ETAGLEN  64           /* Room for an entity tag */
+
+/*
+ * A cached file, keyed by the path a request resolves to. Small files
+ * are held in data, larger ones as a kept-open fd. head is the prebuilt
+ * response header block, without the final empty line. Entries are
+ * reference counted and never change once inserted, so a response may
+ * keep using one after it has been evicted.
+ *
+ * A variant of the file, such as a compressed one, is keyed by the key
+ * of the file, CACHE_VARIANT and the name of the variant. Invalidating
+ * a key also invalidates its variants. A variant with neither data nor
+ * fd records that it isn't worth serving.
+ */
+struct cache_entry {
+    char *key;
+    char *filename;     /* File the key resolved to */
+    char *data;         /* File contents, or NULL */
+    int fd;             /* Kept-open file, or -1 */
+    off_t size;         /* Bytes in data or fd */
+    off_t filesize;     /* Size of filename, when it was cached */
+    ino_t ino;
+    time_t mtime;
+    const char *filetype;   /* From mime_type(), not owned */
+    char *head;
+    size_t headlen;
+    char etag[CACHE_ETAGLEN];   /* Quoted, as sent */
+    const char *cachecontrol;   /* Cache-Control value, or NULL */
+    unsigned variants;  /* Variants the file has, one bit each */
+    unsigned sidecars;  /* ... of which are read from files of their own */
+    time_t checked;     /* Last time the file was seen unchanged */
+    unsigned long gen;  /* cache_generation() before the file was opened */
+
+    /* Owned by the cache. */
+    size_t cost;
+    int refcnt;
+    int referenced;     /* CLOCK bit */
+    unsigned shard;
+    struct cache_entry *hnext, *prev, *next;
+};
+
+struct cache_stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long entries;
+    size_t bytes;
+};
+
+int cache_init(size_t capacity);
+void cache_destroy(void);
+struct cache_entry *cache_entry_new(const char *key);
+struct cache_entry *cache_lookup(const char *key);
+int cache_insert(struct cache_entry *e);
+unsigned long cache_generation(void);
+void cache_invalidate(const char *key);
+void cache_invalidate_prefix(const char *prefix);
+void cache_release(struct cache_entry *e);
+void cache_getstats(struct cache_stats *st);
+
+#endif
@@ -0,0 +1,174 @@
+#ifndef _CONN_H
+#define _CONN_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "http-parser.h"
+#include "pool.h"
+#include "tls.h"
+#include "uring.h"
+
+#ifdef LOG
+    #define log(format, ...) \
+        do { \
+            printf(format, ## __VA_ARGS__); \
+        } while (0)
+#else
+    #define log(format, ...) ((void)0)
+#endif
+
+#define	MAXLINE	    4096  /* Max text line length */
+#define MAXBUF      8192  /* Max I/O buffer size */
+#define SCRATCH     4096  /* Per-request arena of a connection */
+
+enum conn_state {
+    CONN_HANDSHAKE,  /* In the TLS handshake */
+    CONN_READ,   /* Waiting for a complete request head */
+    CONN_WRITE,  /* Sending the response */
+    CONN_PROXY,  /* Passing the request to a backend and its response back */
+    CONN_FCGI,   /* ... to a FastCGI backend */
+    CONN_H2,     /* Speaking HTTP/2, see h2_drive() */
+};
+
+/*
+ * The buffers of a connection with a request or response in flight. An
+ * idle connection gives them back to its worker, so that it costs little
+ * more than its struct conn. scratch backs the arena of the request.
+ */
+struct connbuf {
+    char rbuf[MAXBUF];
+    char wbuf[MAXBUF];
+    char scratch[SCRATCH];
+};
+
+/*
+ * Per-connection state. A connection is driven by EPOLLIN/EPOLLOUT
+ * readiness on a non-blocking socket, or by the completions of the
+ * io_uring requests it has in flight, so a slow client costs memory but
+ * never holds a thread. rbuf may hold the next pipelined request while
+ * the current response is written.
+ */
+struct conn {
+    int fd;
+    enum conn_state state;
+    int nrequests;             /* Requests served on this connection */
+    int keepalive;             /* Keep open after the current response */
+    time_t last_active;        /* Last time the connection made progress */
+    struct conn *prev, *next;  /* Timeout list of the owning worker */
+
+    size_t rlen;               /* Bytes in rbuf */
+    struct http_request req;   /* Request being parsed from rbuf */
+    uint64_t parsetime;        /* Time spent parsing req so far */
+    struct iovec iov[3];       /* Response head and in-memory body */
+    int iovcnt, iovpos;        /* ... and the first one not fully sent */
+    struct sockaddr_storage peer;  /* Client address, if it is logged */
+    int status;                /* Status code of the response */
+    off_t bodylen;             /* Length of its body */
+    uint64_t wstart;           /* When the response was ready to send */
+    char *body;                /* Generated body the response owns */
+    struct cache_entry *entry; /* Cached file the response comes from */
+    int filefd;                /* File of the response body, if any */
+    off_t fileoff, fileend;    /* Body write cursor and end */
+    struct part *parts;        /* Parts of a multipart body, or NULL */
+    int nparts, partpos;       /* ... and the next one to send */
+    int usesplice;             /* sendfile(2) can't read this file */
+    int nodelay;               /* TCP_NODELAY is set, to relay bodies */
+    int splicefd[2];           /* Pipe for the splice fallback, if needed */
+    size_t spliced;            /* Bytes of the body sitting in the pipe */
+    size_t pipesize;           /* Capacity of the pipe, io_uring only */
+    struct msghdr msg;         /* Head being sent by io_uring */
+    int inflight;              /* io_uring requests not completed yet */
+    int closing;               /* ... and to free c once they are */
+
+    struct connbuf *buf;       /* Buffers, NULL while idle */
+    char *rbuf, *wbuf;         /* ... those of buf */
+    struct arena arena;        /* Freed when the response is done */
+    struct upreq *proxy;       /* Request being proxied, in arena */
+    struct fcgireq *fcgi;      /* FastCGI request, in arena */
+    SSL *ssl;                  /* TLS state, NULL for plain HTTP */
+    int ktls;                  /* ... the kernel encrypts what we send */
+    size_t tlsstaged;          /* ... relayed bytes in wbuf, without it */
+    struct h2conn *h2;         /* HTTP/2 state, once it speaks that */
+    struct h2stream *stream;   /* Stream this stands for, or NULL */
+};
+
+/*
+ * Every worker runs its own epoll loop over the connections it owns.
+ * In the default mode the main thread accepts connections and hands
+ * them to workers through fdq, waking them with wakefd. In reactor mode
+ * every worker owns a listening socket instead, so threads share nothing.
+ * With the io_uring engine workers always own a listening socket, and
+ * run their own ring instead of an epoll.
+ */
+struct worker {
+    pthread_t tid;
+    int epollfd;
+    int listenfd;              /* Reactor mode only */
+    int wakefd;                /* Default mode only */
+    struct conn *head, *tail;  /* Connections, least recently active first */
+    struct uring ring;         /* io_uring engine only */
+    struct uring_bufring bufs; /* ... receive buffers, if nbufs > 0 */
+    int nconns;                /* ... connections not freed yet */
+    int accepting;             /* ... multishot accept is armed */
+    int cpu;                   /* CPU it is pinned to, or -1 */
+    struct pool conns;         /* Where its connections come from */
+    struct pool connbufs;      /* ... and their buffers */
+    struct conn *dead;         /* Closed in this round, freed after it */
+    struct pool upconns;       /* Connections to backends, epoll only */
+    struct upconn **idle;      /* ... idle, by backend id */
+    int *nidle;                /* ... and how many */
+    struct upconn *deadups;    /* ... closed in this round */
+    struct pool fcgiconns;     /* Connections to FastCGI backends */
+    struct fcgiconn **fcgis;   /* ... by backend id */
+    struct fcgiconn *deadfcgis;  /* ... closed in this round */
+    struct fcgiconn *fcgiready;  /* ... with work left for the round's end */
+    struct pool h2conns;       /* HTTP/2 states of connections */
+    struct pool h2streams;     /* ... and their streams */
+};
+
+/* What the server calls itself, and the document root. */
+extern const char *httpd_name;
+extern char *workdir;
+
+/* Requests a connection serves, and set once the server is going away. */
+extern int keepalive_requests;
+extern volatile sig_atomic_t drainflag;
+
+/*
+ * What the drivers of requests that go on to backends, and of HTTP/2,
+ * in their own modules, do with the connection of the client. They are
+ * in httpd.c.
+ */
+void conn_handle(struct worker *w, struct conn *c);
+void conn_close(struct worker *w, struct conn *c);
+ssize_t conn_read(struct conn *c, char *buf, size_t len);
+void conn_consume(struct conn *c, size_t len);
+int conn_flush(struct conn *c);
+ssize_t conn_splice_in(struct conn *c, size_t len);
+ssize_t conn_splice_out(struct conn *c, size_t len);
+void conn_nodelay(struct conn *c);
+int peer_name(struct conn *c, char *addr);
+void clienterror(struct conn *c, const char *cause, const char *errnum,
+                 const char *shortmsg, const char *longmsg);
+int build_connhdrs(struct conn *c, char *buf, size_t size);
+void timeout_touch(struct worker *w, struct conn *c);
+void iov_skip(struct iovec *iov, int *pos, int cnt, size_t n);
+void conn_init(struct conn *c, int connfd,
+               const struct sockaddr_storage *peer);
+int conn_getbuf(struct worker *w, struct conn *c);
+void conn_putbuf(struct worker *w, struct conn *c);
+ssize_t conn_sendmsg(struct conn *c, struct msghdr *msg, int flags);
+ssize_t conn_sendfile(struct conn *c, int fd, off_t *off, size_t len);
+int conn_next_part(struct conn *c);
+void conn_done(struct conn *c);
+void doit(struct conn *c, struct http_request *req);
+int request_has_body(struct http_request *req);
+
+#endif
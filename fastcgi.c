@@ -0,0 +1,1581 @@
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
+
+#include "fastcgi.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <ctype.h>
+#include <stddef.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <arpa/inet.h>
+
+#include "error.h"
+#include "http-utils.h"
+#include "http-parser.h"
+#include "metrics.h"
+#include "accesslog.h"
+#include "proxy.h"
+#include "conn.h"
+
+#define FCGICONN_KEEP   8      /* Idle connections a worker keeps to one */
+#define FCGI_INBUF      16384  /* Read buffer of a FastCGI connection */
+#define FCGI_CTLBUF     128    /* Management records waiting to be sent */
+#define CHUNK_FRAMING   12     /* Most a chunk of wbuf adds to its data */
+
+/*
+ * A connection to a FastCGI backend, owned by one worker. It carries up
+ * to maxreqs requests at once, told apart by their ids, and stays open
+ * between them. It is registered with the worker's epoll while it is
+ * open, with the second lowest bit of its pointer set. The records of a
+ * request go out in batches that nothing else comes between, requests
+ * queue up for their turn. Records coming in are read into in and
+ * handed to their clients by id.
+ */
+struct fcgiconn {
+    int fd;                    /* -1 once closed */
+    struct fcgi_backend *backend;
+    struct fcgiconn *next;     /* Worker's list for backend, or closed list */
+    struct fcgiconn *readynext;  /* Run again at the end of the round */
+    int scheduled;             /* ... it is on that list */
+    struct conn *reqs[FCGI_MAXREQS];  /* Clients, by id - 1 */
+    unsigned aborted;          /* Ids given up on that the backend has yet
+                                  to end */
+    int nreqs;                 /* Ids taken */
+    int maxreqs;               /* ... at most, 1 until the backend tells */
+    int used;                  /* Carried a request already */
+    int hup;                   /* The backend closed its side */
+    struct conn *writer;       /* Request in the middle of a batch */
+    struct conn *waithead, *waittail;  /* Requests waiting for their turn */
+    char ctl[FCGI_CTLBUF];     /* Management records, before any batch */
+    size_t ctllen;
+    struct conn *blocked;      /* Client with no room for its output */
+    struct fcgi_header rec;    /* Record being read */
+    int inrec;                 /* ... its header is in */
+    int gather;                /* ... its content is taken in one piece */
+    size_t recleft, padleft;   /* ... content and padding still to come */
+    size_t inpos, inlen;       /* Unhandled bytes of in */
+    char in[FCGI_INBUF];
+};
+
+enum fcgireq_state {
+    FC_SEND,  /* Waiting for its turn to write records, or writing them */
+    FC_BODY,  /* Reading the next piece of the body from the client */
+    FC_RESP,  /* Passing the response on as its records come in */
+};
+
+/*
+ * A request passed to a FastCGI backend. It lives in the arena of its
+ * client, like a proxied one. The records that begin it are built in
+ * wbuf, which then gathers the CGI head of the response and holds the
+ * body on its way to the client. Pieces of the request body are read
+ * into rbuf after the head.
+ */
+struct fcgireq {
+    enum fcgireq_state state;
+    struct fcgi_backend *backend;
+    struct fcgiconn *fc;       /* Connection it goes over, if any yet */
+    int id;                    /* ... and its id there */
+    struct conn *nextw;        /* Next one waiting for its turn on fc */
+    int waiting;               /* ... this one is */
+    size_t headlen;            /* Request head in rbuf */
+    size_t inbuf;              /* ... and the body piece after it */
+    size_t paramlen;           /* Params in wbuf */
+    off_t bodyleft;            /* Body bytes still in the client socket */
+    int first;                 /* The records in wbuf are yet to go */
+    char stdinhdr[2][FCGI_HEADER_LEN];  /* Of the body piece and the end */
+    struct iovec iov[4];       /* Batch being written */
+    int iovcnt, iovpos;
+    int partial;               /* ... some of it is out */
+    int begun;                 /* The backend has seen the request */
+    int whole;                 /* All of it fit in our buffers */
+    int reused;                /* fc carried requests before this one */
+    int retried;               /* It went over a second connection */
+    int got;                   /* Output came back for it */
+    int ended;                 /* The backend ended it */
+    int head;                  /* A HEAD request, the body is dropped */
+    uint64_t start;            /* When it was passed on */
+    struct http_response resp; /* CGI head of the response */
+    size_t outlen;             /* ... bytes of it in wbuf so far */
+    int started;               /* The response head is built */
+    int chunked;               /* The body is sent chunked */
+    int nobody;                /* ... or not at all */
+};
+
+static struct fcgi_route routes[FCGI_MAXROUTES];
+static int nroutes = 0;
+static struct fcgi_backend backends[FCGI_MAXBACKENDS];
+static int nbackends = 0;
+static int maxinflight = FCGI_INFLIGHT;
+
+static int fcgi_params(struct conn *c, struct http_request *req,
+                       const char *uri, off_t len);
+static int fcgi_put(struct conn *c, size_t *n, const char *name,
+                    const char *value, size_t len);
+static void fcgi_begin(struct conn *c);
+static void fcgi_batch(struct conn *c);
+static int fcgi_send(struct worker *w, struct conn *c);
+static int fcgi_body(struct conn *c);
+static int fcgi_output(struct worker *w, struct conn *c);
+static int fcgi_flush(struct conn *c);
+static int fcgi_room(struct conn *c, size_t want, size_t *room);
+static void fcgi_append(struct conn *c, const char *p, size_t len);
+static size_t fcgi_deliver(struct worker *w, struct conn *c, const char *p,
+                           size_t len);
+static int fcgi_head(struct conn *c);
+static int fcgi_end(struct worker *w, struct conn *c, int status);
+static int fcgi_fail(struct worker *w, struct conn *c);
+static void fcgi_done(struct conn *c);
+static void fcgi_detach(struct worker *w, struct conn *c);
+static void fcgi_wait(struct fcgiconn *fc, struct conn *c);
+static void fcgi_unwait(struct fcgiconn *fc, struct conn *c);
+static int fcgiconn_attach(struct worker *w, struct conn *c, int fresh);
+static struct fcgiconn *fcgiconn_open(struct worker *w,
+                                      struct fcgi_backend *b);
+static void fcgiconn_close(struct worker *w, struct fcgiconn *fc);
+static void fcgiconn_fail(struct worker *w, struct fcgiconn *fc);
+static void fcgiconn_schedule(struct worker *w, struct fcgiconn *fc);
+static void fcgiconn_run(struct worker *w, struct fcgiconn *fc);
+static int fcgiconn_ctl(struct fcgiconn *fc);
+static int fcgiconn_read(struct worker *w, struct fcgiconn *fc);
+static int fcgiconn_records(struct worker *w, struct fcgiconn *fc);
+static int fcgiconn_record(struct worker *w, struct fcgiconn *fc,
+                           const char *p);
+
+/*
+ * add_backend - Return the backend at name, a unix socket path or
+ *     host:port, resolving it if it is new. Returns NULL if name is
+ *     malformed or there are too many backends, with errno set to 0, or
+ *     if it can't be resolved, with errno set to EHOSTUNREACH.
+ */
+static struct fcgi_backend *add_backend(const char *name) {
+    struct fcgi_backend *b;
+    struct sockaddr_un *sun;
+    char host[256], *port;
+    size_t len;
+    int i;
+
+    for (i = 0; i < nbackends; ++i) {
+        if (strcmp(backends[i].name, name) == 0)
+            return &backends[i];
+    }
+    errno = 0;
+    if (nbackends == FCGI_MAXBACKENDS)
+        return NULL;
+
+    b = &backends[nbackends];
+    memset(b, 0, sizeof(*b));
+    if (name[0] == '/') {
+        sun = (struct sockaddr_un *)&b->addr;
+        if ((len = strlen(name)) >= sizeof(sun->sun_path))
+            return NULL;
+        sun->sun_family = AF_UNIX;
+        memcpy(sun->sun_path, name, len + 1);
+        b->addrlen = sizeof(*sun);
+    }
+    else {
+        if ((port = strrchr(name, ':')) == NULL || port == name
+            || port[1] == '\0' || (len = port - name) >= sizeof(host))
+            return NULL;
+        memcpy(host, name, len);
+        host[len] = '\0';
+        if (resolve_addr(host, port + 1, &b->addr, &b->addrlen) != 0) {
+            errno = EHOSTUNREACH;
+            return NULL;
+        }
+    }
+    if ((b->name = strdup(name)) == NULL)
+        unix_errq("strdup error");
+    b->id = nbackends++;
+    return b;
+}
+
+/*
+ * fcgi_add - Add the route spec, MATCH=BACKEND, where MATCH is a path
+ *     prefix, or a suffix such as .php, and BACKEND a unix socket path or
+ *     host:port. spec is modified. Returns -1 with errno set to 0 if spec
+ *     is malformed, or to EHOSTUNREACH if the backend can't be resolved.
+ */
+int fcgi_add(char *spec) {
+    struct fcgi_route *r;
+    char *sep;
+
+    errno = 0;
+    if ((spec[0] != '/' && spec[0] != '.')
+        || (sep = strchr(spec, '=')) == NULL || nroutes == FCGI_MAXROUTES)
+        return -1;
+    *sep = '\0';
+    r = &routes[nroutes];
+    r->prefix = spec[0] == '/' ? spec : NULL;
+    r->suffix = spec[0] == '.' ? spec : NULL;
+    if ((r->backend = add_backend(sep + 1)) == NULL)
+        return -1;
+    nroutes++;
+    return 0;
+}
+
+int fcgi_active(void) {
+    return nroutes > 0;
+}
+
+int fcgi_nbackends(void) {
+    return nbackends;
+}
+
+/*
+ * fcgi_set_inflight - Let at most max requests wait for a backend at a
+ *     time.
+ */
+void fcgi_set_inflight(int max) {
+    maxinflight = max;
+}
+
+/*
+ * fcgi_match - Return the route of uri, or NULL if it is served locally.
+ *     Of the prefixes the longest matching one wins, and before them the
+ *     first matching suffix.
+ */
+struct fcgi_route *fcgi_match(const char *uri) {
+    struct fcgi_route *best = NULL;
+    size_t len, bestlen = 0, urilen = strlen(uri);
+    int i;
+
+    for (i = 0; i < nroutes; ++i) {
+        if (routes[i].suffix != NULL) {
+            len = strlen(routes[i].suffix);
+            if (len <= urilen
+                && strcmp(uri + urilen - len, routes[i].suffix) == 0)
+                return &routes[i];
+            continue;
+        }
+        len = strlen(routes[i].prefix);
+        if (len > bestlen && strncmp(uri, routes[i].prefix, len) == 0) {
+            best = &routes[i];
+            bestlen = len;
+        }
+    }
+    return best;
+}
+
+/*
+ * fcgi_acquire - Count a request to b as in flight, unless there are as
+ *     many as allowed already. Returns -1 if there is no room.
+ */
+int fcgi_acquire(struct fcgi_backend *b) {
+    if (__atomic_add_fetch(&b->inflight, 1, __ATOMIC_RELAXED) > maxinflight) {
+        __atomic_sub_fetch(&b->inflight, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&b->rejected, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    __atomic_add_fetch(&b->requests, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/*
+ * fcgi_release - Count the request acquired for b as answered, or as
+ *     failed.
+ */
+void fcgi_release(struct fcgi_backend *b, int failed) {
+    __atomic_sub_fetch(&b->inflight, 1, __ATOMIC_RELAXED);
+    if (failed)
+        __atomic_add_fetch(&b->failures, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * fcgi_header - Write the header of a record of type for request id with
+ *     len bytes of content, and no padding, to buf.
+ */
+void fcgi_header(char *buf, int type, int id, size_t len) {
+    unsigned char *p = (unsigned char *)buf;
+
+    p[0] = 1; /* FCGI_VERSION_1 */
+    p[1] = type;
+    p[2] = id >> 8;
+    p[3] = id;
+    p[4] = len >> 8;
+    p[5] = len;
+    p[6] = 0;
+    p[7] = 0;
+}
+
+/*
+ * fcgi_parse_header - Parse the record header at buf into h. Returns -1
+ *     if it is not of a version we speak.
+ */
+int fcgi_parse_header(const char *buf, struct fcgi_header *h) {
+    const unsigned char *p = (const unsigned char *)buf;
+
+    if (p[0] != 1)
+        return -1;
+    h->type = p[1];
+    h->id = p[2] << 8 | p[3];
+    h->len = p[4] << 8 | p[5];
+    h->pad = p[6];
+    return 0;
+}
+
+/*
+ * put_length - Encode the length of a name or value at p as the
+ *     specification does: one byte up to 127, four bytes beyond. Returns
+ *     how many bytes it took.
+ */
+static size_t put_length(unsigned char *p, size_t len) {
+    if (len < 128) {
+        p[0] = len;
+        return 1;
+    }
+    p[0] = (len >> 24) | 0x80;
+    p[1] = len >> 16;
+    p[2] = len >> 8;
+    p[3] = len;
+    return 4;
+}
+
+/*
+ * fcgi_param - Encode the name-value pair into the size bytes at buf.
+ *     Returns its length, or 0 if it doesn't fit.
+ */
+size_t fcgi_param(char *buf, size_t size, const char *name, size_t namelen,
+                  const char *value, size_t valuelen) {
+    size_t n;
+
+    if (8 + namelen + valuelen > size)
+        return 0;
+    n = put_length((unsigned char *)buf, namelen);
+    n += put_length((unsigned char *)buf + n, valuelen);
+    memcpy(buf + n, name, namelen);
+    memcpy(buf + n + namelen, value, valuelen);
+    return n + namelen + valuelen;
+}
+
+/*
+ * get_length - Decode a length at p, which ends before end, into *len.
+ *     Returns how many bytes it took, or 0 if it is cut short.
+ */
+static size_t get_length(const unsigned char *p, const unsigned char *end,
+                         size_t *len) {
+    if (p < end && p[0] < 128) {
+        *len = p[0];
+        return 1;
+    }
+    if (end - p < 4)
+        return 0;
+    *len = (size_t)(p[0] & 0x7f) << 24 | p[1] << 16 | p[2] << 8 | p[3];
+    return 4;
+}
+
+/*
+ * fcgi_values - Find the value of name in the name-value pairs of the
+ *     FCGI_GET_VALUES_RESULT content buf[0, len). Returns it as a number,
+ *     or -1 if it is missing or isn't one.
+ */
+int fcgi_values(const char *buf, size_t len, const char *name) {
+    const unsigned char *p = (const unsigned char *)buf, *end = p + len;
+    size_t namelen, valuelen, n, m;
+    int value;
+
+    while (p < end) {
+        if ((n = get_length(p, end, &namelen)) == 0
+            || (m = get_length(p + n, end, &valuelen)) == 0
+            || (size_t)(end - p - n - m) < namelen + valuelen)
+            return -1;
+        p += n + m;
+        if (namelen == strlen(name) && memcmp(p, name, namelen) == 0) {
+            for (value = 0, p += namelen; valuelen-- > 0; ++p) {
+                if (*p < '0' || *p > '9' || value > 100000)
+                    return -1;
+                value = value * 10 + *p - '0';
+            }
+            return value;
+        }
+        p += namelen + valuelen;
+    }
+    return -1;
+}
+
+/*
+ * fcgi_write_metrics - Write the state of every backend to fp in the
+ *     Prometheus text format.
+ */
+void fcgi_write_metrics(FILE *fp) {
+    struct fcgi_backend *b;
+    int i;
+
+    if (nbackends == 0)
+        return;
+    fprintf(fp, "# HELP httpd_fastcgi_requests_total Requests sent to a "
+                "FastCGI backend.\n"
+                "# TYPE httpd_fastcgi_requests_total counter\n");
+    for (i = 0, b = backends; i < nbackends; ++i, ++b)
+        fprintf(fp, "httpd_fastcgi_requests_total{backend=\"%s\"} %lu\n",
+                b->name, __atomic_load_n(&b->requests, __ATOMIC_RELAXED));
+    fprintf(fp, "# HELP httpd_fastcgi_failures_total FastCGI requests "
+                "that got no response.\n"
+                "# TYPE httpd_fastcgi_failures_total counter\n");
+    for (i = 0, b = backends; i < nbackends; ++i, ++b)
+        fprintf(fp, "httpd_fastcgi_failures_total{backend=\"%s\"} %lu\n",
+                b->name, __atomic_load_n(&b->failures, __ATOMIC_RELAXED));
+    fprintf(fp, "# HELP httpd_fastcgi_rejected_total FastCGI requests "
+                "turned away over the in-flight limit.\n"
+                "# TYPE httpd_fastcgi_rejected_total counter\n");
+    for (i = 0, b = backends; i < nbackends; ++i, ++b)
+        fprintf(fp, "httpd_fastcgi_rejected_total{backend=\"%s\"} %lu\n",
+                b->name, __atomic_load_n(&b->rejected, __ATOMIC_RELAXED));
+    fprintf(fp, "# HELP httpd_fastcgi_inflight Requests waiting for a "
+                "FastCGI backend.\n"
+                "# TYPE httpd_fastcgi_inflight gauge\n");
+    for (i = 0, b = backends; i < nbackends; ++i, ++b)
+        fprintf(fp, "httpd_fastcgi_inflight{backend=\"%s\"} %d\n",
+                b->name, __atomic_load_n(&b->inflight, __ATOMIC_RELAXED));
+}
+
+/*
+ * fcgi_start - Pass request req of c, for path uri, to the FastCGI
+ *     backend of route r, which gets the file uri maps to as its script.
+ *     The records that begin it are built in wbuf, they only get their
+ *     id once the request has a connection. Leaves c in CONN_FCGI, or
+ *     with an error response.
+ */
+void fcgi_start(struct conn *c, struct fcgi_route *r, const char *uri,
+                struct http_request *req) {
+    struct fcgi_backend *b = r->backend;
+    struct fcgireq *fr;
+    off_t len;
+    int n;
+
+    if (body_length(c, req, &len) != 0)
+        return;
+    /* The body is read piece by piece into rbuf, after the head. */
+    if (len > 0 && req->pos == MAXBUF) {
+        c->keepalive = 0;
+        clienterror(c, "request head", "431",
+                    "Request Header Fields Too Large",
+                    "The request head doesn't fit our buffer");
+        return;
+    }
+    if (fcgi_acquire(b) != 0) {
+        if (len > 0)
+            c->keepalive = 0; /* It would be taken for the next request */
+        clienterror(c, b->name, "503", "Service Unavailable",
+                    "The application is too busy");
+        return;
+    }
+    if ((n = fcgi_params(c, req, uri, len)) < 0) {
+        fcgi_release(b, 0);
+        c->keepalive = 0;
+        clienterror(c, "request head", "431",
+                    "Request Header Fields Too Large",
+                    "The request head doesn't fit our buffer");
+        return;
+    }
+    if ((fr = arena_alloc(&c->arena, sizeof(*fr))) == NULL) {
+        fcgi_release(b, 0);
+        c->keepalive = 0;
+        clienterror(c, "request", "500", "Internal Server Error",
+                    "We couldn't pass the request on");
+        return;
+    }
+    memset(fr, 0, sizeof(*fr));
+    fr->state = FC_SEND;
+    fr->backend = b;
+    fr->headlen = req->pos;
+    fr->inbuf = c->rlen - fr->headlen;
+    if ((off_t)fr->inbuf > len)
+        fr->inbuf = len;
+    fr->paramlen = n;
+    fr->bodyleft = len - fr->inbuf;
+    fr->first = 1;
+    fr->whole = fr->bodyleft == 0;
+    fr->head = http_slice_eq(&req->method, "HEAD");
+    fr->start = metrics_now();
+    http_fields_init(&fr->resp);
+    c->fcgi = fr;
+    c->state = CONN_FCGI;
+    if (fr->bodyleft > 0)
+        send_continue(c, req);
+}
+
+/*
+ * fcgi_params - Build the FCGI_BEGIN_REQUEST record of the request req
+ *     of c, for path uri with a body of len bytes, and the content of its
+ *     FCGI_PARAMS record into wbuf, leaving room for the record headers.
+ *     The params are the CGI/1.1 meta-variables. Returns their length, or
+ *     -1 if they don't fit.
+ */
+static int fcgi_params(struct conn *c, struct http_request *req,
+                       const char *uri, off_t len) {
+    char addr[INET6_ADDRSTRLEN], name[256], num[32];
+    char script[MAXLINE];
+    const struct http_slice *hdr;
+    const struct http_header *h;
+    const char *query, *host;
+    size_t n = 0, i, hostlen;
+    int port, j;
+    unsigned char *begin = (unsigned char *)c->wbuf + FCGI_HEADER_LEN;
+
+    /* A responder, and the connection stays open after it. */
+    memset(begin, 0, FCGI_HEADER_LEN);
+    begin[1] = FCGI_RESPONDER;
+    begin[2] = FCGI_KEEP_CONN;
+
+    query = memchr(req->target.p, '?', req->target.len);
+    port = peer_name(c, addr);
+    snprintf(num, sizeof(num), "%d", port);
+    snprintf(script, sizeof(script), "%s%s",
+             strcmp(workdir, "/") == 0 ? "" : workdir, uri);
+    if (fcgi_put(c, &n, "GATEWAY_INTERFACE", "CGI/1.1", 7) != 0
+        || fcgi_put(c, &n, "SERVER_SOFTWARE", httpd_name,
+                    strlen(httpd_name)) != 0
+        || fcgi_put(c, &n, "SERVER_PROTOCOL",
+                    req->minor_version >= 1 ? "HTTP/1.1" : "HTTP/1.0", 8) != 0
+        || fcgi_put(c, &n, "REQUEST_METHOD", req->method.p,
+                    req->method.len) != 0
+        || fcgi_put(c, &n, "REQUEST_URI", req->target.p,
+                    req->target.len) != 0
+        || fcgi_put(c, &n, "QUERY_STRING", query != NULL ? query + 1 : "",
+                    query != NULL ? req->target.p + req->target.len - query - 1
+                                  : 0) != 0
+        || fcgi_put(c, &n, "SCRIPT_NAME", uri, strlen(uri)) != 0
+        || fcgi_put(c, &n, "SCRIPT_FILENAME", script, strlen(script)) != 0
+        || fcgi_put(c, &n, "DOCUMENT_ROOT", workdir, strlen(workdir)) != 0
+        || fcgi_put(c, &n, "REMOTE_ADDR", addr, strlen(addr)) != 0
+        || fcgi_put(c, &n, "REMOTE_PORT", num, strlen(num)) != 0
+        || (c->ssl != NULL && fcgi_put(c, &n, "HTTPS", "on", 2) != 0))
+        return -1;
+
+    /* SERVER_NAME is the host the client asked for, without the port. */
+    if ((hdr = http_find_header(req, "Host")) != NULL) {
+        host = hdr->p;
+        hostlen = hdr->len;
+        if (host[0] == '[') {
+            for (i = 0; i < hostlen && host[i] != ']'; ++i)
+                ;
+            hostlen = i < hostlen ? i + 1 : hostlen;
+        }
+        else {
+            for (i = 0; i < hostlen && host[i] != ':'; ++i)
+                ;
+            hostlen = i;
+        }
+        if (fcgi_put(c, &n, "SERVER_NAME", host, hostlen) != 0)
+            return -1;
+    }
+    if (http_find_header(req, "Content-Length") != NULL) {
+        snprintf(num, sizeof(num), "%lld", (long long)len);
+        if (fcgi_put(c, &n, "CONTENT_LENGTH", num, strlen(num)) != 0)
+            return -1;
+    }
+    if ((hdr = http_find_header(req, "Content-Type")) != NULL
+        && fcgi_put(c, &n, "CONTENT_TYPE", hdr->p, hdr->len) != 0)
+        return -1;
+
+    /*
+     * Every other header becomes HTTP_ and its name. Proxy is left out,
+     * or it would pass for the HTTP_PROXY of the environment.
+     */
+    for (j = 0, h = req->headers; j < req->nheaders; ++j, ++h) {
+        if (http_slice_caseeq(&h->name, "Content-Length")
+            || http_slice_caseeq(&h->name, "Content-Type")
+            || http_slice_caseeq(&h->name, "Proxy")
+            || h->name.len + 6 > sizeof(name))
+            continue;
+        memcpy(name, "HTTP_", 5);
+        for (i = 0; i < h->name.len; ++i)
+            name[5 + i] = h->name.p[i] == '-'
+                          ? '_' : toupper((unsigned char)h->name.p[i]);
+        name[5 + i] = '\0';
+        if (fcgi_put(c, &n, name, h->value.p, h->value.len) != 0)
+            return -1;
+    }
+    return n;
+}
+
+/*
+ * fcgi_put - Add the param name with value[0, len) to those of c, *n
+ *     bytes so far. Returns -1 if it doesn't fit.
+ */
+static int fcgi_put(struct conn *c, size_t *n, const char *name,
+                    const char *value, size_t len) {
+    size_t m;
+
+    m = fcgi_param(c->wbuf + 3 * FCGI_HEADER_LEN + *n,
+                   MAXBUF - 4 * FCGI_HEADER_LEN - *n,
+                   name, strlen(name), value, len);
+    if (m == 0)
+        return -1;
+    *n += m;
+    return 0;
+}
+
+/*
+ * fcgi_begin - Fill in the record headers around the params in wbuf, now
+ *     that the request of c has an id.
+ */
+static void fcgi_begin(struct conn *c) {
+    struct fcgireq *fr = c->fcgi;
+
+    fcgi_header(c->wbuf, FCGI_BEGIN_REQUEST, fr->id, FCGI_HEADER_LEN);
+    fcgi_header(c->wbuf + 2 * FCGI_HEADER_LEN, FCGI_PARAMS, fr->id,
+                fr->paramlen);
+    fcgi_header(c->wbuf + 3 * FCGI_HEADER_LEN + fr->paramlen, FCGI_PARAMS,
+                fr->id, 0);
+}
+
+/*
+ * fcgi_batch - Set up the next batch of records of the request of c: the
+ *     ones in wbuf the first time, then the body piece in rbuf in an
+ *     FCGI_STDIN record, and the empty one that ends the body after the
+ *     last piece.
+ */
+static void fcgi_batch(struct conn *c) {
+    struct fcgireq *fr = c->fcgi;
+    int i = 0;
+
+    if (fr->first) {
+        fcgi_begin(c);
+        fr->iov[i].iov_base = c->wbuf;
+        fr->iov[i++].iov_len = 4 * FCGI_HEADER_LEN + fr->paramlen;
+        fr->first = 0;
+    }
+    if (fr->inbuf > 0) {
+        fcgi_header(fr->stdinhdr[0], FCGI_STDIN, fr->id, fr->inbuf);
+        fr->iov[i].iov_base = fr->stdinhdr[0];
+        fr->iov[i++].iov_len = FCGI_HEADER_LEN;
+        fr->iov[i].iov_base = c->rbuf + fr->headlen;
+        fr->iov[i++].iov_len = fr->inbuf;
+    }
+    if (fr->bodyleft == 0) {
+        fcgi_header(fr->stdinhdr[1], FCGI_STDIN, fr->id, 0);
+        fr->iov[i].iov_base = fr->stdinhdr[1];
+        fr->iov[i++].iov_len = FCGI_HEADER_LEN;
+    }
+    fr->iovcnt = i;
+    fr->iovpos = 0;
+    fr->partial = 0;
+}
+
+/*
+ * fcgi_drive - Move the FastCGI request of c as far as it can go without
+ *     blocking. Returns like proxy_drive().
+ */
+int fcgi_drive(struct worker *w, struct conn *c) {
+    int rc = 0;
+
+    while (c->state == CONN_FCGI) {
+        switch (c->fcgi->state) {
+        case FC_SEND: rc = fcgi_send(w, c); break;
+        case FC_BODY: rc = fcgi_body(c); break;
+        case FC_RESP: rc = fcgi_output(w, c); break;
+        }
+        if (rc == -2)
+            rc = fcgi_fail(w, c);
+        if (rc != 0)
+            return rc;
+    }
+    return 0;
+}
+
+/*
+ * fcgi_send - Write the next batch of records of the request of c, once
+ *     it has a connection and its turn on it. Returns like fcgi_drive(),
+ *     or -2 if the backend failed.
+ */
+static int fcgi_send(struct worker *w, struct conn *c) {
+    struct fcgireq *fr = c->fcgi;
+    struct fcgiconn *fc;
+    struct msghdr msg;
+    ssize_t n;
+    int rc;
+
+    if (fr->fc == NULL && fcgiconn_attach(w, c, 0) != 0)
+        return -2;
+    fc = fr->fc;
+    if (fc->writer != c) {
+        /* Requests take turns, in the order they came. */
+        rc = fc->writer != NULL || (fc->waithead != NULL && fc->waithead != c)
+             ? 1 : fcgiconn_ctl(fc);
+        if (rc < 0)
+            return -2;
+        if (rc > 0) {
+            fcgi_wait(fc, c);
+            return 1;
+        }
+        fcgi_unwait(fc, c);
+        fc->writer = c;
+        fcgi_batch(c);
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    while (fr->iovpos < fr->iovcnt) {
+        msg.msg_iov = fr->iov + fr->iovpos;
+        msg.msg_iovlen = fr->iovcnt - fr->iovpos;
+        if ((n = sendmsg(fc->fd, &msg, 0)) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 1;
+            if (errno == EINTR)
+                continue;
+            return -2;
+        }
+        fr->begun = fr->partial = 1;
+        iov_skip(fr->iov, &fr->iovpos, fr->iovcnt, n);
+    }
+    fc->writer = NULL;
+    fr->partial = 0;
+    fr->state = fr->bodyleft > 0 ? FC_BODY : FC_RESP;
+    /* The next one in line goes at the end of the round. */
+    if (fc->waithead != NULL)
+        fcgiconn_schedule(w, fc);
+    return 0;
+}
+
+/*
+ * fcgi_body - Read the next piece of the request body of c into rbuf,
+ *     after the head, for fcgi_send() to pass on. Returns like
+ *     fcgi_drive().
+ */
+static int fcgi_body(struct conn *c) {
+    struct fcgireq *fr = c->fcgi;
+    size_t len = MAXBUF - fr->headlen;
+    ssize_t n;
+
+    if ((off_t)len > fr->bodyleft)
+        len = fr->bodyleft;
+    while ((n = conn_read(c, c->rbuf + fr->headlen, len)) < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 1;
+        if (errno != EINTR)
+            return -1;
+    }
+    if (n == 0)
+        return -1; /* The client went away */
+    fr->inbuf = n;
+    fr->bodyleft -= n;
+    c->rlen = fr->headlen + n;
+    fr->state = FC_SEND;
+    return 0;
+}
+
+/*
+ * fcgi_output - Send what the client of c has of its response so far.
+ *     The rest comes as the backend sends it. Returns like fcgi_drive().
+ */
+static int fcgi_output(struct worker *w, struct conn *c) {
+    struct fcgireq *fr = c->fcgi;
+    int rc;
+
+    if (!fr->started)
+        return 1;
+    if ((rc = fcgi_flush(c)) != 0)
+        return rc;
+    /* Records held back for want of room can go on now. */
+    if (fr->fc != NULL && fr->fc->blocked == c) {
+        fr->fc->blocked = NULL;
+        fcgiconn_schedule(w, fr->fc);
+    }
+    return 1;
+}
+
+/*
+ * fcgi_flush - Write the response head of c, in iov[0], and the body in
+ *     iov[1], which points into wbuf, as far as the socket takes them.
+ *     What is left stays there. Returns like conn_flush().
+ */
+static int fcgi_flush(struct conn *c) {
+    int rc;
+
+    c->iovcnt = 2;
+    c->iovpos = 0;
+    rc = conn_flush(c);
+    if (c->iovpos > 0)
+        c->iov[0].iov_len = 0;
+    if (c->iovpos > 1) {
+        c->iov[1].iov_base = c->wbuf;
+        c->iov[1].iov_len = 0;
+    }
+    c->iovpos = 0;
+    return rc;
+}
+
+/*
+ * fcgi_room - Make room for want more bytes at the end of the body in
+ *     wbuf of c, moving what is left to the start and sending some of
+ *     it if it must. Returns -1 if the client is gone, else leaves the
+ *     room there is, which may be less, in *room.
+ */
+static int fcgi_room(struct conn *c, size_t want, size_t *room) {
+    struct iovec *out = &c->iov[1];
+    int pass;
+
+    for (pass = 0; pass < 2; ++pass) {
+        if (out->iov_base != c->wbuf) {
+            memmove(c->wbuf, out->iov_base, out->iov_len);
+            out->iov_base = c->wbuf;
+        }
+        if ((*room = MAXBUF - out->iov_len) >= want || pass == 1)
+            break;
+        if (fcgi_flush(c) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * fcgi_append - Add len bytes at p, which may be in wbuf, to the body of
+ *     c, framed as a chunk if the body is chunked. There must be room.
+ */
+static void fcgi_append(struct conn *c, const char *p, size_t len) {
+    struct iovec *out = &c->iov[1];
+    char *end = (char *)out->iov_base + out->iov_len, line[16];
+    int n = 0;
+
+    if (c->fcgi->chunked)
+        n = snprintf(line, sizeof(line), "%zx\r\n", len);
+    memmove(end + n, p, len);
+    memcpy(end, line, n);
+    if (c->fcgi->chunked) {
+        memcpy(end + n + len, "\r\n", 2);
+        n += 2;
+    }
+    out->iov_len += n + len;
+    c->bodylen += len;
+}
+
+/*
+ * fcgi_deliver - Take up to len bytes at p of the FCGI_STDOUT stream of
+ *     the request of c. The CGI head is gathered until it is complete,
+ *     the body is passed on as it comes. Returns how many bytes were
+ *     taken, 0 if c has no room for any. The client may be answered, or
+ *     closed, meanwhile.
+ */
+static size_t fcgi_deliver(struct worker *w, struct conn *c, const char *p,
+                           size_t len) {
+    struct fcgireq *fr = c->fcgi;
+    size_t room;
+    int n;
+
+    fr->got = 1;
+    timeout_touch(w, c);
+    if (!fr->started) {
+        /* The head has to leave room to frame what came after it. */
+        room = MAXBUF - CHUNK_FRAMING - fr->outlen;
+        if (len > room)
+            len = room;
+        memcpy(c->wbuf + fr->outlen, p, len);
+        fr->outlen += len;
+        n = http_parse_response(&fr->resp, c->wbuf, fr->outlen);
+        if (n == 0 && fr->outlen < MAXBUF - CHUNK_FRAMING)
+            return len;
+        if (n <= 0 || fcgi_head(c) != 0) {
+            log("bad response head from %s\n\n", fr->backend->name);
+            fcgi_detach(w, c);
+            fcgi_release(fr->backend, 1);
+            clienterror(c, fr->backend->name, "502", "Bad Gateway",
+                        "The application sent a bad response");
+            fcgi_done(c);
+            conn_handle(w, c);
+            return len;
+        }
+        /* What came after the head is the start of the body. */
+        c->iov[1].iov_base = c->wbuf;
+        c->iov[1].iov_len = 0;
+        if (!fr->nobody && fr->outlen > (size_t)n)
+            fcgi_append(c, c->wbuf + n, fr->outlen - n);
+    }
+    else if (fr->nobody)
+        return len;
+    else {
+        if (fcgi_room(c, len + CHUNK_FRAMING, &room) != 0) {
+            conn_close(w, c);
+            return len;
+        }
+        if (room <= CHUNK_FRAMING)
+            return 0;
+        if (len > room - CHUNK_FRAMING)
+            len = room - CHUNK_FRAMING;
+        fcgi_append(c, p, len);
+    }
+    if (fcgi_flush(c) < 0)
+        conn_close(w, c);
+    return len;
+}
+
+/*
+ * fcgi_head - Build the response head of c from the CGI head the backend
+ *     sent, the first fr->resp.pos bytes of wbuf. Status becomes the
+ *     status line, and the body is chunked unless the backend gave its
+ *     length. Returns -1 if the head is bad.
+ */
+static int fcgi_head(struct conn *c) {
+    struct fcgireq *fr = c->fcgi;
+    struct http_response *resp = &fr->resp;
+    const struct http_slice *status;
+    const struct http_header *h;
+    struct http_slice reason = {"OK", 2};
+    off_t len;
+    char *buf;
+    size_t size, n;
+    int i, length;
+
+    c->status = 200;
+    if ((status = http_find(resp->headers, resp->nheaders, "Status"))
+        != NULL) {
+        if (status->len < 3 || !isdigit((unsigned char)status->p[0])
+            || !isdigit((unsigned char)status->p[1])
+            || !isdigit((unsigned char)status->p[2])
+            || (status->len > 3 && status->p[3] != ' '))
+            return -1;
+        c->status = (status->p[0] - '0') * 100 + (status->p[1] - '0') * 10
+                    + status->p[2] - '0';
+        reason.p = status->p + 3;
+        reason.len = status->len - 3;
+        while (reason.len > 0 && *reason.p == ' ') {
+            reason.p++;
+            reason.len--;
+        }
+    }
+    else if (http_find(resp->headers, resp->nheaders, "Location") != NULL) {
+        c->status = 302;
+        reason.p = "Found";
+        reason.len = 5;
+    }
+    if (c->status < 200 || c->status > 599)
+        return -1;
+
+    /* Where the body ends: at its length, the last chunk, or the close. */
+    if ((length = http_content_length(resp->headers, resp->nheaders,
+                                      &len)) < 0)
+        return -1;
+    fr->nobody = fr->head || c->status == 204 || c->status == 304;
+    if (!length && c->status != 204 && c->status != 304) {
+        if (c->req.minor_version >= 1)
+            fr->chunked = 1;
+        else
+            c->keepalive = 0;
+    }
+
+    size = resp->pos + 2 * resp->nheaders + 512;
+    if ((buf = arena_alloc(&c->arena, size)) == NULL)
+        return -1;
+    n = snprintf(buf, size, "HTTP/1.1 %d %.*s\r\n", c->status,
+                 (int)reason.len, reason.p);
+    if (http_find(resp->headers, resp->nheaders, "Server") == NULL)
+        n += snprintf(buf + n, size - n, "Server: %s\r\n", httpd_name);
+    for (i = 0, h = resp->headers; i < resp->nheaders; ++i, ++h) {
+        if (!http_slice_caseeq(&h->name, "Status")
+            && !http_slice_caseeq(&h->name, "Transfer-Encoding")
+            && !hop_by_hop(&h->name, NULL))
+            n += snprintf(buf + n, size - n, "%.*s: %.*s\r\n",
+                          (int)h->name.len, h->name.p,
+                          (int)h->value.len, h->value.p);
+    }
+    if (fr->chunked)
+        n += snprintf(buf + n, size - n, "Transfer-Encoding: chunked\r\n");
+    n += build_connhdrs(c, buf + n, size - n);
+    if (n >= size)
+        return -1;
+    c->iov[0].iov_base = buf;
+    c->iov[0].iov_len = n;
+    c->bodylen = 0;
+    c->wstart = metrics_now();
+    metrics_time(STAGE_UPSTREAM, c->wstart - fr->start);
+    log("Response headers:\n%s", buf);
+    conn_nodelay(c);
+    fr->started = 1;
+    return 0;
+}
+
+/*
+ * fcgi_end - Finish the request of c, which its backend ended with
+ *     protocol status status. The end of a chunked body is passed on, and
+ *     c is left in CONN_WRITE with the rest of the response. A backend
+ *     that can't take the request on its connection gets it again over
+ *     another, and a backend that sent no response gets a 502, or a 503
+ *     if it is overloaded. Returns 1 if there is no room for the end yet.
+ */
+static int fcgi_end(struct worker *w, struct conn *c, int status) {
+    struct fcgireq *fr = c->fcgi;
+    size_t room;
+
+    if (status == FCGI_CANT_MPX_CONN) {
+        fr->fc->maxreqs = 1;
+        __atomic_store_n(&fr->backend->maxreqs, 1, __ATOMIC_RELAXED);
+    }
+    if (!fr->started) {
+        fr->ended = 1;
+        if (status == FCGI_OVERLOADED) {
+            fcgi_detach(w, c);
+            fcgi_release(fr->backend, 0);
+            if (fr->bodyleft > 0)
+                c->keepalive = 0;
+            clienterror(c, fr->backend->name, "503", "Service Unavailable",
+                        "The application is too busy");
+            fcgi_done(c);
+        }
+        else {
+            /* Turned away rather than failed, it may go again. */
+            if (status == FCGI_CANT_MPX_CONN)
+                fr->reused = 1;
+            else
+                fr->retried = 1;
+            fcgi_fail(w, c);
+        }
+        conn_handle(w, c);
+        return 0;
+    }
+
+    if (fr->chunked && !fr->nobody) {
+        if (fcgi_room(c, 5, &room) != 0) {
+            conn_close(w, c);
+            return 0;
+        }
+        if (room < 5) {
+            fr->fc->blocked = c;
+            return 1;
+        }
+        memcpy((char *)c->iov[1].iov_base + c->iov[1].iov_len,
+               "0\r\n\r\n", 5);
+        c->iov[1].iov_len += 5;
+    }
+    fr->ended = 1;
+    fcgi_detach(w, c);
+    fcgi_release(fr->backend, 0);
+    /* The rest of a body the backend didn't wait for is still coming. */
+    if (fr->bodyleft > 0)
+        c->keepalive = 0;
+    c->iovcnt = 2;
+    c->iovpos = 0;
+    fcgi_done(c);
+    conn_handle(w, c);
+    return 0;
+}
+
+/*
+ * fcgi_fail - Handle the request of c failing before its backend
+ *     answered. If it never reached the backend, or went over a reused
+ *     connection, which the backend may just have closed, and nothing of
+ *     it is lost, it goes once more over a new connection. Otherwise c
+ *     gets a 502. Returns 0.
+ */
+static int fcgi_fail(struct worker *w, struct conn *c) {
+    struct fcgireq *fr = c->fcgi;
+    int retry;
+
+    retry = !fr->retried && !fr->got
+            && (!fr->begun || (fr->whole && fr->reused));
+    fcgi_detach(w, c);
+    if (retry) {
+        fr->retried = 1;
+        fr->first = 1;
+        fr->begun = fr->ended = 0;
+        fr->state = FC_SEND;
+        if (fcgiconn_attach(w, c, 1) == 0)
+            return 0;
+    }
+    log("FastCGI backend %s failed\n\n", fr->backend->name);
+    fcgi_release(fr->backend, 1);
+    if (fr->bodyleft > 0)
+        c->keepalive = 0;
+    clienterror(c, fr->backend->name, "502", "Bad Gateway",
+                "The application didn't answer");
+    fcgi_done(c);
+    return 0;
+}
+
+/*
+ * fcgi_done - Drop the FastCGI request of c from it and rbuf, and leave c
+ *     in CONN_WRITE with whatever response is left to send.
+ */
+static void fcgi_done(struct conn *c) {
+    struct fcgireq *fr = c->fcgi;
+
+    c->fcgi = NULL;
+    conn_consume(c, fr->headlen + fr->inbuf);
+    c->state = CONN_WRITE;
+}
+
+/*
+ * fcgi_detach - Take the request of c off its connection. If the backend
+ *     has seen it and not ended it yet, it is asked to abort it, and its
+ *     id stays taken until it does. Cutting a batch short would throw the
+ *     records after it off, so then the connection is shut down.
+ */
+static void fcgi_detach(struct worker *w, struct conn *c) {
+    struct fcgireq *fr = c->fcgi;
+    struct fcgiconn *fc = fr->fc;
+    int i;
+
+    if (fc == NULL)
+        return;
+    fcgi_unwait(fc, c);
+    if (fc->blocked == c)
+        fc->blocked = NULL;
+    if (fc->writer == c) {
+        fc->writer = NULL;
+        if (fr->partial) {
+            shutdown(fc->fd, SHUT_RDWR);
+            fc->hup = 1;
+        }
+    }
+    i = fr->id - 1;
+    fc->reqs[i] = NULL;
+    if (fr->begun && !fr->ended) {
+        fc->aborted |= 1u << i;
+        if (fc->ctllen + FCGI_HEADER_LEN <= sizeof(fc->ctl)) {
+            fcgi_header(fc->ctl + fc->ctllen, FCGI_ABORT_REQUEST, fr->id, 0);
+            fc->ctllen += FCGI_HEADER_LEN;
+        }
+        else {
+            shutdown(fc->fd, SHUT_RDWR);
+            fc->hup = 1;
+        }
+    }
+    else
+        fc->nreqs--;
+    fr->fc = NULL;
+    fr->id = 0;
+    /* Whatever the connection can do now is done at the end of the round. */
+    fcgiconn_schedule(w, fc);
+}
+
+/*
+ * fcgi_abort - Give up the FastCGI request of c, which is being closed.
+ *     The request is only logged if the backend answered it.
+ */
+void fcgi_abort(struct worker *w, struct conn *c) {
+    struct fcgireq *fr = c->fcgi;
+
+    fcgi_detach(w, c);
+    fcgi_release(fr->backend, 0);
+    if (fr->started)
+        accesslog_request(&c->peer, &c->req, c->status, c->bodylen);
+    c->fcgi = NULL;
+}
+
+/*
+ * fcgi_wait - Queue the request of c for its turn to write on fc, unless
+ *     it is queued already.
+ */
+static void fcgi_wait(struct fcgiconn *fc, struct conn *c) {
+    if (c->fcgi->waiting)
+        return;
+    c->fcgi->waiting = 1;
+    c->fcgi->nextw = NULL;
+    if (fc->waittail != NULL)
+        fc->waittail->fcgi->nextw = c;
+    else
+        fc->waithead = c;
+    fc->waittail = c;
+}
+
+/*
+ * fcgi_unwait - Take the request of c out of the queue of fc, if it is in.
+ */
+static void fcgi_unwait(struct fcgiconn *fc, struct conn *c) {
+    struct conn **p, *prev = NULL;
+
+    if (!c->fcgi->waiting)
+        return;
+    for (p = &fc->waithead; *p != c; p = &(*p)->fcgi->nextw)
+        prev = *p;
+    *p = c->fcgi->nextw;
+    if (fc->waittail == c)
+        fc->waittail = prev;
+    c->fcgi->waiting = 0;
+}
+
+/*
+ * fcgiconn_attach - Give the request of c an id on a connection of worker
+ *     w to its backend: the first one with room for another request,
+ *     unless fresh is set, or else a new one. Returns -1 on error.
+ */
+static int fcgiconn_attach(struct worker *w, struct conn *c, int fresh) {
+    struct fcgireq *fr = c->fcgi;
+    struct fcgiconn *fc = NULL;
+    int i;
+
+    if (!fresh) {
+        for (fc = w->fcgis[fr->backend->id]; fc != NULL; fc = fc->next) {
+            if (!fc->hup && fc->nreqs < fc->maxreqs)
+                break;
+        }
+    }
+    if (fc == NULL && (fc = fcgiconn_open(w, fr->backend)) == NULL)
+        return -1;
+    for (i = 0; fc->reqs[i] != NULL || fc->aborted & 1u << i; ++i)
+        ;
+    fc->reqs[i] = c;
+    fc->nreqs++;
+    fr->fc = fc;
+    fr->id = i + 1;
+    fr->reused = fc->used;
+    fc->used = 1;
+    return 0;
+}
+
+/*
+ * fcgiconn_open - Open a connection of worker w to FastCGI backend b.
+ *     Until b tells if it takes several requests over one connection,
+ *     which the first connection asks, it gets one. Returns NULL on
+ *     error.
+ */
+static struct fcgiconn *fcgiconn_open(struct worker *w,
+                                      struct fcgi_backend *b) {
+    struct fcgiconn *fc;
+    struct epoll_event ev;
+    int fd, maxreqs;
+    size_t n;
+
+    if ((fd = open_clientfd_nb(&b->addr, b->addrlen)) < 0)
+        return NULL;
+    if ((fc = pool_get(&w->fcgiconns)) == NULL) {
+        close(fd);
+        return NULL;
+    }
+    memset(fc, 0, offsetof(struct fcgiconn, in));
+    fc->fd = fd;
+    fc->backend = b;
+    maxreqs = __atomic_load_n(&b->maxreqs, __ATOMIC_RELAXED);
+    fc->maxreqs = maxreqs > 0 ? maxreqs : 1;
+    if (maxreqs == 0) {
+        n = fcgi_param(fc->ctl + FCGI_HEADER_LEN,
+                       sizeof(fc->ctl) - FCGI_HEADER_LEN,
+                       "FCGI_MPXS_CONNS", 15, "", 0);
+        n += fcgi_param(fc->ctl + FCGI_HEADER_LEN + n,
+                        sizeof(fc->ctl) - FCGI_HEADER_LEN - n,
+                        "FCGI_MAX_REQS", 13, "", 0);
+        fcgi_header(fc->ctl, FCGI_GET_VALUES, 0, n);
+        fc->ctllen = FCGI_HEADER_LEN + n;
+    }
+    fc->next = w->fcgis[b->id];
+    w->fcgis[b->id] = fc;
+
+    /* Registered once and edge-triggered, like a client. */
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = (void *)((uintptr_t)fc | 2);
+    if (epoll_ctl(w->epollfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+        unix_errq("epoll_ctl error");
+    return fc;
+}
+
+/*
+ * fcgiconn_close - Close connection fc of worker w, which no request is
+ *     on any more. It is freed by worker_reap().
+ */
+static void fcgiconn_close(struct worker *w, struct fcgiconn *fc) {
+    struct fcgiconn **p;
+
+    for (p = &w->fcgis[fc->backend->id]; *p != fc; p = &(*p)->next)
+        ;
+    *p = fc->next;
+    if (close(fc->fd) != 0)
+        unix_errq("close fastcgi error");
+    fc->fd = -1;
+    fc->next = w->deadfcgis;
+    w->deadfcgis = fc;
+}
+
+/*
+ * fcgiconn_fail - Close connection fc of worker w, which broke, and fail
+ *     the requests on it. Those still without an answer may go again,
+ *     those halfway through their response lose their client.
+ */
+static void fcgiconn_fail(struct worker *w, struct fcgiconn *fc) {
+    struct conn *c;
+    int i;
+
+    if (fc->nreqs > 0)
+        log("FastCGI connection to %s broke\n\n", fc->backend->name);
+    fcgiconn_close(w, fc);
+    for (i = 0; i < FCGI_MAXREQS; ++i) {
+        if ((c = fc->reqs[i]) == NULL)
+            continue;
+        fc->reqs[i] = NULL;
+        c->fcgi->fc = NULL;
+        c->fcgi->waiting = 0;
+        if (c->fcgi->started)
+            conn_close(w, c);
+        else {
+            fcgi_fail(w, c);
+            conn_handle(w, c);
+        }
+    }
+}
+
+/*
+ * fcgiconn_schedule - Have fc run at the end of the round of worker w.
+ *     Requests waiting for their turn, records held back and connections
+ *     left idle are seen to there, rather than in the middle of handling
+ *     some client.
+ */
+static void fcgiconn_schedule(struct worker *w, struct fcgiconn *fc) {
+    if (fc->scheduled)
+        return;
+    fc->scheduled = 1;
+    fc->readynext = w->fcgiready;
+    w->fcgiready = fc;
+}
+
+/*
+ * fcgiconn_event - Handle events on FastCGI connection fc of worker w.
+ */
+void fcgiconn_event(struct worker *w, struct fcgiconn *fc, uint32_t events) {
+    if (fc->fd < 0)
+        return;
+    if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+        fc->hup = 1;
+    fcgiconn_run(w, fc);
+}
+
+/*
+ * fcgiconn_run - Move connection fc of worker w along: send management
+ *     records, let the requests write in turn, then read and hand out
+ *     records until it would block. An idle connection beyond the ones
+ *     the worker keeps is closed.
+ */
+static void fcgiconn_run(struct worker *w, struct fcgiconn *fc) {
+    struct fcgiconn *other;
+    struct conn *c;
+    int rc, idle = 0;
+
+    while (fc->fd >= 0) {
+        if ((c = fc->writer) == NULL) {
+            if ((rc = fcgiconn_ctl(fc)) < 0) {
+                fcgiconn_fail(w, fc);
+                return;
+            }
+            if (rc > 0 || (c = fc->waithead) == NULL)
+                break;
+        }
+        conn_handle(w, c);
+        /* It is still stuck. */
+        if (fc->writer == c || fc->waithead == c)
+            break;
+    }
+    if (fc->fd >= 0 && fcgiconn_read(w, fc) < 0) {
+        fcgiconn_fail(w, fc);
+        return;
+    }
+
+    if (fc->fd < 0 || fc->nreqs > 0)
+        return;
+    for (other = w->fcgis[fc->backend->id]; other != NULL;
+         other = other->next)
+        idle += other->nreqs == 0;
+    if (fc->hup || idle > FCGICONN_KEEP)
+        fcgiconn_close(w, fc);
+}
+
+/*
+ * fcgiconn_ctl - Send the management records of fc. Returns 0 once they
+ *     are all sent, 1 if the socket would block and -1 on error.
+ */
+static int fcgiconn_ctl(struct fcgiconn *fc) {
+    ssize_t n;
+
+    while (fc->ctllen > 0) {
+        if ((n = send(fc->fd, fc->ctl, fc->ctllen, 0)) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 1;
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        fc->ctllen -= n;
+        memmove(fc->ctl, fc->ctl + n, fc->ctllen);
+    }
+    return 0;
+}
+
+/*
+ * fcgiconn_read - Read records from fc and hand them out until the
+ *     socket would block, or a client has no room for its output.
+ *     Returns -1 if the connection broke or the backend closed it.
+ */
+static int fcgiconn_read(struct worker *w, struct fcgiconn *fc) {
+    ssize_t n;
+    int rc;
+
+    while (fc->fd >= 0) {
+        if ((rc = fcgiconn_records(w, fc)) != 0)
+            return rc > 0 ? 0 : -1;
+        if (fc->inpos > 0) {
+            fc->inlen -= fc->inpos;
+            memmove(fc->in, fc->in + fc->inpos, fc->inlen);
+            fc->inpos = 0;
+        }
+        n = read(fc->fd, fc->in + fc->inlen, FCGI_INBUF - fc->inlen);
+        if (n > 0)
+            fc->inlen += n;
+        else if (n == 0)
+            return -1;
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        else if (errno != EINTR)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * fcgiconn_records - Handle the records read into fc. FCGI_STDOUT goes to
+ *     the client of its request piece by piece, while the other records
+ *     we act on are taken whole, and the rest is dropped. Returns 0 when
+ *     more input is needed, 1 if a client has no room for its output and
+ *     -1 if the input is malformed.
+ */
+static int fcgiconn_records(struct worker *w, struct fcgiconn *fc) {
+    struct fcgi_header *h = &fc->rec;
+    struct conn *c;
+    const char *p;
+    size_t avail, n;
+    int rc;
+
+    while (fc->fd >= 0) {
+        p = fc->in + fc->inpos;
+        avail = fc->inlen - fc->inpos;
+        if (!fc->inrec) {
+            if (avail < FCGI_HEADER_LEN)
+                return 0;
+            if (fcgi_parse_header(p, h) != 0)
+                return -1;
+            fc->inpos += FCGI_HEADER_LEN;
+            fc->inrec = 1;
+            fc->recleft = h->len;
+            fc->padleft = h->pad;
+            fc->gather = h->type == FCGI_END_REQUEST
+                         || h->type == FCGI_GET_VALUES_RESULT;
+            if (fc->gather && h->len > FCGI_INBUF - FCGI_HEADER_LEN)
+                return -1;
+            continue;
+        }
+
+        if (fc->gather) {
+            if (avail < h->len)
+                return 0;
+            if ((rc = fcgiconn_record(w, fc, p)) != 0)
+                return rc;
+            fc->inpos += h->len;
+            fc->recleft = 0;
+            fc->gather = 0;
+            continue;
+        }
+        if (fc->recleft > 0) {
+            if (avail == 0)
+                return 0;
+            n = avail < fc->recleft ? avail : fc->recleft;
+            c = h->id >= 1 && h->id <= FCGI_MAXREQS
+                ? fc->reqs[h->id - 1] : NULL;
+            if (h->type == FCGI_STDOUT && c != NULL
+                && (n = fcgi_deliver(w, c, p, n)) == 0) {
+                fc->blocked = c;
+                return 1;
+            }
+            if (h->type == FCGI_STDERR)
+                log("%s: %.*s\n", fc->backend->name, (int)n, p);
+            fc->inpos += n;
+            fc->recleft -= n;
+            continue;
+        }
+
+        /* Then the padding. */
+        n = avail < fc->padleft ? avail : fc->padleft;
+        fc->inpos += n;
+        if ((fc->padleft -= n) > 0)
+            return 0;
+        fc->inrec = 0;
+    }
+    return 0;
+}
+
+/*
+ * fcgiconn_record - Act on the record of fc whose content is at p: the
+ *     end of a request, or the answer to our FCGI_GET_VALUES, which tells
+ *     how many requests the backend takes over one connection. Returns
+ *     like fcgiconn_records().
+ */
+static int fcgiconn_record(struct worker *w, struct fcgiconn *fc,
+                           const char *p) {
+    struct fcgi_header *h = &fc->rec;
+    struct conn *c;
+    int maxreqs;
+
+    if (h->type == FCGI_GET_VALUES_RESULT) {
+        maxreqs = 1;
+        if (fcgi_values(p, h->len, "FCGI_MPXS_CONNS") == 1
+            && ((maxreqs = fcgi_values(p, h->len, "FCGI_MAX_REQS")) <= 0
+                || maxreqs > FCGI_MAXREQS))
+            maxreqs = FCGI_MAXREQS;
+        fc->maxreqs = maxreqs;
+        __atomic_store_n(&fc->backend->maxreqs, maxreqs, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    if (h->len < 8 || h->id < 1 || h->id > FCGI_MAXREQS)
+        return -1;
+    if ((c = fc->reqs[h->id - 1]) != NULL)
+        return fcgi_end(w, c, (unsigned char)p[4]);
+    /* A request given up on, its id is free again. */
+    if (fc->aborted & 1u << (h->id - 1)) {
+        fc->aborted &= ~(1u << (h->id - 1));
+        fc->nreqs--;
+    }
+    return 0;
+}
+
+/*
+ * fcgi_worker_setup - Set up what worker w keeps of its connections to
+ *     FastCGI backends. It runs in the thread of w.
+ */
+void fcgi_worker_setup(struct worker *w) {
+    pool_init(&w->fcgiconns, sizeof(struct fcgiconn), 1, FCGICONN_KEEP);
+    if (fcgi_active()
+        && (w->fcgis = calloc(fcgi_nbackends(), sizeof(*w->fcgis))) == NULL)
+        unix_errq("calloc error");
+}
+
+/*
+ * fcgi_worker_run - Run the connections of w that were left with work,
+ *     see fcgiconn_schedule(). It is called at the end of every round.
+ */
+void fcgi_worker_run(struct worker *w) {
+    struct fcgiconn *fc;
+
+    while ((fc = w->fcgiready) != NULL) {
+        w->fcgiready = fc->readynext;
+        fc->scheduled = 0;
+        fcgiconn_run(w, fc);
+    }
+}
+
+/*
+ * fcgi_worker_reap - Free the connections to FastCGI backends that
+ *     worker w closed in this round.
+ */
+void fcgi_worker_reap(struct worker *w) {
+    struct fcgiconn *fc;
+
+    while ((fc = w->deadfcgis) != NULL) {
+        w->deadfcgis = fc->next;
+        pool_put(&w->fcgiconns, fc);
+    }
+}
+
+/*
+ * fcgi_worker_stop - Close the connections of worker w to FastCGI
+ *     backends, once its clients are gone, and free what it kept of them.
+ */
+void fcgi_worker_stop(struct worker *w) {
+    int i;
+
+    for (i = 0; i < fcgi_nbackends(); ++i) {
+        while (w->fcgis[i] != NULL)
+            fcgiconn_close(w, w->fcgis[i]);
+    }
+    w->fcgiready = NULL;
+    fcgi_worker_reap(w);
+    free(w->fcgis);
+    pool_destroy(&w->fcgiconns);
+}
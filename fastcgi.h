@@ -0,0 +1,99 @@
+#ifndef _FASTCGI_H
+#define _FASTCGI_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define FCGI_MAXROUTES    16  /* Max --fastcgi rules */
+#define FCGI_MAXBACKENDS  16  /* Max backends over all rules */
+#define FCGI_MAXREQS      32  /* Max requests over one connection */
+#define FCGI_INFLIGHT     64  /* Default max requests to a backend */
+
+/* Record types, from the FastCGI specification. */
+#define FCGI_BEGIN_REQUEST      1
+#define FCGI_ABORT_REQUEST      2
+#define FCGI_END_REQUEST        3
+#define FCGI_PARAMS             4
+#define FCGI_STDIN              5
+#define FCGI_STDOUT             6
+#define FCGI_STDERR             7
+#define FCGI_GET_VALUES         9
+#define FCGI_GET_VALUES_RESULT  10
+
+/* protocolStatus of FCGI_END_REQUEST. */
+#define FCGI_REQUEST_COMPLETE  0
+#define FCGI_CANT_MPX_CONN     1
+#define FCGI_OVERLOADED        2
+
+/* Role and flags of FCGI_BEGIN_REQUEST. */
+#define FCGI_RESPONDER  1
+#define FCGI_KEEP_CONN  1
+
+#define FCGI_HEADER_LEN  8
+#define FCGI_MAXCONTENT  65535
+
+struct fcgi_header {
+    int type;
+    int id;
+    size_t len;                     /* Of the content */
+    size_t pad;                     /* ... and the padding after it */
+};
+
+/*
+ * A FastCGI application, listening on a unix socket or at host:port. Its
+ * address is resolved once, at startup. The counters are shared by all
+ * workers.
+ */
+struct fcgi_backend {
+    int id;                         /* Index, for state kept per worker */
+    char *name;                     /* As configured */
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int maxreqs;                    /* Requests per connection, 0 unknown */
+    int inflight;                   /* Requests sent and not answered */
+    unsigned long requests;         /* Requests sent to it */
+    unsigned long failures;         /* ... that got no response */
+    unsigned long rejected;         /* Turned away over the limit */
+};
+
+/*
+ * Requests for paths under prefix, or ending with suffix, go to backend.
+ * The script is the file the path maps to under the document root.
+ */
+struct fcgi_route {
+    const char *prefix;
+    const char *suffix;
+    struct fcgi_backend *backend;
+};
+
+struct conn;
+struct worker;
+struct fcgiconn;
+struct http_request;
+
+int fcgi_add(char *spec);
+int fcgi_active(void);
+int fcgi_nbackends(void);
+void fcgi_set_inflight(int max);
+struct fcgi_route *fcgi_match(const char *uri);
+int fcgi_acquire(struct fcgi_backend *b);
+void fcgi_release(struct fcgi_backend *b, int failed);
+void fcgi_header(char *buf, int type, int id, size_t len);
+int fcgi_parse_header(const char *buf, struct fcgi_header *h);
+size_t fcgi_param(char *buf, size_t size, const char *name, size_t namelen,
+                  const char *value, size_t valuelen);
+int fcgi_values(const char *buf, size_t len, const char *name);
+void fcgi_write_metrics(FILE *fp);
+
+void fcgi_start(struct conn *c, struct fcgi_route *r, const char *uri,
+                struct http_request *req);
+int fcgi_drive(struct worker *w, struct conn *c);
+void fcgi_abort(struct worker *w, struct conn *c);
+void fcgiconn_event(struct worker *w, struct fcgiconn *fc, uint32_t events);
+void fcgi_worker_setup(struct worker *w);
+void fcgi_worker_run(struct worker *w);
+void fcgi_worker_reap(struct worker *w);
+void fcgi_worker_stop(struct worker *w);
+
+#endif
@@ -0,0 +1,770 @@
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "error.h"
+#include "http-utils.h"
+#include "http-parser.h"
+#include "fastcgi.h"
+#include "rio.h"
+
+#define WAIT_SERVER  5      /* Seconds to wait for the server to come up */
+#define TIMEOUT      5      /* Seconds the server may take for anything */
+#define MAXCONNS     8      /* Connections the responder takes in a run */
+#define MAXREQS      8      /* ... requests over one, as it tells the server */
+#define MAXCLIENTS   4      /* Client connections of one test */
+#define INBUF        65536  /* Records read from the server, not handled */
+#define MAXPARAMS    8192
+#define MAXURI       256
+#define MAXRESP      65536
+
+struct backconn;
+
+/*
+ * A request of the server, as the stand-in responder reads it. It is
+ * ready once its params and the empty FCGI_STDIN record are in, and is
+ * handed to a test once.
+ */
+struct backreq {
+    struct backconn *bc;
+    int id;
+    int active;                /* Begun and not ended by us */
+    int ready, taken;
+    char params[MAXPARAMS];
+    size_t paramlen;
+    char uri[MAXURI];          /* REQUEST_URI */
+};
+
+/* A connection the server opened to the responder. */
+struct backconn {
+    int fd;                    /* -1 once closed */
+    struct backreq reqs[MAXREQS];  /* By id - 1 */
+    size_t inlen;
+    char in[INBUF];
+};
+
+/* A response, as a client read it. */
+struct response {
+    int status;                /* 0 if no head came */
+    int close;                 /* It has Connection: close */
+    int chunked;
+    size_t len;
+    char buf[MAXRESP];         /* As it came */
+    size_t bodylen;
+    char body[MAXRESP];        /* ... and its body, unchunked */
+};
+
+static char *host = "127.0.0.1";
+static char *port = NULL;
+static char *sockpath = NULL;
+static int listenfd = -1;
+static struct backconn conns[MAXCONNS];
+static int nconns = 0;
+static int clients[MAXCLIENTS];
+static int nclients = 0;
+static struct response resps[2];
+static char reason[512];       /* Why the last test failed */
+
+void show_usage(const char *name);
+void wait_server(void);
+void responder_open(const char *path);
+struct backreq *backend_next(void);
+int backend_poll(void);
+void backend_accept(void);
+void backend_read(struct backconn *bc);
+void backend_record(struct backconn *bc, const struct fcgi_header *h,
+                    const char *p);
+void backend_send(struct backreq *r, int type, const char *s, size_t pad);
+void backend_end(struct backreq *r, unsigned appstatus, int status,
+                 size_t pad);
+void backend_write(struct backconn *bc, int type, int id, const char *data,
+                   size_t len, size_t pad);
+void backend_close(struct backconn *bc);
+int record_header(const char *p, struct fcgi_header *h);
+size_t param_put(char *p, const char *name, const char *value);
+int param_get(const char *p, size_t len, const char *name, char *value,
+              size_t size);
+int client_open(void);
+void client_get(int fd, const char *uri);
+void clients_close(void);
+int client_response(int fd, struct response *resp);
+int response_body(struct response *resp, size_t start, off_t length);
+int check_response(const char *who, const struct response *resp, int status,
+                   const char *body);
+int fail(const char *fmt, ...);
+int test_padded(void);
+int test_interleaved(void);
+int test_app_status(void);
+int test_close(void);
+
+/* In order, later ones expect the server to know we multiplex. */
+static const struct test {
+    const char *name;
+    int (*run)(void);
+} tests[] = {
+    {"padded records, head and body split over several", test_padded},
+    {"responses to two requests interleaved", test_interleaved},
+    {"END_REQUEST with a nonzero app status", test_app_status},
+    {"backend closing in the middle of a response", test_close},
+};
+#define NTESTS ((int)(sizeof(tests) / sizeof(tests[0])))
+
+int main(int argc, char *argv[]) {
+    int opt, i, nfailed = 0;
+
+    /* Process args. */
+    while (1) {
+        static const char *optstring = "H:p:s:h";
+        static const struct option longopts[] = {
+            {"host", required_argument, NULL, 'H'},
+            {"port", required_argument, NULL, 'p'},
+            {"socket", required_argument, NULL, 's'},
+            {"help", no_argument, NULL, 'h'},
+            {NULL, 0, NULL, 0}
+        };
+
+        opt = getopt_long(argc, argv, optstring, longopts, NULL);
+        if (opt == -1)
+            break;
+        switch (opt) {
+        case 'H': host = optarg; break;
+        case 'p': port = optarg; break;
+        case 's': sockpath = optarg; break;
+        case 'h':
+        default: show_usage(argv[0]);
+        }
+    }
+    if (port == NULL || sockpath == NULL || optind != argc)
+        show_usage(argv[0]);
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+        unix_errq("signal error");
+
+    http_parser_init();
+    responder_open(sockpath);
+    wait_server();
+    for (i = 0; i < NTESTS; ++i) {
+        reason[0] = '\0';
+        if (tests[i].run() == 0)
+            printf("ok    %s\n", tests[i].name);
+        else {
+            printf("FAIL  %s: %s\n", tests[i].name, reason);
+            nfailed++;
+        }
+        clients_close();
+    }
+    printf("%d of %d tests failed\n", nfailed, NTESTS);
+    unlink(sockpath);
+    return nfailed > 0;
+}
+
+void show_usage(const char *name) {
+    printf("Usage: %s [-H HOST, --host HOST] -p PORT, --port PORT\n"
+           "       -s SOCKET, --socket SOCKET [-h, --help]\n"
+           "Answer FastCGI requests on unix socket SOCKET as the tests need "
+           "while sending\nrequests to the server at HOST:PORT, which must "
+           "pass /fcgi/ to SOCKET.\n",
+           name);
+    exit(1);
+}
+
+void wait_server(void) {
+    int fd, i;
+    struct timespec ts = {0, 100 * 1000 * 1000};
+
+    for (i = 0; i < WAIT_SERVER * 10; ++i) {
+        if ((fd = open_clientfd(host, port)) >= 0) {
+            close(fd);
+            return;
+        }
+        if (fd == -2)
+            break;
+        nanosleep(&ts, NULL);
+    }
+    app_errq("cannot connect to %s:%s", host, port);
+}
+
+/*
+ * responder_open - Listen on unix socket path, replacing whatever a run
+ *     cut short left there.
+ */
+void responder_open(const char *path) {
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        app_errq("Socket path too long: %s", path);
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if ((listenfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        unix_errq("socket error");
+    if (bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+        unix_errq("bind error");
+    if (listen(listenfd, 16) != 0)
+        unix_errq("listen error");
+}
+
+/*
+ * backend_next - Return the next request of the server that is ready,
+ *     reading records until one is. Returns NULL if none came in time.
+ */
+struct backreq *backend_next(void) {
+    struct backreq *r;
+    int i, j;
+
+    while (1) {
+        for (i = 0; i < nconns; ++i) {
+            for (j = 0; j < MAXREQS; ++j) {
+                r = &conns[i].reqs[j];
+                if (r->ready && !r->taken) {
+                    r->taken = 1;
+                    return r;
+                }
+            }
+        }
+        if (backend_poll() != 0)
+            return NULL;
+    }
+}
+
+/*
+ * backend_poll - Wait for new connections and records, and take them in.
+ *     Returns -1 if nothing came in time.
+ */
+int backend_poll(void) {
+    struct pollfd fds[MAXCONNS + 1];
+    int i, n = 0, rc;
+
+    fds[n].fd = listenfd;
+    fds[n++].events = POLLIN;
+    for (i = 0; i < nconns; ++i) {
+        fds[n].fd = conns[i].fd;
+        fds[n++].events = POLLIN;
+    }
+    while ((rc = poll(fds, n, TIMEOUT * 1000)) < 0) {
+        if (errno != EINTR)
+            unix_errq("poll error");
+    }
+    if (rc == 0)
+        return -1;
+    for (i = 1; i < n; ++i) {
+        if (fds[i].revents != 0)
+            backend_read(&conns[i - 1]);
+    }
+    if (fds[0].revents & POLLIN)
+        backend_accept();
+    return 0;
+}
+
+void backend_accept(void) {
+    struct backconn *bc;
+    int fd;
+
+    if ((fd = accept(listenfd, NULL, NULL)) < 0)
+        unix_errq("accept error");
+    if (nconns == MAXCONNS)
+        app_errq("The server opened more than %d connections", MAXCONNS);
+    bc = &conns[nconns++];
+    memset(bc, 0, sizeof(*bc));
+    bc->fd = fd;
+}
+
+/*
+ * backend_read - Read from bc and act on the records that are complete.
+ *     A connection the server closed is closed too.
+ */
+void backend_read(struct backconn *bc) {
+    struct fcgi_header h;
+    size_t pos = 0;
+    ssize_t n;
+
+    if ((n = read(bc->fd, bc->in + bc->inlen, INBUF - bc->inlen)) <= 0) {
+        if (n < 0 && errno == EINTR)
+            return;
+        backend_close(bc);
+        return;
+    }
+    bc->inlen += n;
+    while (bc->inlen - pos >= FCGI_HEADER_LEN) {
+        if (record_header(bc->in + pos, &h) != 0)
+            app_errq("Bad record from the server");
+        if (bc->inlen - pos < FCGI_HEADER_LEN + h.len + h.pad)
+            break;
+        backend_record(bc, &h, bc->in + pos + FCGI_HEADER_LEN);
+        pos += FCGI_HEADER_LEN + h.len + h.pad;
+    }
+    bc->inlen -= pos;
+    memmove(bc->in, bc->in + pos, bc->inlen);
+}
+
+/*
+ * backend_record - Act on a record of bc with header h and content at p.
+ *     We tell the server that we multiplex, and end the requests it
+ *     aborts, like a real application.
+ */
+void backend_record(struct backconn *bc, const struct fcgi_header *h,
+                    const char *p) {
+    struct backreq *r;
+    char buf[64], num[16];
+    size_t n;
+
+    if (h->type == FCGI_GET_VALUES) {
+        snprintf(num, sizeof(num), "%d", MAXREQS);
+        n = param_put(buf, "FCGI_MPXS_CONNS", "1");
+        n += param_put(buf + n, "FCGI_MAX_REQS", num);
+        backend_write(bc, FCGI_GET_VALUES_RESULT, 0, buf, n, 0);
+        return;
+    }
+    if (h->id < 1 || h->id > MAXREQS)
+        app_errq("Request id %d out of range", h->id);
+    r = &bc->reqs[h->id - 1];
+    switch (h->type) {
+    case FCGI_BEGIN_REQUEST:
+        if (r->active)
+            app_errq("Request id %d taken twice", h->id);
+        memset(r, 0, sizeof(*r));
+        r->bc = bc;
+        r->id = h->id;
+        r->active = 1;
+        break;
+    case FCGI_PARAMS:
+        if (r->paramlen + h->len > MAXPARAMS)
+            app_errq("Params too long");
+        memcpy(r->params + r->paramlen, p, h->len);
+        r->paramlen += h->len;
+        break;
+    case FCGI_STDIN:
+        if (h->len == 0 && r->active) {
+            param_get(r->params, r->paramlen, "REQUEST_URI", r->uri,
+                      sizeof(r->uri));
+            r->ready = 1;
+        }
+        break;
+    case FCGI_ABORT_REQUEST:
+        if (r->active)
+            backend_end(r, 0, FCGI_REQUEST_COMPLETE, 0);
+        break;
+    }
+}
+
+/*
+ * backend_send - Send the string s to the server as a record of r of
+ *     type type, followed by pad bytes of padding.
+ */
+void backend_send(struct backreq *r, int type, const char *s, size_t pad) {
+    backend_write(r->bc, type, r->id, s, strlen(s), pad);
+}
+
+/*
+ * backend_end - End r with app status appstatus and protocol status
+ *     status, in a record with pad bytes of padding.
+ */
+void backend_end(struct backreq *r, unsigned appstatus, int status,
+                 size_t pad) {
+    char body[8];
+
+    memset(body, 0, sizeof(body));
+    body[0] = appstatus >> 24;
+    body[1] = appstatus >> 16;
+    body[2] = appstatus >> 8;
+    body[3] = appstatus;
+    body[4] = status;
+    backend_write(r->bc, FCGI_END_REQUEST, r->id, body, sizeof(body), pad);
+    r->active = 0;
+}
+
+void backend_write(struct backconn *bc, int type, int id, const char *data,
+                   size_t len, size_t pad) {
+    static char rec[FCGI_HEADER_LEN + FCGI_MAXCONTENT + 255];
+
+    rec[0] = 1;
+    rec[1] = type;
+    rec[2] = id >> 8;
+    rec[3] = id;
+    rec[4] = len >> 8;
+    rec[5] = len;
+    rec[6] = pad;
+    rec[7] = 0;
+    memcpy(rec + FCGI_HEADER_LEN, data, len);
+    /* Padding may be anything, the server has to skip it. */
+    memset(rec + FCGI_HEADER_LEN + len, 'P', pad);
+    if (rio_writen(bc->fd, rec, FCGI_HEADER_LEN + len + pad) < 0)
+        unix_errq("rio_writen error");
+}
+
+void backend_close(struct backconn *bc) {
+    if (bc->fd < 0)
+        return;
+    if (close(bc->fd) != 0)
+        unix_errq("close error");
+    bc->fd = -1;
+    memset(bc->reqs, 0, sizeof(bc->reqs));
+}
+
+/*
+ * record_header - Decode the record header at p, of FCGI_HEADER_LEN
+ *     bytes, into h. Returns -1 if its version isn't 1. The records of the
+ *     server are taken apart here rather than in fastcgi.c, so that its
+ *     mistakes don't cancel out.
+ */
+int record_header(const char *p, struct fcgi_header *h) {
+    const unsigned char *q = (const unsigned char *)p;
+
+    if (q[0] != 1)
+        return -1;
+    h->type = q[1];
+    h->id = q[2] << 8 | q[3];
+    h->len = q[4] << 8 | q[5];
+    h->pad = q[6];
+    return 0;
+}
+
+/*
+ * param_put - Encode the pair name and value, both shorter than 128
+ *     bytes, at p. Returns its length.
+ */
+size_t param_put(char *p, const char *name, const char *value) {
+    size_t namelen = strlen(name), valuelen = strlen(value);
+
+    p[0] = namelen;
+    p[1] = valuelen;
+    memcpy(p + 2, name, namelen);
+    memcpy(p + 2 + namelen, value, valuelen);
+    return 2 + namelen + valuelen;
+}
+
+/*
+ * param_get - Copy the value of the param name in the name-value pairs
+ *     p[0, len) into value, of size bytes. Returns -1 if it isn't there.
+ */
+int param_get(const char *p, size_t len, const char *name, char *value,
+              size_t size) {
+    const unsigned char *q = (const unsigned char *)p, *end = q + len;
+    size_t lens[2];
+    int i;
+
+    while (q < end) {
+        for (i = 0; i < 2; ++i) {
+            if (q < end && !(*q & 0x80))
+                lens[i] = *q++;
+            else if (end - q >= 4) {
+                lens[i] = (size_t)(q[0] & 0x7f) << 24 | q[1] << 16
+                          | q[2] << 8 | q[3];
+                q += 4;
+            }
+            else
+                return -1;
+        }
+        if ((size_t)(end - q) < lens[0] + lens[1])
+            return -1;
+        if (lens[0] == strlen(name) && memcmp(q, name, lens[0]) == 0) {
+            if (lens[1] >= size)
+                return -1;
+            memcpy(value, q + lens[0], lens[1]);
+            value[lens[1]] = '\0';
+            return 0;
+        }
+        q += lens[0] + lens[1];
+    }
+    return -1;
+}
+
+/*
+ * client_open - Connect to the server. The connection is closed after
+ *     the test.
+ */
+int client_open(void) {
+    struct timeval tv = {TIMEOUT, 0};
+    int fd;
+
+    if (nclients == MAXCLIENTS)
+        app_errq("Too many clients");
+    if ((fd = open_clientfd(host, port)) < 0)
+        app_errq("cannot connect to %s:%s", host, port);
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0)
+        unix_errq("setsockopt error");
+    clients[nclients++] = fd;
+    return fd;
+}
+
+void client_get(int fd, const char *uri) {
+    char buf[512];
+    int n;
+
+    n = snprintf(buf, sizeof(buf), "GET %s HTTP/1.1\r\n"
+                                   "Host: localhost\r\n\r\n", uri);
+    if (rio_writen(fd, buf, n) < 0)
+        unix_errq("rio_writen error");
+}
+
+void clients_close(void) {
+    while (nclients > 0)
+        close(clients[--nclients]);
+}
+
+/*
+ * client_response - Read a response from fd into resp. Returns 0 once it
+ *     is complete, or -1 if the connection ended or nothing came in time
+ *     before, with what came in resp.
+ */
+int client_response(int fd, struct response *resp) {
+    struct http_response head;
+    const struct http_slice *s;
+    off_t length = -1;
+    ssize_t n;
+    int hlen = 0;
+
+    resp->status = resp->close = resp->chunked = 0;
+    resp->len = resp->bodylen = 0;
+    http_response_init(&head);
+    while ((n = read(fd, resp->buf + resp->len,
+                     MAXRESP - 1 - resp->len)) > 0) {
+        resp->len += n;
+        resp->buf[resp->len] = '\0';
+        if (hlen == 0) {
+            if ((hlen = http_parse_response(&head, resp->buf, resp->len)) < 0)
+                return -1;
+            if (hlen == 0)
+                continue;
+            resp->status = head.status;
+            if ((s = http_find(head.headers, head.nheaders,
+                               "Transfer-Encoding")) != NULL)
+                resp->chunked = http_has_token(s, "chunked");
+            if ((s = http_find(head.headers, head.nheaders, "Connection"))
+                != NULL)
+                resp->close = http_has_token(s, "close");
+            if (http_content_length(head.headers, head.nheaders, &length)
+                <= 0)
+                length = -1;
+        }
+        if (response_body(resp, hlen, length))
+            return 0;
+    }
+    if (hlen > 0)
+        response_body(resp, hlen, length);
+    return -1;
+}
+
+/*
+ * response_body - Take the body of resp, from start on, out of its
+ *     framing. Returns 1 if it is complete.
+ */
+int response_body(struct response *resp, size_t start, off_t length) {
+    const char *p = resp->buf + start, *end = resp->buf + resp->len, *eol;
+    size_t size;
+    char *q;
+
+    resp->bodylen = 0;
+    if (!resp->chunked) {
+        size = end - p;
+        if (length >= 0 && size > (size_t)length)
+            size = length;
+        memcpy(resp->body, p, size);
+        resp->bodylen = size;
+        return length >= 0 && size == (size_t)length;
+    }
+    while ((eol = memmem(p, end - p, "\r\n", 2)) != NULL) {
+        size = strtoul(p, &q, 16);
+        if (q == p)
+            return 0;
+        p = eol + 2;
+        if (size == 0)
+            return end - p >= 2 && memcmp(p, "\r\n", 2) == 0;
+        if ((size_t)(end - p) < size)
+            size = end - p;
+        memcpy(resp->body + resp->bodylen, p, size);
+        resp->bodylen += size;
+        if ((size_t)(end - p) < size + 2)
+            return 0;
+        p += size + 2;
+    }
+    return 0;
+}
+
+/*
+ * check_response - Check that resp, of client who, has status status and
+ *     body body, if it isn't NULL. Returns -1 if it doesn't.
+ */
+int check_response(const char *who, const struct response *resp, int status,
+                   const char *body) {
+    if (resp->status != status)
+        return fail("%s got status %d, not %d", who, resp->status, status);
+    if (body != NULL && (resp->bodylen != strlen(body)
+                         || memcmp(resp->body, body, resp->bodylen) != 0))
+        return fail("%s got body \"%.*s\", not \"%s\"", who,
+                    (int)resp->bodylen, resp->body, body);
+    return 0;
+}
+
+/*
+ * fail - Keep why the test failed for main() to print. Returns -1.
+ */
+int fail(const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(reason, sizeof(reason), fmt, ap);
+    va_end(ap);
+    return -1;
+}
+
+/*
+ * test_padded - Records with padding, an FCGI_STDERR record among them,
+ *     and the CGI head and the body each split over FCGI_STDOUT records.
+ */
+int test_padded(void) {
+    struct backreq *r;
+    int fd;
+
+    fd = client_open();
+    client_get(fd, "/fcgi/padded");
+    if ((r = backend_next()) == NULL)
+        return fail("no request came");
+    if (strcmp(r->uri, "/fcgi/padded") != 0)
+        return fail("the request was for %s", r->uri);
+    backend_send(r, FCGI_STDOUT, "Content-Type: te", 3);
+    backend_send(r, FCGI_STDERR, "a warning", 7);
+    backend_send(r, FCGI_STDOUT, "xt/plain\r\n\r\nhello, ", 255);
+    backend_send(r, FCGI_STDOUT, "padded world", 1);
+    backend_send(r, FCGI_STDOUT, "", 4);
+    backend_end(r, 0, FCGI_REQUEST_COMPLETE, 16);
+    if (client_response(fd, &resps[0]) != 0)
+        return fail("the response didn't end");
+    return check_response("the client", &resps[0], 200,
+                          "hello, padded world");
+}
+
+/*
+ * test_interleaved - Two requests over one connection, whose records the
+ *     backend answers in turns, the later request first.
+ */
+int test_interleaved(void) {
+    struct backreq *ra, *rb, *r;
+    int a, b;
+
+    a = client_open();
+    b = client_open();
+    client_get(a, "/fcgi/a");
+    client_get(b, "/fcgi/b");
+    if ((ra = backend_next()) == NULL || (rb = backend_next()) == NULL)
+        return fail("the requests didn't both come");
+    if (strcmp(ra->uri, "/fcgi/b") == 0) {
+        r = ra;
+        ra = rb;
+        rb = r;
+    }
+    if (strcmp(ra->uri, "/fcgi/a") != 0 || strcmp(rb->uri, "/fcgi/b") != 0)
+        return fail("the requests were for %s and %s", ra->uri, rb->uri);
+    if (ra->bc != rb->bc)
+        return fail("the requests came over two connections");
+
+    backend_send(rb, FCGI_STDOUT, "Content-Type: text/plain\r\n\r\n", 0);
+    backend_send(ra, FCGI_STDOUT, "Content-Type: text/plain\r\n", 0);
+    backend_send(rb, FCGI_STDOUT, "this is b, ", 0);
+    backend_send(ra, FCGI_STDOUT, "\r\nthis is a", 0);
+    backend_end(ra, 0, FCGI_REQUEST_COMPLETE, 0);
+    backend_send(rb, FCGI_STDOUT, "answered last", 0);
+    backend_end(rb, 0, FCGI_REQUEST_COMPLETE, 0);
+    if (client_response(a, &resps[0]) != 0
+        || client_response(b, &resps[1]) != 0)
+        return fail("a response didn't end");
+    if (check_response("a", &resps[0], 200, "this is a") != 0
+        || check_response("b", &resps[1], 200, "this is b, answered last")
+           != 0)
+        return -1;
+    return 0;
+}
+
+/*
+ * test_app_status - The app status of FCGI_END_REQUEST is the exit status
+ *     of the application, not an HTTP status: a response that came is
+ *     passed on as it is, and the client kept. Without a response the
+ *     client gets a 502.
+ */
+int test_app_status(void) {
+    struct backreq *r;
+    int fd;
+
+    fd = client_open();
+    client_get(fd, "/fcgi/status");
+    if ((r = backend_next()) == NULL)
+        return fail("no request came");
+    backend_send(r, FCGI_STDOUT, "Status: 201 Created\r\n"
+                                 "Content-Length: 6\r\n\r\nexit 3", 0);
+    backend_end(r, 3, FCGI_REQUEST_COMPLETE, 0);
+    if (client_response(fd, &resps[0]) != 0)
+        return fail("the response didn't end");
+    if (check_response("the client", &resps[0], 201, "exit 3") != 0)
+        return -1;
+    if (resps[0].close)
+        return fail("the client wasn't kept");
+
+    client_get(fd, "/fcgi/silent");
+    if ((r = backend_next()) == NULL)
+        return fail("the second request didn't come");
+    backend_end(r, 1, FCGI_REQUEST_COMPLETE, 0);
+    if (client_response(fd, &resps[0]) != 0)
+        return fail("the second response didn't end");
+    return check_response("the client", &resps[0], 502, NULL);
+}
+
+/*
+ * test_close - The backend closes the connection halfway through one
+ *     response, with another request on it not answered yet. The first
+ *     client is cut off before the last chunk, the other request goes
+ *     again over a new connection.
+ */
+int test_close(void) {
+    struct backreq *ra, *rb, *r;
+    struct backconn *bc;
+    int a, b;
+
+    a = client_open();
+    b = client_open();
+    client_get(a, "/fcgi/cut");
+    client_get(b, "/fcgi/again");
+    if ((ra = backend_next()) == NULL || (rb = backend_next()) == NULL)
+        return fail("the requests didn't both come");
+    if (strcmp(ra->uri, "/fcgi/again") == 0) {
+        r = ra;
+        ra = rb;
+        rb = r;
+    }
+    if (ra->bc != rb->bc)
+        return fail("the requests came over two connections");
+    bc = ra->bc;
+
+    backend_send(ra, FCGI_STDOUT, "Content-Type: text/plain\r\n\r\npartial",
+                 0);
+    backend_close(bc);
+    if (client_response(a, &resps[0]) == 0)
+        return fail("the cut response ended as if it were whole");
+    if (check_response("the cut client", &resps[0], 200, "partial") != 0)
+        return -1;
+    if (!resps[0].chunked)
+        return fail("the cut response wasn't chunked");
+
+    if ((r = backend_next()) == NULL)
+        return fail("the other request didn't come again");
+    if (strcmp(r->uri, "/fcgi/again") != 0 || r->bc == bc)
+        return fail("%s came again over the same connection", r->uri);
+    backend_send(r, FCGI_STDOUT, "Content-Type: text/plain\r\n\r\nsecond try",
+                 2);
+    backend_end(r, 0, FCGI_REQUEST_COMPLETE, 0);
+    if (client_response(b, &resps[1]) != 0)
+        return fail("the other response didn't end");
+    return check_response("the other client", &resps[1], 200, "second try");
+}
@@ -0,0 +1,599 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "error.h"
+#include "http-utils.h"
+#include "hpack.h"
+#include "rio.h"
+
+#define WAIT_SERVER  5      /* Seconds to wait for the server to come up */
+#define TIMEOUT      5      /* Seconds the server may take for anything */
+#define QUIET        300    /* Milliseconds without frames that mean none */
+#define MAXLINE      512
+#define MAXFRAME     16384  /* Largest frame, we don't allow more */
+#define MAXFILE      (256 * 1024)  /* Largest file of the tests */
+#define MAXSTREAMS   3      /* Streams a test has open at once */
+#define WINDOW       65535  /* Initial flow control windows */
+
+/* Frame types, flags and error codes of RFC 9113. */
+#define DATA            0x0
+#define HEADERS         0x1
+#define RST_STREAM      0x3
+#define SETTINGS        0x4
+#define PING            0x6
+#define GOAWAY          0x7
+#define WINDOW_UPDATE   0x8
+#define CONTINUATION    0x9
+#define END_STREAM      0x1
+#define ACK             0x1
+#define END_HEADERS     0x4
+#define PROTOCOL_ERROR     0x1
+#define STREAM_CLOSED      0x5
+#define COMPRESSION_ERROR  0x9
+
+struct frame {
+    size_t len;
+    int type, flags;
+    uint32_t id;
+    char payload[MAXFRAME];
+};
+
+/* A response on one stream, as it comes in. */
+struct stream {
+    uint32_t id;
+    int status;                /* 0 until its HEADERS came */
+    int ended;                 /* END_STREAM came */
+    long reset;                /* Code of its RST_STREAM, or -1 */
+    size_t len;
+    char body[MAXFILE];
+};
+
+static char *host = "127.0.0.1";
+static char *port = NULL;
+static char *docroot = NULL;
+static int fd = -1;            /* The connection of the test */
+static struct hpack_table encoder, decoder;
+static struct frame frame;     /* The last one read */
+static char block[MAXFRAME * 4];  /* A header block coming in */
+static size_t blocklen;
+static struct stream streams[MAXSTREAMS];
+static long goaway;            /* Code of the GOAWAY that came, or -1 */
+static char file[MAXFILE];     /* The file the last test asked for */
+static size_t filelen;
+static char reason[512];       /* Why the last test failed */
+
+void show_usage(const char *name);
+void wait_server(void);
+void load(const char *path);
+void h2_open(void);
+void h2_close(void);
+void send_frame(int type, int flags, uint32_t id, const char *payload,
+                size_t len);
+void send_get(uint32_t id, const char *path);
+void send_window(uint32_t id, uint32_t inc);
+int read_frame(int timeout);
+int handle_frame(int update);
+int collect(int nstreams, int update);
+int decode_status(struct stream *s);
+int expect_goaway(long code);
+int check_body(struct stream *s, const char *path);
+void put32(char *p, uint32_t v);
+uint32_t get32(const char *p);
+int fail(const char *fmt, ...);
+int test_get(void);
+int test_streams(void);
+int test_not_found(void);
+int test_flow_control(void);
+int test_ping(void);
+int test_closed_stream(void);
+int test_skipped_stream(void);
+int test_even_stream(void);
+int test_bad_block(void);
+
+static const struct test {
+    const char *name;
+    int (*run)(void);
+} tests[] = {
+    {"a GET with prior knowledge", test_get},
+    {"three streams at once on one connection", test_streams},
+    {"a file that isn't there", test_not_found},
+    {"a response held back by the flow control windows", test_flow_control},
+    {"PING answered with the same payload", test_ping},
+    {"HEADERS on a stream that ended gets RST_STREAM", test_closed_stream},
+    {"HEADERS on a stream id skipped over gets GOAWAY", test_skipped_stream},
+    {"HEADERS on an even stream id gets GOAWAY", test_even_stream},
+    {"a header block that doesn't decode gets GOAWAY", test_bad_block},
+};
+#define NTESTS ((int)(sizeof(tests) / sizeof(tests[0])))
+
+int main(int argc, char *argv[]) {
+    int opt, i, nfailed = 0;
+
+    /* Process args. */
+    while (1) {
+        static const char *optstring = "H:p:h";
+        static const struct option longopts[] = {
+            {"host", required_argument, NULL, 'H'},
+            {"port", required_argument, NULL, 'p'},
+            {"help", no_argument, NULL, 'h'},
+            {NULL, 0, NULL, 0}
+        };
+
+        opt = getopt_long(argc, argv, optstring, longopts, NULL);
+        if (opt == -1)
+            break;
+        switch (opt) {
+        case 'H': host = optarg; break;
+        case 'p': port = optarg; break;
+        case 'h':
+        default: show_usage(argv[0]);
+        }
+    }
+    if (port == NULL || optind != argc - 1)
+        show_usage(argv[0]);
+    docroot = argv[optind];
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+        unix_errq("signal error");
+
+    hpack_init();
+    wait_server();
+    for (i = 0; i < NTESTS; ++i) {
+        reason[0] = '\0';
+        h2_open();
+        if (tests[i].run() == 0)
+            printf("ok    %s\n", tests[i].name);
+        else {
+            printf("FAIL  %s: %s\n", tests[i].name, reason);
+            nfailed++;
+        }
+        h2_close();
+    }
+    printf("%d of %d tests failed\n", nfailed, NTESTS);
+    return nfailed > 0;
+}
+
+void show_usage(const char *name) {
+    printf("Usage: %s [-H HOST, --host HOST] -p PORT, --port PORT "
+           "[-h, --help] DIR\n"
+           "Speak HTTP/2 with prior knowledge to the server at HOST:PORT, "
+           "which serves DIR\nand must run with --http2.\n",
+           name);
+    exit(1);
+}
+
+void wait_server(void) {
+    int testfd, i;
+    struct timespec ts = {0, 100 * 1000 * 1000};
+
+    for (i = 0; i < WAIT_SERVER * 10; ++i) {
+        if ((testfd = open_clientfd(host, port)) >= 0) {
+            close(testfd);
+            return;
+        }
+        if (testfd == -2)
+            break;
+        nanosleep(&ts, NULL);
+    }
+    app_errq("cannot connect to %s:%s", host, port);
+}
+
+/*
+ * load - Read the file the server serves for path into file.
+ */
+void load(const char *path) {
+    char filename[MAXLINE];
+    ssize_t n;
+    int srcfd;
+
+    snprintf(filename, sizeof(filename), "%s%s", docroot, path);
+    if ((srcfd = open(filename, O_RDONLY, 0)) < 0)
+        unix_errq("open error");
+    for (filelen = 0; filelen < MAXFILE; filelen += n) {
+        if ((n = read(srcfd, file + filelen, MAXFILE - filelen)) < 0)
+            unix_errq("read error");
+        if (n == 0)
+            break;
+    }
+    if (filelen == MAXFILE)
+        app_errq("%s is too large for the tests", filename);
+    close(srcfd);
+}
+
+/*
+ * h2_open - Open the connection of a test, send the preface and empty
+ *     SETTINGS, and start its tables and streams afresh.
+ */
+void h2_open(void) {
+    struct timeval tv = {TIMEOUT, 0};
+    int i;
+
+    if ((fd = open_clientfd(host, port)) < 0)
+        app_errq("cannot connect to %s:%s", host, port);
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0)
+        unix_errq("setsockopt error");
+    if (rio_writen(fd, "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n", 24) < 0)
+        unix_errq("rio_writen error");
+    send_frame(SETTINGS, 0, 0, NULL, 0);
+    hpack_table_init(&encoder);
+    hpack_table_init(&decoder);
+    blocklen = 0;
+    goaway = -1;
+    for (i = 0; i < MAXSTREAMS; ++i) {
+        streams[i].id = 0;
+        streams[i].status = streams[i].ended = 0;
+        streams[i].reset = -1;
+        streams[i].len = 0;
+    }
+}
+
+void h2_close(void) {
+    if (fd >= 0)
+        close(fd);
+    fd = -1;
+}
+
+void send_frame(int type, int flags, uint32_t id, const char *payload,
+                size_t len) {
+    char head[9];
+
+    head[0] = len >> 16;
+    head[1] = len >> 8;
+    head[2] = len;
+    head[3] = type;
+    head[4] = flags;
+    put32(head + 5, id);
+    if (rio_writen(fd, head, 9) < 0
+        || (len > 0 && rio_writen(fd, (char *)payload, len) < 0))
+        unix_errq("rio_writen error");
+}
+
+/*
+ * send_get - Open stream id with a GET for path that ends the stream. The
+ *     response is collected into the slot of streams that has id, or the
+ *     first free one.
+ */
+void send_get(uint32_t id, const char *path) {
+    static const char *const fields[] = {
+        ":method", "GET", ":scheme", "http", ":path", NULL,
+        ":authority", "localhost",
+    };
+    char buf[MAXLINE];
+    const char *value;
+    size_t n = 0, m;
+    int i;
+
+    for (i = 0; i < 8; i += 2) {
+        value = fields[i + 1] != NULL ? fields[i + 1] : path;
+        m = hpack_encode(&encoder, buf + n, sizeof(buf) - n, fields[i],
+                         strlen(fields[i]), value, strlen(value), 1);
+        if (m == 0)
+            app_errq("The request for %s is too long", path);
+        n += m;
+    }
+    send_frame(HEADERS, END_HEADERS | END_STREAM, id, buf, n);
+    for (i = 0; i < MAXSTREAMS && streams[i].id != 0
+                && streams[i].id != id; ++i)
+        ;
+    if (i == MAXSTREAMS)
+        app_errq("More than %d streams in a test", MAXSTREAMS);
+    streams[i].id = id;
+    streams[i].status = streams[i].ended = 0;
+    streams[i].reset = -1;
+    streams[i].len = 0;
+}
+
+void send_window(uint32_t id, uint32_t inc) {
+    char buf[4];
+
+    put32(buf, inc);
+    send_frame(WINDOW_UPDATE, 0, id, buf, 4);
+}
+
+/*
+ * read_frame - Read the next frame into frame, waiting up to timeout
+ *     milliseconds for it to start. Returns -1 if none came, or the
+ *     connection ended.
+ */
+int read_frame(int timeout) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    char head[9];
+
+    if (poll(&pfd, 1, timeout) <= 0 || rio_readn(fd, head, 9) != 9)
+        return -1;
+    frame.len = (unsigned char)head[0] << 16 | (unsigned char)head[1] << 8
+                | (unsigned char)head[2];
+    frame.type = (unsigned char)head[3];
+    frame.flags = (unsigned char)head[4];
+    frame.id = get32(head + 5) & 0x7fffffff;
+    if (frame.len > MAXFRAME)
+        app_errq("The server sent a frame of %zu bytes", frame.len);
+    if (frame.len > 0
+        && rio_readn(fd, frame.payload, frame.len) != (ssize_t)frame.len)
+        return -1;
+    return 0;
+}
+
+/*
+ * handle_frame - Take in the frame just read: answer SETTINGS and put
+ *     responses together in streams, giving back the windows their DATA
+ *     took if update is set. Returns -1 if the frame is one no server
+ *     may send.
+ */
+int handle_frame(int update) {
+    struct stream *s = NULL;
+    int i;
+
+    for (i = 0; i < MAXSTREAMS && s == NULL; ++i) {
+        if (frame.id != 0 && streams[i].id == frame.id)
+            s = &streams[i];
+    }
+    switch (frame.type) {
+    case SETTINGS:
+        if (!(frame.flags & ACK))
+            send_frame(SETTINGS, ACK, 0, NULL, 0);
+        return 0;
+    case GOAWAY:
+        if (frame.len < 8)
+            return fail("a GOAWAY of %zu bytes", frame.len);
+        goaway = get32(frame.payload + 4);
+        return 0;
+    case RST_STREAM:
+        if (s == NULL || frame.len != 4)
+            return fail("RST_STREAM on stream %u", frame.id);
+        s->reset = get32(frame.payload);
+        return 0;
+    case HEADERS:
+    case CONTINUATION:
+        if (s == NULL || s->status != 0)
+            return fail("HEADERS on stream %u", frame.id);
+        if (blocklen + frame.len > sizeof(block))
+            return fail("a header block too long");
+        memcpy(block + blocklen, frame.payload, frame.len);
+        blocklen += frame.len;
+        if (frame.type == HEADERS && (frame.flags & END_STREAM))
+            s->ended = 1;
+        if (!(frame.flags & END_HEADERS))
+            return 0;
+        return decode_status(s);
+    case DATA:
+        if (s == NULL || s->status == 0 || s->ended)
+            return fail("DATA on stream %u", frame.id);
+        if (s->len + frame.len > MAXFILE)
+            return fail("more than %d bytes on stream %u", MAXFILE, s->id);
+        memcpy(s->body + s->len, frame.payload, frame.len);
+        s->len += frame.len;
+        if (frame.flags & END_STREAM)
+            s->ended = 1;
+        if (update && frame.len > 0) {
+            send_window(0, frame.len);
+            if (!s->ended)
+                send_window(s->id, frame.len);
+        }
+        return 0;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * decode_status - Decode the header block of the response on s, which
+ *     must have a :status. Returns -1 if it doesn't decode.
+ */
+int decode_status(struct stream *s) {
+    struct hpack_field fields[64];
+    char buf[8192];
+    int n, i;
+
+    n = hpack_decode(&decoder, block, blocklen, buf, sizeof(buf), fields,
+                     64);
+    blocklen = 0;
+    if (n < 0)
+        return fail("the header block on stream %u doesn't decode", s->id);
+    for (i = 0; i < n; ++i) {
+        if (fields[i].namelen == 7 && fields[i].valuelen == 3
+            && memcmp(fields[i].name, ":status", 7) == 0)
+            s->status = atoi(fields[i].value);
+    }
+    if (s->status == 0)
+        return fail("no :status on stream %u", s->id);
+    return 0;
+}
+
+/*
+ * collect - Read frames until the first nstreams of streams have ended
+ *     or were reset. Returns -1 if they don't in time.
+ */
+int collect(int nstreams, int update) {
+    int i, done;
+
+    while (1) {
+        for (i = 0, done = 0; i < nstreams; ++i)
+            done += streams[i].ended || streams[i].reset >= 0;
+        if (done == nstreams)
+            return 0;
+        if (read_frame(TIMEOUT * 1000) != 0)
+            return fail("%d of %d responses came", done, nstreams);
+        if (handle_frame(update) != 0)
+            return -1;
+        if (goaway >= 0)
+            return fail("GOAWAY with error %ld", goaway);
+    }
+}
+
+/*
+ * expect_goaway - Read frames until a GOAWAY with code comes. Returns -1
+ *     if none does, or one with another code.
+ */
+int expect_goaway(long code) {
+    while (goaway < 0) {
+        if (read_frame(TIMEOUT * 1000) != 0)
+            return fail("no GOAWAY came");
+        if (handle_frame(1) != 0)
+            return -1;
+    }
+    if (goaway != code)
+        return fail("GOAWAY with error %ld, not %ld", goaway, code);
+    return 0;
+}
+
+/*
+ * check_body - Check that s got all of the file at path with a 200.
+ *     Returns -1 if not.
+ */
+int check_body(struct stream *s, const char *path) {
+    load(path);
+    if (s->reset >= 0)
+        return fail("%s: RST_STREAM with error %ld", path, s->reset);
+    if (s->status != 200)
+        return fail("%s: status %d, not 200", path, s->status);
+    if (s->len != filelen || memcmp(s->body, file, filelen) != 0)
+        return fail("%s: %zu bytes that aren't the %zu of the file", path,
+                    s->len, filelen);
+    return 0;
+}
+
+void put32(char *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+uint32_t get32(const char *p) {
+    const unsigned char *u = (const unsigned char *)p;
+
+    return (uint32_t)u[0] << 24 | u[1] << 16 | u[2] << 8 | u[3];
+}
+
+/*
+ * fail - Keep why the test failed for main() to print. Returns -1.
+ */
+int fail(const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(reason, sizeof(reason), fmt, ap);
+    va_end(ap);
+    return -1;
+}
+
+int test_get(void) {
+    send_get(1, "/index.html");
+    if (collect(1, 1) != 0)
+        return -1;
+    return check_body(&streams[0], "/index.html");
+}
+
+/* The second and third requests refer to the fields of the first. */
+int test_streams(void) {
+    send_get(1, "/index.html");
+    send_get(3, "/static/wiki.css");
+    send_get(5, "/about.html");
+    if (collect(3, 1) != 0 || check_body(&streams[0], "/index.html") != 0
+        || check_body(&streams[1], "/static/wiki.css") != 0
+        || check_body(&streams[2], "/about.html") != 0)
+        return -1;
+    return 0;
+}
+
+int test_not_found(void) {
+    send_get(1, "/nosuchfile.html");
+    if (collect(1, 1) != 0)
+        return -1;
+    if (streams[0].status != 404)
+        return fail("status %d, not 404", streams[0].status);
+    return 0;
+}
+
+/*
+ * test_flow_control - A file larger than the windows stops once it has
+ *     taken them, and goes on once they are given back.
+ */
+int test_flow_control(void) {
+    struct stream *s = &streams[0];
+
+    send_get(1, "/static/bootstrap.min.css");
+    while (read_frame(QUIET) == 0) {
+        if (handle_frame(0) != 0)
+            return -1;
+    }
+    if (s->len != WINDOW)
+        return fail("%zu bytes came before the windows were given back, "
+                    "not %d", s->len, WINDOW);
+    send_window(0, WINDOW);
+    send_window(1, MAXFILE);
+    if (collect(1, 1) != 0)
+        return -1;
+    return check_body(s, "/static/bootstrap.min.css");
+}
+
+int test_ping(void) {
+    send_frame(PING, 0, 0, "pingpong", 8);
+    while (1) {
+        if (read_frame(TIMEOUT * 1000) != 0)
+            return fail("no PING came back");
+        if (frame.type == PING)
+            break;
+        if (handle_frame(1) != 0)
+            return -1;
+    }
+    if (!(frame.flags & ACK) || frame.len != 8
+        || memcmp(frame.payload, "pingpong", 8) != 0)
+        return fail("the PING that came back isn't an ACK of ours");
+    return 0;
+}
+
+/*
+ * test_closed_stream - A stream that ended can't be opened again. Only
+ *     the stream is reset, the connection goes on.
+ */
+int test_closed_stream(void) {
+    send_get(1, "/index.html");
+    if (collect(1, 1) != 0)
+        return -1;
+    send_get(1, "/index.html");
+    if (collect(1, 1) != 0)
+        return -1;
+    if (streams[0].reset != STREAM_CLOSED)
+        return fail("RST_STREAM with error %ld, not STREAM_CLOSED",
+                    streams[0].reset);
+    send_get(3, "/about.html");
+    if (collect(2, 1) != 0)
+        return -1;
+    return check_body(&streams[1], "/about.html");
+}
+
+/* Opening 5 closes 3, which was never used and can't be any more. */
+int test_skipped_stream(void) {
+    send_get(5, "/index.html");
+    if (collect(1, 1) != 0)
+        return -1;
+    send_get(3, "/index.html");
+    return expect_goaway(PROTOCOL_ERROR);
+}
+
+/* Even ids are the server's, for pushes. */
+int test_even_stream(void) {
+    send_get(2, "/index.html");
+    return expect_goaway(PROTOCOL_ERROR);
+}
+
+/* Index 0 isn't in any table. */
+int test_bad_block(void) {
+    send_frame(HEADERS, END_HEADERS | END_STREAM, 1, "\x80", 1);
+    return expect_goaway(COMPRESSION_ERROR);
+}
@@ -0,0 +1,588 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+
+#include "error.h"
+#include "hpack.h"
+
+#define MAXBLOCK   4096     /* Longest header block of the tests */
+#define MAXFIELDS  64       /* Fields in a block */
+#define NBLOCKS    2000     /* Blocks the round trip encodes */
+
+/*
+ * A header block in hex, spaces allowed, and what decoding it must
+ * give. Fields and table entries are "name: value" lines, the entries
+ * newest first, and size is what the table counts once it is decoded.
+ */
+struct block {
+    const char *hex;
+    const char *fields;
+    const char *table;
+    size_t size;
+};
+
+/*
+ * A sequence of blocks from RFC 7541 Appendix C, decoded with one table
+ * of maxsize. Bit j of encode is set if block j must come out of
+ * hpack_encode() too: its encoder indexes every literal and Huffman codes
+ * the strings that get shorter, not those that stay as long, like "307"
+ * of C.6.2.
+ */
+static const struct example {
+    const char *name;
+    size_t maxsize;
+    int encode;
+    struct block blocks[3];
+} examples[] = {
+    {"C.2.1", HPACK_TABLE_SIZE, 0, {
+        {"400a 6375 7374 6f6d 2d6b 6579 0d63 7573 746f 6d2d 6865 6164"
+         "6572",
+         "custom-key: custom-header\n",
+         "custom-key: custom-header\n", 55}}},
+    {"C.2.2", HPACK_TABLE_SIZE, 0, {
+        {"040c 2f73 616d 706c 652f 7061 7468",
+         ":path: /sample/path\n", "", 0}}},
+    {"C.2.3", HPACK_TABLE_SIZE, 0, {
+        {"1008 7061 7373 776f 7264 0673 6563 7265 74",
+         "password: secret\n", "", 0}}},
+    {"C.2.4", HPACK_TABLE_SIZE, 0, {
+        {"82", ":method: GET\n", "", 0}}},
+    {"C.3", HPACK_TABLE_SIZE, 0, {
+        {"8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d",
+         ":method: GET\n:scheme: http\n:path: /\n"
+         ":authority: www.example.com\n",
+         ":authority: www.example.com\n", 57},
+        {"8286 84be 5808 6e6f 2d63 6163 6865",
+         ":method: GET\n:scheme: http\n:path: /\n"
+         ":authority: www.example.com\ncache-control: no-cache\n",
+         "cache-control: no-cache\n:authority: www.example.com\n", 110},
+        {"8287 85bf 400a 6375 7374 6f6d 2d6b 6579 0c63 7573 746f 6d2d"
+         "7661 6c75 65",
+         ":method: GET\n:scheme: https\n:path: /index.html\n"
+         ":authority: www.example.com\ncustom-key: custom-value\n",
+         "custom-key: custom-value\ncache-control: no-cache\n"
+         ":authority: www.example.com\n", 164}}},
+    {"C.4", HPACK_TABLE_SIZE, 07, {
+        {"8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff",
+         ":method: GET\n:scheme: http\n:path: /\n"
+         ":authority: www.example.com\n",
+         ":authority: www.example.com\n", 57},
+        {"8286 84be 5886 a8eb 1064 9cbf",
+         ":method: GET\n:scheme: http\n:path: /\n"
+         ":authority: www.example.com\ncache-control: no-cache\n",
+         "cache-control: no-cache\n:authority: www.example.com\n", 110},
+        {"8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf",
+         ":method: GET\n:scheme: https\n:path: /index.html\n"
+         ":authority: www.example.com\ncustom-key: custom-value\n",
+         "custom-key: custom-value\ncache-control: no-cache\n"
+         ":authority: www.example.com\n", 164}}},
+    {"C.5", 256, 0, {
+        {"4803 3330 3258 0770 7269 7661 7465 611d 4d6f 6e2c 2032 3120"
+         "4f63 7420 3230 3133 2032 303a 3133 3a32 3120 474d 546e 1768"
+         "7474 7073 3a2f 2f77 7777 2e65 7861 6d70 6c65 2e63 6f6d",
+         ":status: 302\ncache-control: private\n"
+         "date: Mon, 21 Oct 2013 20:13:21 GMT\n"
+         "location: https://www.example.com\n",
+         "location: https://www.example.com\n"
+         "date: Mon, 21 Oct 2013 20:13:21 GMT\n"
+         "cache-control: private\n:status: 302\n", 222},
+        {"4803 3330 37c1 c0bf",
+         ":status: 307\ncache-control: private\n"
+         "date: Mon, 21 Oct 2013 20:13:21 GMT\n"
+         "location: https://www.example.com\n",
+         ":status: 307\nlocation: https://www.example.com\n"
+         "date: Mon, 21 Oct 2013 20:13:21 GMT\n"
+         "cache-control: private\n", 222},
+        {"88c1 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a"
+         "3133 3a32 3220 474d 54c0 5a04 677a 6970 7738 666f 6f3d 4153"
+         "444a 4b48 514b 425a 584f 5157 454f 5049 5541 5851 5745 4f49"
+         "553b 206d 6178 2d61 6765 3d33 3630 303b 2076 6572 7369 6f6e"
+         "3d31",
+         ":status: 200\ncache-control: private\n"
+         "date: Mon, 21 Oct 2013 20:13:22 GMT\n"
+         "location: https://www.example.com\ncontent-encoding: gzip\n"
+         "set-cookie: foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; "
+         "version=1\n",
+         "set-cookie: foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; "
+         "version=1\ncontent-encoding: gzip\n"
+         "date: Mon, 21 Oct 2013 20:13:22 GMT\n", 215}}},
+    {"C.6", 256, 05, {
+        {"4882 6402 5885 aec3 771a 4b61 96d0 7abe 9410 54d4 44a8 2005"
+         "9504 0b81 66e0 82a6 2d1b ff6e 919d 29ad 1718 63c7 8f0b 97c8"
+         "e9ae 82ae 43d3",
+         ":status: 302\ncache-control: private\n"
+         "date: Mon, 21 Oct 2013 20:13:21 GMT\n"
+         "location: https://www.example.com\n",
+         "location: https://www.example.com\n"
+         "date: Mon, 21 Oct 2013 20:13:21 GMT\n"
+         "cache-control: private\n:status: 302\n", 222},
+        {"4883 640e ffc1 c0bf",
+         ":status: 307\ncache-control: private\n"
+         "date: Mon, 21 Oct 2013 20:13:21 GMT\n"
+         "location: https://www.example.com\n",
+         ":status: 307\nlocation: https://www.example.com\n"
+         "date: Mon, 21 Oct 2013 20:13:21 GMT\n"
+         "cache-control: private\n", 222},
+        {"88c1 6196 d07a be94 1054 d444 a820 0595 040b 8166 e084 a62d"
+         "1bff c05a 839b d9ab 77ad 94e7 821d d7f2 e6c7 b335 dfdf cd5b"
+         "3960 d5af 2708 7f36 72c1 ab27 0fb5 291f 9587 3160 65c0 03ed"
+         "4ee5 b106 3d50 07",
+         ":status: 200\ncache-control: private\n"
+         "date: Mon, 21 Oct 2013 20:13:22 GMT\n"
+         "location: https://www.example.com\ncontent-encoding: gzip\n"
+         "set-cookie: foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; "
+         "version=1\n",
+         "set-cookie: foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; "
+         "version=1\ncontent-encoding: gzip\n"
+         "date: Mon, 21 Oct 2013 20:13:22 GMT\n", 215}}},
+};
+#define NEXAMPLES ((int)(sizeof(examples) / sizeof(examples[0])))
+
+/* Blocks that must not decode with an empty table, and why. */
+static const struct {
+    const char *name;
+    const char *hex;
+} malformed[] = {
+    {"index 0", "80"},
+    {"an index past the table", "be"},
+    {"an integer cut short", "ff"},
+    {"an integer too large", "ffff ffff ff0f"},
+    {"a literal without its name", "40"},
+    {"a name cut short", "4003 6162"},
+    {"a literal without its value", "4001 61"},
+    {"a name index past the table", "7f00 0161"},
+    {"a table size over what we allow", "3fe2 1f"},
+    {"EOS in a Huffman string", "0084 ffff ffff 00"},
+    {"Huffman padding longer than 7 bits", "0082 1fff 00"},
+    {"Huffman padding that isn't EOS", "0081 1800"},
+};
+#define NMALFORMED ((int)(sizeof(malformed) / sizeof(malformed[0])))
+
+static char reason[512];       /* Why the last test failed */
+
+size_t unhex(const char *hex, char *dst);
+int check_fields(const char *want, const struct hpack_field *fields, int n);
+int check_table(const struct hpack_table *t, const char *want, size_t size);
+int same_tables(const struct hpack_table *a, const struct hpack_table *b);
+int next_field(const char **p, const char **name, size_t *namelen,
+               const char **value, size_t *valuelen);
+uint32_t random32(void);
+int fail(const char *fmt, ...);
+int test_decode(void);
+int test_encode(void);
+int test_malformed(void);
+int test_toobig(void);
+int test_resize(void);
+int test_round_trip(void);
+
+static const struct test {
+    const char *name;
+    int (*run)(void);
+} tests[] = {
+    {"RFC 7541 Appendix C blocks, decoded", test_decode},
+    {"RFC 7541 Appendix C.4 and C.6 blocks, encoded", test_encode},
+    {"malformed blocks", test_malformed},
+    {"fields that don't fit the buffers", test_toobig},
+    {"table size updates", test_resize},
+    {"random fields, encoded and decoded again", test_round_trip},
+};
+#define NTESTS ((int)(sizeof(tests) / sizeof(tests[0])))
+
+int main(int argc, char *argv[]) {
+    int i, nfailed = 0;
+
+    if (argc != 1) {
+        printf("Usage: %s\nCheck the HPACK decoder and encoder.\n",
+               argv[0]);
+        return 1;
+    }
+    hpack_init();
+    for (i = 0; i < NTESTS; ++i) {
+        reason[0] = '\0';
+        if (tests[i].run() == 0)
+            printf("ok    %s\n", tests[i].name);
+        else {
+            printf("FAIL  %s: %s\n", tests[i].name, reason);
+            nfailed++;
+        }
+    }
+    printf("%d of %d tests failed\n", nfailed, NTESTS);
+    return nfailed > 0;
+}
+
+/*
+ * unhex - Convert hex, skipping spaces, to bytes at dst, which has room
+ *     for MAXBLOCK. Returns how many there are.
+ */
+size_t unhex(const char *hex, char *dst) {
+    size_t n = 0;
+    unsigned int byte;
+
+    for (; *hex != '\0'; hex += 2) {
+        while (*hex == ' ')
+            hex++;
+        if (*hex == '\0')
+            break;
+        if (n == MAXBLOCK || sscanf(hex, "%2x", &byte) != 1)
+            app_errq("Bad hex in the tests: %s", hex);
+        dst[n++] = byte;
+    }
+    return n;
+}
+
+/*
+ * next_field - Take the next "name: value" line of *p and move *p past
+ *     it. Returns 0 if there are no more.
+ */
+int next_field(const char **p, const char **name, size_t *namelen,
+               const char **value, size_t *valuelen) {
+    const char *sep, *eol;
+
+    if (**p == '\0')
+        return 0;
+    sep = strstr(*p, ": ");
+    eol = strchr(*p, '\n');
+    if (sep == NULL || eol == NULL || sep > eol)
+        app_errq("Bad field in the tests: %s", *p);
+    *name = *p;
+    *namelen = sep - *p;
+    *value = sep + 2;
+    *valuelen = eol - (sep + 2);
+    *p = eol + 1;
+    return 1;
+}
+
+/*
+ * check_fields - Check the n fields against the lines of want. Returns
+ *     -1 if they differ.
+ */
+int check_fields(const char *want, const struct hpack_field *fields,
+                 int n) {
+    const char *name, *value;
+    size_t namelen, valuelen;
+    int i;
+
+    for (i = 0; next_field(&want, &name, &namelen, &value, &valuelen); ++i) {
+        if (i == n)
+            return fail("%d fields, the next is %.*s", n, (int)namelen,
+                        name);
+        if (fields[i].namelen != namelen || fields[i].valuelen != valuelen
+            || memcmp(fields[i].name, name, namelen) != 0
+            || memcmp(fields[i].value, value, valuelen) != 0)
+            return fail("field %d is %.*s: %.*s, not %.*s: %.*s", i,
+                        (int)fields[i].namelen, fields[i].name,
+                        (int)fields[i].valuelen, fields[i].value,
+                        (int)namelen, name, (int)valuelen, value);
+    }
+    if (i != n)
+        return fail("%d fields, not %d", n, i);
+    return 0;
+}
+
+/*
+ * check_table - Check the entries of t, newest first, against the lines
+ *     of want, and the size it counts. Returns -1 if they differ.
+ */
+int check_table(const struct hpack_table *t, const char *want,
+                size_t size) {
+    const char *name, *value, *data;
+    size_t namelen, valuelen;
+    int i, k;
+
+    for (i = 0; next_field(&want, &name, &namelen, &value, &valuelen); ++i) {
+        if (i == t->nentries)
+            return fail("%d entries, the next is %.*s", i, (int)namelen,
+                        name);
+        k = t->nentries - 1 - i;
+        data = t->data + t->entries[k].off;
+        if (t->entries[k].namelen != namelen
+            || t->entries[k].valuelen != valuelen
+            || memcmp(data, name, namelen) != 0
+            || memcmp(data + namelen, value, valuelen) != 0)
+            return fail("entry %d is %.*s: %.*s, not %.*s: %.*s", i + 1,
+                        (int)t->entries[k].namelen, data,
+                        (int)t->entries[k].valuelen,
+                        data + t->entries[k].namelen, (int)namelen, name,
+                        (int)valuelen, value);
+    }
+    if (i != t->nentries)
+        return fail("%d entries, not %d", t->nentries, i);
+    if (t->size != size)
+        return fail("the table size is %zu, not %zu", t->size, size);
+    return 0;
+}
+
+/*
+ * same_tables - Check that the encoder's table a and the decoder's b
+ *     hold the same entries. Returns -1 if not.
+ */
+int same_tables(const struct hpack_table *a, const struct hpack_table *b) {
+    int i;
+
+    if (a->nentries != b->nentries || a->size != b->size
+        || a->maxsize != b->maxsize)
+        return fail("the encoder has %d entries, %zu of %zu bytes, the "
+                    "decoder %d, %zu of %zu", a->nentries, a->size,
+                    a->maxsize, b->nentries, b->size, b->maxsize);
+    for (i = 0; i < a->nentries; ++i) {
+        if (a->entries[i].namelen != b->entries[i].namelen
+            || a->entries[i].valuelen != b->entries[i].valuelen
+            || memcmp(a->data + a->entries[i].off,
+                      b->data + b->entries[i].off,
+                      a->entries[i].namelen + a->entries[i].valuelen) != 0)
+            return fail("the tables differ at entry %d",
+                        a->nentries - i);
+    }
+    return 0;
+}
+
+/*
+ * random32 - Return the next number of a xorshift generator, the same
+ *     sequence on every run.
+ */
+uint32_t random32(void) {
+    static uint32_t x = 2463534242u;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+}
+
+/*
+ * fail - Keep why the test failed for main() to print. Returns -1.
+ */
+int fail(const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(reason, sizeof(reason), fmt, ap);
+    va_end(ap);
+    return -1;
+}
+
+int test_decode(void) {
+    static struct hpack_table t;
+    const struct example *e;
+    const struct block *b;
+    struct hpack_field fields[MAXFIELDS];
+    char block[MAXBLOCK], buf[MAXBLOCK];
+    size_t len;
+    int i, j, n;
+
+    for (i = 0; i < NEXAMPLES; ++i) {
+        e = &examples[i];
+        hpack_table_init(&t);
+        hpack_table_resize(&t, e->maxsize);
+        for (j = 0; j < 3 && e->blocks[j].hex != NULL; ++j) {
+            b = &e->blocks[j];
+            len = unhex(b->hex, block);
+            n = hpack_decode(&t, block, len, buf, sizeof(buf), fields,
+                             MAXFIELDS);
+            if (n < 0)
+                return fail("%s block %d: hpack_decode returned %d",
+                            e->name, j + 1, n);
+            if (check_fields(b->fields, fields, n) != 0
+                || check_table(&t, b->table, b->size) != 0) {
+                snprintf(buf, sizeof(buf), "%s", reason);
+                return fail("%s block %d: %s", e->name, j + 1, buf);
+            }
+        }
+    }
+    return 0;
+}
+
+int test_encode(void) {
+    static struct hpack_table t;
+    const struct example *e;
+    const struct block *b;
+    const char *p, *name, *value;
+    char want[MAXBLOCK], block[MAXBLOCK];
+    size_t len, n, m, namelen, valuelen;
+    int i, j;
+
+    for (i = 0; i < NEXAMPLES; ++i) {
+        e = &examples[i];
+        if (!e->encode)
+            continue;
+        /* The examples leave the table size to the settings. */
+        hpack_table_init(&t);
+        t.maxsize = e->maxsize;
+        for (j = 0; j < 3 && e->blocks[j].hex != NULL; ++j) {
+            b = &e->blocks[j];
+            len = unhex(b->hex, want);
+            for (n = 0, p = b->fields;
+                 next_field(&p, &name, &namelen, &value, &valuelen);
+                 n += m) {
+                m = hpack_encode(&t, block + n, sizeof(block) - n, name,
+                                 namelen, value, valuelen, 1);
+                if (m == 0)
+                    return fail("%s block %d: %.*s didn't fit", e->name,
+                                j + 1, (int)namelen, name);
+            }
+            if ((e->encode & 1 << j)
+                && (n != len || memcmp(block, want, len) != 0))
+                return fail("%s block %d: %zu bytes that aren't the %zu "
+                            "of the RFC", e->name, j + 1, n, len);
+            if (check_table(&t, b->table, b->size) != 0) {
+                snprintf(block, sizeof(block), "%s", reason);
+                return fail("%s block %d: %s", e->name, j + 1, block);
+            }
+        }
+    }
+    return 0;
+}
+
+int test_malformed(void) {
+    static struct hpack_table t;
+    struct hpack_field fields[MAXFIELDS];
+    char block[MAXBLOCK], buf[MAXBLOCK];
+    size_t len;
+    int i, n;
+
+    for (i = 0; i < NMALFORMED; ++i) {
+        hpack_table_init(&t);
+        len = unhex(malformed[i].hex, block);
+        n = hpack_decode(&t, block, len, buf, sizeof(buf), fields,
+                         MAXFIELDS);
+        if (n != HPACK_ERROR)
+            return fail("%s: hpack_decode returned %d", malformed[i].name,
+                        n);
+    }
+    return 0;
+}
+
+/*
+ * test_toobig - Fields past max, or names and values past the buffer,
+ *     Huffman coded or not, are HPACK_TOOBIG.
+ */
+int test_toobig(void) {
+    static struct hpack_table t;
+    struct hpack_field fields[MAXFIELDS];
+    char block[MAXBLOCK], buf[MAXBLOCK];
+    size_t len;
+    int n;
+
+    hpack_table_init(&t);
+    len = unhex("8286", block);
+    if ((n = hpack_decode(&t, block, len, buf, sizeof(buf), fields, 1))
+        != HPACK_TOOBIG)
+        return fail("two fields into one: hpack_decode returned %d", n);
+    if ((n = hpack_decode(&t, block, len, buf, 10, fields, MAXFIELDS))
+        != HPACK_TOOBIG)
+        return fail("11 bytes into 10: hpack_decode returned %d", n);
+    len = unhex(examples[5].blocks[0].hex, block);
+    if ((n = hpack_decode(&t, block, len, buf, 20, fields, MAXFIELDS))
+        != HPACK_TOOBIG)
+        return fail("a Huffman coded value: hpack_decode returned %d", n);
+    hpack_table_init(&t);
+    len = unhex(examples[4].blocks[0].hex, block);
+    if ((n = hpack_decode(&t, block, len, buf, 20, fields, MAXFIELDS))
+        != HPACK_TOOBIG)
+        return fail("a plain value: hpack_decode returned %d", n);
+    return 0;
+}
+
+/*
+ * test_resize - A table that shrinks evicts its oldest entries, and
+ *     the next block the encoder starts tells the decoder, once.
+ */
+int test_resize(void) {
+    static struct hpack_table enc, dec;
+    struct hpack_field fields[MAXFIELDS];
+    char block[MAXBLOCK], buf[MAXBLOCK];
+    size_t n;
+    int rc;
+
+    hpack_table_init(&enc);
+    hpack_table_init(&dec);
+    n = hpack_encode(&enc, block, sizeof(block), "a", 1, "1", 1, 1);
+    n += hpack_encode(&enc, block + n, sizeof(block) - n, "b", 1, "2", 1, 1);
+    if ((rc = hpack_decode(&dec, block, n, buf, sizeof(buf), fields,
+                           MAXFIELDS)) != 2)
+        return fail("hpack_decode returned %d", rc);
+    hpack_table_resize(&enc, 40);
+    if (check_table(&enc, "b: 2\n", 34) != 0)
+        return -1;
+    n = hpack_encode_start(&enc, block, sizeof(block));
+    if (n != 2 || memcmp(block, "\x3f\x09", 2) != 0)
+        return fail("the update took %zu bytes, not 3f 09", n);
+    if (hpack_encode_start(&enc, block, sizeof(block)) != 0)
+        return fail("the update was sent twice");
+    n += hpack_encode(&enc, block + n, sizeof(block) - n, "b", 1, "2", 1, 1);
+    if ((rc = hpack_decode(&dec, block, n, buf, sizeof(buf), fields,
+                           MAXFIELDS)) < 0)
+        return fail("hpack_decode returned %d", rc);
+    if (check_fields("b: 2\n", fields, rc) != 0
+        || same_tables(&enc, &dec) != 0)
+        return -1;
+    hpack_table_resize(&enc, 2 * HPACK_TABLE_SIZE);
+    if (enc.maxsize != HPACK_TABLE_SIZE)
+        return fail("the table grew to %zu", enc.maxsize);
+    return 0;
+}
+
+/*
+ * test_round_trip - Encode blocks of random fields with one table and
+ *     decode them with another. Names are mostly of the static table,
+ *     values repeat often enough to be found in the dynamic one, which
+ *     changes size now and then so that entries get evicted.
+ */
+int test_round_trip(void) {
+    static const char *names[] = {
+        ":status", ":path", "content-type", "cache-control", "x-a",
+        "x-request-id", "set-cookie", "user-agent",
+    };
+    static struct hpack_table enc, dec;
+    struct hpack_field fields[MAXFIELDS];
+    char values[32][300], block[MAXBLOCK], buf[MAXBLOCK];
+    size_t lens[32], n, m, k;
+    int i, j, nfields, rc, nv, name[8], value[8];
+
+    hpack_table_init(&enc);
+    hpack_table_init(&dec);
+    nv = sizeof(names) / sizeof(names[0]);
+    for (i = 0; i < 32; ++i) {
+        lens[i] = random32() % (i < 16 ? 16 : 300);
+        for (k = 0; k < lens[i]; ++k)
+            values[i][k] = i < 16 ? 'a' + random32() % 26 : random32();
+    }
+    for (i = 0; i < NBLOCKS; ++i) {
+        if (random32() % 64 == 0)
+            hpack_table_resize(&enc, random32() % (HPACK_TABLE_SIZE + 1));
+        n = hpack_encode_start(&enc, block, sizeof(block));
+        nfields = random32() % 8 + 1;
+        for (j = 0; j < nfields; ++j) {
+            name[j] = random32() % nv;
+            value[j] = random32() % 32;
+            m = hpack_encode(&enc, block + n, sizeof(block) - n,
+                             names[name[j]], strlen(names[name[j]]),
+                             values[value[j]], lens[value[j]],
+                             random32() % 4 != 0);
+            if (m == 0)
+                return fail("block %d: field %d didn't fit", i, j);
+            n += m;
+        }
+        if ((rc = hpack_decode(&dec, block, n, buf, sizeof(buf), fields,
+                               MAXFIELDS)) != nfields)
+            return fail("block %d: hpack_decode returned %d, not %d", i,
+                        rc, nfields);
+        for (j = 0; j < nfields; ++j) {
+            if (fields[j].namelen != strlen(names[name[j]])
+                || fields[j].valuelen != lens[value[j]]
+                || memcmp(fields[j].name, names[name[j]],
+                          fields[j].namelen) != 0
+                || memcmp(fields[j].value, values[value[j]],
+                          fields[j].valuelen) != 0)
+                return fail("block %d: field %d came back as %.*s", i, j,
+                            (int)fields[j].namelen, fields[j].name);
+        }
+        if (same_tables(&enc, &dec) != 0)
+            return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,495 @@
+#include "hpack.h"
+
+#include <string.h>
+#include <stdint.h>
+
+#define NSTATIC         61   /* Entries of the static table */
+#define HUFFMAN_EOS     256  /* The symbol a string must never hold */
+#define HUFFMAN_MAXLEN  30   /* Longest code */
+
+/* The static table of RFC 7541 Appendix A, entry i is index i + 1. */
+static const struct {
+    const char *name, *value;
+} static_table[NSTATIC] = {
+    {":authority", ""}, {":method", "GET"}, {":method", "POST"},
+    {":path", "/"}, {":path", "/index.html"}, {":scheme", "http"},
+    {":scheme", "https"}, {":status", "200"}, {":status", "204"},
+    {":status", "206"}, {":status", "304"}, {":status", "400"},
+    {":status", "404"}, {":status", "500"}, {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"}, {"accept-language", ""},
+    {"accept-ranges", ""}, {"accept", ""},
+    {"access-control-allow-origin", ""}, {"age", ""}, {"allow", ""},
+    {"authorization", ""}, {"cache-control", ""},
+    {"content-disposition", ""}, {"content-encoding", ""},
+    {"content-language", ""}, {"content-length", ""},
+    {"content-location", ""}, {"content-range", ""}, {"content-type", ""},
+    {"cookie", ""}, {"date", ""}, {"etag", ""}, {"expect", ""},
+    {"expires", ""}, {"from", ""}, {"host", ""}, {"if-match", ""},
+    {"if-modified-since", ""}, {"if-none-match", ""}, {"if-range", ""},
+    {"if-unmodified-since", ""}, {"last-modified", ""}, {"link", ""},
+    {"location", ""}, {"max-forwards", ""}, {"proxy-authenticate", ""},
+    {"proxy-authorization", ""}, {"range", ""}, {"referer", ""},
+    {"refresh", ""}, {"retry-after", ""}, {"server", ""},
+    {"set-cookie", ""}, {"strict-transport-security", ""},
+    {"transfer-encoding", ""}, {"user-agent", ""}, {"vary", ""},
+    {"via", ""}, {"www-authenticate", ""},
+};
+
+/*
+ * Code lengths of the Huffman code of RFC 7541 Appendix B, by symbol.
+ * The code is canonical, so they are all it takes to rebuild it.
+ */
+static const unsigned char huffman_len[HUFFMAN_EOS + 1] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+     6, 10, 10, 12, 13,  6,  8, 11, 10, 10,  8, 11,  8,  6,  6,  6,
+     5,  5,  5,  6,  6,  6,  6,  6,  6,  6,  7,  8, 15,  6, 12, 10,
+    13,  6,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,
+     7,  7,  7,  7,  7,  7,  7,  7,  8,  7,  8, 13, 19, 13, 14,  6,
+    15,  5,  6,  5,  6,  5,  6,  6,  6,  5,  7,  7,  6,  6,  6,  5,
+     6,  7,  6,  5,  5,  6,  7,  7,  7,  7,  7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30
+};
+
+static uint32_t huffman_code[HUFFMAN_EOS + 1];
+static uint32_t first_code[HUFFMAN_MAXLEN + 1];  /* Of each length */
+static uint32_t ncodes[HUFFMAN_MAXLEN + 1];      /* ... and how many */
+static unsigned short first_sym[HUFFMAN_MAXLEN + 1];  /* ... in by_code */
+static unsigned short by_code[HUFFMAN_EOS + 1];  /* Symbols in code order */
+
+/*
+ * hpack_init - Rebuild the Huffman code from its lengths: the codes of
+ *     each length are consecutive, ordered by symbol, and follow those of
+ *     the length before. Must be called before decoding or encoding.
+ */
+void hpack_init(void) {
+    uint32_t code = 0;
+    int len, sym, n = 0;
+
+    for (len = 1; len <= HUFFMAN_MAXLEN; ++len) {
+        first_code[len] = code;
+        first_sym[len] = n;
+        for (sym = 0; sym <= HUFFMAN_EOS; ++sym) {
+            if (huffman_len[sym] == len) {
+                huffman_code[sym] = code++;
+                by_code[n++] = sym;
+            }
+        }
+        ncodes[len] = n - first_sym[len];
+        code <<= 1;
+    }
+}
+
+/*
+ * huffman_decode - Decode the len Huffman coded bytes at src into the
+ *     size bytes at dst. The last byte is padded with the high bits of
+ *     EOS, which are all ones. Returns the decoded length, HPACK_ERROR if
+ *     src is malformed or HPACK_TOOBIG if it doesn't fit.
+ */
+static long huffman_decode(const unsigned char *src, size_t len, char *dst,
+                           size_t size) {
+    uint64_t bits = 0;  /* The next nbits of src, from the high end */
+    uint32_t v;
+    size_t n = 0;
+    int nbits = 0, l;
+
+    while (1) {
+        for (; nbits <= 56 && len > 0; --len, nbits += 8)
+            bits |= (uint64_t)*src++ << (56 - nbits);
+        if (nbits == 0)
+            return n;
+        /*
+         * A code is below the first code of its length that comes after
+         * it, so the first length it is below the end of is its own.
+         */
+        for (l = 5; l <= HUFFMAN_MAXLEN; ++l) {
+            v = bits >> (64 - l);
+            if (v - first_code[l] < ncodes[l])
+                break;
+        }
+        if (l > nbits) {
+            /* What is left is padding, it can't be a code. */
+            if (nbits > 7 || bits >> (64 - nbits) != (1u << nbits) - 1)
+                return HPACK_ERROR;
+            return n;
+        }
+        if (by_code[first_sym[l] + v - first_code[l]] == HUFFMAN_EOS)
+            return HPACK_ERROR;
+        if (n == size)
+            return HPACK_TOOBIG;
+        dst[n++] = by_code[first_sym[l] + v - first_code[l]];
+        bits <<= l;
+        nbits -= l;
+    }
+}
+
+/*
+ * huffman_length - Return how many bytes the len bytes at src take once
+ *     Huffman coded.
+ */
+static size_t huffman_length(const unsigned char *src, size_t len) {
+    size_t nbits = 0;
+
+    while (len-- > 0)
+        nbits += huffman_len[*src++];
+    return (nbits + 7) / 8;
+}
+
+/*
+ * huffman_encode - Huffman code the len bytes at src into dst, which has
+ *     room for huffman_length() of them. Returns that length.
+ */
+static size_t huffman_encode(const unsigned char *src, size_t len,
+                             unsigned char *dst) {
+    uint64_t bits = 0;
+    size_t n = 0;
+    int nbits = 0;
+
+    while (len-- > 0) {
+        bits = bits << huffman_len[*src] | huffman_code[*src];
+        nbits += huffman_len[*src++];
+        for (; nbits >= 8; nbits -= 8)
+            dst[n++] = bits >> (nbits - 8);
+    }
+    if (nbits > 0)
+        dst[n++] = bits << (8 - nbits) | 0xff >> nbits;
+    return n;
+}
+
+/*
+ * put_int - Encode value with an n-bit prefix into the size bytes at dst,
+ *     whose first byte starts with the bits of first. Returns its length,
+ *     or 0 if it doesn't fit.
+ */
+static size_t put_int(unsigned char *dst, size_t size, int n,
+                      unsigned char first, uint32_t value) {
+    uint32_t max = (1u << n) - 1;
+    size_t i = 1;
+
+    if (size == 0)
+        return 0;
+    if (value < max) {
+        dst[0] = first | value;
+        return 1;
+    }
+    dst[0] = first | max;
+    for (value -= max; value >= 128; value /= 128) {
+        if (i == size)
+            return 0;
+        dst[i++] = value % 128 + 128;
+    }
+    if (i == size)
+        return 0;
+    dst[i++] = value;
+    return i;
+}
+
+/*
+ * get_int - Decode an integer with an n-bit prefix at *p, which ends
+ *     before end, into *value and move *p past it. Returns -1 if it is
+ *     cut short or too large for anything we take.
+ */
+static int get_int(const unsigned char **p, const unsigned char *end, int n,
+                   uint32_t *value) {
+    uint32_t max = (1u << n) - 1, v;
+    int shift = 0;
+
+    if (*p == end)
+        return -1;
+    if ((v = *(*p)++ & max) < max) {
+        *value = v;
+        return 0;
+    }
+    do {
+        if (*p == end || shift > 21)
+            return -1;
+        v += (uint32_t)(**p & 127) << shift;
+        shift += 7;
+    } while (*(*p)++ & 128);
+    *value = v;
+    return 0;
+}
+
+/*
+ * put_string - Encode the len bytes at s as a string literal into the
+ *     size bytes at dst, Huffman coded if that makes it shorter. Returns
+ *     its length, or 0 if it doesn't fit.
+ */
+static size_t put_string(unsigned char *dst, size_t size, const char *s,
+                         size_t len) {
+    size_t hlen = huffman_length((const unsigned char *)s, len), n;
+
+    if (hlen < len) {
+        if ((n = put_int(dst, size, 7, 0x80, hlen)) == 0 || size - n < hlen)
+            return 0;
+        return n + huffman_encode((const unsigned char *)s, len, dst + n);
+    }
+    if ((n = put_int(dst, size, 7, 0, len)) == 0 || size - n < len)
+        return 0;
+    memcpy(dst + n, s, len);
+    return n + len;
+}
+
+/*
+ * get_string - Decode the string literal at *p, which ends before end,
+ *     to the end of the *used bytes of the size at buf, and move *p past
+ *     it. Returns 0 and the string in *s and *len, or like hpack_decode()
+ *     on errors.
+ */
+static int get_string(const unsigned char **p, const unsigned char *end,
+                      char *buf, size_t size, size_t *used, const char **s,
+                      size_t *len) {
+    uint32_t n;
+    long dlen;
+    int huffman;
+
+    if (*p == end)
+        return HPACK_ERROR;
+    huffman = **p & 0x80;
+    if (get_int(p, end, 7, &n) != 0 || (size_t)(end - *p) < n)
+        return HPACK_ERROR;
+    if (huffman) {
+        if ((dlen = huffman_decode(*p, n, buf + *used, size - *used)) < 0)
+            return dlen;
+    }
+    else {
+        if (size - *used < n)
+            return HPACK_TOOBIG;
+        memcpy(buf + *used, *p, n);
+        dlen = n;
+    }
+    *p += n;
+    *s = buf + *used;
+    *len = dlen;
+    *used += dlen;
+    return 0;
+}
+
+void hpack_table_init(struct hpack_table *t) {
+    t->size = 0;
+    t->maxsize = HPACK_TABLE_SIZE;
+    t->resized = 0;
+    t->nentries = 0;
+}
+
+/*
+ * evict - Evict the oldest entries of t until room more bytes fit.
+ */
+static void evict(struct hpack_table *t, size_t room) {
+    size_t bytes = 0, end;
+    int i, k = 0;
+
+    for (; k < t->nentries && t->size + room > t->maxsize; ++k) {
+        bytes += t->entries[k].namelen + t->entries[k].valuelen;
+        t->size -= 32 + t->entries[k].namelen + t->entries[k].valuelen;
+    }
+    if (k == 0)
+        return;
+    i = t->nentries - 1;
+    end = t->entries[i].off + t->entries[i].namelen + t->entries[i].valuelen;
+    memmove(t->data, t->data + bytes, end - bytes);
+    t->nentries -= k;
+    for (i = 0; i < t->nentries; ++i) {
+        t->entries[i] = t->entries[i + k];
+        t->entries[i].off -= bytes;
+    }
+}
+
+/*
+ * insert - Add a field to t, as its newest entry. One larger than the
+ *     table just empties it.
+ */
+static void insert(struct hpack_table *t, const char *name, size_t namelen,
+                   const char *value, size_t valuelen) {
+    size_t size = 32 + namelen + valuelen, off = 0;
+    int i;
+
+    evict(t, size);
+    if (size > t->maxsize)
+        return;
+    i = t->nentries;
+    if (i > 0)
+        off = t->entries[i - 1].off + t->entries[i - 1].namelen
+              + t->entries[i - 1].valuelen;
+    memcpy(t->data + off, name, namelen);
+    memcpy(t->data + off + namelen, value, valuelen);
+    t->entries[i].off = off;
+    t->entries[i].namelen = namelen;
+    t->entries[i].valuelen = valuelen;
+    t->nentries++;
+    t->size += size;
+}
+
+/*
+ * lookup - Find the field at index of the static table followed by t,
+ *     newest entries first. Returns -1 if there is none.
+ */
+static int lookup(const struct hpack_table *t, uint32_t index,
+                  struct hpack_field *f) {
+    int i;
+
+    if (index == 0)
+        return -1;
+    if (index <= NSTATIC) {
+        f->name = static_table[index - 1].name;
+        f->namelen = strlen(f->name);
+        f->value = static_table[index - 1].value;
+        f->valuelen = strlen(f->value);
+        return 0;
+    }
+    if ((index -= NSTATIC + 1) >= (uint32_t)t->nentries)
+        return -1;
+    i = t->nentries - 1 - index;
+    f->name = t->data + t->entries[i].off;
+    f->namelen = t->entries[i].namelen;
+    f->value = f->name + f->namelen;
+    f->valuelen = t->entries[i].valuelen;
+    return 0;
+}
+
+/*
+ * hpack_table_resize - Let the entries of t take up to maxsize, but no
+ *     more than HPACK_TABLE_SIZE, as the peer allows its decoder.
+ */
+void hpack_table_resize(struct hpack_table *t, size_t maxsize) {
+    if (maxsize > HPACK_TABLE_SIZE)
+        maxsize = HPACK_TABLE_SIZE;
+    if (maxsize != t->maxsize)
+        t->resized = 1;
+    t->maxsize = maxsize;
+    evict(t, 0);
+}
+
+/*
+ * hpack_decode - Decode the len bytes of the header block at src into at
+ *     most max fields, updating t on the way. The names and values are
+ *     copied into the size bytes at buf. Returns how many fields there
+ *     are, HPACK_ERROR if the block is malformed, or HPACK_TOOBIG if the
+ *     fields don't fit. Either way t is then out of step with the
+ *     encoder, so the connection is lost.
+ */
+int hpack_decode(struct hpack_table *t, const char *src, size_t len,
+                 char *buf, size_t size, struct hpack_field *fields,
+                 int max) {
+    const unsigned char *p = (const unsigned char *)src, *end = p + len;
+    struct hpack_field f;
+    size_t used = 0;
+    uint32_t index;
+    int n = 0, rc, indexing;
+
+    while (p < end) {
+        if ((*p & 0xe0) == 0x20) {
+            /* Dynamic table size update, up to what we allow. */
+            if (get_int(&p, end, 5, &index) != 0
+                || index > HPACK_TABLE_SIZE)
+                return HPACK_ERROR;
+            t->maxsize = index;
+            evict(t, 0);
+            continue;
+        }
+        if (n == max)
+            return HPACK_TOOBIG;
+
+        if (*p & 0x80) {
+            /* Indexed field. */
+            if (get_int(&p, end, 7, &index) != 0 || lookup(t, index, &f) != 0)
+                return HPACK_ERROR;
+            if (size - used < f.namelen + f.valuelen)
+                return HPACK_TOOBIG;
+            memcpy(buf + used, f.name, f.namelen);
+            memcpy(buf + used + f.namelen, f.value, f.valuelen);
+            f.name = buf + used;
+            f.value = buf + used + f.namelen;
+            used += f.namelen + f.valuelen;
+            fields[n++] = f;
+            continue;
+        }
+
+        /* Literal, with incremental indexing, without or never indexed. */
+        indexing = (*p & 0xc0) == 0x40;
+        if (get_int(&p, end, indexing ? 6 : 4, &index) != 0)
+            return HPACK_ERROR;
+        if (index != 0) {
+            /* Copied, inserting may evict the entry it comes from. */
+            if (lookup(t, index, &f) != 0)
+                return HPACK_ERROR;
+            if (size - used < f.namelen)
+                return HPACK_TOOBIG;
+            memcpy(buf + used, f.name, f.namelen);
+            f.name = buf + used;
+            used += f.namelen;
+        }
+        else if ((rc = get_string(&p, end, buf, size, &used, &f.name,
+                                  &f.namelen)) != 0)
+            return rc;
+        if ((rc = get_string(&p, end, buf, size, &used, &f.value,
+                             &f.valuelen)) != 0)
+            return rc;
+        if (indexing)
+            insert(t, f.name, f.namelen, f.value, f.valuelen);
+        fields[n++] = f;
+    }
+    return n;
+}
+
+/*
+ * hpack_encode_start - Begin a header block in the size bytes at dst,
+ *     telling the decoder of a change to the size of t. Returns the
+ *     length, 0 if there is nothing to tell or it doesn't fit.
+ */
+size_t hpack_encode_start(struct hpack_table *t, char *dst, size_t size) {
+    size_t n;
+
+    if (!t->resized)
+        return 0;
+    if ((n = put_int((unsigned char *)dst, size, 5, 0x20, t->maxsize)) > 0)
+        t->resized = 0;
+    return n;
+}
+
+/*
+ * hpack_encode - Encode a field, with a lowercase name, into the size
+ *     bytes at dst. It refers to an entry of the static table or t if one
+ *     matches, and is added to t if index is set and it isn't there yet.
+ *     Returns its length, or 0 if it doesn't fit.
+ */
+size_t hpack_encode(struct hpack_table *t, char *dst, size_t size,
+                    const char *name, size_t namelen, const char *value,
+                    size_t valuelen, int index) {
+    unsigned char *p = (unsigned char *)dst;
+    uint32_t byname = 0;
+    struct hpack_field f;
+    size_t n, m;
+    int i;
+
+    for (i = 1; i <= NSTATIC + t->nentries; ++i) {
+        lookup(t, i, &f);
+        if (f.namelen != namelen || memcmp(f.name, name, namelen) != 0)
+            continue;
+        if (f.valuelen == valuelen && memcmp(f.value, value, valuelen) == 0)
+            return put_int(p, size, 7, 0x80, i);
+        if (byname == 0)
+            byname = i;
+    }
+
+    if ((n = put_int(p, size, index ? 6 : 4, index ? 0x40 : 0, byname)) == 0)
+        return 0;
+    if (byname == 0) {
+        if ((m = put_string(p + n, size - n, name, namelen)) == 0)
+            return 0;
+        n += m;
+    }
+    if ((m = put_string(p + n, size - n, value, valuelen)) == 0)
+        return 0;
+    if (index)
+        insert(t, name, namelen, value, valuelen);
+    return n + m;
+}
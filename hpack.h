@@ -0,0 +1,48 @@
+#ifndef _HPACK_H
+#define _HPACK_H
+
+#include <stddef.h>
+
+#define HPACK_TABLE_SIZE  4096  /* Dynamic table size, the default and most */
+#define HPACK_MAXENTRIES  (HPACK_TABLE_SIZE / 32)  /* Entries cost 32 more */
+
+/* What hpack_decode() returns on errors. */
+#define HPACK_ERROR  -1  /* The block is malformed */
+#define HPACK_TOOBIG -2  /* Its fields don't fit the caller's buffers */
+
+/* A decoded header field, copied into the caller's buffer. */
+struct hpack_field {
+    const char *name;
+    size_t namelen;
+    const char *value;
+    size_t valuelen;
+};
+
+/*
+ * The dynamic table of one direction of a connection. Entries are kept
+ * oldest first, their names and values back to back in data, and the
+ * oldest are evicted once they take up more than maxsize. An encoder
+ * whose table shrank tells the decoder at the start of its next block.
+ */
+struct hpack_table {
+    size_t size;               /* Of the entries, as HPACK counts them */
+    size_t maxsize;            /* ... at most */
+    int resized;               /* maxsize changed, the peer doesn't know */
+    int nentries;
+    struct {
+        unsigned short off, namelen, valuelen;
+    } entries[HPACK_MAXENTRIES];
+    char data[HPACK_TABLE_SIZE];
+};
+
+void hpack_init(void);
+void hpack_table_init(struct hpack_table *t);
+void hpack_table_resize(struct hpack_table *t, size_t maxsize);
+int hpack_decode(struct hpack_table *t, const char *src, size_t len,
+                 char *buf, size_t size, struct hpack_field *fields, int max);
+size_t hpack_encode_start(struct hpack_table *t, char *dst, size_t size);
+size_t hpack_encode(struct hpack_table *t, char *dst, size_t size,
+                    const char *name, size_t namelen, const char *value,
+                    size_t valuelen, int index);
+
+#endif
@@ -0,0 +1,747 @@
+#include "http-parser.h"
+
+#include <string.h>
+#include <strings.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HTTP_PARSER_X86
+#endif
+
+/*
+ * Characters allowed in methods and header names (RFC 9110 tchar). For
+ * the vector code the set is also kept as two nibble tables: c is a
+ * tchar if tchar_lo[c & 15] & tchar_hi[c >> 4] is not 0.
+ */
+static unsigned char tchar[256];
+static unsigned char tchar_lo[16] __attribute__((aligned(16)));
+static unsigned char tchar_hi[16] __attribute__((aligned(16)));
+
+/*
+ * The scans below look at [p, end) and return the first byte that stops
+ * them, or end. They may read up to end even when they stop early, so
+ * the parser gives them the end of the buffer, not of the line: a line
+ * always ends in a byte that stops every one of them.
+ */
+
+/*
+ * find_eol_scalar - Find the first LF, CR or NUL. This is the fallback,
+ *     and the tail of the vectorized versions.
+ */
+static char *find_eol_scalar(char *p, char *end) {
+    for (; p < end; ++p) {
+        if (*p == '\n' || *p == '\r' || *p == '\0')
+            break;
+    }
+    return p;
+}
+
+/*
+ * skip_tchar_scalar - Find the first byte that is not a tchar.
+ */
+static char *skip_tchar_scalar(char *p, char *end) {
+    while (p < end && tchar[(unsigned char)*p])
+        ++p;
+    return p;
+}
+
+/*
+ * skip_vchar_scalar - Find the first byte that can't be in a request
+ *     target: a control character or a space. Bytes past ASCII pass, as
+ *     clients send UTF-8 unencoded.
+ */
+static char *skip_vchar_scalar(char *p, char *end) {
+    while (p < end && (unsigned char)*p > ' ' && *p != 0x7f)
+        ++p;
+    return p;
+}
+
+#ifdef HTTP_PARSER_X86
+/*
+ * find_eol_sse2 - Like find_eol_scalar(), comparing 16 bytes at a time.
+ */
+static char *find_eol_sse2(char *p, char *end) {
+    __m128i lf = _mm_set1_epi8('\n'), cr = _mm_set1_epi8('\r');
+    __m128i nul = _mm_setzero_si128(), v;
+    int mask;
+
+    for (; end - p >= 16; p += 16) {
+        v = _mm_loadu_si128((const __m128i *)p);
+        mask = _mm_movemask_epi8(
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, lf),
+                                      _mm_cmpeq_epi8(v, cr)),
+                         _mm_cmpeq_epi8(v, nul)));
+        if (mask != 0)
+            return p + __builtin_ctz(mask);
+    }
+    return find_eol_scalar(p, end);
+}
+
+/*
+ * skip_tchar_ssse3 - Like skip_tchar_scalar(), 16 bytes at a time, each
+ *     looked up by its nibbles. Bytes past ASCII have a high nibble that
+ *     matches no tchar. Only called if the CPU supports SSSE3.
+ */
+__attribute__((target("ssse3")))
+static char *skip_tchar_ssse3(char *p, char *end) {
+    __m128i lo = _mm_load_si128((const __m128i *)tchar_lo);
+    __m128i hi = _mm_load_si128((const __m128i *)tchar_hi);
+    __m128i nibble = _mm_set1_epi8(0x0f), v, in;
+    int mask;
+
+    for (; end - p >= 16; p += 16) {
+        v = _mm_loadu_si128((const __m128i *)p);
+        in = _mm_and_si128(
+            _mm_shuffle_epi8(lo, _mm_and_si128(v, nibble)),
+            _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi16(v, 4), nibble)));
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(in, _mm_setzero_si128()));
+        if (mask != 0)
+            return p + __builtin_ctz(mask);
+    }
+    return skip_tchar_scalar(p, end);
+}
+
+/*
+ * skip_vchar_sse2 - Like skip_vchar_scalar(), 16 bytes at a time. The
+ *     comparisons are signed, so bytes past ASCII are below 0.
+ */
+static char *skip_vchar_sse2(char *p, char *end) {
+    __m128i space = _mm_set1_epi8(' ' + 1), del = _mm_set1_epi8(0x7f);
+    __m128i v, bad;
+    int mask;
+
+    for (; end - p >= 16; p += 16) {
+        v = _mm_loadu_si128((const __m128i *)p);
+        bad = _mm_or_si128(
+            _mm_andnot_si128(_mm_cmplt_epi8(v, _mm_setzero_si128()),
+                             _mm_cmplt_epi8(v, space)),
+            _mm_cmpeq_epi8(v, del));
+        if ((mask = _mm_movemask_epi8(bad)) != 0)
+            return p + __builtin_ctz(mask);
+    }
+    return skip_vchar_scalar(p, end);
+}
+
+/*
+ * find_eol_avx2, skip_tchar_avx2, skip_vchar_avx2 - The same, 32 bytes at
+ *     a time. Only called if the CPU supports AVX2. The tail is left to
+ *     the scalar scans: going on with the SSE versions would mix in
+ *     legacy SSE code, which stalls after AVX on some CPUs.
+ */
+__attribute__((target("avx2")))
+static char *find_eol_avx2(char *p, char *end) {
+    __m256i lf = _mm256_set1_epi8('\n'), cr = _mm256_set1_epi8('\r');
+    __m256i nul = _mm256_setzero_si256(), v;
+    unsigned mask;
+
+    for (; end - p >= 32; p += 32) {
+        v = _mm256_loadu_si256((const __m256i *)p);
+        mask = _mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, lf),
+                                            _mm256_cmpeq_epi8(v, cr)),
+                            _mm256_cmpeq_epi8(v, nul)));
+        if (mask != 0)
+            return p + __builtin_ctz(mask);
+    }
+    return find_eol_scalar(p, end);
+}
+
+__attribute__((target("avx2")))
+static char *skip_tchar_avx2(char *p, char *end) {
+    __m256i lo = _mm256_broadcastsi128_si256(
+        _mm_load_si128((const __m128i *)tchar_lo));
+    __m256i hi = _mm256_broadcastsi128_si256(
+        _mm_load_si128((const __m128i *)tchar_hi));
+    __m256i nibble = _mm256_set1_epi8(0x0f), v, in;
+    unsigned mask;
+
+    for (; end - p >= 32; p += 32) {
+        v = _mm256_loadu_si256((const __m256i *)p);
+        in = _mm256_and_si256(
+            _mm256_shuffle_epi8(lo, _mm256_and_si256(v, nibble)),
+            _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi16(v, 4),
+                                                     nibble)));
+        mask = _mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(in, _mm256_setzero_si256()));
+        if (mask != 0)
+            return p + __builtin_ctz(mask);
+    }
+    return skip_tchar_scalar(p, end);
+}
+
+__attribute__((target("avx2")))
+static char *skip_vchar_avx2(char *p, char *end) {
+    __m256i space = _mm256_set1_epi8(' ' + 1), del = _mm256_set1_epi8(0x7f);
+    __m256i v, bad;
+    unsigned mask;
+
+    for (; end - p >= 32; p += 32) {
+        v = _mm256_loadu_si256((const __m256i *)p);
+        bad = _mm256_or_si256(
+            _mm256_andnot_si256(_mm256_cmpgt_epi8(_mm256_setzero_si256(), v),
+                                _mm256_cmpgt_epi8(space, v)),
+            _mm256_cmpeq_epi8(v, del));
+        if ((mask = _mm256_movemask_epi8(bad)) != 0)
+            return p + __builtin_ctz(mask);
+    }
+    return skip_vchar_scalar(p, end);
+}
+
+static char *(*find_eol)(char *, char *) = find_eol_sse2;
+static char *(*skip_tchar)(char *, char *) = skip_tchar_scalar;
+static char *(*skip_vchar)(char *, char *) = skip_vchar_sse2;
+#else
+static char *(*find_eol)(char *, char *) = find_eol_scalar;
+static char *(*skip_tchar)(char *, char *) = skip_tchar_scalar;
+static char *(*skip_vchar)(char *, char *) = skip_vchar_scalar;
+#endif
+
+/*
+ * http_parser_init - Build the character tables and pick the widest scans
+ *     the CPU supports. Must be called before parsing.
+ */
+void http_parser_init(void) {
+    const char *p;
+    int c;
+
+    for (c = 0; c < 256; ++c)
+        tchar[c] = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+                   || (c >= '0' && c <= '9');
+    for (p = "!#$%&'*+-.^_`|~"; *p != '\0'; ++p)
+        tchar[(unsigned char)*p] = 1;
+    /* Every tchar is ASCII, so 8 bits cover the high nibbles. */
+    for (c = 0; c < 128; ++c) {
+        if (tchar[c])
+            tchar_lo[c & 15] |= 1 << (c >> 4);
+    }
+    for (c = 0; c < 8; ++c)
+        tchar_hi[c] = 1 << c;
+#ifdef HTTP_PARSER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        find_eol = find_eol_avx2;
+        skip_tchar = skip_tchar_avx2;
+        skip_vchar = skip_vchar_avx2;
+    }
+    else if (__builtin_cpu_supports("ssse3"))
+        skip_tchar = skip_tchar_ssse3;
+#endif
+}
+
+void http_request_init(struct http_request *req) {
+    req->nheaders = 0;
+    req->pos = 0;
+    req->in_headers = 0;
+}
+
+/*
+ * next_line - Find the end of the line at p in [p, bufend): *nl at its LF
+ *     and *end at the CR before, or at the LF if it is bare. Returns 1 if
+ *     it is complete, 0 if not and -1 if it holds a CR or NUL of its own,
+ *     which could end it for someone else.
+ */
+static int next_line(char *p, char *bufend, char **nl, char **end) {
+    char *q = find_eol(p, bufend);
+
+    if (q == bufend)
+        return 0;
+    if (*q == '\n') {
+        *nl = *end = q;
+        return 1;
+    }
+    if (*q == '\r' && q + 1 == bufend)
+        return 0;
+    if (*q == '\r' && q[1] == '\n') {
+        *end = q;
+        *nl = q + 1;
+        return 1;
+    }
+    return -1;
+}
+
+/*
+ * parse_reqline - Split the request line [p, end) into method, target
+ *     and version. Returns -1 if it is malformed. The line is in a buffer
+ *     that goes on to bufend.
+ */
+static int parse_reqline(struct http_request *req, char *p, char *end,
+                         char *bufend) {
+    char *sp;
+
+    /* Method */
+    if ((sp = skip_tchar(p, bufend)) == p || *sp != ' ')
+        return -1;
+    req->method.p = p;
+    req->method.len = sp - p;
+
+    /* Request target */
+    p = sp + 1;
+    if ((sp = skip_vchar(p, bufend)) == p || *sp != ' ')
+        return -1;
+    req->target.p = p;
+    req->target.len = sp - p;
+
+    /* Version, only HTTP/1.x */
+    p = sp + 1;
+    if (end - p != 8 || memcmp(p, "HTTP/1.", 7) != 0
+        || p[7] < '0' || p[7] > '9')
+        return -1;
+    req->version.p = p;
+    req->version.len = 8;
+    req->minor_version = p[7] - '0';
+    return 0;
+}
+
+/*
+ * parse_header - Split the header line [p, end) into name and value, the
+ *     next of the *n in headers. Returns -1 if it is malformed or there
+ *     are too many headers. The line is in a buffer that goes on to
+ *     bufend.
+ */
+static int parse_header(struct http_header *headers, int *n, char *p,
+                        char *end, char *bufend) {
+    struct http_header *h;
+    char *colon;
+
+    if (*n == HTTP_MAXHEADERS)
+        return -1;
+    /* No whitespace before the colon either. */
+    if ((colon = skip_tchar(p, bufend)) == p || *colon != ':')
+        return -1;
+
+    h = &headers[(*n)++];
+    h->name.p = p;
+    h->name.len = colon - p;
+    for (p = colon + 1; p < end && (*p == ' ' || *p == '\t'); ++p)
+        ;
+    while (end > p && (end[-1] == ' ' || end[-1] == '\t'))
+        --end;
+    h->value.p = p;
+    h->value.len = end - p;
+    return 0;
+}
+
+/*
+ * http_parse_request - Parse the request head at the start of buf[0, len)
+ *     into req, without copying. Lines may end with CRLF or a bare LF, but
+ *     header values may hold neither a CR nor a NUL.
+ *     Returns the length of the head including the empty line that ends
+ *     it, 0 if it is incomplete and -1 if it is malformed.
+ */
+int http_parse_request(struct http_request *req, char *buf, size_t len) {
+    char *p, *nl, *end, *bufend = buf + len;
+    int rc;
+
+    for (p = buf + req->pos; (rc = next_line(p, bufend, &nl, &end)) > 0;
+         p = nl + 1) {
+        if (!req->in_headers) {
+            /* Tolerate empty lines before the request line. */
+            if (end == p)
+                continue;
+            if (parse_reqline(req, p, end, bufend) != 0)
+                return -1;
+            req->in_headers = 1;
+        }
+        else if (end == p)
+            return req->pos = nl + 1 - buf;
+        else if (parse_header(req->headers, &req->nheaders, p, end,
+                              bufend) != 0)
+            return -1;
+    }
+    if (rc < 0)
+        return -1;
+
+    req->pos = p - buf;
+    return 0;
+}
+
+void http_response_init(struct http_response *resp) {
+    resp->nheaders = 0;
+    resp->pos = 0;
+    resp->in_headers = 0;
+}
+
+/*
+ * http_fields_init - Like http_response_init(), for a head of header
+ *     fields alone, such as the one a CGI program sends. Its status is
+ *     left to the caller.
+ */
+void http_fields_init(struct http_response *resp) {
+    http_response_init(resp);
+    resp->minor_version = 1;
+    resp->status = 0;
+    resp->reason.p = NULL;
+    resp->reason.len = 0;
+    resp->in_headers = 1;
+}
+
+/*
+ * parse_statusline - Split the status line [p, end) into version, status
+ *     code and reason, which may be empty. Returns -1 if it is malformed.
+ */
+static int parse_statusline(struct http_response *resp, char *p, char *end) {
+    if (end - p < 12 || memcmp(p, "HTTP/1.", 7) != 0
+        || p[7] < '0' || p[7] > '9' || p[8] != ' '
+        || p[9] < '1' || p[9] > '5' || p[10] < '0' || p[10] > '9'
+        || p[11] < '0' || p[11] > '9' || (end - p > 12 && p[12] != ' '))
+        return -1;
+    resp->minor_version = p[7] - '0';
+    resp->status = (p[9] - '0') * 100 + (p[10] - '0') * 10 + (p[11] - '0');
+    resp->reason.p = end - p > 12 ? p + 13 : end;
+    resp->reason.len = end - resp->reason.p;
+    return 0;
+}
+
+/*
+ * http_parse_response - Parse the response head at the start of
+ *     buf[0, len) into resp, like http_parse_request() does a request.
+ *     Returns the length of the head, 0 if it is incomplete and -1 if it
+ *     is malformed.
+ */
+int http_parse_response(struct http_response *resp, char *buf, size_t len) {
+    char *p, *nl, *end, *bufend = buf + len;
+    int rc;
+
+    for (p = buf + resp->pos; (rc = next_line(p, bufend, &nl, &end)) > 0;
+         p = nl + 1) {
+        if (!resp->in_headers) {
+            if (parse_statusline(resp, p, end) != 0)
+                return -1;
+            resp->in_headers = 1;
+        }
+        else if (end == p)
+            return resp->pos = nl + 1 - buf;
+        else if (parse_header(resp->headers, &resp->nheaders, p, end,
+                              bufend) != 0)
+            return -1;
+    }
+    if (rc < 0)
+        return -1;
+
+    resp->pos = p - buf;
+    return 0;
+}
+
+/*
+ * http_find_header - Return the value of the first header called name,
+ *     compared case-insensitively, or NULL.
+ */
+const struct http_slice *http_find_header(const struct http_request *req,
+                                          const char *name) {
+    return http_find(req->headers, req->nheaders, name);
+}
+
+/*
+ * http_find - Like http_find_header(), in the n headers at headers.
+ */
+const struct http_slice *http_find(const struct http_header *headers, int n,
+                                   const char *name) {
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        if (http_slice_caseeq(&headers[i].name, name))
+            return &headers[i].value;
+    }
+    return NULL;
+}
+
+/*
+ * http_parse_length - Parse the Content-Length value s into *len. Returns
+ *     -1 if it is not a plain decimal number that fits.
+ */
+int http_parse_length(const struct http_slice *s, off_t *len) {
+    size_t i;
+    off_t n = 0;
+
+    if (s->len == 0)
+        return -1;
+    for (i = 0; i < s->len; ++i) {
+        if (s->p[i] < '0' || s->p[i] > '9'
+            || n > (HTTP_OFF_MAX - (s->p[i] - '0')) / 10)
+            return -1;
+        n = n * 10 + (s->p[i] - '0');
+    }
+    *len = n;
+    return 0;
+}
+
+/*
+ * http_content_length - Parse the value of the Content-Length header among
+ *     the n at headers into *len. Returns 1 if there is one, 0 if there is
+ *     none and -1 if there are several, or a value that is not a plain
+ *     decimal number, like a list: whoever else reads the message could
+ *     then tell a different end of the body.
+ */
+int http_content_length(const struct http_header *headers, int n,
+                        off_t *len) {
+    const struct http_slice *value = NULL;
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        if (!http_slice_caseeq(&headers[i].name, "Content-Length"))
+            continue;
+        if (value != NULL)
+            return -1;
+        value = &headers[i].value;
+    }
+    if (value == NULL)
+        return 0;
+    return http_parse_length(value, len) == 0 ? 1 : -1;
+}
+
+int http_slice_eq(const struct http_slice *s, const char *str) {
+    return strlen(str) == s->len && memcmp(s->p, str, s->len) == 0;
+}
+
+int http_slice_caseeq(const struct http_slice *s, const char *str) {
+    return strlen(str) == s->len && strncasecmp(s->p, str, s->len) == 0;
+}
+
+/*
+ * http_has_token - Check if the comma-separated list s, like the value of
+ *     Connection, contains token, compared case-insensitively.
+ */
+int http_has_token(const struct http_slice *s, const char *token) {
+    size_t n = strlen(token);
+    char *p = s->p, *end = s->p + s->len, *q;
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            ++p;
+        for (q = p; q < end && *q != ','; ++q)
+            ;
+        while (q > p && (q[-1] == ' ' || q[-1] == '\t'))
+            --q;
+        if ((size_t)(q - p) == n && strncasecmp(p, token, n) == 0)
+            return 1;
+        p = q;
+        while (p < end && *p != ',')
+            ++p;
+    }
+    return 0;
+}
+
+/*
+ * parse_qvalue - Parse the weight at p, like "0.5", in thousandths. A
+ *     malformed one counts as 1.
+ */
+static int parse_qvalue(const char *p, const char *end) {
+    int q, scale;
+
+    if (p == end || (*p != '0' && *p != '1'))
+        return 1000;
+    q = (*p++ - '0') * 1000;
+    if (p < end && *p == '.') {
+        for (++p, scale = 100; p < end && scale > 0 && *p >= '0' && *p <= '9';
+             ++p, scale /= 10)
+            q += (*p - '0') * scale;
+    }
+    return q > 1000 ? 1000 : q;
+}
+
+/*
+ * http_token_q - Return the weight the comma-separated list s, like the
+ *     value of Accept-Encoding, gives token, in thousandths: 1000 if its
+ *     element has no q parameter, 0 if token is refused. A "*" element
+ *     stands for every token not listed. Returns -1 if token isn't
+ *     covered at all.
+ */
+int http_token_q(const struct http_slice *s, const char *token) {
+    size_t n = strlen(token);
+    char *p = s->p, *end = s->p + s->len, *t, *q;
+    int weight, star = -1;
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            ++p;
+        for (t = p; t < end && *t != ',' && *t != ';' && *t != ' '
+                    && *t != '\t'; ++t)
+            ;
+        /* Of the parameters, only q matters. */
+        weight = 1000;
+        for (q = t; q < end && *q != ','; ++q) {
+            if (*q != ';')
+                continue;
+            while (q + 1 < end && (q[1] == ' ' || q[1] == '\t'))
+                ++q;
+            if (end - q > 2 && (q[1] == 'q' || q[1] == 'Q') && q[2] == '=')
+                weight = parse_qvalue(q + 3, end);
+        }
+        if (t - p == 1 && *p == '*')
+            star = weight;
+        else if ((size_t)(t - p) == n && strncasecmp(p, token, n) == 0)
+            return weight;
+        p = q;
+    }
+    return star;
+}
+
+/*
+ * etag_eq - Compare the entity tags at a and b, of lengths alen and blen,
+ *     weakly: a W/ prefix makes no difference.
+ */
+static int etag_eq(const char *a, size_t alen, const char *b, size_t blen) {
+    if (alen > 2 && a[0] == 'W' && a[1] == '/') {
+        a += 2;
+        alen -= 2;
+    }
+    if (blen > 2 && b[0] == 'W' && b[1] == '/') {
+        b += 2;
+        blen -= 2;
+    }
+    return alen == blen && memcmp(a, b, alen) == 0;
+}
+
+/*
+ * http_etag_match - Check if the list of entity tags s, like the value
+ *     of If-None-Match, matches etag in the weak comparison. A "*"
+ *     matches every tag.
+ */
+int http_etag_match(const struct http_slice *s, const char *etag) {
+    size_t n = strlen(etag);
+    char *p = s->p, *end = s->p + s->len, *q;
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            ++p;
+        if (p < end && *p == '*')
+            return 1;
+        /* A tag may hold commas between its quotes. */
+        q = p;
+        if (end - q >= 2 && q[0] == 'W' && q[1] == '/')
+            q += 2;
+        if (q < end && *q == '"') {
+            for (++q; q < end && *q != '"'; ++q)
+                ;
+            if (q < end)
+                ++q;
+        }
+        while (q < end && *q != ',' && *q != ' ' && *q != '\t')
+            ++q;
+        if (etag_eq(p, q - p, etag, n))
+            return 1;
+        p = q;
+    }
+    return 0;
+}
+
+/*
+ * http_parse_date - Parse an HTTP date, like "Sun, 06 Nov 1994 08:49:37
+ *     GMT", into *t. Only this format is understood, as the obsolete ones
+ *     are rarely sent anymore. Returns -1 if s is not such a date.
+ */
+int http_parse_date(const struct http_slice *s, time_t *t) {
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    static const char digits[] = {5, 6, 12, 13, 14, 15, 17, 18, 20, 21, 23, 24};
+    const char *p = s->p;
+    int day, mon, year, hour, min, sec, i;
+    long days;
+
+    if (s->len != 29 || p[3] != ',' || p[4] != ' ' || p[7] != ' '
+        || p[11] != ' ' || p[16] != ' ' || p[19] != ':' || p[22] != ':'
+        || memcmp(p + 25, " GMT", 4) != 0)
+        return -1;
+    for (i = 0; i < (int)sizeof(digits); ++i) {
+        if (p[(int)digits[i]] < '0' || p[(int)digits[i]] > '9')
+            return -1;
+    }
+    for (mon = 0; mon < 12; ++mon) {
+        if (memcmp(p + 8, months + 3 * mon, 3) == 0)
+            break;
+    }
+    if (mon == 12)
+        return -1;
+    day = (p[5] - '0') * 10 + (p[6] - '0');
+    year = (p[12] - '0') * 1000 + (p[13] - '0') * 100 + (p[14] - '0') * 10
+           + (p[15] - '0');
+    hour = (p[17] - '0') * 10 + (p[18] - '0');
+    min = (p[20] - '0') * 10 + (p[21] - '0');
+    sec = (p[23] - '0') * 10 + (p[24] - '0');
+    if (day < 1 || day > 31 || hour > 23 || min > 59 || sec > 60)
+        return -1;
+
+    /* Days since 1970-01-01, counting years from March on. */
+    if (mon < 2)
+        year--;
+    days = 365L * year + year / 4 - year / 100 + year / 400
+           + (153 * ((mon + 10) % 12) + 2) / 5 + day - 1 - 719468;
+    *t = (time_t)days * 86400 + hour * 3600 + min * 60 + sec;
+    return 0;
+}
+
+/*
+ * parse_offset - Parse the decimal number at *pp, moving *pp past it.
+ *     Returns -1 if there is none or it doesn't fit an off_t.
+ */
+static off_t parse_offset(char **pp, char *end) {
+    char *p = *pp;
+    off_t n = 0;
+
+    if (p == end || *p < '0' || *p > '9')
+        return -1;
+    for (; p < end && *p >= '0' && *p <= '9'; ++p) {
+        if (n > (HTTP_OFF_MAX - (*p - '0')) / 10)
+            return -1;
+        n = n * 10 + (*p - '0');
+    }
+    *pp = p;
+    return n;
+}
+
+/*
+ * http_parse_ranges - Parse the Range value s for a representation of
+ *     size bytes into at most max ranges, clipped to the representation.
+ *     Ranges it doesn't cover at all are left out. Returns how many are
+ *     left, 0 meaning that none can be satisfied, or -1 if s is not a
+ *     list of byte ranges or has more than max of them, in which case it
+ *     is to be ignored.
+ */
+int http_parse_ranges(const struct http_slice *s, off_t size,
+                      struct http_range *ranges, int max) {
+    char *p = s->p, *end = s->p + s->len;
+    off_t first, last;
+    int n = 0, nspecs = 0;
+
+    if (s->len < 6 || strncasecmp(p, "bytes=", 6) != 0)
+        return -1;
+    for (p += 6; p < end; ) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            ++p;
+        if (p == end)
+            break;
+        if (++nspecs > max)
+            return -1;
+
+        if (*p == '-') {
+            /* The last bytes of the representation. */
+            ++p;
+            if ((last = parse_offset(&p, end)) < 0)
+                return -1;
+            first = last < size ? size - last : 0;
+            last = size;
+            if (first == last)
+                first = size; /* Leaves it out */
+        }
+        else {
+            if ((first = parse_offset(&p, end)) < 0 || p == end || *p++ != '-')
+                return -1;
+            if (p < end && *p >= '0' && *p <= '9') {
+                if ((last = parse_offset(&p, end)) < 0 || last < first)
+                    return -1;
+                last = last < size - 1 ? last + 1 : size;
+            }
+            else
+                last = size;
+        }
+
+        while (p < end && (*p == ' ' || *p == '\t'))
+            ++p;
+        if (p < end && *p != ',')
+            return -1;
+        if (first < size) {
+            ranges[n].start = first;
+            ranges[n++].end = last;
+        }
+    }
+    return nspecs > 0 ? n : -1;
+}
@@ -0,0 +1,83 @@
+#ifndef _HTTP_PARSER_H
+#define _HTTP_PARSER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+#define HTTP_MAXHEADERS 32  /* More headers than this is a bad request */
+#define HTTP_OFF_MAX    INT64_MAX  /* Largest off_t, which is 64 bits */
+
+/* A view into the buffer the request was parsed from. */
+struct http_slice {
+    char *p;
+    size_t len;
+};
+
+struct http_header {
+    struct http_slice name;
+    struct http_slice value;  /* Without surrounding whitespace */
+};
+
+/* Bytes start up to but not including end of a representation. */
+struct http_range {
+    off_t start, end;
+};
+
+/*
+ * A request head parsed in place. Parsing is incremental: if the head is
+ * incomplete, the lines parsed so far are kept and the next call goes on
+ * from the first incomplete line, so the buffer may grow between calls
+ * but must not move.
+ */
+struct http_request {
+    struct http_slice method;
+    struct http_slice target;
+    struct http_slice version;
+    int minor_version;        /* x of HTTP/1.x */
+    int nheaders;
+    struct http_header headers[HTTP_MAXHEADERS];
+
+    /* Parser state. */
+    size_t pos;               /* Start of the first unparsed line, or the
+                                 length of the head once it is complete */
+    int in_headers;           /* The request line has been parsed */
+};
+
+/* A response head, parsed in place and incrementally like a request. */
+struct http_response {
+    int minor_version;
+    int status;
+    struct http_slice reason;
+    int nheaders;
+    struct http_header headers[HTTP_MAXHEADERS];
+
+    /* Parser state. */
+    size_t pos;
+    int in_headers;
+};
+
+void http_parser_init(void);
+void http_request_init(struct http_request *req);
+int http_parse_request(struct http_request *req, char *buf, size_t len);
+const struct http_slice *http_find_header(const struct http_request *req,
+                                          const char *name);
+void http_response_init(struct http_response *resp);
+void http_fields_init(struct http_response *resp);
+int http_parse_response(struct http_response *resp, char *buf, size_t len);
+const struct http_slice *http_find(const struct http_header *headers, int n,
+                                   const char *name);
+int http_parse_length(const struct http_slice *s, off_t *len);
+int http_content_length(const struct http_header *headers, int n,
+                        off_t *len);
+int http_slice_eq(const struct http_slice *s, const char *str);
+int http_slice_caseeq(const struct http_slice *s, const char *str);
+int http_has_token(const struct http_slice *s, const char *token);
+int http_token_q(const struct http_slice *s, const char *token);
+int http_etag_match(const struct http_slice *s, const char *etag);
+int http_parse_date(const struct http_slice *s, time_t *t);
+int http_parse_ranges(const struct http_slice *s, off_t size,
+                      struct http_range *ranges, int max);
+
+#endif
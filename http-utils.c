@@ -1,5 +1,6 @@
 #define _POSIX_C_SOURCE 200809L
 #define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
 
 #include "http-utils.h"
 
@@ -10,17 +11,21 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 
 /*  
  * open_listenfd - Open and return a listening socket on port. This
- *     function is reentrant and protocol-independent.
+ *     function is reentrant and protocol-independent. If reuseport is
+ *     nonzero, SO_REUSEPORT is set so that several sockets can listen on
+ *     the same port and the kernel balances connections between them.
  *
  *     On error, returns: 
  *       -2 for getaddrinfo error
  *       -1 with errno set for other errors.
  */
-int open_listenfd(const char *port) {
+int open_listenfd(const char *port, int reuseport) {
     struct addrinfo hints, *listp, *p;
     int listenfd, rc, optval = 1;
 
@@ -44,6 +49,14 @@ int open_listenfd(const char *port) {
         setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,
                    (const void *)&optval, sizeof(int));
 
+        /* Share the port with the other listening sockets */
+        if (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                                    (const void *)&optval, sizeof(int)) < 0) {
+            close(listenfd);
+            freeaddrinfo(listp);
+            return -1;
+        }
+
         /* Bind the descriptor to the address */
         if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
             break; /* Success */
@@ -110,4 +123,55 @@ int open_clientfd(char *hostname, char *port) {
         return -1;
     else    /* The last connect succeeded */
         return clientfd;
-}
\ No newline at end of file
+}
+
+/*
+ * resolve_addr - Look up the first address of <hostname, port> into addr,
+ *     once, so that connections to it can be opened without blocking.
+ *
+ *     On error, returns:
+ *       -2 for getaddrinfo error
+ */
+int resolve_addr(const char *hostname, const char *port,
+                 struct sockaddr_storage *addr, socklen_t *addrlen) {
+    int rc;
+    struct addrinfo hints, *listp;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;  /* Open a connection */
+    hints.ai_flags = AI_NUMERICSERV;  /* ... using a numeric port arg. */
+    hints.ai_flags |= AI_ADDRCONFIG;  /* Recommended for connections */
+    if ((rc = getaddrinfo(hostname, port, &hints, &listp)) != 0) {
+        fprintf(stderr, "getaddrinfo failed (%s:%s): %s\n", hostname, port, gai_strerror(rc));
+        return -2;
+    }
+    memcpy(addr, listp->ai_addr, listp->ai_addrlen);
+    *addrlen = listp->ai_addrlen;
+    freeaddrinfo(listp);
+    return 0;
+}
+
+/*
+ * open_clientfd_nb - Start connecting a non-blocking socket to addr and
+ *     return it. The connection may still be in progress: it is up when
+ *     the socket turns writable, or a write fails with the reason it
+ *     didn't come up.
+ *
+ *     On error, returns -1 with errno set.
+ */
+int open_clientfd_nb(const struct sockaddr_storage *addr, socklen_t addrlen) {
+    int clientfd, optval = 1;
+
+    if ((clientfd = socket(addr->ss_family,
+                           SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+        return -1;
+    /* Request heads go out in one write, don't hold them back. */
+    setsockopt(clientfd, IPPROTO_TCP, TCP_NODELAY,
+               (const void *)&optval, sizeof(int));
+    if (connect(clientfd, (const struct sockaddr *)addr, addrlen) < 0
+        && errno != EINPROGRESS) {
+        close(clientfd);
+        return -1;
+    }
+    return clientfd;
+}
@@ -1,9 +1,14 @@
 #ifndef _HTTP_UTILS_H
 #define _HTTP_UTILS_H
 
+#include <sys/socket.h>
+
 #define LISTENQ  1024  /* Second argument to listen() */
 
-int open_listenfd(const char *port);
+int open_listenfd(const char *port, int reuseport);
 int open_clientfd(char *hostname, char *port);
+int resolve_addr(const char *hostname, const char *port,
+                 struct sockaddr_storage *addr, socklen_t *addrlen);
+int open_clientfd_nb(const struct sockaddr_storage *addr, socklen_t addrlen);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,1529 @@
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
+
+#include "http2.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <ctype.h>
+#include <sys/sendfile.h>
+
+#include "error.h"
+#include "hpack.h"
+#include "metrics.h"
+#include "accesslog.h"
+#include "proxy.h"
+#include "conn.h"
+
+#define H2CONN_KEEP     8      /* Free HTTP/2 states a worker keeps */
+#define H2_INBUF        32768  /* Read buffer of an HTTP/2 connection */
+#define H2_OUTBUF       32768  /* Frames waiting to be sent on one */
+#define H2_RESERVE      1024   /* ... of which responses leave to control */
+#define H2_CONTROL      64     /* Room to answer the next frame read */
+#define H2_STREAMS      100    /* Streams a client may have open at once */
+#define H2_CLOSED       (2 * H2_STREAMS)  /* ... and closed, remembered */
+#define H2_WE_RESET     0x80000000  /* Marks a closed one we reset */
+#define H2_BLOCK        16384  /* Largest header block we take */
+#define H2_MAXFIELDS    64     /* ... and most fields in it */
+#define H2STREAM_SLAB   64     /* Streams allocated at a time */
+
+/*
+ * The HTTP/2 state of a connection. Frames are read into in and handled
+ * once they are complete. What we send is framed into out: control
+ * frames as they come up, responses whenever out is empty, the most
+ * urgent first. The bytes of a DATA frame from a file don't pass through
+ * out, they follow its header at fileat straight from the file.
+ */
+struct h2conn {
+    size_t preface;            /* Bytes of the client preface yet to come */
+    int settings;              /* The client sent its SETTINGS */
+    size_t inlen;              /* Bytes in in */
+    uint32_t blockid;          /* Stream of a header block in block, or 0 */
+    int blockflags;            /* ... flags of its HEADERS */
+    size_t blocklen;
+    struct hpack_table decoder, encoder;
+    size_t outpos, outlen;     /* Frames in out not sent yet */
+    struct h2stream *filestream;  /* Stream of the file bytes, if any */
+    size_t fileat, filelen;    /* ... where they go in out, and how many */
+    int copyfiles;             /* sendfile(2) can't read the files */
+    long window;               /* Bytes we may send */
+    long initwindow;           /* ... on a new stream */
+    size_t maxframe;           /* Largest frame the client takes */
+    long recvwindow;           /* Bytes the client may send */
+    uint32_t lastid;           /* Newest stream the client opened */
+    uint32_t closed[H2_CLOSED];  /* Streams closed lately, as a ring */
+    unsigned nclosed;          /* ... put in it so far */
+    int goaway;                /* We sent GOAWAY */
+    int peergoaway;            /* ... the client did */
+    int failed;                /* ... with an error, the connection is lost */
+    int nstreams;              /* Streams open */
+    int nserved;               /* ... and served, against keepalive_requests */
+    unsigned long turn;        /* DATA frames sent */
+    struct h2stream *streams;
+    char in[H2_INBUF];
+    char block[H2_BLOCK];
+    char out[H2_OUTBUF];
+};
+
+/*
+ * A stream of an HTTP/2 connection. Its request is turned into HTTP/1.1
+ * in the rbuf of conn, a connection without a socket of its own, and
+ * served like any other. The response built there waits for its turn:
+ * its head is parsed back and sent with HPACK, its body in DATA frames.
+ */
+struct h2stream {
+    struct conn conn;
+    uint32_t id;
+    struct h2stream *next;     /* Streams of the connection */
+    long window;               /* Bytes we may send on it */
+    int urgency;               /* Of RFC 9218, 0 the most urgent */
+    int incremental;           /* ... the client uses the body as it comes */
+    unsigned long turn;        /* When it last sent a DATA frame */
+    int started;               /* Its HEADERS are queued */
+    int ended;                 /* ... and so is its END_STREAM */
+    int reset;                 /* Closed while its file bytes are queued */
+    int remote_closed;         /* The client sent its END_STREAM */
+    int http11;                /* It goes to a backend, which needs HTTP/1.1 */
+};
+
+static int h2_start(struct worker *w, struct conn *c);
+static int h2_finished(struct h2conn *h2);
+static int h2_input(struct worker *w, struct conn *c);
+static void h2_handle(struct worker *w, struct conn *c,
+                      const struct h2_frame *f, const char *p);
+static void h2_recv_data(struct worker *w, struct conn *c,
+                         const struct h2_frame *f, const char *p);
+static void h2_recv_headers(struct worker *w, struct conn *c,
+                            const struct h2_frame *f, const char *p);
+static void h2_recv_block(struct worker *w, struct conn *c, uint32_t id,
+                          int flags, const char *block, size_t len);
+static void h2_recv_window(struct worker *w, struct conn *c,
+                           const struct h2_frame *f, const char *p);
+static int h2_settings(struct h2conn *h2, const char *p, size_t len);
+static void h2_request(struct worker *w, struct conn *c, uint32_t id, int end,
+                       const struct hpack_field *fields, int n);
+static int h2_token(const char *p, size_t len, int lower);
+static int h2_value_ok(const char *p, size_t len);
+static void h2_serve(struct worker *w, struct conn *c, struct h2stream *s,
+                     size_t len);
+static struct h2stream *h2_stream_new(struct worker *w, struct conn *c,
+                                      uint32_t id);
+static struct h2stream *h2_stream_find(struct h2conn *h2, uint32_t id);
+static void h2_closed_put(struct h2conn *h2, uint32_t id, int reset);
+static int h2_closed_find(struct h2conn *h2, uint32_t id);
+static void h2_stream_done(struct worker *w, struct conn *c,
+                           struct h2stream *s);
+static void h2_stream_close(struct worker *w, struct conn *c,
+                            struct h2stream *s);
+static int h2_fill(struct worker *w, struct conn *c);
+static struct h2stream *h2_next(struct h2conn *h2);
+static int h2_send_headers(struct worker *w, struct conn *c,
+                           struct h2stream *s);
+static int h2_indexed(const char *name);
+static int h2_send_data(struct worker *w, struct conn *c, struct h2stream *s);
+static int h2_more(struct conn *sc);
+static int h2_write(struct worker *w, struct conn *c);
+static int h2_sendfile(struct conn *c);
+static void h2_queue(struct h2conn *h2, int type, int flags, uint32_t id,
+                     const char *payload, size_t len);
+static void h2_reset(struct h2conn *h2, uint32_t id, uint32_t code);
+static void h2_goaway(struct h2conn *h2, uint32_t code);
+static void h2_fail(struct h2conn *h2, uint32_t code);
+
+/*
+ * h2_header - Write the header of a frame of type for stream id, with len
+ *     bytes of payload, to buf.
+ */
+void h2_header(char *buf, size_t len, int type, int flags, uint32_t id) {
+    unsigned char *p = (unsigned char *)buf;
+
+    p[0] = len >> 16;
+    p[1] = len >> 8;
+    p[2] = len;
+    p[3] = type;
+    p[4] = flags;
+    h2_put32(buf + 5, id & H2_MAXWINDOW);
+}
+
+/*
+ * h2_parse_header - Parse the frame header at buf into f. The reserved
+ *     bit of the stream is ignored.
+ */
+void h2_parse_header(const char *buf, struct h2_frame *f) {
+    const unsigned char *p = (const unsigned char *)buf;
+
+    f->len = (size_t)p[0] << 16 | p[1] << 8 | p[2];
+    f->type = p[3];
+    f->flags = p[4];
+    f->id = h2_get32(buf + 5) & H2_MAXWINDOW;
+}
+
+uint32_t h2_get32(const char *p) {
+    const unsigned char *q = (const unsigned char *)p;
+
+    return (uint32_t)q[0] << 24 | q[1] << 16 | q[2] << 8 | q[3];
+}
+
+void h2_put32(char *p, uint32_t v) {
+    unsigned char *q = (unsigned char *)p;
+
+    q[0] = v >> 24;
+    q[1] = v >> 16;
+    q[2] = v >> 8;
+    q[3] = v;
+}
+
+/*
+ * h2_setting - Write the setting id with value, as a SETTINGS frame
+ *     carries it, to buf. Returns its length.
+ */
+size_t h2_setting(char *buf, int id, uint32_t value) {
+    buf[0] = id >> 8;
+    buf[1] = id;
+    h2_put32(buf + 2, value);
+    return 6;
+}
+
+/*
+ * b64url - Return the 6 bits the base64url digit c stands for, or -1.
+ */
+static int b64url(int c) {
+    if (c >= 'A' && c <= 'Z')
+        return c - 'A';
+    if (c >= 'a' && c <= 'z')
+        return c - 'a' + 26;
+    if (c >= '0' && c <= '9')
+        return c - '0' + 52;
+    if (c == '-')
+        return 62;
+    if (c == '_')
+        return 63;
+    return -1;
+}
+
+/*
+ * h2_settings_decode - Decode the HTTP2-Settings header s of an upgrade,
+ *     the payload of a SETTINGS frame in base64url, into the size bytes
+ *     at buf. Returns its length, or -1 if it is malformed or too long.
+ */
+int h2_settings_decode(const struct http_slice *s, char *buf, size_t size) {
+    unsigned bits = 0;
+    size_t i, n = 0;
+    int nbits = 0, v;
+
+    for (i = 0; i < s->len && s->p[i] != '='; ++i) {
+        if ((v = b64url((unsigned char)s->p[i])) < 0)
+            return -1;
+        bits = bits << 6 | v;
+        if ((nbits += 6) >= 8) {
+            if (n == size)
+                return -1;
+            nbits -= 8;
+            buf[n++] = bits >> nbits;
+        }
+    }
+    return n % 6 == 0 ? (int)n : -1;
+}
+
+/*
+ * h2_priority - Parse the Priority header, or the field of a
+ *     PRIORITY_UPDATE frame, p[0, len) of RFC 9218, like "u=1, i".
+ *     Returns the urgency, 0 the most urgent and 7 the least, and tells
+ *     in *incremental whether the response is of use in pieces. What is
+ *     missing or malformed takes the defaults.
+ */
+int h2_priority(const char *p, size_t len, int *incremental) {
+    const char *end = p + len, *key;
+    int urgency = H2_URGENCY;
+
+    *incremental = 0;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            ++p;
+        for (key = p; p < end && *p != '=' && *p != ',' && *p != ';'; ++p)
+            ;
+        if (p - key == 1 && *key == 'u' && end - p >= 2 && *p == '='
+            && p[1] >= '0' && p[1] <= '7' && (end - p == 2 || p[2] == ','
+                                              || p[2] == ' ' || p[2] == ';'))
+            urgency = p[1] - '0';
+        else if (p - key == 1 && *key == 'i')
+            *incremental = p == end || *p != '='
+                           || (end - p >= 3 && memcmp(p, "=?1", 3) == 0);
+        while (p < end && *p != ',')
+            ++p;
+    }
+    return urgency;
+}
+
+/*
+ * h2_upgrade - Check if the request of c, parsed but not served, asks
+ *     to switch to HTTP/2 over cleartext with settings we can take. One
+ *     with a body isn't switched, the body would have to be read first.
+ */
+int h2_upgrade(struct conn *c) {
+    const struct http_slice *hdr, *settings;
+    char buf[H2_CONTROL * 6];
+
+    if (c->ssl != NULL
+        || (hdr = http_find_header(&c->req, "Upgrade")) == NULL
+        || !http_has_token(hdr, "h2c")
+        || (hdr = http_find_header(&c->req, "Connection")) == NULL
+        || !http_has_token(hdr, "Upgrade")
+        || !http_has_token(hdr, "HTTP2-Settings")
+        || (settings = http_find_header(&c->req, "HTTP2-Settings")) == NULL
+        || h2_settings_decode(settings, buf, sizeof(buf)) < 0)
+        return 0;
+    return !request_has_body(&c->req);
+}
+
+/*
+ * h2_start - Switch c of worker w to HTTP/2. It gets here with the
+ *     client preface in rbuf, after ALPN picked h2, or with a request
+ *     that asks to upgrade, which becomes stream 1 and is answered with
+ *     a 101 first. What rbuf holds past that is the first input. Returns
+ *     -1 on error.
+ */
+static int h2_start(struct worker *w, struct conn *c) {
+    struct h2conn *h2;
+    struct h2stream *s;
+    char buf[H2_CONTROL * 6];
+    size_t used = 0, n;
+    int len, err;
+
+    if ((h2 = pool_get(&w->h2conns)) == NULL) {
+        unix_err("pool_get error");
+        return -1;
+    }
+    h2->preface = H2_PREFACE_LEN;
+    h2->settings = 0;
+    h2->inlen = 0;
+    h2->blockid = 0;
+    h2->blockflags = 0;
+    h2->blocklen = 0;
+    hpack_table_init(&h2->decoder);
+    hpack_table_init(&h2->encoder);
+    h2->outpos = h2->outlen = 0;
+    h2->filestream = NULL;
+    h2->fileat = h2->filelen = 0;
+    h2->copyfiles = 0;
+    h2->window = h2->initwindow = H2_WINDOW;
+    h2->maxframe = H2_MAXFRAME;
+    h2->recvwindow = H2_WINDOW;
+    h2->lastid = 0;
+    h2->nclosed = 0;
+    h2->goaway = h2->peergoaway = h2->failed = 0;
+    h2->nstreams = h2->nserved = 0;
+    h2->turn = 0;
+    h2->streams = NULL;
+    c->h2 = h2;
+    metrics_count(COUNTER_H2_CONNS, 1);
+    /* Frames go out in pieces sized by flow control, the last one short. */
+    conn_nodelay(c);
+
+    if (c->req.pos > 0) {
+        n = snprintf(h2->out, H2_OUTBUF,
+                     "HTTP/1.1 101 Switching Protocols\r\n"
+                     "Connection: Upgrade\r\n"
+                     "Upgrade: h2c\r\n\r\n");
+        h2->outlen = n;
+    }
+
+    /* Our SETTINGS are the server preface. */
+    n = h2_setting(buf, H2_MAX_CONCURRENT_STREAMS, H2_STREAMS);
+    n += h2_setting(buf + n, H2_MAX_HEADER_LIST_SIZE, MAXBUF);
+    n += h2_setting(buf + n, H2_NO_RFC7540_PRIORITIES, 1);
+    h2_queue(h2, H2_SETTINGS, 0, 0, buf, n);
+
+    if (c->req.pos > 0) {
+        /* The settings of an upgrade are acknowledged by the switch. */
+        len = h2_settings_decode(http_find_header(&c->req, "HTTP2-Settings"),
+                                 buf, sizeof(buf));
+        if ((err = h2_settings(h2, buf, len)) != 0)
+            h2_fail(h2, err);
+        h2->lastid = 1;
+        used = c->req.pos;
+        if (h2->failed)
+            ;
+        else if ((s = h2_stream_new(w, c, 1)) == NULL)
+            h2_reset(h2, 1, H2_REFUSED_STREAM);
+        else {
+            s->remote_closed = 1;
+            memcpy(s->conn.rbuf, c->rbuf, used);
+            h2_serve(w, c, s, used);
+        }
+        http_request_init(&c->req);
+    }
+
+    if (c->buf != NULL) {
+        h2->inlen = c->rlen - used;
+        memcpy(h2->in, c->rbuf + used, h2->inlen);
+        conn_putbuf(w, c);
+    }
+    c->rlen = 0;
+    return 0;
+}
+
+/*
+ * h2_drive - Move HTTP/2 connection c of worker w as far as it can go
+ *     without blocking: handle the frames read, queue what the streams
+ *     have to send, send it and read more. Like conn_handle(), it runs
+ *     until the socket would block. Returns 1 to wait for the next event,
+ *     -1 if c is to be closed.
+ */
+int h2_drive(struct worker *w, struct conn *c) {
+    struct h2conn *h2;
+    ssize_t n;
+    int rc, pending, filled, blocked = 0;
+
+    if (c->h2 == NULL && h2_start(w, c) != 0)
+        return -1;
+    h2 = c->h2;
+    while (1) {
+        pending = h2_input(w, c);
+        filled = h2_fill(w, c);
+        if ((rc = h2_write(w, c)) < 0)
+            return -1;
+        if (rc == 0 && h2_finished(h2))
+            return -1;
+
+        if (!blocked && h2->inlen < H2_INBUF) {
+            n = conn_read(c, h2->in + h2->inlen, H2_INBUF - h2->inlen);
+            if (n > 0) {
+                h2->inlen += n;
+                continue;
+            }
+            if (n == 0)
+                return -1; /* EOF */
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return -1;
+            blocked = 1;
+        }
+        /* Everything went out, there may be more to send or to handle. */
+        if (rc == 0 && (pending || filled
+                        || (!blocked && h2->inlen == H2_INBUF)))
+            continue;
+        return 1;
+    }
+}
+
+/*
+ * h2_finished - Check if the connection of h2, whose frames are all sent,
+ *     is done: it failed, or it is going away and has no streams left.
+ */
+static int h2_finished(struct h2conn *h2) {
+    return h2->failed
+           || ((h2->goaway || h2->peergoaway) && h2->nstreams == 0);
+}
+
+/*
+ * h2_input - Handle the complete frames read on c, as long as there is
+ *     room left in out to answer them. The rest waits for more input or
+ *     for out to drain. Returns 1 if it stopped for room.
+ */
+static int h2_input(struct worker *w, struct conn *c) {
+    struct h2conn *h2 = c->h2;
+    struct h2_frame f;
+    size_t pos = 0, n;
+    int full = 0;
+
+    while (!h2->failed
+           && !(full = H2_OUTBUF - h2->outlen + h2->outpos < H2_CONTROL)) {
+        if (h2->preface > 0) {
+            n = h2->inlen - pos < h2->preface ? h2->inlen - pos
+                                               : h2->preface;
+            if (memcmp(h2->in + pos,
+                       H2_PREFACE + H2_PREFACE_LEN - h2->preface, n) != 0) {
+                h2_fail(h2, H2_PROTOCOL_ERROR);
+                break;
+            }
+            pos += n;
+            if ((h2->preface -= n) > 0)
+                break;
+            continue;
+        }
+        if (h2->inlen - pos < H2_FRAME_HEADER)
+            break;
+        h2_parse_header(h2->in + pos, &f);
+        if (f.len > H2_MAXFRAME) {
+            h2_fail(h2, H2_FRAME_SIZE_ERROR);
+            break;
+        }
+        if (h2->inlen - pos < H2_FRAME_HEADER + f.len)
+            break;
+        h2_handle(w, c, &f, h2->in + pos + H2_FRAME_HEADER);
+        pos += H2_FRAME_HEADER + f.len;
+    }
+
+    /* Nothing more is taken from a failed connection. */
+    if (h2->failed)
+        h2->inlen = 0;
+    else if (pos > 0) {
+        h2->inlen -= pos;
+        memmove(h2->in, h2->in + pos, h2->inlen);
+    }
+    return full && h2->inlen >= H2_FRAME_HEADER;
+}
+
+/*
+ * h2_handle - Handle frame f with payload p, read on c. Errors of the
+ *     connection make it fail, those of a stream reset the stream.
+ */
+static void h2_handle(struct worker *w, struct conn *c,
+                      const struct h2_frame *f, const char *p) {
+    struct h2conn *h2 = c->h2;
+    struct h2stream *s;
+    uint32_t id;
+    int err;
+
+    /* A header block goes on in CONTINUATION frames, and only in them. */
+    if (h2->blockid != 0
+        && (f->type != H2_CONTINUATION || f->id != h2->blockid)) {
+        h2_fail(h2, H2_PROTOCOL_ERROR);
+        return;
+    }
+    /* The client preface ends with its SETTINGS. */
+    if (!h2->settings
+        && (f->type != H2_SETTINGS || (f->flags & H2_ACK))) {
+        h2_fail(h2, H2_PROTOCOL_ERROR);
+        return;
+    }
+
+    switch (f->type) {
+    case H2_DATA:
+        h2_recv_data(w, c, f, p);
+        break;
+    case H2_HEADERS:
+        h2_recv_headers(w, c, f, p);
+        break;
+    case H2_PRIORITY:
+        /* The priority tree of RFC 7540 is deprecated, see RFC 9218. */
+        if (f->id == 0)
+            h2_fail(h2, H2_PROTOCOL_ERROR);
+        else if (f->len != 5)
+            h2_reset(h2, f->id, H2_FRAME_SIZE_ERROR);
+        break;
+    case H2_RST_STREAM:
+        if (f->id == 0 || f->id > h2->lastid)
+            h2_fail(h2, H2_PROTOCOL_ERROR);
+        else if (f->len != 4)
+            h2_fail(h2, H2_FRAME_SIZE_ERROR);
+        else if ((s = h2_stream_find(h2, f->id)) != NULL) {
+            s->remote_closed = 1;
+            h2_stream_close(w, c, s);
+        }
+        break;
+    case H2_SETTINGS:
+        if (f->id != 0)
+            h2_fail(h2, H2_PROTOCOL_ERROR);
+        else if ((f->flags & H2_ACK) ? f->len != 0 : f->len % 6 != 0)
+            h2_fail(h2, H2_FRAME_SIZE_ERROR);
+        else if (!(f->flags & H2_ACK)) {
+            if ((err = h2_settings(h2, p, f->len)) != 0) {
+                h2_fail(h2, err);
+                break;
+            }
+            h2->settings = 1;
+            h2_queue(h2, H2_SETTINGS, H2_ACK, 0, NULL, 0);
+        }
+        break;
+    case H2_PUSH_PROMISE:
+        h2_fail(h2, H2_PROTOCOL_ERROR); /* Clients don't push */
+        break;
+    case H2_PING:
+        if (f->id != 0)
+            h2_fail(h2, H2_PROTOCOL_ERROR);
+        else if (f->len != 8)
+            h2_fail(h2, H2_FRAME_SIZE_ERROR);
+        else if (!(f->flags & H2_ACK))
+            h2_queue(h2, H2_PING, H2_ACK, 0, p, 8);
+        break;
+    case H2_GOAWAY:
+        if (f->id != 0)
+            h2_fail(h2, H2_PROTOCOL_ERROR);
+        else if (f->len < 8)
+            h2_fail(h2, H2_FRAME_SIZE_ERROR);
+        else
+            h2->peergoaway = 1;
+        break;
+    case H2_WINDOW_UPDATE:
+        h2_recv_window(w, c, f, p);
+        break;
+    case H2_CONTINUATION:
+        if (h2->blockid == 0) {
+            h2_fail(h2, H2_PROTOCOL_ERROR);
+            break;
+        }
+        if (h2->blocklen + f->len > H2_BLOCK) {
+            h2_fail(h2, H2_ENHANCE_YOUR_CALM);
+            break;
+        }
+        memcpy(h2->block + h2->blocklen, p, f->len);
+        h2->blocklen += f->len;
+        if (f->flags & H2_END_HEADERS) {
+            id = h2->blockid;
+            h2->blockid = 0;
+            h2_recv_block(w, c, id, h2->blockflags, h2->block,
+                          h2->blocklen);
+        }
+        break;
+    case H2_PRIORITY_UPDATE:
+        if (f->id != 0)
+            h2_fail(h2, H2_PROTOCOL_ERROR);
+        else if (f->len < 4)
+            h2_fail(h2, H2_FRAME_SIZE_ERROR);
+        else if ((id = h2_get32(p) & H2_MAXWINDOW) == 0)
+            h2_fail(h2, H2_PROTOCOL_ERROR);
+        else if ((s = h2_stream_find(h2, id)) != NULL)
+            s->urgency = h2_priority(p + 4, f->len - 4, &s->incremental);
+        break;
+    default:
+        break; /* Unknown types are ignored */
+    }
+}
+
+/*
+ * h2_recv_data - Handle DATA frame f with payload p, read on c. Request
+ *     bodies are of no use to us, they are only taken into account for
+ *     flow control.
+ */
+static void h2_recv_data(struct worker *w, struct conn *c,
+                         const struct h2_frame *f, const char *p) {
+    struct h2conn *h2 = c->h2;
+    struct h2stream *s;
+    char buf[4];
+
+    if (f->id == 0) {
+        h2_fail(h2, H2_PROTOCOL_ERROR);
+        return;
+    }
+    if ((long)f->len > h2->recvwindow) {
+        h2_fail(h2, H2_FLOW_CONTROL_ERROR);
+        return;
+    }
+    if ((h2->recvwindow -= f->len) <= H2_WINDOW / 2) {
+        h2_put32(buf, H2_WINDOW - h2->recvwindow);
+        h2_queue(h2, H2_WINDOW_UPDATE, 0, 0, buf, 4);
+        h2->recvwindow = H2_WINDOW;
+    }
+    if ((f->flags & H2_PADDED)
+        && (f->len == 0 || (unsigned char)p[0] >= f->len)) {
+        h2_fail(h2, H2_PROTOCOL_ERROR);
+        return;
+    }
+
+    if ((s = h2_stream_find(h2, f->id)) == NULL) {
+        /* Streams we reset may still have frames on their way. */
+        if (f->id > h2->lastid)
+            h2_fail(h2, H2_PROTOCOL_ERROR);
+        else if (h2_closed_find(h2, f->id) == 0)
+            h2_reset(h2, f->id, H2_STREAM_CLOSED);
+        return;
+    }
+    if (s->remote_closed) {
+        h2_reset(h2, s->id, H2_STREAM_CLOSED);
+        h2_stream_close(w, c, s);
+        return;
+    }
+    if (f->flags & H2_END_STREAM)
+        s->remote_closed = 1;
+}
+
+/*
+ * h2_recv_headers - Handle HEADERS frame f with payload p, read on c. The
+ *     header block is decoded once it is complete, which may take
+ *     CONTINUATION frames.
+ */
+static void h2_recv_headers(struct worker *w, struct conn *c,
+                            const struct h2_frame *f, const char *p) {
+    struct h2conn *h2 = c->h2;
+    size_t off = 0, pad = 0;
+
+    if (f->id == 0 || f->id % 2 == 0) {
+        h2_fail(h2, H2_PROTOCOL_ERROR);
+        return;
+    }
+    if (f->flags & H2_PADDED) {
+        if (f->len == 0) {
+            h2_fail(h2, H2_PROTOCOL_ERROR);
+            return;
+        }
+        pad = (unsigned char)p[0];
+        off = 1;
+    }
+    if (f->flags & H2_PRIORITY_FLAG)
+        off += 5;
+    if (off + pad > f->len) {
+        h2_fail(h2, H2_PROTOCOL_ERROR);
+        return;
+    }
+
+    if (f->flags & H2_END_HEADERS) {
+        h2_recv_block(w, c, f->id, f->flags, p + off, f->len - off - pad);
+        return;
+    }
+    h2->blockid = f->id;
+    h2->blockflags = f->flags;
+    h2->blocklen = f->len - off - pad;
+    memcpy(h2->block, p + off, h2->blocklen);
+}
+
+/*
+ * h2_recv_block - Decode the complete header block of stream id, whose
+ *     HEADERS came with flags, and open the stream with it. Trailers are
+ *     decoded too, for the dynamic table, and dropped. A block that comes
+ *     too late is decoded as well, and answered as RFC 9113 5.1 says.
+ */
+static void h2_recv_block(struct worker *w, struct conn *c, uint32_t id,
+                          int flags, const char *block, size_t len) {
+    struct h2conn *h2 = c->h2;
+    struct hpack_field fields[H2_MAXFIELDS];
+    struct h2stream *s;
+    char buf[MAXBUF];
+    int n;
+
+    if ((n = hpack_decode(&h2->decoder, block, len, buf, sizeof(buf),
+                          fields, H2_MAXFIELDS)) < 0) {
+        h2_fail(h2, n == HPACK_TOOBIG ? H2_ENHANCE_YOUR_CALM
+                                      : H2_COMPRESSION_ERROR);
+        return;
+    }
+
+    if ((s = h2_stream_find(h2, id)) != NULL) {
+        if (s->remote_closed || !(flags & H2_END_STREAM)) {
+            h2_reset(h2, id, s->remote_closed ? H2_STREAM_CLOSED
+                                              : H2_PROTOCOL_ERROR);
+            h2_stream_close(w, c, s);
+        }
+        else
+            s->remote_closed = 1;
+        return;
+    }
+    if (id <= h2->lastid) {
+        /*
+         * Trailers may still be on their way on a stream we reset, and
+         * streams opened after our GOAWAY are ignored. The client ended
+         * the others, or skipped their ids, which can't be used again.
+         */
+        if (h2->goaway)
+            return;
+        switch (h2_closed_find(h2, id)) {
+        case 1:  break;
+        case 0:  h2_reset(h2, id, H2_STREAM_CLOSED); break;
+        default: h2_fail(h2, H2_PROTOCOL_ERROR); break;
+        }
+        return;
+    }
+    h2->lastid = id;
+    /* Streams opened after our GOAWAY are ignored. */
+    if (h2->goaway)
+        return;
+    if (h2->nstreams >= H2_STREAMS) {
+        h2_reset(h2, id, H2_REFUSED_STREAM);
+        return;
+    }
+    h2_request(w, c, id, flags & H2_END_STREAM, fields, n);
+}
+
+/*
+ * h2_recv_window - Handle WINDOW_UPDATE frame f with payload p, read on c.
+ */
+static void h2_recv_window(struct worker *w, struct conn *c,
+                           const struct h2_frame *f, const char *p) {
+    struct h2conn *h2 = c->h2;
+    struct h2stream *s;
+    long inc;
+
+    if (f->len != 4) {
+        h2_fail(h2, H2_FRAME_SIZE_ERROR);
+        return;
+    }
+    inc = h2_get32(p) & H2_MAXWINDOW;
+    if (f->id == 0) {
+        if (inc == 0)
+            h2_fail(h2, H2_PROTOCOL_ERROR);
+        else if (h2->window + inc > H2_MAXWINDOW)
+            h2_fail(h2, H2_FLOW_CONTROL_ERROR);
+        else
+            h2->window += inc;
+        return;
+    }
+    if ((s = h2_stream_find(h2, f->id)) == NULL) {
+        if (f->id > h2->lastid)
+            h2_fail(h2, H2_PROTOCOL_ERROR);
+        return;
+    }
+    if (inc == 0 || s->window + inc > H2_MAXWINDOW) {
+        h2_reset(h2, s->id, inc == 0 ? H2_PROTOCOL_ERROR
+                                     : H2_FLOW_CONTROL_ERROR);
+        h2_stream_close(w, c, s);
+        return;
+    }
+    s->window += inc;
+}
+
+/*
+ * h2_settings - Apply the len bytes of settings at p from the client.
+ *     Returns 0, or the error code of a setting we can't take.
+ */
+static int h2_settings(struct h2conn *h2, const char *p, size_t len) {
+    struct h2stream *s;
+    uint32_t value;
+    size_t i;
+    int id;
+
+    for (i = 0; i + 6 <= len; i += 6) {
+        id = (unsigned char)p[i] << 8 | (unsigned char)p[i + 1];
+        value = h2_get32(p + i + 2);
+        switch (id) {
+        case H2_HEADER_TABLE_SIZE:
+            hpack_table_resize(&h2->encoder, value);
+            break;
+        case H2_ENABLE_PUSH:
+            if (value > 1)
+                return H2_PROTOCOL_ERROR;
+            break;
+        case H2_INITIAL_WINDOW_SIZE:
+            if (value > H2_MAXWINDOW)
+                return H2_FLOW_CONTROL_ERROR;
+            /* Open streams take the change, it may leave them owing. */
+            for (s = h2->streams; s != NULL; s = s->next) {
+                s->window += (long)value - h2->initwindow;
+                if (s->window > H2_MAXWINDOW)
+                    return H2_FLOW_CONTROL_ERROR;
+            }
+            h2->initwindow = value;
+            break;
+        case H2_MAX_FRAME_SIZE:
+            if (value < H2_MAXFRAME || value > 0xffffff)
+                return H2_PROTOCOL_ERROR;
+            h2->maxframe = value;
+            break;
+        default:
+            break;
+        }
+    }
+    return 0;
+}
+
+/*
+ * h2_request - Open stream id of c with the n decoded fields of its
+ *     request, end set if it has no body. They are checked as RFC 9113
+ *     asks, so that what passes makes a valid HTTP/1.1 head, which is
+ *     served like any other. A malformed request resets the stream.
+ */
+static void h2_request(struct worker *w, struct conn *c, uint32_t id, int end,
+                       const struct hpack_field *fields, int n) {
+    static const char *const banned[] = {
+        "connection", "keep-alive", "proxy-connection", "transfer-encoding",
+        "upgrade", NULL
+    };
+    const struct hpack_field *method = NULL, *scheme = NULL, *path = NULL;
+    const struct hpack_field *authority = NULL, *f, **pseudo;
+    struct h2stream *s;
+    char *buf;
+    size_t len;
+    int i, j, regular = 0, host = 0;
+
+    for (i = 0; i < n; ++i) {
+        f = &fields[i];
+        if (!h2_value_ok(f->value, f->valuelen))
+            goto malformed;
+        if (f->namelen > 0 && f->name[0] == ':') {
+            /* Pseudo-headers come first, once each. */
+            if (regular)
+                goto malformed;
+            if (f->namelen == 7 && memcmp(f->name, ":method", 7) == 0)
+                pseudo = &method;
+            else if (f->namelen == 7 && memcmp(f->name, ":scheme", 7) == 0)
+                pseudo = &scheme;
+            else if (f->namelen == 5 && memcmp(f->name, ":path", 5) == 0)
+                pseudo = &path;
+            else if (f->namelen == 10
+                     && memcmp(f->name, ":authority", 10) == 0)
+                pseudo = &authority;
+            else
+                goto malformed;
+            if (*pseudo != NULL)
+                goto malformed;
+            *pseudo = f;
+            continue;
+        }
+        regular = 1;
+        if (!h2_token(f->name, f->namelen, 1))
+            goto malformed;
+        for (j = 0; banned[j] != NULL; ++j) {
+            if (f->namelen == strlen(banned[j])
+                && memcmp(f->name, banned[j], f->namelen) == 0)
+                goto malformed;
+        }
+        if (f->namelen == 2 && memcmp(f->name, "te", 2) == 0
+            && (f->valuelen != 8 || memcmp(f->value, "trailers", 8) != 0))
+            goto malformed;
+        if (f->namelen == 4 && memcmp(f->name, "host", 4) == 0)
+            host = 1;
+    }
+    /* CONNECT has no path, and we don't tunnel. */
+    if (method == NULL || scheme == NULL || path == NULL
+        || !h2_token(method->value, method->valuelen, 0)
+        || path->valuelen == 0 || memchr(path->value, ' ', path->valuelen))
+        goto malformed;
+
+    if ((s = h2_stream_new(w, c, id)) == NULL) {
+        h2_reset(c->h2, id, H2_REFUSED_STREAM);
+        return;
+    }
+    s->remote_closed = end;
+
+    /* The head is built as if it came over HTTP/1.1, 0 if it won't fit. */
+    buf = s->conn.rbuf;
+    len = snprintf(buf, MAXBUF, "%.*s %.*s HTTP/1.1\r\n",
+                   (int)method->valuelen, method->value,
+                   (int)path->valuelen, path->value);
+    if (authority != NULL && !host && len < MAXBUF)
+        len += snprintf(buf + len, MAXBUF - len, "Host: %.*s\r\n",
+                        (int)authority->valuelen, authority->value);
+    for (i = 0; i < n && len < MAXBUF; ++i) {
+        if (fields[i].name[0] != ':')
+            len += snprintf(buf + len, MAXBUF - len, "%.*s: %.*s\r\n",
+                            (int)fields[i].namelen, fields[i].name,
+                            (int)fields[i].valuelen, fields[i].value);
+    }
+    if (len < MAXBUF)
+        len += snprintf(buf + len, MAXBUF - len, "\r\n");
+    h2_serve(w, c, s, len < MAXBUF ? len : 0);
+    return;
+
+malformed:
+    h2_reset(c->h2, id, H2_PROTOCOL_ERROR);
+}
+
+/*
+ * h2_token - Check that p[0, len) is a token, without uppercase letters
+ *     if lower is set, as field names on HTTP/2 must be.
+ */
+static int h2_token(const char *p, size_t len, int lower) {
+    size_t i;
+
+    if (len == 0)
+        return 0;
+    for (i = 0; i < len; ++i) {
+        if (!isgraph((unsigned char)p[i])
+            || (lower && isupper((unsigned char)p[i]))
+            || strchr("\"(),/:;<=>?@[\\]{}", p[i]) != NULL)
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * h2_value_ok - Check that field value p[0, len) has none of the
+ *     characters HTTP/2 forbids, which would end a line of HTTP/1.1.
+ */
+static int h2_value_ok(const char *p, size_t len) {
+    size_t i;
+
+    for (i = 0; i < len; ++i) {
+        if (p[i] == '\0' || p[i] == '\r' || p[i] == '\n')
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * h2_serve - Serve the request of stream s of c, the len bytes of
+ *     HTTP/1.1 head in its rbuf, 0 if it didn't fit. The response waits
+ *     in s for h2_fill(). After keepalive_requests streams, the client is
+ *     told to open no more.
+ */
+static void h2_serve(struct worker *w, struct conn *c, struct h2stream *s,
+                     size_t len) {
+    struct h2conn *h2 = c->h2;
+    struct conn *sc = &s->conn;
+    const struct http_slice *hdr;
+    uint64_t start;
+    int rc = 0;
+
+    metrics_count(COUNTER_H2_STREAMS, 1);
+    start = metrics_now();
+    if (len > 0)
+        rc = http_parse_request(&sc->req, sc->rbuf, len);
+    sc->wstart = metrics_now();
+    metrics_time(STAGE_PARSE, sc->wstart - start);
+
+    if (rc <= 0) {
+        if (len > 0)
+            clienterror(sc, "request head", "400", "Bad Request",
+                        "We couldn't parse the request head");
+        else
+            clienterror(sc, "request head", "431",
+                        "Request Header Fields Too Large",
+                        "The request head doesn't fit our buffer");
+        accesslog_request(&sc->peer, NULL, sc->status, sc->bodylen);
+    }
+    else {
+        metrics_count(COUNTER_REQUESTS, 1);
+        /* The log tells which protocol the request came over. */
+        if (sc->req.version.len == 8)
+            memcpy(sc->req.version.p, "HTTP/2.0", 8);
+        if ((hdr = http_find_header(&sc->req, "Priority")) != NULL)
+            s->urgency = h2_priority(hdr->p, hdr->len, &s->incremental);
+        doit(sc, &sc->req);
+        if (s->http11) {
+            h2_reset(h2, s->id, H2_HTTP_1_1_REQUIRED);
+            h2_stream_close(w, c, s);
+        }
+        else
+            accesslog_request(&sc->peer, &sc->req, sc->status, sc->bodylen);
+    }
+    start = sc->wstart;
+    sc->wstart = metrics_now();
+    metrics_time(STAGE_RESOLVE, sc->wstart - start);
+
+    if ((++h2->nserved >= keepalive_requests || drainflag) && !h2->goaway)
+        h2_goaway(h2, H2_NO_ERROR);
+}
+
+/*
+ * h2_stream_new - Open stream id of c, with buffers from worker w.
+ *     Returns NULL on error.
+ */
+static struct h2stream *h2_stream_new(struct worker *w, struct conn *c,
+                                      uint32_t id) {
+    struct h2conn *h2 = c->h2;
+    struct h2stream *s;
+
+    if ((s = pool_get(&w->h2streams)) == NULL) {
+        unix_err("pool_get error");
+        return NULL;
+    }
+    conn_init(&s->conn, -1, &c->peer);
+    if (conn_getbuf(w, &s->conn) != 0) {
+        pool_put(&w->h2streams, s);
+        return NULL;
+    }
+    s->conn.state = CONN_WRITE;
+    s->conn.stream = s;
+    s->id = id;
+    s->window = h2->initwindow;
+    s->urgency = H2_URGENCY;
+    s->incremental = 0;
+    s->turn = 0;
+    s->started = s->ended = s->reset = 0;
+    s->remote_closed = 0;
+    s->http11 = 0;
+    s->next = h2->streams;
+    h2->streams = s;
+    h2->nstreams++;
+    return s;
+}
+
+static struct h2stream *h2_stream_find(struct h2conn *h2, uint32_t id) {
+    struct h2stream *s;
+
+    for (s = h2->streams; s != NULL && s->id != id; s = s->next)
+        ;
+    return s;
+}
+
+/*
+ * h2_closed_put - Remember that stream id is closed, and if reset, that
+ *     we reset it. Closing a stream right after resetting it keeps the
+ *     one entry.
+ */
+static void h2_closed_put(struct h2conn *h2, uint32_t id, int reset) {
+    uint32_t *last = &h2->closed[(h2->nclosed - 1) % H2_CLOSED];
+
+    if (h2->nclosed > 0 && (*last & ~H2_WE_RESET) == id) {
+        if (reset)
+            *last |= H2_WE_RESET;
+        return;
+    }
+    h2->closed[h2->nclosed++ % H2_CLOSED] = id | (reset ? H2_WE_RESET : 0);
+}
+
+/*
+ * h2_closed_find - Check how stream id was closed, if it was lately.
+ *     Returns 1 if we reset it, 0 if it closed otherwise, and -1 if we
+ *     don't remember it.
+ */
+static int h2_closed_find(struct h2conn *h2, uint32_t id) {
+    unsigned i, n = h2->nclosed < H2_CLOSED ? h2->nclosed : H2_CLOSED;
+    int rc = -1;
+
+    /* A stream reset while still open is in twice. */
+    for (i = 0; i < n; ++i) {
+        if ((h2->closed[i] & ~H2_WE_RESET) != id)
+            continue;
+        if (h2->closed[i] & H2_WE_RESET)
+            return 1;
+        rc = 0;
+    }
+    return rc;
+}
+
+/*
+ * h2_stream_done - Finish stream s of c, whose response is all queued. A
+ *     client still sending its request is told to stop.
+ */
+static void h2_stream_done(struct worker *w, struct conn *c,
+                           struct h2stream *s) {
+    metrics_time(STAGE_WRITE, metrics_now() - s->conn.wstart);
+    metrics_status(s->conn.status);
+    if (!s->remote_closed)
+        h2_reset(c->h2, s->id, H2_NO_ERROR);
+    h2_stream_close(w, c, s);
+}
+
+/*
+ * h2_stream_close - Free stream s of c and its response. One whose file
+ *     bytes are queued is only marked, and freed once they are sent.
+ */
+static void h2_stream_close(struct worker *w, struct conn *c,
+                            struct h2stream *s) {
+    struct h2conn *h2 = c->h2;
+    struct h2stream **pp;
+
+    if (s == h2->filestream) {
+        s->reset = 1;
+        return;
+    }
+    for (pp = &h2->streams; *pp != s; pp = &(*pp)->next)
+        ;
+    *pp = s->next;
+    h2->nstreams--;
+    h2_closed_put(h2, s->id, 0);
+    conn_done(&s->conn);
+    if (s->conn.buf != NULL)
+        conn_putbuf(w, &s->conn);
+    pool_put(&w->h2streams, s);
+}
+
+/*
+ * h2_fill - Queue the frames of responses on c, once the ones before are
+ *     sent, until out is full or a file is up. Returns 1 if it queued any,
+ *     or if it has to wait for out to drain first.
+ */
+static int h2_fill(struct worker *w, struct conn *c) {
+    struct h2conn *h2 = c->h2;
+    struct h2stream *s;
+
+    if (h2->failed)
+        return 0;
+    if (h2->outpos < h2->outlen || h2->filestream != NULL)
+        return 1;
+    h2->outpos = h2->outlen = 0;
+    while (H2_OUTBUF - H2_RESERVE - h2->outlen > H2_FRAME_HEADER
+           && (s = h2_next(h2)) != NULL) {
+        if (!s->started ? h2_send_headers(w, c, s)
+                        : h2_send_data(w, c, s))
+            break;
+    }
+    return h2->outlen > 0;
+}
+
+/*
+ * h2_next - Pick the stream of h2 to queue a frame of next. Heads go
+ *     first, they are small and don't wait for the flow control window.
+ *     Bodies go by urgency, and within one the bodies clients use whole
+ *     one after the other, oldest stream first, before those they use as
+ *     they come, which take turns. Returns NULL if none can send.
+ */
+static struct h2stream *h2_next(struct h2conn *h2) {
+    struct h2stream *s, *best = NULL;
+
+    for (s = h2->streams; s != NULL; s = s->next) {
+        if (s->ended || s->reset)
+            continue;
+        if (!s->started)
+            return s;
+        if (s->window <= 0 || h2->window <= 0)
+            continue;
+        if (best == NULL || s->urgency < best->urgency)
+            best = s;
+        else if (s->urgency > best->urgency)
+            continue;
+        else if (s->incremental != best->incremental) {
+            if (!s->incremental)
+                best = s;
+        }
+        else if (!s->incremental ? s->id < best->id : s->turn < best->turn)
+            best = s;
+    }
+    return best;
+}
+
+/*
+ * h2_send_headers - Queue the HEADERS frame of the response of stream s of
+ *     c. The head built for HTTP/1.1 is parsed back and encoded, without
+ *     the fields about the connection. Returns 1 if out has no room for
+ *     it, as the dynamic table can't be undone once it is encoded.
+ */
+static int h2_send_headers(struct worker *w, struct conn *c,
+                           struct h2stream *s) {
+    struct h2conn *h2 = c->h2;
+    struct conn *sc = &s->conn;
+    struct http_response resp;
+    const struct http_slice *conn;
+    struct http_header *hdr;
+    char head[MAXBUF], name[MAXLINE], status[4], *dst;
+    size_t len = 0, n, room;
+    int i, rc, flags = H2_END_HEADERS;
+
+    for (i = sc->iovpos; i < sc->iovcnt && len < sizeof(head); ++i) {
+        n = sc->iov[i].iov_len < sizeof(head) - len ? sc->iov[i].iov_len
+                                                     : sizeof(head) - len;
+        memcpy(head + len, sc->iov[i].iov_base, n);
+        len += n;
+    }
+    http_response_init(&resp);
+    if ((rc = http_parse_response(&resp, head, len)) <= 0) {
+        h2_reset(h2, s->id, H2_INTERNAL_ERROR);
+        h2_stream_close(w, c, s);
+        return 0;
+    }
+    /* Encoding never takes more than twice the text. */
+    room = H2_OUTBUF - H2_RESERVE - h2->outlen - H2_FRAME_HEADER;
+    if (room < 2 * (size_t)rc + 32)
+        return 1;
+    iov_skip(sc->iov, &sc->iovpos, sc->iovcnt, rc);
+
+    dst = h2->out + h2->outlen + H2_FRAME_HEADER;
+    n = hpack_encode_start(&h2->encoder, dst, room);
+    snprintf(status, sizeof(status), "%03d", resp.status);
+    n += hpack_encode(&h2->encoder, dst + n, room - n, ":status", 7,
+                      status, 3, 1);
+    conn = http_find(resp.headers, resp.nheaders, "Connection");
+    for (i = 0; i < resp.nheaders; ++i) {
+        hdr = &resp.headers[i];
+        if (hop_by_hop(&hdr->name, conn)
+            || http_slice_caseeq(&hdr->name, "Transfer-Encoding")
+            || hdr->name.len >= sizeof(name))
+            continue;
+        for (len = 0; len < hdr->name.len; ++len)
+            name[len] = tolower((unsigned char)hdr->name.p[len]);
+        name[len] = '\0';
+        n += hpack_encode(&h2->encoder, dst + n, room - n, name, len,
+                          hdr->value.p, hdr->value.len, h2_indexed(name));
+    }
+
+    s->started = 1;
+    if (!h2_more(sc)) {
+        flags |= H2_END_STREAM;
+        s->ended = 1;
+    }
+    h2_header(h2->out + h2->outlen, n, H2_HEADERS, flags, s->id);
+    h2->outlen += H2_FRAME_HEADER + n;
+    if (s->ended)
+        h2_stream_done(w, c, s);
+    return 0;
+}
+
+/*
+ * h2_indexed - Check if a response field called name is worth adding to
+ *     the dynamic table. Those that change from file to file would only
+ *     push out those that repeat.
+ */
+static int h2_indexed(const char *name) {
+    static const char *const once[] = {
+        "content-length", "content-range", "etag", "last-modified", NULL
+    };
+    int i;
+
+    for (i = 0; once[i] != NULL; ++i) {
+        if (strcmp(name, once[i]) == 0)
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * h2_send_data - Queue a DATA frame of the body of stream s of c, as large
+ *     as the flow control windows and out let it be. In-memory bytes are
+ *     copied into out. File bytes are sent from the file after out, with
+ *     sendfile(2), unless they must pass through user space anyway, then
+ *     they are read into out. Returns 1 after a frame of file bytes, which
+ *     has to be the last in out.
+ */
+static int h2_send_data(struct worker *w, struct conn *c, struct h2stream *s) {
+    struct h2conn *h2 = c->h2;
+    struct conn *sc = &s->conn;
+    char *dst = h2->out + h2->outlen + H2_FRAME_HEADER;
+    long avail = H2_OUTBUF - H2_RESERVE - h2->outlen - H2_FRAME_HEADER;
+    size_t n = 0, len;
+    ssize_t rc;
+    int flags = 0;
+
+    if (avail > h2->window)
+        avail = h2->window;
+    if (avail > s->window)
+        avail = s->window;
+    if (avail > (long)h2->maxframe)
+        avail = h2->maxframe;
+
+    /* The frame before may have ended a part, this one takes the next. */
+    h2_more(sc);
+    if (sc->iovpos < sc->iovcnt) {
+        while (sc->iovpos < sc->iovcnt && n < (size_t)avail) {
+            len = sc->iov[sc->iovpos].iov_len;
+            if (len > avail - n)
+                len = avail - n;
+            memcpy(dst + n, sc->iov[sc->iovpos].iov_base, len);
+            iov_skip(sc->iov, &sc->iovpos, sc->iovcnt, len);
+            n += len;
+        }
+    }
+    else {
+        len = sc->fileend - sc->fileoff;
+        n = len < (size_t)avail ? len : (size_t)avail;
+        if (!h2->copyfiles && (c->ssl == NULL || c->ktls)) {
+            if (n == len && sc->partpos == sc->nparts) {
+                flags = H2_END_STREAM;
+                s->ended = 1;
+            }
+            h2_header(h2->out + h2->outlen, n, H2_DATA, flags, s->id);
+            h2->outlen += H2_FRAME_HEADER;
+            h2->filestream = s;
+            h2->fileat = h2->outlen;
+            h2->filelen = n;
+            h2->window -= n;
+            s->window -= n;
+            s->turn = ++h2->turn;
+            return 1;
+        }
+        if ((rc = pread(sc->filefd, dst, n, sc->fileoff)) <= 0) {
+            h2_reset(h2, s->id, H2_INTERNAL_ERROR);
+            h2_stream_close(w, c, s);
+            return 0;
+        }
+        n = rc;
+        sc->fileoff += n;
+    }
+
+    if (!h2_more(sc)) {
+        flags = H2_END_STREAM;
+        s->ended = 1;
+    }
+    h2_header(h2->out + h2->outlen, n, H2_DATA, flags, s->id);
+    h2->outlen += H2_FRAME_HEADER + n;
+    h2->window -= n;
+    s->window -= n;
+    s->turn = ++h2->turn;
+    if (s->ended)
+        h2_stream_done(w, c, s);
+    return 0;
+}
+
+/*
+ * h2_more - Check if any of the body of stream connection sc is left to
+ *     queue, moving on to the next part of a multipart body if need be.
+ */
+static int h2_more(struct conn *sc) {
+    while (sc->iovpos == sc->iovcnt && sc->fileoff == sc->fileend) {
+        if (!conn_next_part(sc))
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * h2_write - Send the frames queued on c, with the file bytes of a DATA
+ *     frame in between. Returns like conn_flush().
+ */
+static int h2_write(struct worker *w, struct conn *c) {
+    struct h2conn *h2 = c->h2;
+    struct h2stream *s;
+    struct msghdr msg;
+    struct iovec iov;
+    size_t end;
+    ssize_t n;
+    int rc;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    while (1) {
+        end = h2->filestream != NULL ? h2->fileat : h2->outlen;
+        while (h2->outpos < end) {
+            iov.iov_base = h2->out + h2->outpos;
+            iov.iov_len = end - h2->outpos;
+            n = conn_sendmsg(c, &msg, h2->filestream != NULL ? MSG_MORE : 0);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return 1;
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            metrics_count(COUNTER_BYTES, n);
+            h2->outpos += n;
+        }
+        if (h2->filestream == NULL)
+            break;
+
+        if ((rc = h2_sendfile(c)) != 0)
+            return rc;
+        s = h2->filestream;
+        h2->filestream = NULL;
+        if (s->reset)
+            h2_stream_close(w, c, s);
+        else if (s->ended)
+            h2_stream_done(w, c, s);
+    }
+    h2->outpos = h2->outlen = 0;
+    return 0;
+}
+
+/*
+ * h2_sendfile - Send the file bytes of the DATA frame queued on c. Files
+ *     sendfile(2) can't read are copied, for this frame and the next.
+ *     Returns like conn_flush().
+ */
+static int h2_sendfile(struct conn *c) {
+    struct h2conn *h2 = c->h2;
+    struct conn *sc = &h2->filestream->conn;
+    char buf[TLS_RECORD];
+    struct msghdr msg;
+    struct iovec iov;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    while (h2->filelen > 0) {
+        if (!h2->copyfiles)
+            n = conn_sendfile(c, sc->filefd, &sc->fileoff, h2->filelen);
+        else if ((n = pread(sc->filefd, buf, h2->filelen < sizeof(buf)
+                                             ? h2->filelen : sizeof(buf),
+                            sc->fileoff)) > 0) {
+            iov.iov_base = buf;
+            iov.iov_len = n;
+            if ((n = conn_sendmsg(c, &msg, 0)) > 0)
+                sc->fileoff += n;
+        }
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 1;
+            if (errno == EINTR)
+                continue;
+            if ((errno == EINVAL || errno == ENOSYS) && !h2->copyfiles) {
+                h2->copyfiles = 1;
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0)
+            return -1; /* The file shrank under us */
+        metrics_count(COUNTER_BYTES, n);
+        h2->filelen -= n;
+    }
+    return 0;
+}
+
+/*
+ * h2_queue - Queue a frame with len bytes of payload on the connection of
+ *     h2. If there is no room, which the callers see to, it fails.
+ */
+static void h2_queue(struct h2conn *h2, int type, int flags, uint32_t id,
+                     const char *payload, size_t len) {
+    if (H2_OUTBUF - h2->outlen < H2_FRAME_HEADER + len && h2->outpos > 0) {
+        h2->outlen -= h2->outpos;
+        memmove(h2->out, h2->out + h2->outpos, h2->outlen);
+        if (h2->filestream != NULL)
+            h2->fileat -= h2->outpos;
+        h2->outpos = 0;
+    }
+    if (H2_OUTBUF - h2->outlen < H2_FRAME_HEADER + len) {
+        h2->failed = 1;
+        return;
+    }
+    h2_header(h2->out + h2->outlen, len, type, flags, id);
+    if (len > 0)
+        memcpy(h2->out + h2->outlen + H2_FRAME_HEADER, payload, len);
+    h2->outlen += H2_FRAME_HEADER + len;
+}
+
+static void h2_reset(struct h2conn *h2, uint32_t id, uint32_t code) {
+    char buf[4];
+
+    h2_closed_put(h2, id, 1);
+    h2_put32(buf, code);
+    h2_queue(h2, H2_RST_STREAM, 0, id, buf, 4);
+}
+
+/*
+ * h2_goaway - Tell the client of h2 to open no more streams, and why.
+ *     Those it has opened are still served.
+ */
+static void h2_goaway(struct h2conn *h2, uint32_t code) {
+    char buf[8];
+
+    h2_put32(buf, h2->lastid);
+    h2_put32(buf + 4, code);
+    h2_queue(h2, H2_GOAWAY, 0, 0, buf, 8);
+    h2->goaway = 1;
+}
+
+/*
+ * h2_fail - Give up on the connection of h2 after an error of the
+ *     connection: the client is told why, and it is closed once that is
+ *     sent.
+ */
+static void h2_fail(struct h2conn *h2, uint32_t code) {
+    if (h2->failed)
+        return;
+    h2_goaway(h2, code);
+    h2->failed = 1;
+}
+
+/*
+ * h2_free - Free the HTTP/2 state of c and its streams, back to worker w.
+ */
+void h2_free(struct worker *w, struct conn *c) {
+    struct h2conn *h2 = c->h2;
+
+    h2->filestream = NULL;
+    while (h2->streams != NULL)
+        h2_stream_close(w, c, h2->streams);
+    pool_put(&w->h2conns, h2);
+    c->h2 = NULL;
+}
+
+/*
+ * h2_drain - Tell the client of c to open no more streams, as the server
+ *     is going away, and move the connection on. Returns like h2_drive().
+ */
+int h2_drain(struct worker *w, struct conn *c) {
+    if (!c->h2->goaway)
+        h2_goaway(c->h2, H2_NO_ERROR);
+    return h2_drive(w, c);
+}
+
+/*
+ * h2_require_http11 - Have the stream that c stands for reset with
+ *     HTTP_1_1_REQUIRED once its request is handled, instead of served.
+ */
+void h2_require_http11(struct conn *c) {
+    c->stream->http11 = 1;
+}
+
+/*
+ * h2_worker_setup - Set up the pools of HTTP/2 states of worker w. It
+ *     runs in the thread of w.
+ */
+void h2_worker_setup(struct worker *w) {
+    pool_init(&w->h2conns, sizeof(struct h2conn), 1, H2CONN_KEEP);
+    pool_init(&w->h2streams, sizeof(struct h2stream), H2STREAM_SLAB, 0);
+}
+
+/*
+ * h2_worker_stop - Free the pools of HTTP/2 states of worker w, once its
+ *     connections are gone.
+ */
+void h2_worker_stop(struct worker *w) {
+    pool_destroy(&w->h2conns);
+    pool_destroy(&w->h2streams);
+}
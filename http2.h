@@ -0,0 +1,84 @@
+#ifndef _HTTP2_H
+#define _HTTP2_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "http-parser.h"
+
+#define H2_PREFACE       "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN   24
+#define H2_FRAME_HEADER  9
+#define H2_MAXFRAME      16384  /* Largest frame we take, the default */
+#define H2_WINDOW        65535  /* Initial flow control window */
+#define H2_MAXWINDOW     0x7fffffff
+#define H2_URGENCY       3      /* Default urgency of a response */
+
+/* Frame types, from RFC 9113 and PRIORITY_UPDATE from RFC 9218. */
+#define H2_DATA             0x0
+#define H2_HEADERS          0x1
+#define H2_PRIORITY         0x2
+#define H2_RST_STREAM       0x3
+#define H2_SETTINGS         0x4
+#define H2_PUSH_PROMISE     0x5
+#define H2_PING             0x6
+#define H2_GOAWAY           0x7
+#define H2_WINDOW_UPDATE    0x8
+#define H2_CONTINUATION     0x9
+#define H2_PRIORITY_UPDATE  0x10
+
+/* Frame flags. */
+#define H2_END_STREAM   0x1
+#define H2_ACK          0x1
+#define H2_END_HEADERS  0x4
+#define H2_PADDED       0x8
+#define H2_PRIORITY_FLAG  0x20
+
+/* Settings. */
+#define H2_HEADER_TABLE_SIZE       0x1
+#define H2_ENABLE_PUSH             0x2
+#define H2_MAX_CONCURRENT_STREAMS  0x3
+#define H2_INITIAL_WINDOW_SIZE     0x4
+#define H2_MAX_FRAME_SIZE          0x5
+#define H2_MAX_HEADER_LIST_SIZE    0x6
+#define H2_NO_RFC7540_PRIORITIES   0x9
+
+/* Error codes of RST_STREAM and GOAWAY. */
+#define H2_NO_ERROR             0x0
+#define H2_PROTOCOL_ERROR       0x1
+#define H2_INTERNAL_ERROR       0x2
+#define H2_FLOW_CONTROL_ERROR   0x3
+#define H2_STREAM_CLOSED        0x5
+#define H2_FRAME_SIZE_ERROR     0x6
+#define H2_REFUSED_STREAM       0x7
+#define H2_COMPRESSION_ERROR    0x9
+#define H2_ENHANCE_YOUR_CALM    0xb
+#define H2_HTTP_1_1_REQUIRED    0xd
+
+struct h2_frame {
+    size_t len;                 /* Of the payload */
+    int type;
+    int flags;
+    uint32_t id;                /* Stream, 0 for the connection */
+};
+
+void h2_header(char *buf, size_t len, int type, int flags, uint32_t id);
+void h2_parse_header(const char *buf, struct h2_frame *f);
+uint32_t h2_get32(const char *p);
+void h2_put32(char *p, uint32_t v);
+size_t h2_setting(char *buf, int id, uint32_t value);
+int h2_settings_decode(const struct http_slice *s, char *buf, size_t size);
+int h2_priority(const char *p, size_t len, int *incremental);
+
+struct conn;
+struct worker;
+
+int h2_upgrade(struct conn *c);
+int h2_drive(struct worker *w, struct conn *c);
+void h2_free(struct worker *w, struct conn *c);
+int h2_drain(struct worker *w, struct conn *c);
+void h2_require_http11(struct conn *c);
+void h2_worker_setup(struct worker *w);
+void h2_worker_stop(struct worker *w);
+
+#endif
@@ -1,87 +1,323 @@
 #define _POSIX_C_SOURCE 200809L
 #define _XOPEN_SOURCE 700
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 #include <errno.h>
 #include <assert.h>
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <zlib.h>
 
 #include <signal.h>
+#include <poll.h>
 #include <sys/socket.h>
-#include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 
-#include "rio.h"
 #include "error.h"
 #include "http-utils.h"
 #include "queue.h"
+#include "cache.h"
+#include "watch.h"
+#include "http-parser.h"
+#include "metrics.h"
+#include "accesslog.h"
+#include "uring.h"
+#include "limit.h"
+#include "mime.h"
+#include "affinity.h"
+#include "pool.h"
+#include "proxy.h"
+#include "fastcgi.h"
+#include "tls.h"
+#include "hpack.h"
+#include "http2.h"
+#include "upgrade.h"
+#include "conn.h"
 
-#ifdef LOG
-    #define log(format, ...) \
-        do { \
-            printf(format, ## __VA_ARGS__); \
-        } while (0)
-#else
-    #define log(format, ...) ((void)0)
-#endif
-
-#define	MAXLINE	    4096  /* Max text line length */
-#define MAXBUF      8192  /* Max I/O buffer size */
 #define MAXEVENTS   1024  /* Max epoll event size */
-#define NTHREADS    4     /* Number of worker threads */
+#define MAXTHREADS  255   /* Max worker threads, metrics keeps 256 */
+
+#define KEEPALIVE_TIMEOUT   5    /* Default idle seconds before close */
+#define KEEPALIVE_REQUESTS  100  /* Default max requests per connection */
+
+#define QUEUE_CAPACITY  1024  /* Default max connections waiting in fdq */
+#define QUEUE_RETRY_MS  10    /* How soon to retry when fdq is full */
+#define SHED_DEPTH      512   /* Default fdq depth where clients get a 503 */
+
+#define CACHE_SIZE      (64 * 1024 * 1024)  /* Default file cache size */
+#define CACHE_MAXDATA   (256 * 1024)  /* Larger files are cached as fds */
+#define CACHE_TTL       1     /* Default seconds a hit is trusted */
+#define GZIP_MINSIZE    256   /* Smaller files aren't worth compressing */
+#define MAXCONTROLS     16    /* Max --cache-control rules */
+#define MAXRANGES       16    /* More ranges than this get the whole file */
+
+#define URING_ENTRIES   1024  /* Submission queue size of every worker */
+#define URING_NBUFS     512   /* Provided receive buffers per worker */
+#define URING_BUFSIZE   4096  /* ... and their size */
+#define URING_PIPESIZE  (256 * 1024)  /* Bytes spliced per round trip */
+
+#define CONN_SLAB       64   /* Connections allocated at a time */
+#define CONNBUF_KEEP    256  /* Free buffers a worker keeps */
+
+const char *httpd_name = "The Naive HTTP Server";
+char *workdir = NULL;
+static int keepalive_timeout = KEEPALIVE_TIMEOUT;
+int keepalive_requests = KEEPALIVE_REQUESTS;
+static int reactor_mode = 0;
+static int queue_capacity = QUEUE_CAPACITY;
+static int shed_depth = SHED_DEPTH;
+static int max_conns = 0;
+static int max_perclient = 0;
+static long cache_size = CACHE_SIZE;
+static int cache_ttl = CACHE_TTL;
+static const char *metrics_path = NULL;  /* NULL unless --metrics */
+static int nthreads = 0;  /* 0 for one per CPU we may run on */
+static const char *proxy_check = NULL;  /* Health check path of backends */
+static int http2 = 0;  /* Clients may speak HTTP/2 */
+
+enum affinity {
+    AFFINITY_NONE,      /* Workers run wherever the scheduler likes */
+    AFFINITY_CPU,       /* Every worker is pinned to a CPU of its own */
+    AFFINITY_INCOMING,  /* ... and accepts connections received on it */
+};
+
+static enum affinity affinity = AFFINITY_CPU;
+static int cpus[AFFINITY_MAXCPUS];  /* CPUs we may run on */
+static int ncpus = 0;
+
+/* Cache-Control values for paths under a prefix, the longest one wins. */
+static struct {
+    const char *prefix;
+    const char *value;
+} cache_controls[MAXCONTROLS];
+static int ncontrols = 0;
+
+enum io_engine {
+    ENGINE_EPOLL,  /* Readiness with epoll(7) */
+    ENGINE_URING,  /* Completions with io_uring(7) */
+};
+
+static enum io_engine io_engine = ENGINE_EPOLL;
+
+/* Content codings, best first for clients that like them all as much. */
+enum encoding {
+    ENC_BR,
+    ENC_GZIP,
+    NENCODINGS
+};
+
+static const struct {
+    const char *name;    /* As in Accept-Encoding and Content-Encoding */
+    const char *suffix;  /* Of a file precompressed this way */
+} encodings[NENCODINGS] = {
+    {"br", ".br"},
+    {"gzip", ".gz"},
+};
+
+/* A part of a multipart/byteranges body: its head, then its bytes. */
+struct part {
+    char *head;
+    size_t headlen;
+    off_t start, end;
+};
 
-static const char *httpd_name = "The Naive HTTP Server";
-static char *workdir = NULL;
+static struct worker *workers = NULL;
 
-/* Used to transfer connfd between the main thread and worker threads. */
+/*
+ * What an io_uring completion is for. A conn is at least 8-byte aligned,
+ * so user_data is the connection with the operation in its low bits.
+ */
+enum uring_op {
+    OP_ACCEPT,     /* Multishot accept, no connection */
+    OP_RECV,       /* Receive into rbuf or a provided buffer */
+    OP_SEND,       /* Send the head and in-memory body */
+    OP_SPLICEIN,   /* Splice the file body into the pipe */
+    OP_SPLICEOUT,  /* Splice the pipe into the socket */
+    OP_CANCEL,     /* Cancel a closing connection, no connection */
+};
+
+#define OP_MASK  7
+
+/*
+ * Used to transfer new connfd from the main thread to worker threads.
+ * It is bounded and lock-free, workers are woken through their wakefd.
+ */
 static queue_t fdq;
-static pthread_mutex_t worker_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t worker_cond = PTHREAD_COND_INITIALIZER;
+
+/* What the main thread knows about a connection waiting in fdq. */
+struct accepted {
+    uint64_t at;                   /* When it was accepted */
+    struct sockaddr_storage peer;  /* Client address */
+};
+
+/* Indexed by descriptor. */
+static struct accepted *accepted = NULL;
+static rlim_t maxfds = 0;
 static volatile sig_atomic_t termflag = 0;
+static volatile sig_atomic_t reloadflag = 0;   /* SIGHUP came */
+static volatile sig_atomic_t upgradeflag = 0;  /* SIGUSR2 came */
+/* Another process took over the listening sockets, finish and exit. */
+volatile sig_atomic_t drainflag = 0;
+static char **httpd_argv = NULL;  /* To start again with on upgrades */
+
+/*
+ * Clients turned away get this 503, built once. A descriptor is kept in
+ * reserve to accept them with when we are out of descriptors.
+ */
+static char busy_response[MAXLINE];
+static size_t busy_len = 0;
+static int reservefd = -1;
 
 void show_usage(const char *name);
 void normalize_dir(char *dir);
 
 void httpd_run(const char *port);
+int httpd_signals(int listenfd);
+void worker_init(struct worker *w, int listenfd);
+void worker_setup(struct worker *w);
 void *worker_thread(void *arg);
-int doit(int connfd);
-void clienterror(int fd, const char *cause, const char *errnum,
-                 const char *shortmsg, const char *longmsg);
-void read_requesthdrs(rio_t *rp);
-int parse_uri(char *uri, char *filename);
-void get_filetype(char *filename, char *filetype);
-void serve_static(int fd, char *filename, int filesize);
+void worker_drain(struct worker *w);
+void worker_takeconns(struct worker *w);
+int accept_conn(int listenfd, struct sockaddr_storage *peer);
+int accept_shed(int listenfd);
+int admit_conn(int connfd, const struct sockaddr_storage *peer);
+void reject_conn(int connfd, enum metrics_counter why);
+struct conn *conn_open(struct worker *w, int connfd,
+                       const struct sockaddr_storage *peer);
+struct conn *conn_new(struct worker *w, int connfd,
+                      const struct sockaddr_storage *peer);
+void conn_free(struct worker *w, struct conn *c);
+void conn_release(struct worker *w, struct conn *c);
+void worker_reap(struct worker *w);
+int conn_serve(struct conn *c);
+int conn_written(struct conn *c);
+void conn_sent(struct conn *c, size_t n);
+int conn_handshake(struct conn *c);
+int conn_splice(struct conn *c);
+void *uring_worker_thread(void *arg);
+struct io_uring_sqe *uring_get(struct worker *w, unsigned n);
+void uring_complete(struct worker *w, struct io_uring_cqe *cqe);
+void uring_accept(struct worker *w);
+void uring_drain(struct worker *w);
+void uring_recv(struct worker *w, struct conn *c, int provided);
+void uring_send(struct worker *w, struct conn *c);
+void uring_splice(struct worker *w, struct conn *c);
+void uring_drive(struct worker *w, struct conn *c);
+void uring_close(struct worker *w, struct conn *c);
+void timeout_append(struct worker *w, struct conn *c);
+void timeout_remove(struct worker *w, struct conn *c);
+int normalize_uri(char *uri);
+int parse_uri(char *uri, char *filename, struct stat *sbuf);
+void serve_static(struct conn *c, const char *key, char *filename,
+                  struct stat *sbuf, unsigned long gen,
+                  struct http_request *req, const char *cachecontrol);
+void serve_encoded(struct conn *c, struct cache_entry *e,
+                   struct http_request *req);
+void serve_cached(struct conn *c, struct cache_entry *e);
+int serve_range(struct conn *c, struct cache_entry *e,
+                struct http_request *req);
+int if_range(struct http_request *req, struct cache_entry *e);
+void serve_not_modified(struct conn *c, const char *etag, time_t mtime,
+                        const char *cachecontrol, int vary);
+int not_modified(struct http_request *req, const char *etag, time_t mtime);
+const char *cache_control(const char *uri);
+void make_etag(char *buf, size_t size, ino_t ino, off_t filesize,
+               time_t mtime, const char *encoding);
+void serve_metrics(struct conn *c);
+int accept_encodings(const struct http_slice *accept, unsigned mask,
+                     int *order);
+int compressible(const char *filetype);
+struct cache_entry *variant_get(struct cache_entry *e, int enc);
+int cache_fresh(struct cache_entry *e);
+int cache_file(struct cache_entry *e, int srcfd, char *filename,
+               struct stat *sbuf);
+int cache_variant(struct cache_entry *v, struct cache_entry *e, int enc);
+int cache_read(struct cache_entry *e, int srcfd);
+ssize_t gzip_data(const char *src, size_t len, char **dst);
+int build_head(char *buf, size_t size, const char *status, off_t filesize,
+               const char *filetype, const char *encoding);
+int build_validators(char *buf, size_t size, const char *etag, time_t mtime,
+                     const char *cachecontrol, int vary);
 
 typedef void (*sigfunc_t)(int);
 sigfunc_t signal_intr(int signo, sigfunc_t func);
 void sigint_handle(int signum);
+void sighup_handle(int signum);
+void sigusr2_handle(int signum);
 
 int main(int argc, char *argv[]) {
     int opt;
-    char *port = NULL;
-
-    /* Initialize variables. */
-    if (queue_init(&fdq) != 0)
-        unix_errq("queue_init error");
+    char *port = NULL, *accesslog = NULL, *sep;
+    char *tlscert = NULL, *tlskey = NULL;
+    enum accesslog_format logformat = ACCESSLOG_COMBINED;
+    struct cache_stats st;
 
     /* Initialize signal handle. */
     if (signal_intr(SIGINT, sigint_handle) == SIG_ERR)
         unix_errq("signal_intr error");
+    /* A peer closing a keep-alive connection must not kill us. */
+    if (signal_intr(SIGPIPE, SIG_IGN) == SIG_ERR)
+        unix_errq("signal_intr error");
+    /*
+     * SIGHUP reopens the access log after it was rotated and reloads the
+     * TLS certificate, SIGUSR2 hands the listening sockets to a new
+     * process. The main thread acts on them, see httpd_signals().
+     */
+    if (signal_intr(SIGHUP, sighup_handle) == SIG_ERR
+        || signal_intr(SIGUSR2, sigusr2_handle) == SIG_ERR)
+        unix_errq("signal_intr error");
+    httpd_argv = argv;
+    /* Resolved now, the child of an upgrade can't search PATH. */
+    if (upgrade_init(argv[0]) != 0)
+        unix_err("upgrade_init error, SIGUSR2 won't upgrade");
 
     /* Process args. */
     while (1) {
-        static const char *optstring = "p:h";
+        static const char *optstring = "p:t:m:rn:c:l:h";
         static const struct option longopts[] = {
             {"port", required_argument, NULL, 'p'},
+            {"reactors", no_argument, NULL, 'r'},
+            {"threads", required_argument, NULL, 'n'},
+            {"affinity", required_argument, NULL, 'A'},
+            {"keepalive-timeout", required_argument, NULL, 't'},
+            {"max-requests", required_argument, NULL, 'm'},
+            {"cache-size", required_argument, NULL, 'c'},
+            {"cache-ttl", required_argument, NULL, 'T'},
+            {"cache-control", required_argument, NULL, 'C'},
+            {"queue-size", required_argument, NULL, 'Q'},
+            {"metrics", required_argument, NULL, 'M'},
+            {"access-log", required_argument, NULL, 'l'},
+            {"log-format", required_argument, NULL, 'F'},
+            {"io-engine", required_argument, NULL, 'E'},
+            {"max-conns", required_argument, NULL, 'N'},
+            {"max-conns-per-ip", required_argument, NULL, 'I'},
+            {"shed-depth", required_argument, NULL, 'S'},
+            {"mime-types", required_argument, NULL, 'Y'},
+            {"proxy", required_argument, NULL, 'X'},
+            {"proxy-check", required_argument, NULL, 'H'},
+            {"fastcgi", required_argument, NULL, 'G'},
+            {"fastcgi-max", required_argument, NULL, 'J'},
+            {"tls-cert", required_argument, NULL, 'L'},
+            {"tls-key", required_argument, NULL, 'U'},
+            {"http2", no_argument, NULL, 'W'},
             {"help", no_argument, NULL, 'h'},
             {NULL, no_argument, NULL, 0}};
 
@@ -91,6 +327,121 @@ int main(int argc, char *argv[]) {
 
         switch (opt) {
         case 'p': port = optarg; break;
+        case 't':
+            if ((keepalive_timeout = atoi(optarg)) <= 0)
+                app_errq("Invalid keepalive timeout: %s", optarg);
+            break;
+        case 'm':
+            if ((keepalive_requests = atoi(optarg)) <= 0)
+                app_errq("Invalid max requests: %s", optarg);
+            break;
+        case 'r': reactor_mode = 1; break;
+        case 'n':
+            if ((nthreads = atoi(optarg)) <= 0 || nthreads > MAXTHREADS)
+                app_errq("Invalid thread count: %s", optarg);
+            break;
+        case 'A':
+            if (strcmp(optarg, "none") == 0)
+                affinity = AFFINITY_NONE;
+            else if (strcmp(optarg, "cpu") == 0)
+                affinity = AFFINITY_CPU;
+            else if (strcmp(optarg, "incoming") == 0)
+                affinity = AFFINITY_INCOMING;
+            else
+                app_errq("Invalid affinity: %s", optarg);
+            break;
+        case 'c':
+            if ((cache_size = atol(optarg)) < 0)
+                app_errq("Invalid cache size: %s", optarg);
+            cache_size *= 1024 * 1024;
+            break;
+        case 'T':
+            if ((cache_ttl = atoi(optarg)) < 0)
+                app_errq("Invalid cache ttl: %s", optarg);
+            break;
+        case 'C':
+            if (optarg[0] != '/' || (sep = strchr(optarg, '=')) == NULL)
+                app_errq("Invalid cache control: %s", optarg);
+            if (ncontrols == MAXCONTROLS)
+                app_errq("Too many cache controls: %s", optarg);
+            *sep = '\0';
+            cache_controls[ncontrols].prefix = optarg;
+            cache_controls[ncontrols++].value = sep + 1;
+            break;
+        case 'Q':
+            if ((queue_capacity = atoi(optarg)) <= 0)
+                app_errq("Invalid queue size: %s", optarg);
+            break;
+        case 'M':
+            if (optarg[0] != '/')
+                app_errq("Invalid metrics path: %s", optarg);
+            metrics_path = optarg;
+            break;
+        case 'l': accesslog = optarg; break;
+        case 'F':
+            if (strcmp(optarg, "common") == 0)
+                logformat = ACCESSLOG_COMMON;
+            else if (strcmp(optarg, "combined") == 0)
+                logformat = ACCESSLOG_COMBINED;
+            else if (strcmp(optarg, "json") == 0)
+                logformat = ACCESSLOG_JSON;
+            else
+                app_errq("Invalid log format: %s", optarg);
+            break;
+        case 'E':
+            if (strcmp(optarg, "epoll") == 0)
+                io_engine = ENGINE_EPOLL;
+            else if (strcmp(optarg, "uring") == 0)
+                io_engine = ENGINE_URING;
+            else
+                app_errq("Invalid I/O engine: %s", optarg);
+            break;
+        case 'N':
+            if ((max_conns = atoi(optarg)) < 0)
+                app_errq("Invalid max connections: %s", optarg);
+            break;
+        case 'I':
+            if ((max_perclient = atoi(optarg)) < 0)
+                app_errq("Invalid max connections per ip: %s", optarg);
+            break;
+        case 'S':
+            if ((shed_depth = atoi(optarg)) < 0)
+                app_errq("Invalid shed depth: %s", optarg);
+            break;
+        case 'Y':
+            if (mime_load(optarg) < 0) {
+                if (errno == 0)
+                    app_errq("Invalid mime types file: %s", optarg);
+                unix_errq("mime_load error");
+            }
+            break;
+        case 'X':
+            if (proxy_add(optarg) != 0) {
+                if (errno == 0)
+                    app_errq("Invalid proxy: %s", optarg);
+                app_errq("Cannot resolve a backend of proxy %s", optarg);
+            }
+            break;
+        case 'H':
+            if (optarg[0] != '/')
+                app_errq("Invalid proxy check path: %s", optarg);
+            proxy_check = optarg;
+            break;
+        case 'G':
+            if (fcgi_add(optarg) != 0) {
+                if (errno == 0)
+                    app_errq("Invalid fastcgi: %s", optarg);
+                app_errq("Cannot resolve the backend of fastcgi %s", optarg);
+            }
+            break;
+        case 'J':
+            if (atoi(optarg) <= 0)
+                app_errq("Invalid fastcgi max: %s", optarg);
+            fcgi_set_inflight(atoi(optarg));
+            break;
+        case 'L': tlscert = optarg; break;
+        case 'U': tlskey = optarg; break;
+        case 'W': http2 = 1; break;
         case 'h':
         /* 0, ?, etc. */
         default: show_usage(argv[0]);
@@ -104,10 +455,94 @@ int main(int argc, char *argv[]) {
         app_errq("Expected argument after options");
     workdir = strdup(argv[optind]);
     normalize_dir(workdir);
+    if ((tlscert == NULL) != (tlskey == NULL))
+        app_errq("--tls-cert and --tls-key go together");
+    if (tlscert != NULL && tls_init(tlscert, tlskey, http2) != 0)
+        app_errq("cannot load TLS certificate %s and key %s", tlscert,
+                 tlskey);
+    if (io_engine == ENGINE_URING && (proxy_active() || fcgi_active())) {
+        app_err("--proxy and --fastcgi need the epoll engine, using epoll");
+        io_engine = ENGINE_EPOLL;
+    }
+    if (io_engine == ENGINE_URING && tls_active()) {
+        app_err("TLS needs the epoll engine, using epoll");
+        io_engine = ENGINE_EPOLL;
+    }
+    if (io_engine == ENGINE_URING && http2) {
+        app_err("HTTP/2 needs the epoll engine, using epoll");
+        io_engine = ENGINE_EPOLL;
+    }
+    if (io_engine == ENGINE_URING) {
+        if (!uring_supported()) {
+            unix_err("io_uring is not available, using epoll");
+            io_engine = ENGINE_EPOLL;
+        }
+        else
+            reactor_mode = 1; /* Every ring accepts on its own socket */
+    }
+    if ((ncpus = affinity_cpus(cpus, AFFINITY_MAXCPUS)) < 0) {
+        unix_err("affinity_cpus error, workers are not pinned");
+        affinity = AFFINITY_NONE;
+        ncpus = 1;
+    }
+    if (nthreads == 0)
+        nthreads = ncpus < MAXTHREADS ? ncpus : MAXTHREADS;
+    if (affinity == AFFINITY_INCOMING && !reactor_mode) {
+        app_err("--affinity incoming needs -r, workers are only pinned");
+        affinity = AFFINITY_CPU;
+    }
+
+    if (cache_size > 0) {
+        if (cache_init(cache_size) != 0)
+            unix_errq("cache_init error");
+        /* Without inotify cached files are revalidated after cache_ttl. */
+        if (watch_start(workdir) != 0)
+            unix_err("cannot watch %s, cached files expire after %ds",
+                     workdir, cache_ttl);
+    }
+
+    /* Initialize variables. */
+    http_parser_init();
+    hpack_init();
+    if (queue_init(&fdq, queue_capacity) != 0)
+        unix_errq("queue_init error");
+    if (metrics_register() != 0)
+        app_errq("metrics_register error");
+    if (limit_init(max_conns, max_perclient) != 0)
+        unix_errq("limit_init error");
+    if ((reservefd = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0)
+        unix_errq("open /dev/null error");
+    busy_len = snprintf(busy_response, sizeof(busy_response),
+                        "HTTP/1.1 503 Service Unavailable\r\n"
+                        "Server: %s\r\n"
+                        "Retry-After: 1\r\n"
+                        "Connection: close\r\n"
+                        "Content-type: text/plain\r\n"
+                        "Content-length: 19\r\n\r\n"
+                        "Server is too busy\n", httpd_name);
+    if (accesslog != NULL && accesslog_open(accesslog, logformat) != 0)
+        unix_errq("cannot open access log %s", accesslog);
+    if (proxy_active() && proxy_check_start(proxy_check) != 0)
+        unix_errq("proxy_check_start error");
 
     /* Run! */
     httpd_run(port);
 
+    cache_getstats(&st);
+    if (st.hits + st.misses > 0)
+        printf("Cache: %lu hits, %lu misses (%.1f%% hit ratio), %lu evictions\n",
+               st.hits, st.misses, 100.0 * st.hits / (st.hits + st.misses),
+               st.evictions);
+    if (accesslog_dropped() > 0)
+        printf("Access log: %lu records dropped\n", accesslog_dropped());
+    proxy_check_stop();
+    accesslog_close();
+    limit_destroy();
+    if (reservefd >= 0)
+        close(reservefd);
+    watch_stop();
+    cache_destroy();
+    queue_destroy(&fdq);
     free(workdir);
     printf("Httpd is shut down\n");
     return 0;
@@ -132,8 +567,29 @@ void sigint_handle(int signum) {
     termflag = 1;
 }
 
+void sighup_handle(int signum) {
+    assert(signum == SIGHUP);
+    reloadflag = 1;
+}
+
+void sigusr2_handle(int signum) {
+    assert(signum == SIGUSR2);
+    upgradeflag = 1;
+}
+
 void show_usage(const char *name) {
-    printf("Usage: %s [-p PORT, --port PORT] [-h, --help] DIR\n", name);
+    printf("Usage: %s [-p PORT, --port PORT] [-t SECS, --keepalive-timeout SECS]\n"
+           "       [-m N, --max-requests N] [-r, --reactors] [-n N, --threads N]\n"
+           "       [--affinity none|cpu|incoming] [-c MB, --cache-size MB]\n"
+           "       [--cache-ttl SECS] [--queue-size N] [--metrics PATH]\n"
+           "       [-l FILE, --access-log FILE] [--log-format common|combined|json]\n"
+           "       [--io-engine epoll|uring] [--max-conns N] [--max-conns-per-ip N]\n"
+           "       [--shed-depth N] [--cache-control PREFIX=VALUE]...\n"
+           "       [--mime-types FILE]... [--proxy PREFIX=HOST:PORT[,HOST:PORT]...]...\n"
+           "       [--proxy-check PATH] [--fastcgi MATCH=SOCKET]...\n"
+           "       [--fastcgi-max N] [--tls-cert FILE --tls-key FILE]\n"
+           "       [--http2] [-h, --help] DIR\n",
+           name);
     exit(1);
 }
 
@@ -144,294 +600,2625 @@ void normalize_dir(char *dir) {
 }
 
 void httpd_run(const char *port) {
-    int i, rc, listenfd, connfd, epollfd, nfds;
-    char cli_hostname[MAXLINE], cli_port[MAXLINE];
-    struct sockaddr_in cli_addr;
-    socklen_t cli_len;
+    int i, rc, listenfd = -1, connfd, epollfd = -1, nfds, next = 0;
+    int pending = -1, nready, upgraded = 0;
+    int inherited[UPGRADE_MAXFDS], ninherited;
     struct epoll_event ev, events[MAXEVENTS];
-    pthread_t tids[NTHREADS];
+    struct sockaddr_storage peer;
+    uint64_t one = 1;
+    sigset_t mask, oldmask;
+    struct rlimit rl;
 
-    /* Open socket and listen. */
-    if ((listenfd = open_listenfd(port)) < 0)
-        unix_errq("open_listenfd error");
+    /* After an upgrade, the listening sockets come from the old process. */
+    if ((ninherited = upgrade_inherit(inherited, UPGRADE_MAXFDS)) < 0)
+        unix_errq("upgrade_inherit error");
+    if ((workers = calloc(nthreads, sizeof(struct worker))) == NULL)
+        unix_errq("calloc error");
+    if (reactor_mode) {
+        /* Every worker listens on its own socket bound to the same port. */
+        for (i = 0; i < nthreads; ++i) {
+            listenfd = i < ninherited ? inherited[i] : open_listenfd(port, 1);
+            if (listenfd < 0 || fcntl(listenfd, F_SETFL, O_NONBLOCK) < 0)
+                unix_errq("open_listenfd error");
+            worker_init(&workers[i], listenfd);
+            if (affinity == AFFINITY_INCOMING
+                && affinity_incoming(listenfd, workers[i].cpu) != 0)
+                unix_err("affinity_incoming error, worker %d", i);
+        }
+    }
+    else {
+        /* Open socket and listen. It is drained until accept(2) blocks. */
+        listenfd = ninherited > 0 ? inherited[0] : open_listenfd(port, 0);
+        if (listenfd < 0 || fcntl(listenfd, F_SETFL, O_NONBLOCK) < 0)
+            unix_errq("open_listenfd error");
 
-    /* Create epoll and add listenfd in. */
-    if ((epollfd = epoll_create1(0)) == -1)
-        unix_errq("epoll_create1 error");
-    ev.events = EPOLLIN;
-    ev.data.fd = listenfd;
-    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, listenfd, &ev) == -1)
-        unix_errq("epoll_ctl add error");
+        /* Create epoll and add listenfd in. */
+        if ((epollfd = epoll_create1(0)) == -1)
+            unix_errq("epoll_create1 error");
+        ev.events = EPOLLIN;
+        ev.data.fd = listenfd;
+        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, listenfd, &ev) == -1)
+            unix_errq("epoll_ctl add error");
+
+        /* No descriptor can be above the limit, so that bounds the table. */
+        if (getrlimit(RLIMIT_NOFILE, &rl) != 0)
+            unix_errq("getrlimit error");
+        maxfds = rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > 1 << 20
+                 ? 1 << 20 : rl.rlim_cur;
+        if ((accepted = calloc(maxfds, sizeof(struct accepted))) == NULL)
+            unix_errq("calloc error");
+
+        for (i = 0; i < nthreads; ++i)
+            worker_init(&workers[i], -1);
+    }
+    /* Those left over would get connections nobody accepts. */
+    for (i = reactor_mode ? nthreads : 1; i < ninherited; ++i)
+        close(inherited[i]);
 
     /* Create worker threads. */
-    for (i = 0; i < NTHREADS; ++i) {
-        if ((rc = pthread_create(&tids[i], NULL, worker_thread, NULL)) != 0)
+    for (i = 0; i < nthreads; ++i) {
+        if ((rc = pthread_create(&workers[i].tid, NULL,
+                                 io_engine == ENGINE_URING
+                                 ? uring_worker_thread : worker_thread,
+                                 &workers[i])) != 0)
             posix_errq(rc, "pthread create error");
     }
 
-    /* Loop until sigint_handle set termflag. */
-    printf("Httpd is running. (port=%s, workdir=%s)\n", port, workdir);
-    while (!termflag) {
-        if ((nfds = epoll_wait(epollfd, events, MAXEVENTS, -1)) == -1) {
+    upgrade_ready();
+
+    /* Loop until sigint_handle set termflag, or until an upgrade. */
+    printf("Httpd is running. (pid=%ld, port=%s, workdir=%s, mode=%s, "
+           "engine=%s, threads=%d, affinity=%s)\n",
+           (long)getpid(), port, workdir,
+           reactor_mode ? "reactors" : "acceptor",
+           io_engine == ENGINE_URING ? "io_uring" : "epoll", nthreads,
+           affinity == AFFINITY_NONE ? "none"
+           : affinity == AFFINITY_CPU ? "cpu" : "incoming");
+    /* Signals are only taken while we wait, so that none is missed. */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGUSR2);
+    if (sigprocmask(SIG_BLOCK, &mask, &oldmask) != 0)
+        unix_errq("sigprocmask error");
+    if (reactor_mode) {
+        while (!termflag && !upgraded) {
+            sigsuspend(&oldmask);
+            upgraded = httpd_signals(-1);
+        }
+    }
+    while (!termflag && !upgraded) {
+        /*
+         * While fdq is full we hold one connection back and stop accepting,
+         * so new clients wait in the listen backlog instead of our memory.
+         */
+        if ((nfds = epoll_pwait(epollfd, events, MAXEVENTS,
+                                pending >= 0 ? QUEUE_RETRY_MS : -1,
+                                &oldmask)) == -1) {
             if (errno == EINTR) {
-                printf("\ninterrupted from epoll wait\n");
-                break;
+                upgraded = httpd_signals(listenfd);
+                continue;
             }
-            unix_errq("epoll_wait error");
+            unix_errq("epoll_pwait error");
+        }
+        nready = 0;
+        if (pending >= 0) {
+            if (enqueue(&fdq, pending) != 0)
+                continue;
+            pending = -1;
+            nready++;
+            ev.events = EPOLLIN;
+            ev.data.fd = listenfd;
+            if (epoll_ctl(epollfd, EPOLL_CTL_MOD, listenfd, &ev) == -1)
+                unix_errq("epoll_ctl mod error");
+        }
+        else {
+            assert(nfds <= 1 && (nfds == 0 || events[0].data.fd == listenfd));
+            if (nfds == 0)
+                continue;
         }
 
-        for (i = 0; i < nfds; ++i) {
-            /* Listenfd is ready to accept. */
-            if (events[i].data.fd == listenfd) {
-                cli_len = sizeof(cli_addr);
-                if ((connfd = accept(listenfd, (struct sockaddr *)&cli_addr,
-                                     &cli_len)) < 0)
-                    unix_errq("accept error");
-                if ((rc = getnameinfo((struct sockaddr *)&cli_addr, cli_len,
-                                      cli_hostname, MAXLINE,
-                                      cli_port, MAXLINE, 0)) != 0)
-                    unix_errq("getnameinfo error: %s", gai_strerror(rc));
-                log("Accepted connection from (%s, %s)\n", cli_hostname, cli_port);
-                log("connfd: %d\n\n", connfd);
-
-                ev.events = EPOLLIN;
-                ev.data.fd = connfd;
-                if (epoll_ctl(epollfd, EPOLL_CTL_ADD, connfd, &ev) == -1)
-                    unix_errq("epoll_ctl error");
+        /* Drain the backlog, until it is empty or fdq is full. */
+        while ((connfd = accept_conn(listenfd, &peer)) >= 0) {
+            /*
+             * Past shed_depth a client would wait too long for a worker,
+             * it is better off with a quick 503 and trying again.
+             */
+            if (shed_depth > 0 && queue_size(&fdq) >= shed_depth) {
+                reject_conn(connfd, COUNTER_SHED);
+                continue;
             }
-            /* Connfd is ready to read. */
-            else if (events[i].events & EPOLLIN) {
-                connfd = events[i].data.fd;
-                /* Workers will close connfd, so we delete it from epoll. */
-                if (epoll_ctl(epollfd, EPOLL_CTL_DEL, connfd, &ev) == -1)
-                    unix_errq("epoll_ctl error");
-
-                /* Put connfd in queue and notify workers to serve it. */
-                pthread_mutex_lock(&worker_mutex);
-                if (enqueue(&fdq, connfd) != 0)
-                    unix_errq("enqueue error");
-                log("enqueue connfd %d\n\n", connfd);
-                pthread_cond_signal(&worker_cond);
-                pthread_mutex_unlock(&worker_mutex);
+            if ((rlim_t)connfd >= maxfds) {
+                reject_conn(connfd, COUNTER_REJECTED);
+                continue;
             }
-            /* Should not reach here. */
-            else {
-                assert(0);
+            if (admit_conn(connfd, &peer) != 0)
+                continue;
+            accepted[connfd].at = metrics_now();
+            accepted[connfd].peer = peer;
+
+            /* Put connfd in queue, or hold it back if it is full. */
+            if (enqueue(&fdq, connfd) != 0) {
+                log("fdq is full, holding connfd %d\n\n", connfd);
+                pending = connfd;
+                ev.events = 0;
+                ev.data.fd = listenfd;
+                if (epoll_ctl(epollfd, EPOLL_CTL_MOD, listenfd, &ev) == -1)
+                    unix_errq("epoll_ctl mod error");
+                break;
             }
+            log("enqueue connfd %d\n\n", connfd);
+            nready++;
+        }
+
+        /* Wake a worker per new connection, any of them takes them all. */
+        for (i = 0; i < nready && i < nthreads; ++i) {
+            if (write(workers[next].wakefd, &one, sizeof(one)) != sizeof(one))
+                unix_errq("eventfd write error");
+            next = (next + 1) % nthreads;
         }
     }
+    if (sigprocmask(SIG_SETMASK, &oldmask, NULL) != 0)
+        unix_errq("sigprocmask error");
 
-    /* Notify all workers it's time to terminate. */
-    pthread_mutex_lock(&worker_mutex);
-    pthread_cond_broadcast(&worker_cond);
-    pthread_mutex_unlock(&worker_mutex);
+    if (upgraded) {
+        /*
+         * The new process accepts from now on. What was accepted here is
+         * still served, and a connection held back joins the others.
+         */
+        if (!reactor_mode) {
+            if (close(listenfd) != 0)
+                unix_errq("close listenfd error");
+            listenfd = -1;
+            while (pending >= 0 && !termflag) {
+                if (enqueue(&fdq, pending) == 0)
+                    pending = -1;
+                else
+                    poll(NULL, 0, QUEUE_RETRY_MS);
+            }
+        }
+        drainflag = 1;
+        printf("waiting for connections to finish, SIGINT to stop now\n");
+    }
+    else
+        printf("\ninterrupted, waiting for workers\n");
 
-    /* Wait all workers. */
-    for (i = 0; i < NTHREADS; ++i) {
-        if ((rc = pthread_join(tids[i], NULL)) != 0)
+    /* Workers notice termflag, or that they have drained, within a second. */
+    for (i = 0; i < nthreads; ++i) {
+        if ((rc = pthread_join(workers[i].tid, NULL)) != 0)
             posix_errq(rc, "pthread join error");
     }
 
     /* Release resource. */
-    if (close(listenfd) != 0)
-        unix_errq("close listenfd error");
-    if (close(epollfd) != 0)
-        unix_errq("epoll close error");
+    if (!reactor_mode) {
+        if (pending >= 0)
+            close(pending);
+        while (dequeue(&fdq, &connfd) == 0)
+            close(connfd);
+        if (listenfd >= 0 && close(listenfd) != 0)
+            unix_errq("close listenfd error");
+        if (close(epollfd) != 0)
+            unix_errq("epoll close error");
+        free(accepted);
+    }
+    free(workers);
 }
 
-void *worker_thread(void *arg) {
+/*
+ * httpd_signals - Act on the SIGHUP or SIGUSR2 the handlers flagged, in
+ *     the main thread. listenfd is the listening socket, or -1 in reactor
+ *     mode, where every worker has its own. Returns 1 once a new process
+ *     took the listening sockets over, 0 if we go on accepting.
+ */
+int httpd_signals(int listenfd) {
+    int fds[MAXTHREADS], i, n = 0;
+    pid_t pid;
+
+    if (reloadflag) {
+        reloadflag = 0;
+        accesslog_reopen();
+        if (tls_reload() != 0)
+            app_err("cannot reload the TLS certificate, keeping the old one");
+    }
+    if (!upgradeflag)
+        return 0;
+    upgradeflag = 0;
+    if (listenfd >= 0)
+        fds[n++] = listenfd;
+    else {
+        for (i = 0; i < nthreads; ++i)
+            fds[n++] = workers[i].listenfd;
+    }
+    if ((pid = upgrade_start(httpd_argv, fds, n)) < 0) {
+        unix_err("upgrade error, still serving");
+        return 0;
+    }
+    printf("\nupgraded, pid %ld serves now\n", (long)pid);
+    return 1;
+}
+
+/*
+ * worker_init - Create the epoll of worker w. In reactor mode listenfd is
+ *     the worker's own listening socket, otherwise it is -1 and the
+ *     worker is woken through an eventfd when fdq has new connections.
+ *     The io_uring engine sets up its ring in the worker thread instead.
+ */
+void worker_init(struct worker *w, int listenfd) {
+    struct epoll_event ev;
+
+    w->listenfd = listenfd;
+    w->wakefd = -1;
+    w->epollfd = -1;
+    w->head = w->tail = NULL;
+    w->nconns = 0;
+    w->accepting = 0;
+    w->dead = NULL;
+    w->idle = NULL;
+    w->nidle = NULL;
+    w->deadups = NULL;
+    w->fcgis = NULL;
+    w->deadfcgis = NULL;
+    w->fcgiready = NULL;
+    w->cpu = affinity != AFFINITY_NONE ? cpus[(w - workers) % ncpus] : -1;
+    if (io_engine == ENGINE_URING)
+        return;
+    if ((w->epollfd = epoll_create1(0)) == -1)
+        unix_errq("epoll_create1 error");
+    if (listenfd < 0 && (w->wakefd = eventfd(0, EFD_NONBLOCK)) == -1)
+        unix_errq("eventfd error");
+
+    /* Connections use their conn as data, the worker marks its own fd. */
+    ev.events = EPOLLIN;
+    ev.data.ptr = w;
+    if (epoll_ctl(w->epollfd, EPOLL_CTL_ADD,
+                  listenfd >= 0 ? listenfd : w->wakefd, &ev) == -1)
+        unix_errq("epoll_ctl add error");
+}
+
+/*
+ * worker_setup - Prepare the calling thread to run worker w. It is pinned
+ *     first, so that what it allocates is local to its CPU.
+ */
+void worker_setup(struct worker *w) {
     sigset_t mask;
-    int connfd, rc;
+    int rc;
 
     /* Block all signals. */
     sigfillset(&mask);
     if ((rc = pthread_sigmask(SIG_SETMASK, &mask, NULL)) != 0)
         posix_errq(rc, "pthread_sigmask error");
+    if (w->cpu >= 0 && affinity_pin(w->cpu) != 0)
+        unix_err("affinity_pin error, worker %ld is not pinned",
+                 (long)(w - workers));
+    pool_init(&w->conns, sizeof(struct conn), CONN_SLAB, 0);
+    pool_init(&w->connbufs, sizeof(struct connbuf), 1, CONNBUF_KEEP);
+    proxy_worker_setup(w);
+    fcgi_worker_setup(w);
+    h2_worker_setup(w);
+    if (metrics_register() != 0)
+        app_err("metrics_register error, worker %ld records nothing",
+                (long)(w - workers));
+    if (accesslog_active() && accesslog_register() != 0)
+        app_err("accesslog_register error, worker %ld logs nothing",
+                (long)(w - workers));
+}
 
-    while (1) {
-        pthread_mutex_lock(&worker_mutex);
-        while (!termflag && queue_empty(&fdq))
-            pthread_cond_wait(&worker_cond, &worker_mutex);
-        if (termflag && queue_empty(&fdq)) {
-            /*
-             * Termflag is set and we have served all connfd from fdq.
-             * Now terminate.
-             */
-            pthread_mutex_unlock(&worker_mutex);
-            break;
+void *worker_thread(void *arg) {
+    struct worker *w = arg;
+    int i, nfds, connfd;
+    struct sockaddr_storage peer;
+    struct conn *c;
+    struct upconn *up;
+    struct fcgiconn *fc;
+    struct epoll_event events[MAXEVENTS];
+    time_t now;
+    int draining = 0;
+
+    worker_setup(w);
+
+    while (!termflag && !(draining && w->head == NULL)) {
+        /* Wake up at least once a second to close idle connections. */
+        if ((nfds = epoll_wait(w->epollfd, events, MAXEVENTS, 1000)) == -1) {
+            if (errno == EINTR)
+                continue;
+            unix_errq("epoll_wait error");
+        }
+
+        for (i = 0; i < nfds; ++i) {
+            if (events[i].data.ptr == w) {
+                if (w->listenfd < 0)
+                    worker_takeconns(w);
+                else {
+                    /* Drain the backlog, the socket is level-triggered. */
+                    while ((connfd = accept_conn(w->listenfd, &peer)) >= 0) {
+                        if (admit_conn(connfd, &peer) == 0)
+                            conn_open(w, connfd, &peer);
+                    }
+                }
+                continue;
+            }
+            if ((uintptr_t)events[i].data.ptr & 1) {
+                up = (void *)((uintptr_t)events[i].data.ptr & ~(uintptr_t)1);
+                upconn_event(w, up, events[i].events);
+                continue;
+            }
+            if ((uintptr_t)events[i].data.ptr & 2) {
+                fc = (void *)((uintptr_t)events[i].data.ptr & ~(uintptr_t)2);
+                fcgiconn_event(w, fc, events[i].events);
+                continue;
+            }
+            /* It may have been closed by an event before this one. */
+            if ((c = events[i].data.ptr)->fd >= 0)
+                conn_handle(w, c);
         }
-        /* Get connfd from queue. */
-        if (dequeue(&fdq, &connfd) != 0)
-            unix_errq("dequeue error");
-        log("dequeue connfd %d\n\n", connfd);
-        pthread_mutex_unlock(&worker_mutex);
 
-        /* Serve connfd. */
-        doit(connfd);
-        if (close(connfd) != 0)
-            unix_errq("close connfd error");
+        /* The timeout list is ordered, so expired connections are in front. */
+        now = time(NULL);
+        while ((c = w->head) != NULL
+               && now - c->last_active >= keepalive_timeout) {
+            log("close idle connfd %d\n\n", c->fd);
+            conn_close(w, c);
+        }
+
+        /* FastCGI connections left with work in this round. */
+        fcgi_worker_run(w);
+        if (drainflag && !draining) {
+            worker_drain(w);
+            draining = 1;
+        }
+        worker_reap(w);
     }
 
-    return 0;
+    /* Release everything this worker owns. */
+    while (w->head != NULL)
+        conn_close(w, w->head);
+    proxy_worker_stop(w);
+    fcgi_worker_stop(w);
+    worker_reap(w);
+    pool_destroy(&w->conns);
+    pool_destroy(&w->connbufs);
+    h2_worker_stop(w);
+    if (w->listenfd >= 0 && close(w->listenfd) != 0)
+        unix_errq("close listenfd error");
+    if (w->wakefd >= 0 && close(w->wakefd) != 0)
+        unix_errq("close wakefd error");
+    if (close(w->epollfd) != 0)
+        unix_errq("epoll close error");
+    return NULL;
 }
 
-int doit(int connfd) {
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-    char filename[MAXLINE];
-    struct stat sbuf;
-    rio_t rio;
-    ssize_t nread;
+/*
+ * worker_drain - Have worker w finish up, now that another process took
+ *     over the listening sockets. It accepts no more, but takes what the
+ *     main thread queued, closes idle connections and tells HTTP/2
+ *     clients to go away. The others are closed after their response.
+ */
+void worker_drain(struct worker *w) {
+    struct conn *c, *next;
+
+    if (w->listenfd < 0)
+        worker_takeconns(w);
+    else {
+        /* The new process shares the socket, so epoll would keep it. */
+        if (epoll_ctl(w->epollfd, EPOLL_CTL_DEL, w->listenfd, NULL) == -1)
+            unix_errq("epoll_ctl del error");
+        if (close(w->listenfd) != 0)
+            unix_errq("close listenfd error");
+        w->listenfd = -1;
+    }
+    for (c = w->head; c != NULL; c = next) {
+        next = c->next;
+        if (c->h2 != NULL) {
+            if (h2_drain(w, c) < 0)
+                conn_close(w, c);
+        }
+        else if (c->state == CONN_READ && c->buf == NULL && c->nrequests > 0)
+            conn_close(w, c);
+    }
+}
+
+/*
+ * worker_reap - Free the connections of w closed in this round. Until
+ *     then they stay around, with fd -1, so that their events left in the
+ *     round find them closed instead of freed or reused.
+ */
+void worker_reap(struct worker *w) {
+    struct conn *c;
+
+    while ((c = w->dead) != NULL) {
+        w->dead = c->next;
+        pool_put(&w->conns, c);
+    }
+    proxy_worker_reap(w);
+    fcgi_worker_reap(w);
+}
+
+/*
+ * worker_takeconns - Take the connections the main thread queued. Any
+ *     woken worker may take any of them, which also balances the load.
+ */
+void worker_takeconns(struct worker *w) {
+    uint64_t count;
+    int connfd;
+
+    if (read(w->wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        unix_errq("eventfd read error");
+    while (dequeue(&fdq, &connfd) == 0) {
+        log("dequeue connfd %d\n\n", connfd);
+        metrics_time(STAGE_QUEUE, metrics_now() - accepted[connfd].at);
+        conn_open(w, connfd, &accepted[connfd].peer);
+    }
+}
 
-    rio_readinitb(&rio, connfd);
-    /* Read method, uri, version. */
-    if ((nread = rio_readlineb(&rio, buf, MAXLINE)) <= 0) {
-        if (nread == 0)
+/*
+ * accept_conn - Accept a connection on non-blocking listenfd. The new
+ *     socket is non-blocking too, and the client address is left in peer
+ *     as it is: formatting it is up to whoever wants it. Returns -1 once
+ *     the backlog is empty, or on errors that leave it to later.
+ */
+int accept_conn(int listenfd, struct sockaddr_storage *peer) {
+    int connfd;
+    socklen_t peerlen;
+    uint64_t start = metrics_now();
+
+    while (1) {
+        peerlen = sizeof(*peer);
+        if ((connfd = accept4(listenfd, (struct sockaddr *)peer, &peerlen,
+                              SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+            break;
+        /* The client gave up while waiting, try the next one. */
+        if (errno == EINTR || errno == ECONNABORTED)
+            continue;
+        if (errno == EMFILE || errno == ENFILE) {
+            if (accept_shed(listenfd) == 0)
+                continue;
             return -1;
-        unix_errq("rio_readlineb error");
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            unix_err("accept error");
+        return -1;
     }
-    sscanf(buf, "%s %s %s", method, uri, version);
-    log("%s", buf);
+    log("connfd: %d\n\n", connfd);
+    metrics_count(COUNTER_ACCEPTED, 1);
+    metrics_time(STAGE_ACCEPT, metrics_now() - start);
+    return connfd;
+}
 
-    /* Check method. */
-    if (strcasecmp(method, "GET")) { /* We only support GET method */
-        clienterror(connfd, method, "501", "Not Implemented",
-                    "We haven't implemented this method");
+/*
+ * accept_shed - Turn the next client on listenfd away while we are out
+ *     of descriptors, using the one kept in reserve. Otherwise it would
+ *     stay in the backlog and keep listenfd readable. Returns -1 if
+ *     there is no client, or no reserve.
+ */
+int accept_shed(int listenfd) {
+    int fd, connfd;
+
+    /* Only one thread at a time can use the reserve. */
+    if ((fd = __atomic_exchange_n(&reservefd, -1, __ATOMIC_ACQ_REL)) < 0)
+        return -1;
+    close(fd);
+    connfd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (connfd >= 0) {
+        metrics_count(COUNTER_ACCEPTED, 1);
+        reject_conn(connfd, COUNTER_REJECTED);
+    }
+    __atomic_store_n(&reservefd, open("/dev/null", O_RDONLY | O_CLOEXEC),
+                     __ATOMIC_RELEASE);
+    return connfd >= 0 ? 0 : -1;
+}
+
+/*
+ * admit_conn - Count connfd from peer against the connection limits, or
+ *     turn it away if it is over one. Returns -1 if it was turned away.
+ */
+int admit_conn(int connfd, const struct sockaddr_storage *peer) {
+    if (limit_acquire(peer) == 0)
         return 0;
+    log("connfd %d is over a connection limit\n\n", connfd);
+    reject_conn(connfd, COUNTER_REJECTED);
+    return -1;
+}
+
+/*
+ * reject_conn - Answer connfd with the prebuilt 503 and close it, without
+ *     waiting for anything. What the client already sent is read first,
+ *     or closing would reset the connection and could lose the answer.
+ */
+void reject_conn(int connfd, enum metrics_counter why) {
+    char buf[MAXBUF];
+
+    /* A TLS client couldn't read it, it only sees the close. */
+    if (!tls_active()
+        && send(connfd, busy_response, busy_len, MSG_DONTWAIT | MSG_NOSIGNAL)
+           == (ssize_t)busy_len)
+        metrics_status(503);
+    shutdown(connfd, SHUT_WR);
+    while (recv(connfd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+        ;
+    close(connfd);
+    metrics_count(why, 1);
+    metrics_count(COUNTER_CLOSED, 1);
+}
+
+/*
+ * conn_open - Set up the state of connfd from peer and register it with
+ *     the epoll of worker w. Returns NULL and closes connfd on failure.
+ */
+struct conn *conn_open(struct worker *w, int connfd,
+                       const struct sockaddr_storage *peer) {
+    struct conn *c;
+    struct epoll_event ev;
+
+    if ((c = conn_new(w, connfd, peer)) == NULL)
+        return NULL;
+    timeout_append(w, c);
+
+    /*
+     * Edge-triggered for both directions, so the connection is registered
+     * once and never modified: conn_handle() always runs until EAGAIN.
+     */
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = c;
+    if (epoll_ctl(w->epollfd, EPOLL_CTL_ADD, connfd, &ev) == -1)
+        unix_errq("epoll_ctl error");
+    return c;
+}
+
+/*
+ * conn_new - Allocate the state of connfd from peer in worker w, for
+ *     either I/O engine. Returns NULL and closes connfd on failure.
+ */
+struct conn *conn_new(struct worker *w, int connfd,
+                      const struct sockaddr_storage *peer) {
+    struct conn *c;
+
+    if ((c = pool_get(&w->conns)) == NULL) {
+        unix_err("pool_get error");
+        limit_release(peer);
+        close(connfd);
+        metrics_count(COUNTER_CLOSED, 1);
+        return NULL;
+    }
+    conn_init(c, connfd, peer);
+    if (tls_active()) {
+        if ((c->ssl = tls_new(connfd)) == NULL) {
+            app_err("tls_new error");
+            pool_put(&w->conns, c);
+            limit_release(peer);
+            close(connfd);
+            metrics_count(COUNTER_CLOSED, 1);
+            return NULL;
+        }
+        c->state = CONN_HANDSHAKE;
     }
+    return c;
+}
 
-    /* Read request headers and discard them. */
-    read_requesthdrs(&rio);
+/*
+ * conn_init - Set up the state of c for connfd from peer, with nothing
+ *     received yet.
+ */
+void conn_init(struct conn *c, int connfd,
+               const struct sockaddr_storage *peer) {
+    c->fd = connfd;
+    c->state = CONN_READ;
+    c->nrequests = 0;
+    c->keepalive = 0;
+    c->rlen = 0;
+    http_request_init(&c->req);
+    c->parsetime = 0;
+    c->status = 0;
+    c->bodylen = 0;
+    c->body = NULL;
+    c->peer = *peer;
+    c->iovcnt = c->iovpos = 0;
+    c->entry = NULL;
+    c->filefd = -1;
+    c->fileoff = c->fileend = 0;
+    c->parts = NULL;
+    c->nparts = c->partpos = 0;
+    c->usesplice = 0;
+    c->nodelay = 0;
+    c->splicefd[0] = c->splicefd[1] = -1;
+    c->spliced = 0;
+    c->pipesize = 0;
+    c->inflight = 0;
+    c->closing = 0;
+    c->buf = NULL;
+    c->rbuf = c->wbuf = NULL;
+    arena_init(&c->arena, NULL, 0);
+    c->proxy = NULL;
+    c->fcgi = NULL;
+    c->ssl = NULL;
+    c->ktls = 0;
+    c->tlsstaged = 0;
+    c->h2 = NULL;
+    c->stream = NULL;
+    c->last_active = time(NULL);
+}
 
-    /* Parse uri to local filename. */
-    if (parse_uri(uri, filename) != 0) {
-        clienterror(connfd, filename, "404", "Not Found",
-                    "We couldn't find this file");
-        return 0;
+/*
+ * conn_close - Release a connection. Closing the descriptor also removes
+ *     it from epoll. An event of its backend may have closed it, so c
+ *     itself is only freed by worker_reap().
+ */
+void conn_close(struct worker *w, struct conn *c) {
+    timeout_remove(w, c);
+    conn_release(w, c);
+    c->fd = -1;
+    c->next = w->dead;
+    w->dead = c;
+}
+
+/*
+ * conn_free - Release connection c of worker w and free it, but for its
+ *     place in the timeout list.
+ */
+void conn_free(struct worker *w, struct conn *c) {
+    conn_release(w, c);
+    pool_put(&w->conns, c);
+}
+
+/*
+ * conn_release - Release everything connection c of worker w holds but
+ *     its place in the timeout list and c itself.
+ */
+void conn_release(struct worker *w, struct conn *c) {
+    if (c->h2 != NULL)
+        h2_free(w, c);
+    if (c->proxy != NULL)
+        proxy_abort(w, c);
+    if (c->fcgi != NULL)
+        fcgi_abort(w, c);
+    conn_done(c);
+    if (c->buf != NULL)
+        conn_putbuf(w, c);
+    limit_release(&c->peer);
+    if (c->splicefd[0] >= 0) {
+        close(c->splicefd[0]);
+        close(c->splicefd[1]);
     }
+    if (c->ssl != NULL) {
+        tls_close(c->ssl);
+        c->ssl = NULL;
+    }
+    if (close(c->fd) != 0)
+        unix_errq("close connfd error");
+    metrics_count(COUNTER_CLOSED, 1);
+}
 
-    /* Check existence. */
-    if (stat(filename, &sbuf) < 0) {
-        clienterror(connfd, filename, "404", "Not Found",
-                    "We couldn't find this file");
-        return 0;
+/*
+ * conn_getbuf - Give c buffers from its worker w, before it receives
+ *     anything. Returns -1 on error.
+ */
+int conn_getbuf(struct worker *w, struct conn *c) {
+    if ((c->buf = pool_get(&w->connbufs)) == NULL) {
+        unix_err("pool_get error");
+        return -1;
     }
+    c->rbuf = c->buf->rbuf;
+    c->wbuf = c->buf->wbuf;
+    arena_init(&c->arena, c->buf->scratch, sizeof(c->buf->scratch));
+    return 0;
+}
 
-    /* Check permission. */
-    if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
-        clienterror(connfd, filename, "403", "Forbidden",
-                    "We couldn't read the file");
+/*
+ * conn_putbuf - Give the buffers of c back to its worker w, once it has
+ *     neither a response to send nor a request begun in rbuf.
+ */
+void conn_putbuf(struct worker *w, struct conn *c) {
+    arena_reset(&c->arena);
+    arena_init(&c->arena, NULL, 0);
+    pool_put(&w->connbufs, c->buf);
+    c->buf = NULL;
+    c->rbuf = c->wbuf = NULL;
+}
+
+/*
+ * conn_handle - Drive connection c as far as it can go without blocking:
+ *     flush the pending response, then parse and serve buffered requests,
+ *     reading more from the socket only when no complete request is left.
+ *     A request passed to a backend is driven by the events of its
+ *     backend connection too.
+ */
+void conn_handle(struct worker *w, struct conn *c) {
+    ssize_t n;
+    int rc;
+
+    /* Anything that happens counts as activity. */
+    timeout_touch(w, c);
+
+    if (c->state == CONN_HANDSHAKE && (rc = conn_handshake(c)) != 0) {
+        if (rc < 0)
+            conn_close(w, c);
+        return;
+    }
+
+    while (1) {
+        if (c->state == CONN_H2) {
+            if (h2_drive(w, c) < 0)
+                break;
+            return;
+        }
+        if (c->state == CONN_PROXY) {
+            if ((rc = proxy_drive(w, c)) < 0)
+                break;
+            if (rc > 0)
+                return; /* Wait for the client or the backend */
+        }
+        if (c->state == CONN_FCGI) {
+            if ((rc = fcgi_drive(w, c)) < 0)
+                break;
+            if (rc > 0)
+                return;
+        }
+        if (c->state == CONN_WRITE) {
+            if ((rc = conn_flush(c)) < 0)
+                break;
+            if (rc > 0)
+                return; /* Wait for EPOLLOUT */
+            if (!conn_written(c))
+                break;
+        }
+
+        if (conn_serve(c))
+            continue;
+
+        if (c->buf == NULL && conn_getbuf(w, c) != 0)
+            break;
+        n = conn_read(c, c->rbuf + c->rlen, MAXBUF - c->rlen);
+        if (n > 0)
+            c->rlen += n;
+        else if (n == 0)
+            break; /* EOF */
+        else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            /* Idle connections don't keep buffers. */
+            if (c->rlen == 0)
+                conn_putbuf(w, c);
+            return; /* Wait for EPOLLIN */
+        }
+        else if (errno != EINTR)
+            break;
+    }
+    conn_close(w, c);
+}
+
+/*
+ * conn_serve - Serve the next request if its head is already in c->rbuf.
+ *     The parser picks up where it stopped, so a head arriving in many
+ *     reads is still only scanned once. Returns 1 and leaves c in
+ *     CONN_WRITE if there is a response to send, in CONN_PROXY or
+ *     CONN_FCGI if the request goes to a backend, or in CONN_H2 if the
+ *     client switches to HTTP/2, 0 if more input is needed.
+ */
+int conn_serve(struct conn *c) {
+    int rc;
+    uint64_t start;
+    size_t n;
+
+    if (c->rlen == 0)
         return 0;
+    /* A client that knows we speak HTTP/2 starts with its preface. */
+    if (http2 && c->ssl == NULL && c->nrequests == 0 && c->req.pos == 0) {
+        n = c->rlen < H2_PREFACE_LEN ? c->rlen : H2_PREFACE_LEN;
+        if (memcmp(c->rbuf, H2_PREFACE, n) == 0) {
+            if (n < H2_PREFACE_LEN)
+                return 0;
+            c->state = CONN_H2;
+            return 1;
+        }
+    }
+    start = metrics_now();
+    rc = http_parse_request(&c->req, c->rbuf, c->rlen);
+    c->wstart = metrics_now();
+    c->parsetime += c->wstart - start;
+    if (rc != 0) {
+        metrics_time(STAGE_PARSE, c->parsetime);
+        c->parsetime = 0;
+    }
+    if (rc < 0) {
+        c->rlen = 0;
+        http_request_init(&c->req);
+        c->keepalive = 0;
+        clienterror(c, "request head", "400", "Bad Request",
+                    "We couldn't parse the request head");
+        accesslog_request(&c->peer, NULL, c->status, c->bodylen);
+        c->state = CONN_WRITE;
+        return 1;
+    }
+    if (rc > 0) {
+        if (http2 && h2_upgrade(c)) {
+            c->state = CONN_H2;
+            return 1;
+        }
+        metrics_count(COUNTER_REQUESTS, 1);
+        doit(c, &c->req);
+        start = c->wstart;
+        c->wstart = metrics_now();
+        metrics_time(STAGE_RESOLVE, c->wstart - start);
+        /* A proxied request stays in rbuf until it is answered. */
+        if (c->state == CONN_PROXY || c->state == CONN_FCGI)
+            return 1;
+        conn_consume(c, rc);
+        c->state = CONN_WRITE;
+        return 1;
     }
 
-    serve_static(connfd, filename, sbuf.st_size);
+    if (c->rlen == MAXBUF) {
+        c->rlen = 0;
+        http_request_init(&c->req);
+        c->keepalive = 0;
+        clienterror(c, "request head", "431",
+                    "Request Header Fields Too Large",
+                    "The request head doesn't fit our buffer");
+        accesslog_request(&c->peer, NULL, c->status, c->bodylen);
+        c->wstart = metrics_now();
+        c->state = CONN_WRITE;
+        return 1;
+    }
     return 0;
 }
 
-void clienterror(int fd, const char *cause, const char *errnum,
-                 const char *shortmsg, const char *longmsg) {
-    char buf[MAXBUF], body[MAXBUF];
-    size_t body_len;
+/*
+ * conn_consume - Log the request of c, now that its response is known,
+ *     and drop it and the len bytes it took from rbuf.
+ */
+void conn_consume(struct conn *c, size_t len) {
+    accesslog_request(&c->peer, &c->req, c->status, c->bodylen);
+    c->rlen -= len;
+    memmove(c->rbuf, c->rbuf + len, c->rlen);
+    http_request_init(&c->req);
+}
 
-    /* Build the HTTP response body. */
-    sprintf(body, "<html><title>Error</title>");
-    sprintf(body, "%s<body bgcolor=ffffff>\r\n", body);
-    sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-    sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-    sprintf(body, "%s<hr><em>%s</em>\r\n", body, httpd_name);
-    body_len = strlen(body);
-
-    /* Send the HTTP response. */
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    sprintf(buf, "%sContent-type: text/html\r\n", buf);
-    sprintf(buf, "%sContent-length: %d\r\n\r\n", buf, (int)body_len);
-    if (rio_writen(fd, buf, strlen(buf)) < 0)
-        unix_errq("rio_writen error");
-    if (rio_writen(fd, body, body_len) < 0)
-        unix_errq("rio_writen error");
-    log("%s", buf);
-}
-
-void read_requesthdrs(rio_t *rp) {
-    char buf[MAXLINE];
-
-    /* Skip request headers. */
-    if (rio_readlineb(rp, buf, MAXLINE) < 0)
-        unix_errq("rio_readlineb error");
-    log("%s", buf);
-    while (strcmp(buf, "\r\n")) {
-        if (rio_readlineb(rp, buf, MAXLINE) < 0)
-            unix_errq("rio_readlineb error");
-        log("%s", buf);
-    }
-}
-
-int parse_uri(char *uri, char *filename) {
-    struct stat sbuf;
+/*
+ * conn_written - Finish the response c has sent. Returns 1 and leaves c
+ *     in CONN_READ if the connection is kept alive, 0 if it is to be
+ *     closed.
+ */
+int conn_written(struct conn *c) {
+    metrics_time(STAGE_WRITE, metrics_now() - c->wstart);
+    metrics_status(c->status);
+    conn_done(c);
+    c->state = CONN_READ;
+    /* Connections told to stay open before a drain close all the same. */
+    return c->keepalive && !drainflag;
+}
 
-    if (strcmp(workdir, "/") == 0)
-        strcpy(filename, "");
-    else
-        strcpy(filename, workdir);
-    strcat(filename, uri);
+/*
+ * conn_sent - Skip n bytes of the head and in-memory body, which have
+ *     been sent.
+ */
+void conn_sent(struct conn *c, size_t n) {
+    metrics_count(COUNTER_BYTES, n);
+    iov_skip(c->iov, &c->iovpos, c->iovcnt, n);
+}
 
-    if (uri[strlen(uri) - 1] == '/')
-        strcat(filename, "index.html");
-    else {
-        if (stat(filename, &sbuf) < 0)
-            return -1;
-        if (S_ISDIR(sbuf.st_mode))
-            strcat(filename, "/index.html");
+/*
+ * iov_skip - Skip n bytes of iov[*pos, cnt), which have been written,
+ *     moving *pos past the vectors they used up.
+ */
+void iov_skip(struct iovec *iov, int *pos, int cnt, size_t n) {
+    for (; *pos < cnt; ++*pos) {
+        if (n < iov[*pos].iov_len) {
+            iov[*pos].iov_base = (char *)iov[*pos].iov_base + n;
+            iov[*pos].iov_len -= n;
+            break;
+        }
+        n -= iov[*pos].iov_len;
     }
-    return 0;
 }
 
-void get_filetype(char *filename, char *filetype) {
-    if (strstr(filename, ".html"))
-        strcpy(filetype, "text/html");
-    else if (strstr(filename, ".css"))
-        strcpy(filetype, "text/css");
-    else if (strstr(filename, ".gif"))
-        strcpy(filetype, "image/gif");
-    else if (strstr(filename, ".png"))
-        strcpy(filetype, "image/png");
-    else if (strstr(filename, ".jpg"))
-        strcpy(filetype, "image/jpeg");
-    else if (strstr(filename, ".jpeg"))
-        strcpy(filetype, "image/jpeg");
-    else if (strstr(filename, ".ico"))
-        strcpy(filetype, "image/ico");
-    else if (strstr(filename, ".js"))
-        strcpy(filetype, "application/js");
-    else if (strstr(filename, ".json"))
-        strcpy(filetype, "application/json");
-    else
-        strcpy(filetype, "text/plain");
+/*
+ * conn_handshake - Go on with the TLS handshake of c. Returns like
+ *     tls_handshake(), and leaves c in CONN_READ once it is done, or in
+ *     CONN_H2 if the client picked HTTP/2.
+ */
+int conn_handshake(struct conn *c) {
+    int rc;
+
+    if ((rc = tls_handshake(c->ssl, &c->ktls)) == 0)
+        c->state = http2 && tls_alpn_h2(c->ssl) ? CONN_H2 : CONN_READ;
+    return rc;
 }
 
-void serve_static(int fd, char *filename, int filesize) {
-    int srcfd;
-    char *srcp, filetype[MAXLINE], buf[MAXBUF];
-
-    /* Send response headers to client. */
-    get_filetype(filename, filetype);
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");
-    sprintf(buf, "%sServer: %s\r\n", buf, httpd_name);
-    sprintf(buf, "%sConnection: close\r\n", buf);
-    sprintf(buf, "%sContent-length: %d\r\n", buf, filesize);
-    sprintf(buf, "%sContent-type: %s\r\n\r\n", buf, filetype);
-    if (rio_writen(fd, buf, strlen(buf)) < 0)
-        unix_errq("rio_writen error");
-    log("Response headers:\n%s", buf);
-
-    /* Send response body to client. */
-    if ((srcfd = open(filename, O_RDONLY, 0)) < 0)
-        unix_errq("open error");
-    if ((srcp = mmap(NULL, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0)) == MAP_FAILED)
-        unix_errq("mmap error");
-    if (close(srcfd) != 0)
-        unix_errq("close error");
-    if (rio_writen(fd, srcp, filesize) < 0)
-        unix_errq("rio_writen error");
-    if (munmap(srcp, filesize) != 0)
-        unix_errq("munmap error");
+/*
+ * conn_read - Read up to len bytes of the request stream of c, like
+ *     read(2).
+ */
+ssize_t conn_read(struct conn *c, char *buf, size_t len) {
+    if (c->ssl != NULL)
+        return tls_read(c->ssl, buf, len);
+    return read(c->fd, buf, len);
+}
+
+/*
+ * conn_sendmsg - Send the vectors of msg to c, like sendmsg(2). Without
+ *     kTLS, as much of them as fits goes into one record, so that a head
+ *     and a small body still share a packet. A retry after EAGAIN starts
+ *     with the same vectors, so it sends the same bytes.
+ */
+ssize_t conn_sendmsg(struct conn *c, struct msghdr *msg, int flags) {
+    char buf[TLS_RECORD];
+    struct iovec *iov = msg->msg_iov;
+    size_t i, len, n = 0;
+
+    if (c->ssl == NULL || c->ktls)
+        return sendmsg(c->fd, msg, flags);
+    if (iov[0].iov_len >= sizeof(buf))
+        return tls_write(c->ssl, iov[0].iov_base, iov[0].iov_len);
+    for (i = 0; i < msg->msg_iovlen && n < sizeof(buf); ++i) {
+        len = iov[i].iov_len < sizeof(buf) - n ? iov[i].iov_len
+                                                : sizeof(buf) - n;
+        memcpy(buf + n, iov[i].iov_base, len);
+        n += len;
+    }
+    return tls_write(c->ssl, buf, n);
+}
+
+/*
+ * conn_sendfile - Send up to len bytes of file fd from *off on to c, like
+ *     sendfile(2). Without kTLS the file has to pass through user space
+ *     to be encrypted, a record at a time. A retry after EAGAIN reads the
+ *     same bytes again.
+ */
+ssize_t conn_sendfile(struct conn *c, int fd, off_t *off, size_t len) {
+    char buf[TLS_RECORD];
+    ssize_t n;
+
+    if (c->ssl == NULL || c->ktls)
+        return sendfile(c->fd, fd, off, len);
+    if ((n = pread(fd, buf, len < sizeof(buf) ? len : sizeof(buf), *off))
+        <= 0)
+        return n;
+    if ((n = tls_write(c->ssl, buf, n)) > 0)
+        *off += n;
+    return n;
+}
+
+/*
+ * conn_splice_in - Move up to len bytes of the request body of c into
+ *     its pipe, which is empty, like splice(2). What TLS decrypts passes
+ *     through user space, a record at a time, which the pipe always
+ *     takes whole.
+ */
+ssize_t conn_splice_in(struct conn *c, size_t len) {
+    char buf[TLS_RECORD];
+    ssize_t n;
+
+    if (c->ssl == NULL)
+        return splice(c->fd, NULL, c->splicefd[1], NULL, len,
+                      SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if ((n = tls_read(c->ssl, buf, len < sizeof(buf) ? len : sizeof(buf)))
+        <= 0)
+        return n;
+    return write(c->splicefd[1], buf, n);
+}
+
+/*
+ * conn_splice_out - Move up to len bytes from the pipe of c to the
+ *     client, like splice(2). Without kTLS they are read into wbuf to be
+ *     encrypted, and stay there until they are sent.
+ */
+ssize_t conn_splice_out(struct conn *c, size_t len) {
+    ssize_t n;
+
+    if (c->ssl == NULL || c->ktls)
+        return splice(c->splicefd[0], NULL, c->fd, NULL, len,
+                      SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (c->tlsstaged == 0) {
+        if ((n = read(c->splicefd[0], c->wbuf, len < MAXBUF ? len : MAXBUF))
+            <= 0)
+            return n;
+        c->tlsstaged = n;
+    }
+    if ((n = tls_write(c->ssl, c->wbuf, c->tlsstaged)) > 0) {
+        c->tlsstaged -= n;
+        memmove(c->wbuf, c->wbuf + n, c->tlsstaged);
+    }
+    return n;
+}
+
+/*
+ * conn_nodelay - Turn Nagle's algorithm off on c, for a body relayed in
+ *     pieces of any size, which it would hold back until the client
+ *     acknowledges the one before.
+ */
+void conn_nodelay(struct conn *c) {
+    int one = 1;
+
+    if (!c->nodelay) {
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        c->nodelay = 1;
+    }
+}
+
+/*
+ * peer_name - Write the address of the client of c to addr, which has
+ *     room for INET6_ADDRSTRLEN bytes. Returns its port, or 0 if it isn't
+ *     an internet address.
+ */
+int peer_name(struct conn *c, char *addr) {
+    const void *src = NULL;
+    int port = 0;
+
+    if (c->peer.ss_family == AF_INET) {
+        src = &((struct sockaddr_in *)&c->peer)->sin_addr;
+        port = ntohs(((struct sockaddr_in *)&c->peer)->sin_port);
+    }
+    else if (c->peer.ss_family == AF_INET6) {
+        src = &((struct sockaddr_in6 *)&c->peer)->sin6_addr;
+        port = ntohs(((struct sockaddr_in6 *)&c->peer)->sin6_port);
+    }
+    if (src == NULL
+        || inet_ntop(c->peer.ss_family, src, addr, INET6_ADDRSTRLEN) == NULL)
+        strcpy(addr, "unknown");
+    return port;
+}
+
+/*
+ * conn_flush - Write the pending response. The head and an in-memory body
+ *     go out in one sendmsg(2), with MSG_MORE if a file or relayed body
+ *     follows so that they share packets with it. A file body goes from
+ *     the file to the socket with sendfile(2) without passing through user
+ *     space. The parts of a multipart body go out one after the other.
+ *     Returns 0 when everything is written, 1 if the socket would block
+ *     and -1 on error.
+ */
+int conn_flush(struct conn *c) {
+    struct msghdr msg;
+    ssize_t n;
+    int rc;
+
+    memset(&msg, 0, sizeof(msg));
+    do {
+        while (c->iovpos < c->iovcnt) {
+            msg.msg_iov = c->iov + c->iovpos;
+            msg.msg_iovlen = c->iovcnt - c->iovpos;
+            n = conn_sendmsg(c, &msg, c->fileoff < c->fileend
+                                      || c->partpos < c->nparts
+                                      || proxy_more(c)
+                                      ? MSG_MORE : 0);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return 1;
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            conn_sent(c, n);
+        }
+
+        while (c->fileoff < c->fileend) {
+            if (c->usesplice) {
+                if ((rc = conn_splice(c)) != 0)
+                    return rc;
+                break;
+            }
+
+            if ((n = conn_sendfile(c, c->filefd, &c->fileoff,
+                                   c->fileend - c->fileoff)) < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return 1;
+                if (errno == EINTR)
+                    continue;
+                if (errno != EINVAL && errno != ENOSYS)
+                    return -1;
+                /* The pipe is kept for later responses on this connection. */
+                if (c->splicefd[0] < 0 && pipe2(c->splicefd, O_NONBLOCK) < 0) {
+                    c->splicefd[0] = c->splicefd[1] = -1;
+                    return -1;
+                }
+                c->usesplice = 1;
+                continue;
+            }
+            if (n == 0)
+                return -1; /* The file shrank under us */
+            metrics_count(COUNTER_BYTES, n);
+        }
+    } while (conn_next_part(c));
+    return 0;
+}
+
+/*
+ * conn_splice - Fallback of conn_flush() for files sendfile(2) can't
+ *     read from: move the body through a pipe with splice(2), which still
+ *     keeps it out of user space. Data in the pipe survives EAGAIN on the
+ *     socket. Returns like conn_flush().
+ */
+int conn_splice(struct conn *c) {
+    ssize_t n;
+
+    while (c->fileoff < c->fileend || c->spliced > 0) {
+        /* Refill the pipe from the file. */
+        if (c->spliced == 0) {
+            n = splice(c->filefd, &c->fileoff, c->splicefd[1], NULL,
+                       c->fileend - c->fileoff, SPLICE_F_MOVE);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return -1;
+            c->spliced = n;
+        }
+
+        /* Drain it into the socket. */
+        n = splice(c->splicefd[0], NULL, c->fd, NULL, c->spliced,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK
+                   | (c->fileoff < c->fileend ? SPLICE_F_MORE : 0));
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 1;
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        metrics_count(COUNTER_BYTES, n);
+        c->spliced -= n;
+    }
+    return 0;
+}
+
+/*
+ * conn_next_part - Queue the next part of a multipart body behind what c
+ *     has left to send, which is nothing but for the first part. Returns
+ *     0 if there is no part left.
+ */
+int conn_next_part(struct conn *c) {
+    struct part *p;
+    char *data = c->entry != NULL ? c->entry->data : NULL;
+
+    if (c->partpos == c->nparts)
+        return 0;
+    p = &c->parts[c->partpos++];
+    if (c->iovpos == c->iovcnt)
+        c->iovcnt = c->iovpos = 0;
+    c->iov[c->iovcnt].iov_base = p->head;
+    c->iov[c->iovcnt++].iov_len = p->headlen;
+    if (data != NULL && p->start < p->end) {
+        c->iov[c->iovcnt].iov_base = data + p->start;
+        c->iov[c->iovcnt++].iov_len = p->end - p->start;
+    }
+    else {
+        c->fileoff = p->start;
+        c->fileend = p->end;
+    }
+    return 1;
+}
+
+/*
+ * conn_done - Release the resources of the current response.
+ */
+void conn_done(struct conn *c) {
+    /* A cached file descriptor belongs to its entry. */
+    if (c->entry != NULL)
+        cache_release(c->entry);
+    else if (c->filefd >= 0 && close(c->filefd) != 0)
+        unix_errq("close error");
+    free(c->body);
+    arena_reset(&c->arena);
+    c->body = NULL;
+    c->parts = NULL;
+    c->nparts = c->partpos = 0;
+    c->entry = NULL;
+    c->filefd = -1;
+    c->fileoff = c->fileend = 0;
+    c->usesplice = 0;
+    c->spliced = 0;
+    c->iovcnt = c->iovpos = 0;
+}
+
+/*
+ * uring_worker_thread - The worker loop of the io_uring engine. Instead
+ *     of waiting for readiness and then making the system calls, every
+ *     worker keeps requests in flight on its own ring: a multishot accept
+ *     on its listening socket, and a receive or a send on every
+ *     connection. New requests are submitted and completions reaped with
+ *     one io_uring_enter(2) per round.
+ */
+void *uring_worker_thread(void *arg) {
+    struct worker *w = arg;
+    struct io_uring_cqe *cqe;
+    struct conn *c;
+    int i, draining = 0;
+    time_t now;
+
+    worker_setup(w);
+
+    /* Only this thread submits, so it sets the ring up. */
+    if (uring_init(&w->ring, URING_ENTRIES) != 0)
+        unix_errq("uring_init error");
+    if (uring_bufring_init(&w->ring, &w->bufs, 0, URING_NBUFS,
+                           URING_BUFSIZE) != 0) {
+        unix_err("uring_bufring_init error, worker %ld receives into "
+                 "connection buffers", (long)(w - workers));
+        w->bufs.nbufs = 0;
+    }
+    uring_accept(w);
+
+    while (!termflag && !(draining && w->head == NULL)) {
+        /* Wake up at least once a second to close idle connections. */
+        if (uring_enter(&w->ring, 1, 1000) != 0)
+            unix_errq("io_uring_enter error");
+        while ((cqe = uring_peek(&w->ring)) != NULL) {
+            uring_complete(w, cqe);
+            uring_seen(&w->ring);
+        }
+
+        /* The timeout list is ordered, so expired connections are in front. */
+        now = time(NULL);
+        while ((c = w->head) != NULL
+               && now - c->last_active >= keepalive_timeout) {
+            log("close idle connfd %d\n\n", c->fd);
+            uring_close(w, c);
+        }
+        if (drainflag && !draining) {
+            uring_drain(w);
+            draining = 1;
+        }
+    }
+
+    /*
+     * The kernel may still write into connections with requests in
+     * flight, so cancel everything and give it a second to complete.
+     */
+    while (w->head != NULL)
+        uring_close(w, w->head);
+    if (w->accepting)
+        uring_prep_cancel(uring_get(w, 1), w->listenfd, OP_CANCEL);
+    for (i = 0; i < 10 && (w->nconns > 0 || w->accepting); ++i) {
+        if (uring_enter(&w->ring, 1, 100) != 0)
+            unix_errq("io_uring_enter error");
+        while ((cqe = uring_peek(&w->ring)) != NULL) {
+            uring_complete(w, cqe);
+            uring_seen(&w->ring);
+        }
+    }
+    uring_destroy(&w->ring);
+    if (w->bufs.nbufs > 0)
+        uring_bufring_destroy(&w->bufs);
+    /* Connections the kernel didn't let go of are left to exit(). */
+    if (w->nconns == 0) {
+        pool_destroy(&w->conns);
+        pool_destroy(&w->connbufs);
+    }
+    if (close(w->listenfd) != 0)
+        unix_errq("close listenfd error");
+    return NULL;
+}
+
+/*
+ * uring_get - Return a submission queue entry of worker w, followed by
+ *     n - 1 more free ones, submitting what is queued first if needed.
+ */
+struct io_uring_sqe *uring_get(struct worker *w, unsigned n) {
+    struct io_uring_sqe *sqe;
+
+    if (uring_space(&w->ring) < n && uring_enter(&w->ring, 0, 0) != 0)
+        unix_errq("io_uring_enter error");
+    if ((sqe = uring_sqe(&w->ring)) == NULL)
+        app_errq("io_uring submission queue is full");
+    return sqe;
+}
+
+/*
+ * uring_complete - Go on with whatever completion cqe has finished.
+ */
+void uring_complete(struct worker *w, struct io_uring_cqe *cqe) {
+    struct conn *c = (struct conn *)(uintptr_t)(cqe->user_data & ~OP_MASK);
+    enum uring_op op = cqe->user_data & OP_MASK;
+    int res = cqe->res;
+    unsigned short bid;
+    struct sockaddr_storage peer;
+    socklen_t peerlen;
+
+    if (op == OP_CANCEL)
+        return;
+    if (op == OP_ACCEPT) {
+        /* Multishot accept stops on errors and has to be armed again. */
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            w->accepting = 0;
+            if (!termflag && !drainflag)
+                uring_accept(w);
+        }
+        if (res == -EMFILE || res == -ENFILE) {
+            while (accept_shed(w->listenfd) == 0)
+                ;
+            return;
+        }
+        if (res < 0) {
+            if (res != -ECANCELED) {
+                errno = -res;
+                unix_err("accept error");
+            }
+            return;
+        }
+        if (termflag) {
+            close(res);
+            return;
+        }
+        log("connfd: %d\n\n", res);
+        metrics_count(COUNTER_ACCEPTED, 1);
+        /* Several accepts may complete at once, so the address is asked. */
+        peerlen = sizeof(peer);
+        if (getpeername(res, (struct sockaddr *)&peer, &peerlen) != 0)
+            peer.ss_family = AF_UNSPEC;
+        if (admit_conn(res, &peer) != 0
+            || (c = conn_new(w, res, &peer)) == NULL)
+            return;
+        w->nconns++;
+        timeout_append(w, c);
+        uring_recv(w, c, 1);
+        return;
+    }
+
+    c->inflight--;
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        /* The buffer is returned right away, rbuf keeps the data. */
+        bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (!c->closing && res > 0) {
+            if (c->buf == NULL && conn_getbuf(w, c) != 0) {
+                uring_buf_put(&w->bufs, bid);
+                uring_close(w, c);
+                return;
+            }
+            memcpy(c->rbuf + c->rlen, uring_buf(&w->bufs, bid), res);
+        }
+        uring_buf_put(&w->bufs, bid);
+    }
+    if (c->closing) {
+        if (c->inflight == 0) {
+            conn_free(w, c);
+            w->nconns--;
+        }
+        return;
+    }
+
+    /* Anything that happens counts as activity. */
+    timeout_touch(w, c);
+
+    switch (op) {
+    case OP_RECV:
+        if (res == -ENOBUFS) {
+            uring_recv(w, c, 0); /* Provided buffers ran out */
+            return;
+        }
+        if (res <= 0) {
+            uring_close(w, c); /* EOF or error */
+            return;
+        }
+        c->rlen += res;
+        uring_drive(w, c);
+        return;
+    case OP_SEND:
+        if (res < 0) {
+            uring_close(w, c);
+            return;
+        }
+        conn_sent(c, res);
+        uring_send(w, c);
+        return;
+    case OP_SPLICEIN:
+        /* The linked splice into the socket goes on, or is cancelled. */
+        if (res <= 0) {
+            uring_close(w, c); /* Error, or the file shrank under us */
+            return;
+        }
+        c->fileoff += res;
+        c->spliced += res;
+        return;
+    case OP_SPLICEOUT:
+        if (res == -ECANCELED && c->spliced > 0)
+            res = 0; /* The file came up short, send what there is */
+        else if (res <= 0) {
+            uring_close(w, c);
+            return;
+        }
+        metrics_count(COUNTER_BYTES, res);
+        c->spliced -= res;
+        uring_send(w, c);
+        return;
+    default:
+        app_errq("unexpected io_uring completion %d", op);
+    }
+}
+
+/*
+ * uring_accept - Arm the multishot accept of worker w.
+ */
+void uring_accept(struct worker *w) {
+    uring_prep_accept(uring_get(w, 1), w->listenfd, OP_ACCEPT);
+    w->accepting = 1;
+}
+
+/*
+ * uring_drain - Have worker w finish up like worker_drain() does. The
+ *     socket stays open until the cancelled accept has completed.
+ */
+void uring_drain(struct worker *w) {
+    struct conn *c, *next;
+
+    if (w->accepting)
+        uring_prep_cancel(uring_get(w, 1), w->listenfd, OP_CANCEL);
+    for (c = w->head; c != NULL; c = next) {
+        next = c->next;
+        if (c->state == CONN_READ && c->rlen == 0 && c->nrequests > 0)
+            uring_close(w, c);
+    }
+}
+
+/*
+ * uring_recv - Receive more of the request head of c. If provided is set
+ *     and a whole buffer fits in rbuf, the kernel picks one of the
+ *     worker's buffers only once data arrives, and an idle c gives its
+ *     own back meanwhile. Otherwise it receives straight into rbuf.
+ */
+void uring_recv(struct worker *w, struct conn *c, int provided) {
+    struct io_uring_sqe *sqe;
+    uint64_t data = (uintptr_t)c | OP_RECV;
+
+    if (provided && w->bufs.nbufs > 0
+        && MAXBUF - c->rlen >= w->bufs.bufsize) {
+        if (c->rlen == 0 && c->buf != NULL)
+            conn_putbuf(w, c);
+        uring_prep_recv(uring_get(w, 1), c->fd, NULL, 0, w->bufs.bgid, data);
+    }
+    else {
+        if (c->buf == NULL && conn_getbuf(w, c) != 0) {
+            uring_close(w, c);
+            return;
+        }
+        sqe = uring_get(w, 1);
+        uring_prep_recv(sqe, c->fd, c->rbuf + c->rlen, MAXBUF - c->rlen, -1,
+                        data);
+    }
+    c->inflight++;
+}
+
+/*
+ * uring_send - Send the rest of the response of c: the head and an
+ *     in-memory body in one sendmsg(2), then a file body through the
+ *     pipe, then the same for every part of a multipart body. Once all of
+ *     it is sent, go on with the next request.
+ */
+void uring_send(struct worker *w, struct conn *c) {
+    if (c->iovpos < c->iovcnt) {
+        memset(&c->msg, 0, sizeof(c->msg));
+        c->msg.msg_iov = c->iov + c->iovpos;
+        c->msg.msg_iovlen = c->iovcnt - c->iovpos;
+        uring_prep_sendmsg(uring_get(w, 1), c->fd, &c->msg,
+                           c->fileoff < c->fileend || c->partpos < c->nparts
+                           ? MSG_MORE : 0, (uintptr_t)c | OP_SEND);
+        c->inflight++;
+        return;
+    }
+    if (c->fileoff < c->fileend || c->spliced > 0) {
+        uring_splice(w, c);
+        return;
+    }
+    if (conn_next_part(c)) {
+        uring_send(w, c);
+        return;
+    }
+    if (!conn_written(c)) {
+        uring_close(w, c);
+        return;
+    }
+    uring_drive(w, c);
+}
+
+/*
+ * uring_splice - Send the next part of the file body of c. A splice(2)
+ *     from the file into the pipe is linked to one from the pipe into the
+ *     socket, so a part takes one submission and never enters user
+ *     space. What a short send left in the pipe goes first.
+ */
+void uring_splice(struct worker *w, struct conn *c) {
+    struct io_uring_sqe *sqe;
+    size_t len;
+    int size;
+
+    if (c->splicefd[0] < 0) {
+        /*
+         * The splices block in io_uring's own threads. Filling the pipe
+         * must not, or it would wait for the splice linked behind it.
+         */
+        if (pipe2(c->splicefd, O_CLOEXEC) < 0
+            || fcntl(c->splicefd[1], F_SETFL, O_NONBLOCK) < 0) {
+            unix_err("pipe error");
+            uring_close(w, c);
+            return;
+        }
+        if ((size = fcntl(c->splicefd[1], F_SETPIPE_SZ, URING_PIPESIZE)) < 0)
+            size = fcntl(c->splicefd[1], F_GETPIPE_SZ);
+        c->pipesize = size > 0 ? size : 65536;
+    }
+
+    if (c->spliced > 0) {
+        sqe = uring_get(w, 1);
+        uring_prep_splice(sqe, c->splicefd[0], -1, c->fd, c->spliced,
+                          (uintptr_t)c | OP_SPLICEOUT);
+        if (c->fileoff < c->fileend)
+            sqe->splice_flags |= SPLICE_F_MORE;
+        c->inflight++;
+        return;
+    }
+
+    len = c->fileend - c->fileoff;
+    if (len > c->pipesize)
+        len = c->pipesize;
+    sqe = uring_get(w, 2);
+    uring_prep_splice(sqe, c->filefd, c->fileoff, c->splicefd[1], len,
+                      (uintptr_t)c | OP_SPLICEIN);
+    sqe->flags |= IOSQE_IO_LINK;
+    sqe = uring_sqe(&w->ring);
+    uring_prep_splice(sqe, c->splicefd[0], -1, c->fd, len,
+                      (uintptr_t)c | OP_SPLICEOUT);
+    if (c->fileoff + (off_t)len < c->fileend)
+        sqe->splice_flags |= SPLICE_F_MORE;
+    c->inflight += 2;
+}
+
+/*
+ * uring_drive - Serve the next request of c if it is buffered, otherwise
+ *     receive more.
+ */
+void uring_drive(struct worker *w, struct conn *c) {
+    if (conn_serve(c))
+        uring_send(w, c);
+    else
+        uring_recv(w, c, 1);
+}
+
+/*
+ * uring_close - Close connection c. Its requests in flight are cancelled,
+ *     and c is freed once the last of them has completed.
+ */
+void uring_close(struct worker *w, struct conn *c) {
+    c->closing = 1;
+    timeout_remove(w, c);
+    if (c->inflight == 0) {
+        conn_free(w, c);
+        w->nconns--;
+        return;
+    }
+    /* A splice blocked on the socket only notices the shutdown. */
+    shutdown(c->fd, SHUT_RDWR);
+    uring_prep_cancel(uring_get(w, 1), c->fd, OP_CANCEL);
+}
+
+/*
+ * timeout_append - Put c at the tail of the timeout list of worker w.
+ */
+void timeout_append(struct worker *w, struct conn *c) {
+    c->prev = w->tail;
+    c->next = NULL;
+    if (w->tail != NULL)
+        w->tail->next = c;
+    else
+        w->head = c;
+    w->tail = c;
+}
+
+/*
+ * timeout_remove - Take c off the timeout list of worker w.
+ */
+void timeout_remove(struct worker *w, struct conn *c) {
+    if (c->prev != NULL)
+        c->prev->next = c->next;
+    else
+        w->head = c->next;
+    if (c->next != NULL)
+        c->next->prev = c->prev;
+    else
+        w->tail = c->prev;
+    c->prev = c->next = NULL;
+}
+
+/*
+ * timeout_touch - Count c of worker w as active now, moving it to the
+ *     tail of the timeout list.
+ */
+void timeout_touch(struct worker *w, struct conn *c) {
+    timeout_remove(w, c);
+    c->last_active = time(NULL);
+    timeout_append(w, c);
+}
+
+/*
+ * doit - Serve request req, parsed in place from c->rbuf. The response is
+ *     left in c for conn_flush() to send, it doesn't point into rbuf.
+ */
+void doit(struct conn *c, struct http_request *req) {
+    char filename[MAXLINE], key[MAXLINE], uri[MAXLINE], *method;
+    const struct http_slice *hdr;
+    struct stat sbuf;
+    struct cache_entry *e;
+    struct proxy_route *route;
+    struct fcgi_route *app;
+    unsigned long gen;
+    int rc;
+
+    /* The space after the method can become its terminator. */
+    method = req->method.p;
+    method[req->method.len] = '\0';
+    log("%s %.*s HTTP/1.%d\n", method, (int)req->target.len, req->target.p,
+        req->minor_version);
+
+    /* HTTP/1.1 defaults to keep-alive, HTTP/1.0 has to ask for it. */
+    c->keepalive = (req->minor_version >= 1);
+    if ((hdr = http_find_header(req, "Connection")) != NULL) {
+        if (http_has_token(hdr, "close"))
+            c->keepalive = 0;
+        else if (http_has_token(hdr, "keep-alive"))
+            c->keepalive = 1;
+    }
+    if (++c->nrequests >= keepalive_requests || drainflag)
+        c->keepalive = 0;
+
+    /* Whatever the target maps to under workdir has to fit a file name. */
+    if (req->target.len + strlen(workdir) + sizeof("/index.html") > MAXLINE) {
+        c->keepalive = 0;
+        clienterror(c, "request target", "414", "URI Too Long",
+                    "The uri is longer than we accept");
+        return;
+    }
+    /* Normalize a copy, the access log wants the target as it was sent. */
+    memcpy(uri, req->target.p, req->target.len);
+    uri[req->target.len] = '\0';
+    if (normalize_uri(uri) != 0) {
+        c->keepalive = 0;
+        clienterror(c, uri, "400", "Bad Request",
+                    "We couldn't understand this uri");
+        return;
+    }
+
+    /* Paths a backend serves go there, whatever the method. */
+    if (c->stream != NULL
+        && (proxy_match(uri) != NULL || fcgi_match(uri) != NULL)) {
+        /* We only talk to backends for HTTP/1.1 clients. */
+        h2_require_http11(c);
+        return;
+    }
+    if ((route = proxy_match(uri)) != NULL) {
+        proxy_start(c, route, uri, req);
+        return;
+    }
+    if ((app = fcgi_match(uri)) != NULL) {
+        fcgi_start(c, app, uri, req);
+        return;
+    }
+
+    /*
+     * Only backends take request bodies. A body sent here would be taken
+     * for the next request, so the connection ends with this response.
+     */
+    if (c->stream == NULL && request_has_body(req))
+        c->keepalive = 0;
+
+    /* Check method. */
+    if (strcmp(method, "GET")) { /* We only support GET method */
+        /* We can't tell where a request body ends, so close. */
+        c->keepalive = 0;
+        clienterror(c, method, "501", "Not Implemented",
+                    "We haven't implemented this method");
+        return;
+    }
+
+    if (metrics_path != NULL && strcmp(uri, metrics_path) == 0) {
+        serve_metrics(c);
+        return;
+    }
+
+    /*
+     * The path uri maps to under workdir is the cache key. A fresh hit
+     * is served without touching the file system.
+     */
+    snprintf(key, sizeof(key), "%s%s",
+             strcmp(workdir, "/") == 0 ? "" : workdir, uri);
+    if ((e = cache_lookup(key)) != NULL) {
+        if (cache_fresh(e)) {
+            serve_encoded(c, e, req);
+            return;
+        }
+        cache_invalidate(key);
+        cache_release(e);
+    }
+    gen = cache_generation();
+
+    /* Parse uri to local filename. */
+    if ((rc = parse_uri(uri, filename, &sbuf)) > 0) {
+        c->keepalive = 0;
+        clienterror(c, "request target", "414", "URI Too Long",
+                    "The uri is longer than we accept");
+        return;
+    }
+    if (rc < 0) {
+        clienterror(c, filename, "404", "Not Found",
+                    "We couldn't find this file");
+        return;
+    }
+
+    /* Check permission. */
+    if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
+        clienterror(c, filename, "403", "Forbidden",
+                    "We couldn't read the file");
+        return;
+    }
+
+    serve_static(c, key, filename, &sbuf, gen, req, cache_control(uri));
+}
+
+/*
+ * cache_fresh - Check that cached entry e still matches its file. While
+ *     the document root is watched, changes drop entries from the cache
+ *     right away, so every entry found is fresh. Otherwise it is trusted
+ *     within cache_ttl seconds of the last check. An entry with a weak
+ *     tag is stale as soon as its file can be given a strong one.
+ */
+int cache_fresh(struct cache_entry *e) {
+    struct stat sbuf;
+    time_t now;
+
+    if (e->etag[0] == 'W' && e->mtime < time(NULL) - 1)
+        return 0;
+    if (watch_active())
+        return 1;
+    now = time(NULL);
+    if (now - __atomic_load_n(&e->checked, __ATOMIC_RELAXED) < cache_ttl)
+        return 1;
+    if (stat(e->filename, &sbuf) < 0 || sbuf.st_ino != e->ino
+        || sbuf.st_size != e->filesize || sbuf.st_mtime != e->mtime)
+        return 0;
+    __atomic_store_n(&e->checked, now, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/*
+ * clienterror - Build an error response in c.
+ */
+void clienterror(struct conn *c, const char *cause, const char *errnum,
+                 const char *shortmsg, const char *longmsg) {
+    char body[MAXBUF];
+    int body_len;
+
+    /* Build the HTTP response body. */
+    body_len = snprintf(body, sizeof(body),
+                        "<html><title>Error</title>"
+                        "<body bgcolor=ffffff>\r\n"
+                        "%s: %s\r\n"
+                        "<p>%s: %.1024s\r\n"
+                        "<hr><em>%s</em>\r\n",
+                        errnum, shortmsg, longmsg, cause, httpd_name);
+
+    /* Build the HTTP response head, followed by the body. */
+    c->iov[0].iov_base = c->wbuf;
+    c->iov[0].iov_len = snprintf(c->wbuf, MAXBUF,
+                                 "HTTP/1.1 %s %s\r\n"
+                                 "Connection: %s\r\n"
+                                 "Content-type: text/html\r\n"
+                                 "Content-length: %d\r\n\r\n"
+                                 "%s",
+                                 errnum, shortmsg,
+                                 c->keepalive ? "keep-alive" : "close",
+                                 body_len, body);
+    c->iovcnt = 1;
+    c->iovpos = 0;
+    c->status = atoi(errnum);
+    c->bodylen = body_len;
+    log("%s", c->wbuf);
+}
+
+/*
+ * normalize_uri - Turn uri into the canonical path of what it refers to,
+ *     in place: the query is dropped, repeated slashes and "." segments
+ *     are removed and ".." segments never climb above the root. Every
+ *     uri for one file thus gives the same cache key. Returns -1 if uri
+ *     is not an absolute path.
+ */
+int normalize_uri(char *uri) {
+    char *src, *dst, *seg;
+
+    if (uri[0] != '/')
+        return -1;
+    uri[strcspn(uri, "?#")] = '\0';
+
+    for (src = dst = uri; *src != '\0'; ) {
+        /* At a slash: look at the segment that follows. */
+        seg = src + 1;
+        if (*seg == '/') {
+            src = seg;
+            continue;
+        }
+        if (seg[0] == '.' && (seg[1] == '/' || seg[1] == '\0')) {
+            src = seg + 1;
+            if (*src == '\0')
+                *dst++ = '/';
+            continue;
+        }
+        if (seg[0] == '.' && seg[1] == '.' && (seg[2] == '/' || seg[2] == '\0')) {
+            while (dst > uri && *--dst != '/')
+                ;
+            src = seg + 2;
+            if (*src == '\0')
+                *dst++ = '/';
+            continue;
+        }
+
+        /* Copy the slash and the segment. */
+        *dst++ = *src++;
+        while (*src != '\0' && *src != '/')
+            *dst++ = *src++;
+    }
+    if (dst == uri)
+        *dst++ = '/';
+    *dst = '\0';
+    return 0;
+}
+
+/*
+ * request_has_body - Check if a body follows the head of req, or may.
+ */
+int request_has_body(struct http_request *req) {
+    off_t len;
+    int rc;
+
+    if (http_find_header(req, "Transfer-Encoding") != NULL)
+        return 1;
+    rc = http_content_length(req->headers, req->nheaders, &len);
+    return rc < 0 || (rc > 0 && len > 0);
+}
+
+/*
+ * parse_uri - Map uri to filename, MAXLINE bytes, under workdir, resolving
+ *     directories to their index.html, and stat the result into sbuf.
+ *     Returns -1 if there is no such file, or 1 if its name doesn't fit.
+ */
+int parse_uri(char *uri, char *filename, struct stat *sbuf) {
+    size_t n;
+
+    n = snprintf(filename, MAXLINE, "%s%s",
+                 strcmp(workdir, "/") == 0 ? "" : workdir, uri);
+    if (n >= MAXLINE)
+        return 1;
+
+    if (uri[strlen(uri) - 1] == '/')
+        n += snprintf(filename + n, MAXLINE - n, "index.html");
+    else {
+        if (stat(filename, sbuf) < 0)
+            return -1;
+        if (!S_ISDIR(sbuf->st_mode))
+            return 0;
+        n += snprintf(filename + n, MAXLINE - n, "/index.html");
+    }
+    if (n >= MAXLINE)
+        return 1;
+    return stat(filename, sbuf);
+}
+
+/*
+ * serve_static - Build the response for a regular file in c and add the
+ *     file to the cache under key, unless the cache has been invalidated
+ *     since generation gen. The file stays open until its body has been
+ *     sent. Compressed variants, which req may ask for, are only served
+ *     from the cache.
+ */
+void serve_static(struct conn *c, const char *key, char *filename,
+                  struct stat *sbuf, unsigned long gen,
+                  struct http_request *req, const char *cachecontrol) {
+    int srcfd;
+    const char *filetype;
+    char etag[CACHE_ETAGLEN];
+    struct cache_entry *e, file;
+
+    /* Without the cache, a file the client has is not even opened. */
+    make_etag(etag, sizeof(etag), sbuf->st_ino, sbuf->st_size,
+              sbuf->st_mtime, NULL);
+    if (cache_size == 0 && not_modified(req, etag, sbuf->st_mtime)) {
+        serve_not_modified(c, etag, sbuf->st_mtime, cachecontrol, 0);
+        return;
+    }
+
+    /* Open the file first, so that failing still gets a response. */
+    if ((srcfd = open(filename, O_RDONLY, 0)) < 0) {
+        clienterror(c, filename, "403", "Forbidden",
+                    "We couldn't read the file");
+        return;
+    }
+
+    if (cache_size > 0 && (e = cache_entry_new(key)) != NULL) {
+        e->gen = gen;
+        e->cachecontrol = cachecontrol;
+        if (cache_file(e, srcfd, filename, sbuf) == 0) {
+            cache_insert(e);
+            serve_encoded(c, e, req);
+            return;
+        }
+        cache_release(e);
+    }
+
+    /* The body goes out right behind the headers. */
+    filetype = mime_type(filename);
+    c->filefd = srcfd;
+    memset(&file, 0, sizeof(file));
+    file.fd = srcfd;
+    file.size = sbuf->st_size;
+    file.mtime = sbuf->st_mtime;
+    file.filetype = filetype;
+    file.cachecontrol = cachecontrol;
+    strcpy(file.etag, etag);
+    if (serve_range(c, &file, req))
+        return;
+
+    /* Build response headers. */
+    c->iov[0].iov_base = c->wbuf;
+    c->iov[0].iov_len = build_head(c->wbuf, MAXBUF, "200 OK",
+                                   sbuf->st_size, filetype, NULL);
+    c->iov[0].iov_len += build_validators(c->wbuf + c->iov[0].iov_len,
+                                          MAXBUF - c->iov[0].iov_len,
+                                          etag, sbuf->st_mtime, cachecontrol,
+                                          0);
+    c->iov[0].iov_len += build_connhdrs(c, c->wbuf + c->iov[0].iov_len,
+                                        MAXBUF - c->iov[0].iov_len);
+    c->iovcnt = 1;
+    c->iovpos = 0;
+    c->status = 200;
+    c->bodylen = sbuf->st_size;
+    log("Response headers:\n%s", c->wbuf);
+    c->fileoff = 0;
+    c->fileend = sbuf->st_size;
+}
+
+/*
+ * serve_encoded - Build the response for cached file e in c, with the
+ *     variant the Accept-Encoding header of req, if any, likes best. If
+ *     req is conditional and the client has that variant already, the
+ *     response is a 304. Ranges are always served from e itself. The
+ *     response takes over the caller's reference to e.
+ */
+void serve_encoded(struct conn *c, struct cache_entry *e,
+                   struct http_request *req) {
+    int order[NENCODINGS], n, i;
+    const struct http_slice *accept;
+    struct cache_entry *v;
+
+    if (e->variants != 0 && http_find_header(req, "Range") == NULL
+        && (accept = http_find_header(req, "Accept-Encoding")) != NULL) {
+        n = accept_encodings(accept, e->variants, order);
+        for (i = 0; i < n; ++i) {
+            if ((v = variant_get(e, order[i])) != NULL) {
+                cache_release(e);
+                e = v;
+                break;
+            }
+        }
+    }
+
+    if (not_modified(req, e->etag, e->mtime)) {
+        serve_not_modified(c, e->etag, e->mtime, e->cachecontrol,
+                           e->variants != 0);
+        cache_release(e);
+        return;
+    }
+    c->entry = e;
+    if (!serve_range(c, e, req))
+        serve_cached(c, e);
+}
+
+/*
+ * serve_cached - Build the response for cached file e in c. The response
+ *     takes over the caller's reference to e.
+ */
+void serve_cached(struct conn *c, struct cache_entry *e) {
+    c->status = 200;
+    c->bodylen = e->size;
+    c->entry = e;
+    c->iov[0].iov_base = e->head;
+    c->iov[0].iov_len = e->headlen;
+    c->iov[1].iov_base = c->wbuf;
+    c->iov[1].iov_len = build_connhdrs(c, c->wbuf, MAXBUF);
+    c->iovcnt = 2;
+    c->iovpos = 0;
+
+    if (e->data != NULL) {
+        c->iov[2].iov_base = e->data;
+        c->iov[2].iov_len = e->size;
+        c->iovcnt = 3;
+    }
+    else {
+        c->filefd = e->fd;
+        c->fileoff = 0;
+        c->fileend = e->size;
+    }
+}
+
+/*
+ * serve_range - Build a 206 response in c with the ranges of file e the
+ *     Range header of req asks for, or a 416 if none of them is in the
+ *     file. The body comes from e->data, or else from e->fd, and c->entry
+ *     must already hold e if it is cached. Returns 0 and builds nothing
+ *     if the whole file is to be sent instead: there is no Range, it is
+ *     one we don't take or the file no longer matches If-Range.
+ */
+int serve_range(struct conn *c, struct cache_entry *e,
+                struct http_request *req) {
+    struct http_range ranges[MAXRANGES];
+    const struct http_slice *hdr;
+    char boundary[24], type[64], *text;
+    size_t len, room;
+    off_t bodylen = 0;
+    int n, i;
+
+    if ((hdr = http_find_header(req, "Range")) == NULL || !if_range(req, e)
+        || (n = http_parse_ranges(hdr, e->size, ranges,
+                                  MAXRANGES)) < 0)
+        return 0;
+
+    c->iov[0].iov_base = c->wbuf;
+    c->iovcnt = 1;
+    c->iovpos = 0;
+    if (n == 0) {
+        len = snprintf(c->wbuf, MAXBUF,
+                       "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                       "Server: %s\r\n"
+                       "Content-Range: bytes */%lld\r\n"
+                       "Content-length: 0\r\n",
+                       httpd_name, (long long)e->size);
+        c->iov[0].iov_len = len + build_connhdrs(c, c->wbuf + len,
+                                                 MAXBUF - len);
+        c->status = 416;
+        c->bodylen = 0;
+        return 1;
+    }
+    if (e->data == NULL)
+        c->filefd = e->fd;
+    c->status = 206;
+
+    if (n == 1) {
+        c->bodylen = ranges[0].end - ranges[0].start;
+        len = build_head(c->wbuf, MAXBUF, "206 Partial Content",
+                         c->bodylen, e->filetype, NULL);
+        len += snprintf(c->wbuf + len, MAXBUF - len,
+                        "Content-Range: bytes %lld-%lld/%lld\r\n",
+                        (long long)ranges[0].start,
+                        (long long)ranges[0].end - 1, (long long)e->size);
+        if (e->data != NULL) {
+            c->iov[1].iov_base = e->data + ranges[0].start;
+            c->iov[1].iov_len = c->bodylen;
+            c->iovcnt = 2;
+        }
+        else {
+            c->fileoff = ranges[0].start;
+            c->fileend = ranges[0].end;
+        }
+    }
+    else {
+        /*
+         * Every part gets its head now, the closing boundary is a last
+         * part without bytes.
+         */
+        snprintf(boundary, sizeof(boundary), "%016llx",
+                 (unsigned long long)(metrics_now() ^ (uintptr_t)c));
+        snprintf(type, sizeof(type), "multipart/byteranges; boundary=%s",
+                 boundary);
+        room = (n + 1) * (160 + strlen(e->filetype));
+        if ((c->parts = arena_alloc(&c->arena,
+                                    (n + 1) * sizeof(struct part) + room))
+            == NULL) {
+            clienterror(c, "ranges", "500", "Internal Server Error",
+                        "We couldn't build the response");
+            return 1;
+        }
+        text = (char *)(c->parts + n + 1);
+        for (i = 0; i <= n; ++i) {
+            c->parts[i].head = text;
+            if (i < n) {
+                len = snprintf(text, room,
+                               "%s--%s\r\n"
+                               "Content-type: %s\r\n"
+                               "Content-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                               i > 0 ? "\r\n" : "", boundary, e->filetype,
+                               (long long)ranges[i].start,
+                               (long long)ranges[i].end - 1,
+                               (long long)e->size);
+                c->parts[i].start = ranges[i].start;
+                c->parts[i].end = ranges[i].end;
+            }
+            else {
+                len = snprintf(text, room, "\r\n--%s--\r\n", boundary);
+                c->parts[i].start = c->parts[i].end = 0;
+            }
+            c->parts[i].headlen = len;
+            bodylen += len + c->parts[i].end - c->parts[i].start;
+            text += len;
+            room -= len;
+        }
+        c->nparts = n + 1;
+        c->bodylen = bodylen;
+        len = build_head(c->wbuf, MAXBUF, "206 Partial Content",
+                         bodylen, type, NULL);
+    }
+
+    len += build_validators(c->wbuf + len, MAXBUF - len, e->etag,
+                            e->mtime, e->cachecontrol, e->variants != 0);
+    len += build_connhdrs(c, c->wbuf + len, MAXBUF - len);
+    c->iov[0].iov_len = len;
+    conn_next_part(c);
+    return 1;
+}
+
+/*
+ * if_range - Check that the If-Range header of req, if any, matches file
+ *     e, so that a range of it may be sent. An entity tag has to match in
+ *     the strong comparison, a date has to be the exact Last-Modified.
+ */
+int if_range(struct http_request *req, struct cache_entry *e) {
+    const struct http_slice *hdr;
+    time_t date;
+
+    if ((hdr = http_find_header(req, "If-Range")) == NULL)
+        return 1;
+    if (hdr->len > 0 && (hdr->p[0] == '"' || hdr->p[0] == 'W'))
+        return e->etag[0] == '"' && http_slice_eq(hdr, e->etag);
+    return http_parse_date(hdr, &date) == 0 && date == e->mtime;
+}
+
+/*
+ * serve_not_modified - Build a 304 response in c for the file with etag
+ *     and mtime. It repeats the headers the full response would have
+ *     that caches care about.
+ */
+void serve_not_modified(struct conn *c, const char *etag, time_t mtime,
+                        const char *cachecontrol, int vary) {
+    size_t len;
+
+    len = snprintf(c->wbuf, MAXBUF,
+                   "HTTP/1.1 304 Not Modified\r\n"
+                   "Server: %s\r\n", httpd_name);
+    len += build_validators(c->wbuf + len, MAXBUF - len, etag,
+                            mtime, cachecontrol, vary);
+    len += build_connhdrs(c, c->wbuf + len, MAXBUF - len);
+    c->iov[0].iov_base = c->wbuf;
+    c->iov[0].iov_len = len;
+    c->iovcnt = 1;
+    c->iovpos = 0;
+    c->status = 304;
+    c->bodylen = 0;
+}
+
+/*
+ * not_modified - Check if the conditional headers of req say that the
+ *     client has the file with etag and mtime already. If-None-Match
+ *     wins over If-Modified-Since.
+ */
+int not_modified(struct http_request *req, const char *etag, time_t mtime) {
+    const struct http_slice *hdr;
+    time_t since;
+
+    if ((hdr = http_find_header(req, "If-None-Match")) != NULL)
+        return http_etag_match(hdr, etag);
+    if ((hdr = http_find_header(req, "If-Modified-Since")) != NULL
+        && http_parse_date(hdr, &since) == 0)
+        return mtime <= since;
+    return 0;
+}
+
+/*
+ * cache_control - Return the Cache-Control value for uri, from the rule
+ *     with the longest prefix of it, or NULL if there is none.
+ */
+const char *cache_control(const char *uri) {
+    const char *value = NULL;
+    size_t len, best = 0;
+    int i;
+
+    for (i = 0; i < ncontrols; ++i) {
+        len = strlen(cache_controls[i].prefix);
+        if (len > best && strncmp(uri, cache_controls[i].prefix, len) == 0) {
+            value = cache_controls[i].value;
+            best = len;
+        }
+    }
+    return value;
+}
+
+/*
+ * make_etag - Build the entity tag of a file from its inode, size and
+ *     mtime, and the name of its encoding if it has one. The tag is weak
+ *     while the file may still change within the second of its mtime,
+ *     which would leave all three as they are.
+ */
+void make_etag(char *buf, size_t size, ino_t ino, off_t filesize,
+               time_t mtime, const char *encoding) {
+    snprintf(buf, size, "%s\"%lx-%llx-%llx%s%s\"",
+             mtime >= time(NULL) - 1 ? "W/" : "", (unsigned long)ino,
+             (unsigned long long)filesize, (unsigned long long)mtime,
+             encoding != NULL ? "-" : "", encoding != NULL ? encoding : "");
+}
+
+/*
+ * serve_metrics - Build a response in c with the metrics of all threads,
+ *     the cache and fdq, in the Prometheus text format.
+ */
+void serve_metrics(struct conn *c) {
+    FILE *fp;
+    char *body = NULL;
+    size_t len = 0;
+    struct cache_stats st;
+
+    if ((fp = open_memstream(&body, &len)) == NULL) {
+        clienterror(c, "metrics", "500", "Internal Server Error",
+                    "We couldn't collect the metrics");
+        return;
+    }
+    metrics_write(fp);
+    cache_getstats(&st);
+    fprintf(fp, "# HELP httpd_cache_hits_total File cache hits.\n"
+                "# TYPE httpd_cache_hits_total counter\n"
+                "httpd_cache_hits_total %lu\n"
+                "# HELP httpd_cache_misses_total File cache misses.\n"
+                "# TYPE httpd_cache_misses_total counter\n"
+                "httpd_cache_misses_total %lu\n"
+                "# HELP httpd_cache_evictions_total Files evicted from the cache.\n"
+                "# TYPE httpd_cache_evictions_total counter\n"
+                "httpd_cache_evictions_total %lu\n"
+                "# HELP httpd_cache_entries Files in the cache.\n"
+                "# TYPE httpd_cache_entries gauge\n"
+                "httpd_cache_entries %lu\n"
+                "# HELP httpd_cache_bytes Bytes the cache holds.\n"
+                "# TYPE httpd_cache_bytes gauge\n"
+                "httpd_cache_bytes %zu\n"
+                "# HELP httpd_queue_depth Connections waiting for a worker.\n"
+                "# TYPE httpd_queue_depth gauge\n"
+                "httpd_queue_depth %d\n"
+                "# HELP httpd_accesslog_dropped_total Access log records "
+                "dropped.\n"
+                "# TYPE httpd_accesslog_dropped_total counter\n"
+                "httpd_accesslog_dropped_total %lu\n",
+            st.hits, st.misses, st.evictions, st.entries, st.bytes,
+            queue_size(&fdq), accesslog_dropped());
+    proxy_write_metrics(fp);
+    fcgi_write_metrics(fp);
+    tls_write_metrics(fp);
+    if (fclose(fp) != 0) {
+        free(body);
+        clienterror(c, "metrics", "500", "Internal Server Error",
+                    "We couldn't collect the metrics");
+        return;
+    }
+
+    c->body = body;
+    c->iov[0].iov_base = c->wbuf;
+    c->iov[0].iov_len = snprintf(c->wbuf, MAXBUF,
+                                 "HTTP/1.1 200 OK\r\n"
+                                 "Server: %s\r\n"
+                                 "Content-length: %zu\r\n"
+                                 "Content-type: text/plain; version=0.0.4\r\n",
+                                 httpd_name, len);
+    c->iov[0].iov_len += build_connhdrs(c, c->wbuf + c->iov[0].iov_len,
+                                        MAXBUF - c->iov[0].iov_len);
+    c->iov[1].iov_base = body;
+    c->iov[1].iov_len = len;
+    c->iovcnt = 2;
+    c->iovpos = 0;
+    c->status = 200;
+    c->bodylen = len;
+}
+
+/*
+ * accept_encodings - Store in order the encodings in mask that the
+ *     Accept-Encoding value accept allows, the most wanted first. An
+ *     encoding the client likes less than none at all is left out.
+ *     Returns how many there are.
+ */
+int accept_encodings(const struct http_slice *accept, unsigned mask,
+                     int *order) {
+    int weight[NENCODINGS], identity, q, n = 0, i, enc;
+
+    identity = http_token_q(accept, "identity");
+    for (enc = 0; enc < NENCODINGS; ++enc) {
+        if (!(mask & 1u << enc)
+            || (q = http_token_q(accept, encodings[enc].name)) <= 0
+            || q < identity)
+            continue;
+        /* Ties keep our order. */
+        for (i = n; i > 0 && weight[i - 1] < q; --i) {
+            weight[i] = weight[i - 1];
+            order[i] = order[i - 1];
+        }
+        weight[i] = q;
+        order[i] = enc;
+        n++;
+    }
+    return n;
+}
+
+/*
+ * compressible - Check if files of filetype are worth compressing. Text
+ *     and XML or JSON based formats are, most image, audio, video and
+ *     archive formats are compressed already.
+ */
+int compressible(const char *filetype) {
+    static const char *const types[] = {
+        "application/javascript", "application/json", "application/xml",
+        "application/wasm", "application/x-sh", "application/postscript",
+        "application/vnd.ms-fontobject", "font/otf", "font/ttf",
+        "image/bmp", "image/vnd.microsoft.icon", "image/x-icon", NULL
+    };
+    const char *const *t;
+    size_t len = strlen(filetype);
+
+    if (strncmp(filetype, "text/", 5) == 0
+        || (len > 5 && (strcmp(filetype + len - 5, "+json") == 0
+                        || strcmp(filetype + len - 4, "+xml") == 0)))
+        return 1;
+    for (t = types; *t != NULL; ++t) {
+        if (strcmp(filetype, *t) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * variant_get - Return the variant of cached file e in encoding enc,
+ *     building and caching it on a miss. Returns NULL if there is none
+ *     worth serving.
+ */
+struct cache_entry *variant_get(struct cache_entry *e, int enc) {
+    char key[MAXLINE + 16];
+    unsigned long gen;
+    struct cache_entry *v;
+
+    snprintf(key, sizeof(key), "%s%c%s", e->key, CACHE_VARIANT,
+             encodings[enc].name);
+    if ((v = cache_lookup(key)) != NULL) {
+        if (cache_fresh(v))
+            goto found;
+        cache_invalidate(key);
+        cache_release(v);
+    }
+
+    /*
+     * The variant is only as fresh as e. If e is still cached after gen
+     * is taken, a change to its file will keep the variant out.
+     */
+    gen = cache_generation();
+    if ((v = cache_lookup(e->key)) == NULL)
+        return NULL;
+    cache_release(v);
+    if (v != e || (v = cache_entry_new(key)) == NULL)
+        return NULL;
+    v->gen = gen;
+    if (cache_variant(v, e, enc) != 0) {
+        cache_release(v);
+        return NULL;
+    }
+    cache_insert(v);
+
+found:
+    if (v->data == NULL && v->fd < 0) {
+        cache_release(v);
+        return NULL;
+    }
+    return v;
+}
+
+/*
+ * cache_file - Fill cache entry e for the file open as srcfd and note the
+ *     variants it has. Small files are read into memory and srcfd is
+ *     closed, larger ones keep srcfd. Returns -1 and leaves srcfd to the
+ *     caller on error.
+ */
+int cache_file(struct cache_entry *e, int srcfd, char *filename,
+               struct stat *sbuf) {
+    char head[MAXBUF], sidecar[MAXLINE + 8];
+    struct stat st;
+    int enc;
+
+    e->filetype = mime_type(filename);
+    for (enc = 0; enc < NENCODINGS; ++enc) {
+        snprintf(sidecar, sizeof(sidecar), "%s%s", filename,
+                 encodings[enc].suffix);
+        if (stat(sidecar, &st) == 0 && S_ISREG(st.st_mode))
+            e->sidecars |= 1u << enc;
+    }
+    e->variants = e->sidecars;
+    if (compressible(e->filetype) && sbuf->st_size >= GZIP_MINSIZE
+        && sbuf->st_size <= CACHE_MAXDATA)
+        e->variants |= 1u << ENC_GZIP;
+
+    make_etag(e->etag, sizeof(e->etag), sbuf->st_ino, sbuf->st_size,
+              sbuf->st_mtime, NULL);
+    e->headlen = build_head(head, sizeof(head), "200 OK", sbuf->st_size,
+                            e->filetype, NULL);
+    e->headlen += build_validators(head + e->headlen,
+                                   sizeof(head) - e->headlen, e->etag,
+                                   sbuf->st_mtime, e->cachecontrol,
+                                   e->variants != 0);
+    if ((e->filename = strdup(filename)) == NULL
+        || (e->head = malloc(e->headlen)) == NULL)
+        return -1;
+    memcpy(e->head, head, e->headlen);
+    e->size = e->filesize = sbuf->st_size;
+    e->ino = sbuf->st_ino;
+    e->mtime = sbuf->st_mtime;
+    e->checked = time(NULL);
+    return cache_read(e, srcfd);
+}
+
+/*
+ * cache_variant - Fill cache entry v for the variant of cached file e in
+ *     encoding enc, from the file precompressed that way or else by
+ *     compressing e. If the former is missing or the latter comes out no
+ *     smaller than e, v is left empty. Returns -1 on error.
+ */
+int cache_variant(struct cache_entry *v, struct cache_entry *e, int enc) {
+    char filename[MAXLINE + 8], head[MAXBUF];
+    struct stat sbuf;
+    ssize_t n;
+    int srcfd;
+
+    v->checked = time(NULL);
+    v->variants = e->variants;
+    v->cachecontrol = e->cachecontrol;
+    if (e->sidecars & 1u << enc) {
+        snprintf(filename, sizeof(filename), "%s%s", e->filename,
+                 encodings[enc].suffix);
+        if ((v->filename = strdup(filename)) == NULL)
+            return -1;
+        if ((srcfd = open(filename, O_RDONLY, 0)) < 0)
+            return 0;
+        if (fstat(srcfd, &sbuf) < 0) {
+            close(srcfd);
+            return 0;
+        }
+        v->size = v->filesize = sbuf.st_size;
+        v->ino = sbuf.st_ino;
+        v->mtime = sbuf.st_mtime;
+        if (cache_read(v, srcfd) != 0) {
+            close(srcfd);
+            return -1;
+        }
+    }
+    else {
+        /* Fresh as long as the file of e is unchanged. */
+        if ((v->filename = strdup(e->filename)) == NULL)
+            return -1;
+        v->filesize = e->filesize;
+        v->ino = e->ino;
+        v->mtime = e->mtime;
+        if ((n = gzip_data(e->data, e->size, &v->data)) < 0)
+            return -1;
+        if (n >= e->size) {
+            free(v->data);
+            v->data = NULL;
+            return 0;
+        }
+        v->size = n;
+    }
+
+    make_etag(v->etag, sizeof(v->etag), v->ino, v->filesize, v->mtime,
+              encodings[enc].name);
+    v->headlen = build_head(head, sizeof(head), "200 OK", v->size,
+                            e->filetype, encodings[enc].name);
+    v->headlen += build_validators(head + v->headlen,
+                                   sizeof(head) - v->headlen, v->etag,
+                                   v->mtime, v->cachecontrol, 1);
+    v->filetype = e->filetype;
+    if ((v->head = malloc(v->headlen)) == NULL)
+        return -1;
+    memcpy(v->head, head, v->headlen);
+    return 0;
+}
+
+/*
+ * cache_read - Give entry e the e->size bytes of the file open as srcfd.
+ *     Up to CACHE_MAXDATA bytes are read into memory and srcfd is closed,
+ *     more are served from srcfd. Returns -1 and leaves srcfd to the
+ *     caller on error.
+ */
+int cache_read(struct cache_entry *e, int srcfd) {
+    ssize_t n;
+    off_t off;
+
+    if (e->size > CACHE_MAXDATA) {
+        e->fd = srcfd;
+        return 0;
+    }
+
+    if ((e->data = malloc(e->size > 0 ? e->size : 1)) == NULL)
+        return -1;
+    for (off = 0; off < e->size; off += n) {
+        if ((n = pread(srcfd, e->data + off, e->size - off, off)) <= 0) {
+            if (n < 0 && errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            return -1;
+        }
+    }
+    if (close(srcfd) != 0)
+        unix_errq("close error");
+    return 0;
+}
+
+/*
+ * gzip_data - Compress the len bytes at src into a gzip stream in a new
+ *     buffer *dst. Returns the length of the stream, or -1 on error.
+ */
+ssize_t gzip_data(const char *src, size_t len, char **dst) {
+    z_stream zs;
+    ssize_t n = -1;
+
+    memset(&zs, 0, sizeof(zs));
+    /* 16 more window bits ask for a gzip header. */
+    if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+        return -1;
+    if ((*dst = malloc(deflateBound(&zs, len))) != NULL) {
+        zs.next_in = (Bytef *)src;
+        zs.avail_in = len;
+        zs.next_out = (Bytef *)*dst;
+        zs.avail_out = deflateBound(&zs, len);
+        if (deflate(&zs, Z_FINISH) == Z_STREAM_END)
+            n = zs.total_out;
+        else {
+            free(*dst);
+            *dst = NULL;
+        }
+    }
+    deflateEnd(&zs);
+    return n;
+}
+
+/*
+ * build_head - Build the status line and the headers that describe the
+ *     body, which is encoded with encoding unless it is NULL. Returns the
+ *     length.
+ */
+int build_head(char *buf, size_t size, const char *status, off_t filesize,
+               const char *filetype, const char *encoding) {
+    return snprintf(buf, size,
+                    "HTTP/1.1 %s\r\n"
+                    "Server: %s\r\n"
+                    "Content-length: %lld\r\n"
+                    "Content-type: %s\r\n"
+                    "%s%s%s",
+                    status, httpd_name, (long long)filesize, filetype,
+                    encoding != NULL ? "Content-Encoding: " : "",
+                    encoding != NULL ? encoding : "",
+                    encoding != NULL ? "\r\n" : "");
+}
+
+/*
+ * build_validators - Build the headers that a 304 repeats: ETag,
+ *     Last-Modified, Cache-Control unless cachecontrol is NULL, and Vary
+ *     if vary says the file has variants. Returns the length.
+ */
+int build_validators(char *buf, size_t size, const char *etag, time_t mtime,
+                     const char *cachecontrol, int vary) {
+    char date[64];
+    struct tm tm;
+
+    gmtime_r(&mtime, &tm);
+    strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return snprintf(buf, size,
+                    "ETag: %s\r\n"
+                    "Last-Modified: %s\r\n"
+                    "%s%s%s%s",
+                    etag, date,
+                    cachecontrol != NULL ? "Cache-Control: " : "",
+                    cachecontrol != NULL ? cachecontrol : "",
+                    cachecontrol != NULL ? "\r\n" : "",
+                    vary ? "Vary: Accept-Encoding\r\n" : "");
+}
+
+/*
+ * build_connhdrs - Build the headers that depend on the connection and
+ *     the empty line that ends the head. Returns the length.
+ */
+int build_connhdrs(struct conn *c, char *buf, size_t size) {
+    if (c->keepalive)
+        return snprintf(buf, size,
+                        "Connection: keep-alive\r\n"
+                        "Keep-Alive: timeout=%d\r\n\r\n", keepalive_timeout);
+    return snprintf(buf, size, "Connection: close\r\n\r\n");
 }
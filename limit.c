@@ -0,0 +1,178 @@
+#include "limit.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#define LIMIT_BUCKETS 256  /* Hash buckets per shard */
+
+/*
+ * A client address with connections open. IPv4 addresses are stored
+ * mapped to IPv6, so that a client has one key whichever way it came.
+ */
+struct client {
+    unsigned char addr[16];
+    int conns;
+    struct client *next;
+};
+
+/* Every shard has its own lock, so threads rarely wait for each other. */
+struct limit_shard {
+    pthread_mutex_t mutex;
+    struct client *buckets[LIMIT_BUCKETS];
+};
+
+static struct limit_shard *shards = NULL;
+static int max_conns = 0;      /* 0 for no limit */
+static int max_perclient = 0;  /* 0 for no limit */
+static int nconns = 0;         /* Counted only with max_conns */
+
+static unsigned long hash(const unsigned char *addr) {
+    unsigned long h = 14695981039346656037UL; /* FNV-1a */
+    int i;
+
+    for (i = 0; i < 16; ++i) {
+        h ^= addr[i];
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+/*
+ * client_key - Store the key of peer in addr. Returns -1 if peer has no
+ *     address to limit, such as a Unix socket.
+ */
+static int client_key(const struct sockaddr_storage *peer,
+                      unsigned char *addr) {
+    if (peer->ss_family == AF_INET6) {
+        memcpy(addr, &((const struct sockaddr_in6 *)peer)->sin6_addr, 16);
+        return 0;
+    }
+    if (peer->ss_family == AF_INET) {
+        memset(addr, 0, 10);
+        addr[10] = addr[11] = 0xff;
+        memcpy(addr + 12, &((const struct sockaddr_in *)peer)->sin_addr, 4);
+        return 0;
+    }
+    return -1;
+}
+
+/*
+ * limit_init - Allow at most maxconns connections in all, and at most
+ *     maxperclient from any one client address. 0 means no limit.
+ *     Returns -1 with errno set on error.
+ */
+int limit_init(int maxconns, int maxperclient) {
+    int i, rc;
+
+    max_conns = maxconns;
+    max_perclient = maxperclient;
+    if (maxperclient == 0)
+        return 0;
+    if ((shards = calloc(LIMIT_SHARDS, sizeof(struct limit_shard))) == NULL)
+        return -1;
+    for (i = 0; i < LIMIT_SHARDS; ++i) {
+        if ((rc = pthread_mutex_init(&shards[i].mutex, NULL)) != 0) {
+            errno = rc;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void limit_destroy(void) {
+    struct client *c, *next;
+    int i, j;
+
+    if (shards == NULL)
+        return;
+    for (i = 0; i < LIMIT_SHARDS; ++i) {
+        for (j = 0; j < LIMIT_BUCKETS; ++j) {
+            for (c = shards[i].buckets[j]; c != NULL; c = next) {
+                next = c->next;
+                free(c);
+            }
+        }
+        pthread_mutex_destroy(&shards[i].mutex);
+    }
+    free(shards);
+    shards = NULL;
+}
+
+/*
+ * limit_acquire - Count a new connection from peer. Returns -1 and
+ *     counts nothing if a limit is reached, in which case the connection
+ *     is to be turned away. Every successful call is to be paired with a
+ *     limit_release() once the connection is closed.
+ */
+int limit_acquire(const struct sockaddr_storage *peer) {
+    unsigned char addr[16];
+    unsigned long h;
+    struct limit_shard *s;
+    struct client *c;
+    int rc = 0;
+
+    if (max_conns > 0
+        && __atomic_add_fetch(&nconns, 1, __ATOMIC_RELAXED) > max_conns) {
+        __atomic_sub_fetch(&nconns, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    if (shards == NULL || client_key(peer, addr) != 0)
+        return 0;
+
+    h = hash(addr);
+    s = &shards[h % LIMIT_SHARDS];
+    pthread_mutex_lock(&s->mutex);
+    for (c = s->buckets[h % LIMIT_BUCKETS]; c != NULL; c = c->next) {
+        if (memcmp(c->addr, addr, 16) == 0)
+            break;
+    }
+    if (c == NULL && (c = calloc(1, sizeof(struct client))) != NULL) {
+        memcpy(c->addr, addr, 16);
+        c->next = s->buckets[h % LIMIT_BUCKETS];
+        s->buckets[h % LIMIT_BUCKETS] = c;
+    }
+    /* A client we can't keep track of is turned away too. */
+    if (c == NULL || c->conns >= max_perclient)
+        rc = -1;
+    else
+        c->conns++;
+    pthread_mutex_unlock(&s->mutex);
+
+    if (rc != 0 && max_conns > 0)
+        __atomic_sub_fetch(&nconns, 1, __ATOMIC_RELAXED);
+    return rc;
+}
+
+/*
+ * limit_release - Count a connection from peer as closed. Clients
+ *     without connections left are forgotten.
+ */
+void limit_release(const struct sockaddr_storage *peer) {
+    unsigned char addr[16];
+    unsigned long h;
+    struct limit_shard *s;
+    struct client *c, **pp;
+
+    if (max_conns > 0)
+        __atomic_sub_fetch(&nconns, 1, __ATOMIC_RELAXED);
+    if (shards == NULL || client_key(peer, addr) != 0)
+        return;
+
+    h = hash(addr);
+    s = &shards[h % LIMIT_SHARDS];
+    pthread_mutex_lock(&s->mutex);
+    for (pp = &s->buckets[h % LIMIT_BUCKETS]; (c = *pp) != NULL;
+         pp = &c->next) {
+        if (memcmp(c->addr, addr, 16) == 0) {
+            if (--c->conns == 0) {
+                *pp = c->next;
+                free(c);
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&s->mutex);
+}
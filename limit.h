@@ -0,0 +1,13 @@
+#ifndef _LIMIT_H
+#define _LIMIT_H
+
+#include <sys/socket.h>
+
+#define LIMIT_SHARDS  16  /* Independently locked parts of the client table */
+
+int limit_init(int maxconns, int maxperclient);
+void limit_destroy(void);
+int limit_acquire(const struct sockaddr_storage *peer);
+void limit_release(const struct sockaddr_storage *peer);
+
+#endif
@@ -0,0 +1,264 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "metrics.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define METRICS_MAXTHREADS  256  /* Threads that can record */
+
+/*
+ * Latencies in nanoseconds go into log-linear histograms, in the manner
+ * of HdrHistogram: values below HIST_SUB get a bucket each, and every
+ * power of two above is split in HIST_SUB buckets. A bucket is thus
+ * never wider than 1/HIST_SUB of its values, about 6%.
+ */
+#define HIST_SUBBITS  4
+#define HIST_SUB      (1 << HIST_SUBBITS)
+#define HIST_BUCKETS  ((64 - HIST_SUBBITS + 1) * HIST_SUB)
+
+#define STATUS_MIN  100
+#define STATUS_MAX  599
+
+struct hist {
+    unsigned long count[HIST_BUCKETS];
+    unsigned long n;
+    unsigned long sum;
+};
+
+/*
+ * Everything one thread records. Only the owner writes it, so recording
+ * takes no locks; readers sum up all threads and may see a count a few
+ * increments behind.
+ */
+struct metrics {
+    unsigned long counters[NCOUNTERS];
+    unsigned long status[STATUS_MAX - STATUS_MIN + 1];
+    struct hist hists[NSTAGES];
+};
+
+static struct metrics *threads[METRICS_MAXTHREADS];
+static int nthreads = 0;
+static __thread struct metrics *self = NULL;
+
+static const char *stage_names[NSTAGES] = {
+    "accept", "queue", "parse", "resolve", "write", "upstream"
+};
+
+/* Upper bounds of the exported histogram buckets, in nanoseconds. */
+static const uint64_t bounds[] = {
+    1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000, 25000000, 50000000, 100000000,
+    250000000, 500000000, 1000000000, 2500000000UL, 5000000000UL,
+    10000000000UL
+};
+
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+/*
+ * add - Add n to counter *p of the calling thread. The store is atomic
+ *     so that readers never see a torn value.
+ */
+static void add(unsigned long *p, unsigned long n) {
+    __atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + n,
+                     __ATOMIC_RELAXED);
+}
+
+static unsigned long get(const unsigned long *p) {
+    return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+static int hist_index(uint64_t v) {
+    int e;
+
+    if (v < HIST_SUB)
+        return v;
+    e = 63 - __builtin_clzll(v);
+    return (e - HIST_SUBBITS + 1) * HIST_SUB
+           + ((v >> (e - HIST_SUBBITS)) & (HIST_SUB - 1));
+}
+
+/*
+ * hist_upper - Return the largest value that goes into bucket i.
+ */
+static uint64_t hist_upper(int i) {
+    int e;
+
+    if (i < HIST_SUB)
+        return i;
+    e = i / HIST_SUB + HIST_SUBBITS - 1;
+    return ((uint64_t)(HIST_SUB + i % HIST_SUB + 1) << (e - HIST_SUBBITS)) - 1;
+}
+
+/*
+ * hist_quantile - Return the value that a fraction q of the values in h
+ *     doesn't exceed, rounded up to the end of its bucket.
+ */
+static uint64_t hist_quantile(const struct hist *h, double q) {
+    unsigned long want, seen = 0;
+    int i;
+
+    if (h->n == 0)
+        return 0;
+    if ((want = (unsigned long)(q * h->n + 0.5)) == 0)
+        want = 1;
+    for (i = 0; i < HIST_BUCKETS - 1; ++i) {
+        if ((seen += h->count[i]) >= want)
+            break;
+    }
+    return hist_upper(i);
+}
+
+/*
+ * metrics_register - Give the calling thread a place to record into.
+ *     Until it is called, whatever the thread records is dropped.
+ *     Returns -1 if there is no room.
+ */
+int metrics_register(void) {
+    int i;
+
+    if (self != NULL)
+        return 0;
+    if ((i = __atomic_fetch_add(&nthreads, 1, __ATOMIC_ACQ_REL))
+        >= METRICS_MAXTHREADS)
+        return -1;
+    if ((self = calloc(1, sizeof(struct metrics))) == NULL)
+        return -1;
+    __atomic_store_n(&threads[i], self, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * metrics_now - Return a monotonic timestamp in nanoseconds, to time
+ *     stages with.
+ */
+uint64_t metrics_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void metrics_time(enum metrics_stage stage, uint64_t ns) {
+    struct hist *h;
+
+    if (self == NULL)
+        return;
+    h = &self->hists[stage];
+    add(&h->count[hist_index(ns)], 1);
+    add(&h->n, 1);
+    add(&h->sum, ns);
+}
+
+void metrics_count(enum metrics_counter counter, unsigned long n) {
+    if (self != NULL)
+        add(&self->counters[counter], n);
+}
+
+void metrics_status(int status) {
+    if (self != NULL && status >= STATUS_MIN && status <= STATUS_MAX)
+        add(&self->status[status - STATUS_MIN], 1);
+}
+
+/*
+ * metrics_write - Sum up what all threads recorded and write it to fp in
+ *     the Prometheus text format.
+ */
+void metrics_write(FILE *fp) {
+    struct metrics *sum, *m;
+    struct hist *h;
+    unsigned long cum;
+    int i, j, k, n;
+
+    if ((sum = calloc(1, sizeof(struct metrics))) == NULL)
+        return;
+    n = __atomic_load_n(&nthreads, __ATOMIC_ACQUIRE);
+    for (i = 0; i < n && i < METRICS_MAXTHREADS; ++i) {
+        if ((m = __atomic_load_n(&threads[i], __ATOMIC_ACQUIRE)) == NULL)
+            continue;
+        for (j = 0; j < NCOUNTERS; ++j)
+            sum->counters[j] += get(&m->counters[j]);
+        for (j = 0; j <= STATUS_MAX - STATUS_MIN; ++j)
+            sum->status[j] += get(&m->status[j]);
+        for (j = 0; j < NSTAGES; ++j) {
+            for (k = 0; k < HIST_BUCKETS; ++k)
+                sum->hists[j].count[k] += get(&m->hists[j].count[k]);
+            sum->hists[j].n += get(&m->hists[j].n);
+            sum->hists[j].sum += get(&m->hists[j].sum);
+        }
+    }
+
+    fprintf(fp, "# HELP httpd_connections_accepted_total Connections accepted.\n"
+                "# TYPE httpd_connections_accepted_total counter\n"
+                "httpd_connections_accepted_total %lu\n"
+                "# HELP httpd_connections_open Connections open.\n"
+                "# TYPE httpd_connections_open gauge\n"
+                "httpd_connections_open %lu\n"
+                "# HELP httpd_requests_total Request heads parsed.\n"
+                "# TYPE httpd_requests_total counter\n"
+                "httpd_requests_total %lu\n"
+                "# HELP httpd_response_bytes_total Response bytes sent.\n"
+                "# TYPE httpd_response_bytes_total counter\n"
+                "httpd_response_bytes_total %lu\n"
+                "# HELP httpd_connections_rejected_total Connections "
+                "answered with 503, by reason.\n"
+                "# TYPE httpd_connections_rejected_total counter\n"
+                "httpd_connections_rejected_total{reason=\"limit\"} %lu\n"
+                "httpd_connections_rejected_total{reason=\"shed\"} %lu\n"
+                "# HELP httpd_http2_connections_total Connections that spoke "
+                "HTTP/2.\n"
+                "# TYPE httpd_http2_connections_total counter\n"
+                "httpd_http2_connections_total %lu\n"
+                "# HELP httpd_http2_streams_total HTTP/2 streams opened.\n"
+                "# TYPE httpd_http2_streams_total counter\n"
+                "httpd_http2_streams_total %lu\n",
+            sum->counters[COUNTER_ACCEPTED],
+            sum->counters[COUNTER_ACCEPTED] - sum->counters[COUNTER_CLOSED],
+            sum->counters[COUNTER_REQUESTS], sum->counters[COUNTER_BYTES],
+            sum->counters[COUNTER_REJECTED], sum->counters[COUNTER_SHED],
+            sum->counters[COUNTER_H2_CONNS],
+            sum->counters[COUNTER_H2_STREAMS]);
+
+    fprintf(fp, "# HELP httpd_responses_total Responses sent, by status.\n"
+                "# TYPE httpd_responses_total counter\n");
+    for (j = 0; j <= STATUS_MAX - STATUS_MIN; ++j) {
+        if (sum->status[j] > 0)
+            fprintf(fp, "httpd_responses_total{code=\"%d\"} %lu\n",
+                    j + STATUS_MIN, sum->status[j]);
+    }
+
+    /* Buckets are counted by their upper end, so le may be up to 6% low. */
+    fprintf(fp, "# HELP httpd_stage_seconds Time spent in each stage.\n"
+                "# TYPE httpd_stage_seconds histogram\n");
+    for (j = 0; j < NSTAGES; ++j) {
+        h = &sum->hists[j];
+        cum = 0;
+        for (i = k = 0; i < (int)(sizeof(bounds) / sizeof(bounds[0])); ++i) {
+            for (; k < HIST_BUCKETS && hist_upper(k) <= bounds[i]; ++k)
+                cum += h->count[k];
+            fprintf(fp, "httpd_stage_seconds_bucket{stage=\"%s\",le=\"%g\"} %lu\n",
+                    stage_names[j], bounds[i] / 1e9, cum);
+        }
+        /* Taken from the buckets, h->n may be read a little ahead. */
+        for (; k < HIST_BUCKETS; ++k)
+            cum += h->count[k];
+        fprintf(fp, "httpd_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %lu\n"
+                    "httpd_stage_seconds_sum{stage=\"%s\"} %.9f\n"
+                    "httpd_stage_seconds_count{stage=\"%s\"} %lu\n",
+                stage_names[j], cum, stage_names[j], h->sum / 1e9,
+                stage_names[j], cum);
+    }
+
+    fprintf(fp, "# HELP httpd_stage_quantile_seconds Quantiles of the time "
+                "spent in each stage.\n"
+                "# TYPE httpd_stage_quantile_seconds gauge\n");
+    for (j = 0; j < NSTAGES; ++j) {
+        for (i = 0; i < (int)(sizeof(quantiles) / sizeof(quantiles[0])); ++i)
+            fprintf(fp, "httpd_stage_quantile_seconds{stage=\"%s\","
+                        "quantile=\"%g\"} %.9f\n",
+                    stage_names[j], quantiles[i],
+                    hist_quantile(&sum->hists[j], quantiles[i]) / 1e9);
+    }
+    free(sum);
+}
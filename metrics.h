@@ -0,0 +1,37 @@
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Timed stages of serving a connection and its requests. */
+enum metrics_stage {
+    STAGE_ACCEPT,   /* Accepting and setting up the socket */
+    STAGE_QUEUE,    /* Waiting in fdq for a worker */
+    STAGE_PARSE,    /* Parsing the request head */
+    STAGE_RESOLVE,  /* Mapping the uri to a file and building the response */
+    STAGE_WRITE,    /* Sending the response */
+    STAGE_UPSTREAM, /* Waiting for a proxy or FastCGI backend to answer */
+    NSTAGES
+};
+
+enum metrics_counter {
+    COUNTER_ACCEPTED,  /* Connections accepted */
+    COUNTER_CLOSED,    /* Connections closed */
+    COUNTER_REQUESTS,  /* Request heads parsed */
+    COUNTER_BYTES,     /* Response bytes sent */
+    COUNTER_REJECTED,  /* Connections turned away at a limit */
+    COUNTER_SHED,      /* Connections turned away while fdq was deep */
+    COUNTER_H2_CONNS,  /* Connections that spoke HTTP/2 */
+    COUNTER_H2_STREAMS,  /* ... and the streams they opened */
+    NCOUNTERS
+};
+
+int metrics_register(void);
+uint64_t metrics_now(void);
+void metrics_time(enum metrics_stage stage, uint64_t ns);
+void metrics_count(enum metrics_counter counter, unsigned long n);
+void metrics_status(int status);
+void metrics_write(FILE *fp);
+
+#endif
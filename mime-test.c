@@ -0,0 +1,214 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "mime.h"
+
+#define MAXLINE  4096
+
+/* File names that have no extension we know, or none at all. */
+static const char *unknown[] = {
+    "README", "/site/Makefile", "/site/.htaccess", "/site/.html",
+    "/site.html/index", "/site/a.", "/site/a.nosuchext",
+    "/site/a.htmlhtmlhtmlhtml", "/site/a.html ", "/site/a.ht",
+};
+#define NUNKNOWN ((int)(sizeof(unknown) / sizeof(unknown[0])))
+
+/* How a few names map, whatever the table holds. */
+static const struct name_case {
+    const char *name;
+    const char *type;
+} names[] = {
+    {"/index.html", "text/html"},
+    {"/INDEX.HTML", "text/html"},
+    {"/a.b/c.CsS", "text/css"},
+    {"/archive.tar.gz", "application/gzip"},
+    {"/kernel.png", "image/png"},
+    {"/.config/a.json", "application/json"},
+};
+#define NNAMES ((int)(sizeof(names) / sizeof(names[0])))
+
+static const char *types = "mime.types";
+static char reason[512];       /* Why the last test failed */
+
+int check_type(const char *name, const char *want);
+int fail(const char *fmt, ...);
+int test_table(void);
+int test_names(void);
+int test_unknown(void);
+int load(const char *text);
+int test_load(void);
+
+/* In order, the last one loads mappings that stay. */
+static const struct test {
+    const char *name;
+    int (*run)(void);
+} tests[] = {
+    {"every extension in the table, as its first type", test_table},
+    {"names in any case and with dots in the path", test_names},
+    {"names without an extension we know", test_unknown},
+    {"loaded mappings, before the built-in ones", test_load},
+};
+#define NTESTS ((int)(sizeof(tests) / sizeof(tests[0])))
+
+int main(int argc, char *argv[]) {
+    int i, nfailed = 0;
+
+    if (argc > 2 || (argc == 2 && argv[1][0] == '-')) {
+        printf("Usage: %s [FILE]\nCheck the MIME table against FILE, "
+               "mime.types by default, which\nit must have been built "
+               "from.\n", argv[0]);
+        return 1;
+    }
+    if (argc == 2)
+        types = argv[1];
+    for (i = 0; i < NTESTS; ++i) {
+        reason[0] = '\0';
+        if (tests[i].run() == 0)
+            printf("ok    %s\n", tests[i].name);
+        else {
+            printf("FAIL  %s: %s\n", tests[i].name, reason);
+            nfailed++;
+        }
+    }
+    printf("%d of %d tests failed\n", nfailed, NTESTS);
+    return nfailed > 0;
+}
+
+/*
+ * check_type - Check that name maps to want. Returns -1 if not.
+ */
+int check_type(const char *name, const char *want) {
+    const char *type = mime_type(name);
+
+    if (strcmp(type, want) != 0)
+        return fail("%s is %s, not %s", name, type, want);
+    return 0;
+}
+
+/*
+ * fail - Keep why the test failed for main() to print. Returns -1.
+ */
+int fail(const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(reason, sizeof(reason), fmt, ap);
+    va_end(ap);
+    return -1;
+}
+
+/*
+ * test_table - Read the table the way mkmime does and look up every
+ *     extension in it, lowercase and uppercase. An extension listed twice
+ *     keeps its first type, so only the first line of each counts.
+ */
+int test_table(void) {
+    FILE *fp;
+    char line[MAXLINE], name[MIME_MAXEXT + 8], *type, *ext, *p;
+    char seen[MAXLINE * 4] = "";
+    int n = 0, rc = 0;
+
+    if ((fp = fopen(types, "r")) == NULL)
+        unix_errq("fopen error");
+    while (rc == 0 && fgets(line, sizeof(line), fp) != NULL) {
+        line[strcspn(line, "#\n")] = '\0';
+        if ((type = strtok(line, " \t\r")) == NULL)
+            continue;
+        while (rc == 0 && (ext = strtok(NULL, " \t\r")) != NULL) {
+            snprintf(name, sizeof(name), " %s ", ext);
+            if (strstr(seen, name) != NULL)
+                continue;
+            if (strlen(seen) + strlen(name) < sizeof(seen))
+                strcat(seen, name + 1);
+            snprintf(name, sizeof(name), "/f.%s", ext);
+            if ((rc = check_type(name, type)) != 0)
+                break;
+            for (p = name; *p != '\0'; ++p)
+                *p = toupper((unsigned char)*p);
+            rc = check_type(name, type);
+            n++;
+        }
+    }
+    fclose(fp);
+    if (rc == 0 && n == 0)
+        return fail("%s holds no extensions", types);
+    return rc;
+}
+
+int test_names(void) {
+    int i;
+
+    for (i = 0; i < NNAMES; ++i) {
+        if (check_type(names[i].name, names[i].type) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+int test_unknown(void) {
+    int i;
+
+    for (i = 0; i < NUNKNOWN; ++i) {
+        if (check_type(unknown[i], MIME_DEFAULT) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * load - Load the mappings text from a file of its own. Returns what
+ *     mime_load() did, with errno as it left it.
+ */
+int load(const char *text) {
+    char path[] = "/tmp/mime-test-XXXXXX";
+    FILE *fp;
+    int fd, rc, err;
+
+    if ((fd = mkstemp(path)) < 0)
+        unix_errq("mkstemp error");
+    if ((fp = fdopen(fd, "w")) == NULL)
+        unix_errq("fdopen error");
+    fputs(text, fp);
+    if (fclose(fp) != 0)
+        unix_errq("fclose error");
+    errno = 0;
+    rc = mime_load(path);
+    err = errno;
+    unlink(path);
+    errno = err;
+    return rc;
+}
+
+/*
+ * test_load - A file that isn't in the format is refused. One that maps
+ *     an extension of the table to another type, adds one, and repeats
+ *     one of its own, whose first type wins, is looked up first.
+ */
+int test_load(void) {
+    if (load("html text/html\n") != -1 || errno != 0)
+        return fail("a line without a type was taken");
+    if (load("text/plain averyveryverylongext\n") != -1 || errno != 0)
+        return fail("a long extension was taken");
+    if (load("# Extra types\n"
+             "text/x-test-html  HTML   shtml\n"
+             "application/x-new new  NEW2\n"
+             "\n"
+             "text/x-later      new\n") != 0)
+        return fail("mime_load error: %s", strerror(errno));
+    if (check_type("/a.html", "text/x-test-html") != 0
+        || check_type("/a.SHTML", "text/x-test-html") != 0
+        || check_type("/a.htm", "text/html") != 0
+        || check_type("/a.new", "application/x-new") != 0
+        || check_type("/a.new2", "application/x-new") != 0
+        || check_type("/a.png", "image/png") != 0)
+        return -1;
+    return 0;
+}
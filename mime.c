@@ -0,0 +1,145 @@
+#include "mime.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#define MAXLINE 4096
+
+struct mime_slot {
+    const char *ext;
+    const char *type;
+};
+
+#include "mime-table.h"
+
+/*
+ * Mappings loaded at startup, an open addressing table with at most half
+ * of its slots used. They are looked up before the built-in ones and are
+ * never freed, since cache entries point at their types.
+ */
+static struct mime_slot *extra = NULL;
+static size_t nextra = 0, extrasize = 0;
+
+/*
+ * extra_slot - Return the slot of ext in table, or the free slot where it
+ *     belongs.
+ */
+static struct mime_slot *extra_slot(struct mime_slot *table, size_t size,
+                                    const char *ext, size_t len) {
+    size_t i = mime_hash(ext, len, 0) & (size - 1);
+
+    while (table[i].ext != NULL && strcmp(table[i].ext, ext) != 0)
+        i = (i + 1) & (size - 1);
+    return &table[i];
+}
+
+/*
+ * extra_add - Map ext to type, unless a loaded mapping has it already.
+ *     Returns -1 with errno set on error.
+ */
+static int extra_add(const char *ext, const char *type) {
+    size_t i, size;
+    struct mime_slot *table, *slot;
+
+    if (2 * (nextra + 1) > extrasize) {
+        size = extrasize > 0 ? 2 * extrasize : 64;
+        if ((table = calloc(size, sizeof(struct mime_slot))) == NULL)
+            return -1;
+        for (i = 0; i < extrasize; ++i) {
+            if (extra[i].ext != NULL)
+                *extra_slot(table, size, extra[i].ext,
+                            strlen(extra[i].ext)) = extra[i];
+        }
+        free(extra);
+        extra = table;
+        extrasize = size;
+    }
+    slot = extra_slot(extra, extrasize, ext, strlen(ext));
+    if (slot->ext != NULL)
+        return 0;
+    if ((slot->ext = strdup(ext)) == NULL)
+        return -1;
+    if ((slot->type = strdup(type)) == NULL) {
+        free((char *)slot->ext);
+        slot->ext = NULL;
+        return -1;
+    }
+    nextra++;
+    return 0;
+}
+
+/*
+ * mime_type - Return the media type of filename, decided by its extension
+ *     alone. Files without a known extension are MIME_DEFAULT.
+ */
+const char *mime_type(const char *filename) {
+    const char *dot, *slash;
+    char ext[MIME_MAXEXT + 1];
+    size_t i, len;
+    const struct mime_slot *s;
+    uint32_t seed;
+
+    dot = strrchr(filename, '.');
+    slash = strrchr(filename, '/');
+    /* Dot files like .htaccess have no extension. */
+    if (dot == NULL || dot == filename || (slash != NULL && dot <= slash + 1))
+        return MIME_DEFAULT;
+    len = strlen(++dot);
+    if (len == 0 || len > MIME_MAXEXT)
+        return MIME_DEFAULT;
+    for (i = 0; i <= len; ++i)
+        ext[i] = tolower((unsigned char)dot[i]);
+
+    if (nextra > 0) {
+        s = extra_slot(extra, extrasize, ext, len);
+        if (s->ext != NULL)
+            return s->type;
+    }
+    seed = mime_seeds[mime_hash(ext, len, 0) % MIME_NBUCKETS];
+    s = &mime_slots[mime_hash(ext, len, seed) & (MIME_NSLOTS - 1)];
+    if (s->ext != NULL && strcmp(s->ext, ext) == 0)
+        return s->type;
+    return MIME_DEFAULT;
+}
+
+/*
+ * mime_load - Read mappings from the mime.types style file path, lines of
+ *     a media type followed by its extensions, and let them take
+ *     precedence over the built-in ones. Returns -1 with errno set on
+ *     error, or with errno 0 if the file is malformed.
+ */
+int mime_load(const char *path) {
+    FILE *fp;
+    char line[MAXLINE], *type, *ext, *p;
+    int rc = 0;
+
+    if ((fp = fopen(path, "r")) == NULL)
+        return -1;
+    while (rc == 0 && fgets(line, sizeof(line), fp) != NULL) {
+        line[strcspn(line, "#\n")] = '\0';
+        if ((type = strtok(line, " \t\r")) == NULL)
+            continue;
+        if (strchr(type, '/') == NULL) {
+            errno = 0;
+            rc = -1;
+            break;
+        }
+        while (rc == 0 && (ext = strtok(NULL, " \t\r")) != NULL) {
+            if (strlen(ext) > MIME_MAXEXT) {
+                errno = 0;
+                rc = -1;
+                break;
+            }
+            for (p = ext; *p != '\0'; ++p)
+                *p = tolower((unsigned char)*p);
+            rc = extra_add(ext, type);
+        }
+    }
+    if (rc == 0 && ferror(fp))
+        rc = -1;
+    fclose(fp);
+    return rc;
+}
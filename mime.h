@@ -0,0 +1,32 @@
+#ifndef _MIME_H
+#define _MIME_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MIME_MAXEXT   15            /* Longer extensions are unknown */
+#define MIME_DEFAULT  "text/plain"  /* Type of files we know nothing of */
+
+/*
+ * mime_hash - Hash the len bytes of the extension ext with seed. mkmime
+ *     picks seeds that give every built-in extension a slot of its own,
+ *     so it has to hash exactly like the lookup does.
+ */
+static inline uint32_t mime_hash(const char *ext, size_t len, uint32_t seed) {
+    uint32_t h = 2166136261u ^ (seed * 0x9e3779b9u); /* FNV-1a */
+    size_t i;
+
+    for (i = 0; i < len; ++i) {
+        h ^= (unsigned char)ext[i];
+        h *= 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    return h;
+}
+
+const char *mime_type(const char *filename);
+int mime_load(const char *path);
+
+#endif
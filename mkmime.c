@@ -0,0 +1,178 @@
+/*
+ * mkmime - Turn a mime.types file into the perfect hash table mime.c
+ * looks extensions up in, written to standard output as C.
+ *
+ * Extensions are spread over buckets by mime_hash() with seed 0. Then,
+ * biggest bucket first, every bucket gets the smallest seed that puts
+ * all of its extensions into free slots. A lookup thus takes two hashes
+ * and one comparison.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "mime.h"
+
+#define MAXLINE     4096
+#define MAXSEED     65535  /* Seeds have to fit the unsigned short table */
+
+struct ext {
+    char *name;
+    char *type;
+    unsigned bucket;
+};
+
+static struct ext *exts = NULL;
+static int nexts = 0, maxexts = 0;
+
+static void die(const char *msg, const char *arg) {
+    fprintf(stderr, "mkmime: %s%s\n", msg, arg);
+    exit(1);
+}
+
+/*
+ * add_ext - Map extension name to type, unless it is mapped already.
+ */
+static void add_ext(const char *name, const char *type) {
+    int i;
+
+    if (strlen(name) > MIME_MAXEXT)
+        die("extension too long: ", name);
+    for (i = 0; i < nexts; ++i) {
+        if (strcmp(exts[i].name, name) == 0)
+            return;
+    }
+    if (nexts == maxexts) {
+        maxexts = maxexts > 0 ? 2 * maxexts : 256;
+        if ((exts = realloc(exts, maxexts * sizeof(struct ext))) == NULL)
+            die("out of memory", "");
+    }
+    if ((exts[nexts].name = strdup(name)) == NULL
+        || (exts[nexts].type = strdup(type)) == NULL)
+        die("out of memory", "");
+    nexts++;
+}
+
+/*
+ * read_types - Read the lines of fp, a media type followed by its
+ *     extensions. Extensions are case-insensitive and stored lowercase.
+ */
+static void read_types(FILE *fp) {
+    char line[MAXLINE], *type, *name, *p;
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        line[strcspn(line, "#\n")] = '\0';
+        if ((type = strtok(line, " \t")) == NULL)
+            continue;
+        while ((name = strtok(NULL, " \t")) != NULL) {
+            for (p = name; *p != '\0'; ++p)
+                *p = tolower((unsigned char)*p);
+            add_ext(name, type);
+        }
+    }
+}
+
+static void print_str(const char *s) {
+    putchar('"');
+    for (; *s != '\0'; ++s) {
+        if (*s == '"' || *s == '\\')
+            putchar('\\');
+        putchar(*s);
+    }
+    putchar('"');
+}
+
+int main(int argc, char *argv[]) {
+    FILE *fp;
+    unsigned nslots, nbuckets, i, j, k, seed, *order, *size;
+    unsigned short *disp;
+    int *slots, b;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s MIME-TYPES\n", argv[0]);
+        return 1;
+    }
+    if ((fp = fopen(argv[1], "r")) == NULL)
+        die("cannot open ", argv[1]);
+    read_types(fp);
+    fclose(fp);
+    if (nexts == 0)
+        die("no extensions in ", argv[1]);
+
+    /* Slots are kept a third empty, which makes seeds quick to find. */
+    for (nslots = 1; nslots < nexts + nexts / 2; nslots *= 2)
+        ;
+    nbuckets = (nexts + 3) / 4;
+    if ((slots = malloc(nslots * sizeof(int))) == NULL
+        || (disp = calloc(nbuckets, sizeof(unsigned short))) == NULL
+        || (size = calloc(nbuckets, sizeof(unsigned))) == NULL
+        || (order = malloc(nbuckets * sizeof(unsigned))) == NULL)
+        die("out of memory", "");
+    for (i = 0; i < nslots; ++i)
+        slots[i] = -1;
+    for (i = 0; i < (unsigned)nexts; ++i) {
+        exts[i].bucket = mime_hash(exts[i].name, strlen(exts[i].name), 0)
+                         % nbuckets;
+        size[exts[i].bucket]++;
+    }
+
+    /* Biggest buckets first, while most slots are free. */
+    for (i = 0; i < nbuckets; ++i)
+        order[i] = i;
+    for (i = 1; i < nbuckets; ++i) {
+        for (j = i; j > 0 && size[order[j - 1]] < size[order[j]]; --j) {
+            k = order[j];
+            order[j] = order[j - 1];
+            order[j - 1] = k;
+        }
+    }
+
+    for (i = 0; i < nbuckets && size[order[i]] > 0; ++i) {
+        b = order[i];
+        for (seed = 1; seed <= MAXSEED; ++seed) {
+            /* Try to place every extension of b, and undo if one fails. */
+            for (j = 0; j < (unsigned)nexts; ++j) {
+                if (exts[j].bucket != (unsigned)b)
+                    continue;
+                k = mime_hash(exts[j].name, strlen(exts[j].name), seed)
+                    & (nslots - 1);
+                if (slots[k] >= 0)
+                    break;
+                slots[k] = j;
+            }
+            if (j == (unsigned)nexts)
+                break;
+            for (k = 0; k < nslots; ++k) {
+                if (slots[k] >= 0 && exts[slots[k]].bucket == (unsigned)b)
+                    slots[k] = -1;
+            }
+        }
+        if (seed > MAXSEED)
+            die("no perfect hash found for ", argv[1]);
+        disp[b] = seed;
+    }
+
+    printf("/* Generated by mkmime from %s, do not edit. */\n\n", argv[1]);
+    printf("#define MIME_NEXTS     %d\n", nexts);
+    printf("#define MIME_NBUCKETS  %u\n", nbuckets);
+    printf("#define MIME_NSLOTS    %u\n\n", nslots);
+    printf("static const unsigned short mime_seeds[MIME_NBUCKETS] = {");
+    for (i = 0; i < nbuckets; ++i)
+        printf("%s%u,", i % 12 == 0 ? "\n    " : " ", disp[i]);
+    printf("\n};\n\n");
+    printf("static const struct mime_slot mime_slots[MIME_NSLOTS] = {\n");
+    for (i = 0; i < nslots; ++i) {
+        if (slots[i] < 0) {
+            printf("    {NULL, NULL},\n");
+            continue;
+        }
+        printf("    {");
+        print_str(exts[slots[i]].name);
+        printf(", ");
+        print_str(exts[slots[i]].type);
+        printf("},\n");
+    }
+    printf("};\n");
+    return 0;
+}
@@ -0,0 +1,385 @@
+#define _POSIX_C_SOURCE 200809L
+
+/* The scans are static, so the parser is built into the test. */
+#include "http-parser.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+
+#include "error.h"
+
+#define SCANLEN  72         /* Longest buffer the scans are checked on */
+
+/* A set of scans the parser can run with. */
+struct scans {
+    const char *name;
+    char *(*find_eol)(char *, char *);
+    char *(*skip_tchar)(char *, char *);
+    char *(*skip_vchar)(char *, char *);
+};
+
+/* HTTP_MAXHEADERS header lines. */
+#define MAXHEADERS \
+    "A0: 0\r\nA1: 1\r\nA2: 2\r\nA3: 3\r\n" \
+    "A4: 4\r\nA5: 5\r\nA6: 6\r\nA7: 7\r\n" \
+    "B0: 0\r\nB1: 1\r\nB2: 2\r\nB3: 3\r\n" \
+    "B4: 4\r\nB5: 5\r\nB6: 6\r\nB7: 7\r\n" \
+    "C0: 0\r\nC1: 1\r\nC2: 2\r\nC3: 3\r\n" \
+    "C4: 4\r\nC5: 5\r\nC6: 6\r\nC7: 7\r\n" \
+    "D0: 0\r\nD1: 1\r\nD2: 2\r\nD3: 3\r\n" \
+    "D4: 4\r\nD5: 5\r\nD6: 6\r\nD7: 7\r\n"
+
+/* A string and its length, which counts the NULs it may hold. */
+#define TEXT(s) s, sizeof(s) - 1
+
+/*
+ * A request head and what parsing it must give: want is 1 if it is
+ * complete, ending tail bytes before the end of text, 0 if it is not
+ * and -1 if it is malformed. A complete head has method, target and
+ * minor version, nheaders headers, and hname with value hvalue if hname
+ * isn't NULL.
+ */
+static const struct parse_case {
+    const char *name;
+    const char *text;
+    size_t len;
+    int want;
+    size_t tail;
+    const char *method, *target;
+    int minor, nheaders;
+    const char *hname, *hvalue;
+} cases[] = {
+    {"simple GET",
+     TEXT("GET /index.html HTTP/1.1\r\nHost: a\r\n\r\n"),
+     1, 0, "GET", "/index.html", 1, 1, "Host", "a"},
+    {"HTTP/1.0 without headers",
+     TEXT("GET / HTTP/1.0\r\n\r\n"), 1, 0, "GET", "/", 0, 0, NULL, NULL},
+    {"bare LF line ends",
+     TEXT("GET / HTTP/1.1\nHost: a\n\n"),
+     1, 0, "GET", "/", 1, 1, "host", "a"},
+    {"empty lines before the request line",
+     TEXT("\r\n\r\nGET / HTTP/1.1\r\n\r\n"),
+     1, 0, "GET", "/", 1, 0, NULL, NULL},
+    {"a body after the head",
+     TEXT("POST /f HTTP/1.1\r\nContent-Length: 5\r\n\r\nhello"),
+     1, 5, "POST", "/f", 1, 1, "content-length", "5"},
+    {"whitespace around a value",
+     TEXT("GET / HTTP/1.1\r\nX-A: \t a b \t\r\n\r\n"),
+     1, 0, "GET", "/", 1, 1, "X-A", "a b"},
+    {"an empty value",
+     TEXT("GET / HTTP/1.1\r\nX-A:\r\n\r\n"),
+     1, 0, "GET", "/", 1, 1, "X-A", ""},
+    {"punctuation in a method and a name",
+     TEXT("M-SEARCH * HTTP/1.1\r\nX_!#$%&'*+-.^`|~: v\r\n\r\n"),
+     1, 0, "M-SEARCH", "*", 1, 1, "X_!#$%&'*+-.^`|~", "v"},
+    {"UTF-8 in a target and a value",
+     TEXT("GET /caf\xc3\xa9?q=\xe2\x82\xac HTTP/1.1\r\n"
+          "X-A: \xc3\xa9t\xc3\xa9\r\n\r\n"),
+     1, 0, "GET", "/caf\xc3\xa9?q=\xe2\x82\xac", 1, 1, "X-A",
+     "\xc3\xa9t\xc3\xa9"},
+    {"a method and a name longer than a vector",
+     TEXT("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789 / "
+          "HTTP/1.1\r\n"
+          "X-abcdefghijklmnopqrstuvwxyz-abcdefghijklmnopqrstuvwxyz: v\r\n"
+          "\r\n"), 1, 0,
+     "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789", "/",
+     1, 1, "X-abcdefghijklmnopqrstuvwxyz-abcdefghijklmnopqrstuvwxyz", "v"},
+    {"HTTP_MAXHEADERS headers",
+     TEXT("GET / HTTP/1.1\r\n" MAXHEADERS "\r\n"),
+     1, 0, "GET", "/", 1, HTTP_MAXHEADERS, "D7", "7"},
+
+    {"only the request line", TEXT("GET / HTTP/1.1\r\n"), 0},
+    {"a head cut after a CR", TEXT("GET / HTTP/1.1\r\nHost: a\r\n\r"), 0},
+    {"a head cut in a header", TEXT("GET / HTTP/1.1\r\nHost: a"), 0},
+    {"nothing but empty lines", TEXT("\r\n\r\n"), 0},
+
+    {"one header too many",
+     TEXT("GET / HTTP/1.1\r\n" MAXHEADERS "E0: 0\r\n\r\n"), -1},
+    {"no method", TEXT(" / HTTP/1.1\r\n\r\n"), -1},
+    {"two spaces after the method", TEXT("GET  / HTTP/1.1\r\n\r\n"), -1},
+    {"no target", TEXT("GET HTTP/1.1\r\n\r\n"), -1},
+    {"a tab for a space", TEXT("GET\t/ HTTP/1.1\r\n\r\n"), -1},
+    {"a separator in a method", TEXT("GE(T / HTTP/1.1\r\n\r\n"), -1},
+    {"a byte past ASCII in a method",
+     TEXT("G\xc3\x89T / HTTP/1.1\r\n\r\n"), -1},
+    {"a control character in a target",
+     TEXT("GET /a\x01 HTTP/1.1\r\n\r\n"), -1},
+    {"DEL in a target", TEXT("GET /a\x7f HTTP/1.1\r\n\r\n"), -1},
+    {"HTTP/2.0", TEXT("GET / HTTP/2.0\r\n\r\n"), -1},
+    {"HTTP/1.10", TEXT("GET / HTTP/1.10\r\n\r\n"), -1},
+    {"a lower case version", TEXT("GET / http/1.1\r\n\r\n"), -1},
+    {"a space after the version", TEXT("GET / HTTP/1.1 \r\n\r\n"), -1},
+    {"no version", TEXT("GET /\r\n\r\n"), -1},
+    {"whitespace before a colon",
+     TEXT("GET / HTTP/1.1\r\nHost : a\r\n\r\n"), -1},
+    {"no colon", TEXT("GET / HTTP/1.1\r\nHost a\r\n\r\n"), -1},
+    {"no name", TEXT("GET / HTTP/1.1\r\n: a\r\n\r\n"), -1},
+    {"a folded value",
+     TEXT("GET / HTTP/1.1\r\nX-A: a\r\n b\r\n\r\n"), -1},
+    {"a separator in a name", TEXT("GET / HTTP/1.1\r\nX@A: a\r\n\r\n"), -1},
+    {"a CR alone in a value", TEXT("GET / HTTP/1.1\r\nX-A: a\rb\r\n\r\n"), -1},
+    {"a NUL in a value", TEXT("GET / HTTP/1.1\r\nX-A: a\0b\r\n\r\n"), -1},
+    {"a CR alone in the request line", TEXT("GET /\r HTTP/1.1\r\n\r\n"), -1},
+};
+#define NCASES ((int)(sizeof(cases) / sizeof(cases[0])))
+
+/* Content-Length values and what http_content_length() makes of them. */
+static const struct length_case {
+    const char *head;
+    int want;
+    off_t len;
+} lengths[] = {
+    {"GET / HTTP/1.1\r\n\r\n", 0, 0},
+    {"GET / HTTP/1.1\r\nContent-Length: 0\r\n\r\n", 1, 0},
+    {"GET / HTTP/1.1\r\nContent-Length: 0042\r\n\r\n", 1, 42},
+    {"GET / HTTP/1.1\r\nContent-Length: 9223372036854775807\r\n\r\n",
+     1, HTTP_OFF_MAX},
+    {"GET / HTTP/1.1\r\nContent-Length: 9223372036854775808\r\n\r\n", -1, 0},
+    {"GET / HTTP/1.1\r\nContent-Length: \r\n\r\n", -1, 0},
+    {"GET / HTTP/1.1\r\nContent-Length: +5\r\n\r\n", -1, 0},
+    {"GET / HTTP/1.1\r\nContent-Length: -1\r\n\r\n", -1, 0},
+    {"GET / HTTP/1.1\r\nContent-Length: 5 5\r\n\r\n", -1, 0},
+    {"GET / HTTP/1.1\r\nContent-Length: 5, 5\r\n\r\n", -1, 0},
+    {"GET / HTTP/1.1\r\nContent-Length: 5\r\ncontent-length: 5\r\n\r\n",
+     -1, 0},
+};
+#define NLENGTHS ((int)(sizeof(lengths) / sizeof(lengths[0])))
+
+static struct scans scans[3];
+static int nscans = 0;
+static char reason[512];       /* Why the last test failed */
+
+void scans_init(void);
+int parse(const struct parse_case *t, struct http_request *req,
+          int incremental);
+int check_case(const struct parse_case *t, const struct scans *s);
+void check_parts(const struct parse_case *t, const struct http_request *req);
+int check_scan(const char *what, char *(*scan)(char *, char *),
+               char *(*scalar)(char *, char *), char base);
+int fail(const char *fmt, ...);
+int test_cases(void);
+int test_scans(void);
+int test_lengths(void);
+
+static const struct test {
+    const char *name;
+    int (*run)(void);
+} tests[] = {
+    {"request heads, with every set of scans", test_cases},
+    {"vector scans agree with the scalar ones", test_scans},
+    {"Content-Length values", test_lengths},
+};
+#define NTESTS ((int)(sizeof(tests) / sizeof(tests[0])))
+
+int main(int argc, char *argv[]) {
+    int i, nfailed = 0;
+
+    if (argc != 1) {
+        printf("Usage: %s\nCheck the request parser against the cases "
+               "it is built with.\n", argv[0]);
+        return 1;
+    }
+    scans_init();
+    for (i = 0; i < NTESTS; ++i) {
+        reason[0] = '\0';
+        if (tests[i].run() == 0)
+            printf("ok    %s\n", tests[i].name);
+        else {
+            printf("FAIL  %s: %s\n", tests[i].name, reason);
+            nfailed++;
+        }
+    }
+    printf("%d of %d tests failed\n", nfailed, NTESTS);
+    return nfailed > 0;
+}
+
+/*
+ * scans_init - Set up the parser and list the scans the CPU can run: the
+ *     scalar ones first, then the ones http_parser_init() picks from.
+ */
+void scans_init(void) {
+    http_parser_init();
+    scans[nscans++] = (struct scans){"scalar", find_eol_scalar,
+                                     skip_tchar_scalar, skip_vchar_scalar};
+#ifdef HTTP_PARSER_X86
+    scans[nscans++] = (struct scans){"sse2", find_eol_sse2,
+                                     skip_tchar_scalar, skip_vchar_sse2};
+    if (__builtin_cpu_supports("ssse3"))
+        scans[nscans - 1].skip_tchar = skip_tchar_ssse3;
+    if (__builtin_cpu_supports("avx2"))
+        scans[nscans++] = (struct scans){"avx2", find_eol_avx2,
+                                         skip_tchar_avx2, skip_vchar_avx2};
+#endif
+}
+
+/*
+ * parse - Parse the text of t into req from a buffer of its own, all at
+ *     once or a byte more at a time. Returns what the last call of
+ *     http_parse_request() did.
+ */
+int parse(const struct parse_case *t, struct http_request *req,
+          int incremental) {
+    char *buf;
+    size_t n;
+    int rc = 0;
+
+    if ((buf = malloc(t->len)) == NULL)
+        unix_errq("malloc error");
+    memcpy(buf, t->text, t->len);
+    http_request_init(req);
+    for (n = incremental ? 1 : t->len; n <= t->len; ++n) {
+        if ((rc = http_parse_request(req, buf, n)) != 0)
+            break;
+    }
+    /* The slices point into buf, which only the parts need. */
+    if (rc > 0)
+        check_parts(t, req);
+    free(buf);
+    return rc;
+}
+
+/*
+ * check_case - Parse the head of t with scans s, at once and a byte at a
+ *     time, and check that both give what t wants. Returns -1 if not.
+ */
+int check_case(const struct parse_case *t, const struct scans *s) {
+    struct http_request req;
+    int incremental, rc, want;
+
+    find_eol = s->find_eol;
+    skip_tchar = s->skip_tchar;
+    skip_vchar = s->skip_vchar;
+    want = t->want > 0 ? (int)(t->len - t->tail) : t->want;
+    for (incremental = 0; incremental < 2; ++incremental) {
+        reason[0] = '\0';
+        rc = parse(t, &req, incremental);
+        if (rc != want)
+            return fail("%s, %s scans%s: returned %d, not %d", t->name,
+                        s->name, incremental ? ", a byte a time" : "", rc,
+                        want);
+        if (reason[0] != '\0')
+            return fail("%s, %s scans%s: %s", t->name, s->name,
+                        incremental ? ", a byte a time" : "", reason);
+    }
+    return 0;
+}
+
+/*
+ * check_parts - Check that req has the parts t wants, keeping why not
+ *     in reason.
+ */
+void check_parts(const struct parse_case *t, const struct http_request *req) {
+    const struct http_slice *value;
+
+    if (!http_slice_eq(&req->method, t->method))
+        fail("the method is \"%.*s\"", (int)req->method.len, req->method.p);
+    else if (!http_slice_eq(&req->target, t->target))
+        fail("the target is \"%.*s\"", (int)req->target.len, req->target.p);
+    else if (req->minor_version != t->minor)
+        fail("the version is HTTP/1.%d", req->minor_version);
+    else if (req->nheaders != t->nheaders)
+        fail("%d headers came", req->nheaders);
+    else if (t->hname == NULL)
+        ;
+    else if ((value = http_find_header(req, t->hname)) == NULL)
+        fail("%s is missing", t->hname);
+    else if (!http_slice_eq(value, t->hvalue))
+        fail("%s is \"%.*s\"", t->hname, (int)value->len, value->p);
+}
+
+/*
+ * check_scan - Check that scan stops where scalar does on buffers of base
+ *     of every length up to SCANLEN, with each byte value in each place.
+ *     Returns -1 if not.
+ */
+int check_scan(const char *what, char *(*scan)(char *, char *),
+               char *(*scalar)(char *, char *), char base) {
+    static char buf[SCANLEN];
+    char *got, *want;
+    int len, at, start, c;
+
+    for (len = 0; len <= SCANLEN; ++len) {
+        memset(buf, base, len);
+        for (at = 0; at < len; ++at) {
+            for (c = 0; c < 256; ++c) {
+                buf[at] = c;
+                /* The loads are unaligned, one more start will do. */
+                for (start = 0; start <= at && start < 2; ++start) {
+                    want = scalar(buf + start, buf + len);
+                    if ((got = scan(buf + start, buf + len)) != want)
+                        return fail("%s stopped at %ld, not %ld, on byte "
+                                    "0x%02x at %d of %d from %d", what,
+                                    (long)(got - buf), (long)(want - buf), c,
+                                    at, len, start);
+                }
+            }
+            buf[at] = base;
+        }
+        /* Nothing to stop at: the end is the answer. */
+        if (scan(buf, buf + len) != buf + len)
+            return fail("%s didn't run to the end of %d bytes", what, len);
+    }
+    return 0;
+}
+
+/*
+ * fail - Keep why the test failed for main() to print. Returns -1.
+ */
+int fail(const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(reason, sizeof(reason), fmt, ap);
+    va_end(ap);
+    return -1;
+}
+
+int test_cases(void) {
+    int i, j;
+
+    for (i = 0; i < nscans; ++i) {
+        for (j = 0; j < NCASES; ++j) {
+            if (check_case(&cases[j], &scans[i]) != 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+int test_scans(void) {
+    int i;
+
+    for (i = 1; i < nscans; ++i) {
+        if (check_scan(scans[i].name, scans[i].find_eol, find_eol_scalar,
+                       'a') != 0
+            || check_scan(scans[i].name, scans[i].skip_tchar,
+                          skip_tchar_scalar, 'a') != 0
+            || check_scan(scans[i].name, scans[i].skip_vchar,
+                          skip_vchar_scalar, 'a') != 0)
+            return -1;
+    }
+    return 0;
+}
+
+int test_lengths(void) {
+    const struct length_case *t;
+    struct http_request req;
+    char buf[128];
+    off_t len;
+    int i, rc;
+
+    for (i = 0, t = lengths; i < NLENGTHS; ++i, ++t) {
+        strcpy(buf, t->head);
+        http_request_init(&req);
+        if (http_parse_request(&req, buf, strlen(buf)) <= 0)
+            return fail("%s didn't parse", t->head);
+        len = 0;
+        rc = http_content_length(req.headers, req.nheaders, &len);
+        if (rc != t->want || (rc == 1 && len != t->len))
+            return fail("case %d returned %d with %lld, not %d with %lld",
+                        i + 1, rc, (long long)len, t->want,
+                        (long long)t->len);
+    }
+    return 0;
+}
@@ -0,0 +1,150 @@
+#include "pool.h"
+
+#include <stdlib.h>
+
+#define POOL_ALIGN  16  /* Enough for anything we put in a pool */
+
+#define ALIGN(n)  (((n) + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1))
+
+/* The head of a slab, its objects follow. */
+struct pool_slab {
+    struct pool_slab *next;
+    size_t pad;  /* Keeps the objects aligned */
+};
+
+/* An arena allocation too large for its buffer, data follows. */
+struct arena_big {
+    struct arena_big *next;
+    size_t pad;
+};
+
+/*
+ * pool_init - Set up p to hand out objects of size bytes, allocating
+ *     perslab of them at a time. With perslab 1, at most maxfree
+ *     objects are kept free.
+ */
+void pool_init(struct pool *p, size_t size, int perslab,
+               unsigned long maxfree) {
+    p->size = ALIGN(size < sizeof(void *) ? sizeof(void *) : size);
+    p->perslab = perslab > 0 ? perslab : 1;
+    p->maxfree = maxfree;
+    p->free = NULL;
+    p->slabs = NULL;
+    p->nfree = p->used = 0;
+}
+
+/*
+ * pool_destroy - Free the memory of p. Objects still handed out go with
+ *     their slabs, or are leaked with perslab 1.
+ */
+void pool_destroy(struct pool *p) {
+    struct pool_slab *slab, *next;
+    void *obj;
+
+    if (p->perslab == 1) {
+        while ((obj = p->free) != NULL) {
+            p->free = *(void **)obj;
+            free(obj);
+        }
+    }
+    for (slab = p->slabs; slab != NULL; slab = next) {
+        next = slab->next;
+        free(slab);
+    }
+    p->free = NULL;
+    p->slabs = NULL;
+    p->nfree = p->used = 0;
+}
+
+/*
+ * pool_get - Take an object from p, allocating more if none is free. The
+ *     object is not zeroed. Returns NULL with errno set on error.
+ */
+void *pool_get(struct pool *p) {
+    struct pool_slab *slab;
+    char *obj;
+    int i;
+
+    if (p->free == NULL) {
+        if (p->perslab == 1) {
+            if ((obj = malloc(p->size)) != NULL)
+                p->used++;
+            return obj;
+        }
+        if ((slab = malloc(sizeof(*slab) + p->size * p->perslab)) == NULL)
+            return NULL;
+        slab->next = p->slabs;
+        p->slabs = slab;
+        for (i = p->perslab - 1; i >= 0; --i) {
+            obj = (char *)(slab + 1) + i * p->size;
+            *(void **)obj = p->free;
+            p->free = obj;
+        }
+        p->nfree += p->perslab;
+    }
+    obj = p->free;
+    p->free = *(void **)obj;
+    p->nfree--;
+    p->used++;
+    return obj;
+}
+
+/*
+ * pool_put - Give obj back to p, which it was taken from.
+ */
+void pool_put(struct pool *p, void *obj) {
+    p->used--;
+    if (p->perslab == 1 && p->nfree >= p->maxfree) {
+        free(obj);
+        return;
+    }
+    *(void **)obj = p->free;
+    p->free = obj;
+    p->nfree++;
+}
+
+/*
+ * arena_init - Set up a to allocate from the size bytes at base, which
+ *     may be NULL to allocate everything with malloc().
+ */
+void arena_init(struct arena *a, char *base, size_t size) {
+    a->base = base;
+    a->size = base != NULL ? size : 0;
+    a->used = 0;
+    a->big = NULL;
+}
+
+/*
+ * arena_alloc - Allocate size bytes from a, to be freed by the next
+ *     arena_reset(). Returns NULL with errno set on error.
+ */
+void *arena_alloc(struct arena *a, size_t size) {
+    struct arena_big *big;
+    void *p;
+
+    size = ALIGN(size);
+    if (size <= a->size - a->used) {
+        p = a->base + a->used;
+        a->used += size;
+        return p;
+    }
+    if ((big = malloc(sizeof(struct arena_big) + size)) == NULL)
+        return NULL;
+    big->next = a->big;
+    a->big = big;
+    return big + 1;
+}
+
+/*
+ * arena_reset - Free everything allocated from a.
+ */
+void arena_reset(struct arena *a) {
+    struct arena_big *big, *next;
+
+    for (big = a->big; big != NULL; big = next) {
+        next = big->next;
+        free(big);
+    }
+    a->big = NULL;
+    a->used = 0;
+}
@@ -0,0 +1,43 @@
+#ifndef _POOL_H
+#define _POOL_H
+
+#include <stddef.h>
+
+/*
+ * Objects of one size, recycled through a free list. A pool belongs to
+ * one thread, so nothing is locked. Small objects are carved out of
+ * slabs, which are only given back when the pool is destroyed. Large
+ * ones are allocated one at a time, perslab 1, and more than maxfree of
+ * them aren't kept free, so a burst doesn't hold on to its memory.
+ */
+struct pool {
+    size_t size;          /* Of an object, rounded up for alignment */
+    int perslab;          /* Objects per slab */
+    unsigned long maxfree;  /* Free objects kept, with perslab 1 */
+    void *free;           /* Free objects, linked through their first word */
+    struct pool_slab *slabs;
+    unsigned long nfree;  /* Objects in free */
+    unsigned long used;   /* Objects handed out */
+};
+
+void pool_init(struct pool *p, size_t size, int perslab,
+               unsigned long maxfree);
+void pool_destroy(struct pool *p);
+void *pool_get(struct pool *p);
+void pool_put(struct pool *p, void *obj);
+
+/*
+ * Bump allocation from a fixed buffer for what lives as long as one
+ * request. What doesn't fit is malloc()ed and freed on reset.
+ */
+struct arena {
+    char *base;           /* Bump space, or NULL for none */
+    size_t size, used;
+    struct arena_big *big;  /* Allocations that didn't fit */
+};
+
+void arena_init(struct arena *a, char *base, size_t size);
+void *arena_alloc(struct arena *a, size_t size);
+void arena_reset(struct arena *a);
+
+#endif
@@ -0,0 +1,401 @@
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "error.h"
+#include "http-utils.h"
+#include "http-parser.h"
+#include "rio.h"
+
+#define WAIT_SERVER  5      /* Seconds to wait for the server to come up */
+#define TIMEOUT      5      /* Seconds the server may take for anything */
+#define MAXCONNS     16     /* Connections open to the backend at a time */
+#define INBUF        8192
+#define MAXURI       256
+#define MAXRESP      65536
+
+/*
+ * A connection the server opened to the stand-in backend, and the head
+ * of the request coming over it.
+ */
+struct backconn {
+    int fd;                    /* -1 if the slot is free */
+    struct http_request req;
+    size_t inlen;
+    char in[INBUF];
+};
+
+/* A response, as a client read it. */
+struct response {
+    int status;                /* 0 if no head came */
+    size_t len;
+    char buf[MAXRESP];
+    size_t bodylen;
+    char body[MAXRESP];
+};
+
+static char *host = "127.0.0.1";
+static char *port = NULL;
+static char *backport = NULL;
+static int listenfd = -1;
+static struct backconn conns[MAXCONNS];
+static int client = -1;
+static struct response resp;
+static char target[MAXURI];    /* Of the last request the backend got */
+static char reason[512];       /* Why the last test failed */
+
+void show_usage(const char *name);
+void wait_server(void);
+struct backconn *backend_next(void);
+void backend_accept(void);
+int backend_read(struct backconn *bc);
+void backend_answer(struct backconn *bc);
+void backend_close(struct backconn *bc);
+void client_get(const char *uri);
+void client_close(void);
+int client_response(void);
+int check_forwarded(const char *sent, const char *forwarded);
+int fail(const char *fmt, ...);
+int test_dot_segments(void);
+int test_query(void);
+int test_out_of_route(void);
+int test_into_route(void);
+
+static const struct test {
+    const char *name;
+    int (*run)(void);
+} tests[] = {
+    {"dot segments and empty ones taken out of the path", test_dot_segments},
+    {"the query passed on as it came", test_query},
+    {"a path that climbs out of the route served here", test_out_of_route},
+    {"a path that climbs into the route, from outside", test_into_route},
+};
+#define NTESTS ((int)(sizeof(tests) / sizeof(tests[0])))
+
+int main(int argc, char *argv[]) {
+    int opt, i, nfailed = 0;
+
+    /* Process args. */
+    while (1) {
+        static const char *optstring = "H:p:b:h";
+        static const struct option longopts[] = {
+            {"host", required_argument, NULL, 'H'},
+            {"port", required_argument, NULL, 'p'},
+            {"backend", required_argument, NULL, 'b'},
+            {"help", no_argument, NULL, 'h'},
+            {NULL, 0, NULL, 0}
+        };
+
+        opt = getopt_long(argc, argv, optstring, longopts, NULL);
+        if (opt == -1)
+            break;
+        switch (opt) {
+        case 'H': host = optarg; break;
+        case 'p': port = optarg; break;
+        case 'b': backport = optarg; break;
+        case 'h':
+        default: show_usage(argv[0]);
+        }
+    }
+    if (port == NULL || backport == NULL || optind != argc)
+        show_usage(argv[0]);
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+        unix_errq("signal error");
+
+    http_parser_init();
+    for (i = 0; i < MAXCONNS; ++i)
+        conns[i].fd = -1;
+    if ((listenfd = open_listenfd(backport, 0)) < 0)
+        app_errq("cannot listen on port %s", backport);
+    wait_server();
+    for (i = 0; i < NTESTS; ++i) {
+        reason[0] = '\0';
+        if (tests[i].run() == 0)
+            printf("ok    %s\n", tests[i].name);
+        else {
+            printf("FAIL  %s: %s\n", tests[i].name, reason);
+            nfailed++;
+        }
+        client_close();
+    }
+    printf("%d of %d tests failed\n", nfailed, NTESTS);
+    return nfailed > 0;
+}
+
+void show_usage(const char *name) {
+    printf("Usage: %s [-H HOST, --host HOST] -p PORT, --port PORT\n"
+           "       -b PORT, --backend PORT [-h, --help]\n"
+           "Answer HTTP requests on port PORT of -b as a stand-in backend "
+           "while sending\nrequests to the server at HOST:PORT, which must "
+           "proxy /api/ to it.\n",
+           name);
+    exit(1);
+}
+
+void wait_server(void) {
+    int fd, i;
+    struct timespec ts = {0, 100 * 1000 * 1000};
+
+    for (i = 0; i < WAIT_SERVER * 10; ++i) {
+        if ((fd = open_clientfd(host, port)) >= 0) {
+            close(fd);
+            return;
+        }
+        if (fd == -2)
+            break;
+        nanosleep(&ts, NULL);
+    }
+    app_errq("cannot connect to %s:%s", host, port);
+}
+
+/*
+ * backend_next - Wait for the head of a request of the server to come
+ *     in whole, and return its connection. Health checks come and go in
+ *     between. Returns NULL if no request came in time.
+ */
+struct backconn *backend_next(void) {
+    struct pollfd fds[MAXCONNS + 1];
+    int i, n, rc, slot[MAXCONNS + 1];
+
+    while (1) {
+        n = 0;
+        fds[n].fd = listenfd;
+        fds[n++].events = POLLIN;
+        for (i = 0; i < MAXCONNS; ++i) {
+            if (conns[i].fd < 0)
+                continue;
+            slot[n] = i;
+            fds[n].fd = conns[i].fd;
+            fds[n++].events = POLLIN;
+        }
+        while ((rc = poll(fds, n, TIMEOUT * 1000)) < 0) {
+            if (errno != EINTR)
+                unix_errq("poll error");
+        }
+        if (rc == 0)
+            return NULL;
+        for (i = 1; i < n; ++i) {
+            if (fds[i].revents != 0 && backend_read(&conns[slot[i]]) > 0)
+                return &conns[slot[i]];
+        }
+        if (fds[0].revents & POLLIN)
+            backend_accept();
+    }
+}
+
+void backend_accept(void) {
+    int fd, i;
+
+    if ((fd = accept(listenfd, NULL, NULL)) < 0)
+        unix_errq("accept error");
+    for (i = 0; i < MAXCONNS && conns[i].fd >= 0; ++i)
+        ;
+    if (i == MAXCONNS)
+        app_errq("The server opened more than %d connections", MAXCONNS);
+    conns[i].fd = fd;
+    conns[i].inlen = 0;
+    http_request_init(&conns[i].req);
+}
+
+/*
+ * backend_read - Read from bc. Returns 1 once the head of a request is
+ *     in, with its target in target, and 0 before. A connection the server
+ *     closed is closed too.
+ */
+int backend_read(struct backconn *bc) {
+    struct http_request *req = &bc->req;
+    ssize_t n;
+    int rc;
+
+    if ((n = read(bc->fd, bc->in + bc->inlen, INBUF - bc->inlen)) <= 0) {
+        if (n < 0 && errno == EINTR)
+            return 0;
+        backend_close(bc);
+        return 0;
+    }
+    bc->inlen += n;
+    if ((rc = http_parse_request(req, bc->in, bc->inlen)) < 0)
+        app_errq("Bad request from the server");
+    if (rc == 0)
+        return 0;
+    if (req->target.len >= MAXURI)
+        app_errq("Target too long");
+    memcpy(target, req->target.p, req->target.len);
+    target[req->target.len] = '\0';
+    return 1;
+}
+
+/*
+ * backend_answer - Answer the request that came over bc with its target,
+ *     and get ready for the next one. Requests of the tests have no body.
+ */
+void backend_answer(struct backconn *bc) {
+    char buf[512];
+    int n;
+
+    n = snprintf(buf, sizeof(buf), "HTTP/1.1 200 OK\r\n"
+                                   "Content-Type: text/plain\r\n"
+                                   "Content-Length: %zu\r\n\r\n%s",
+                 strlen(target), target);
+    if (rio_writen(bc->fd, buf, n) < 0)
+        unix_errq("rio_writen error");
+    bc->inlen -= bc->req.pos;
+    memmove(bc->in, bc->in + bc->req.pos, bc->inlen);
+    http_request_init(&bc->req);
+}
+
+void backend_close(struct backconn *bc) {
+    if (close(bc->fd) != 0)
+        unix_errq("close error");
+    bc->fd = -1;
+}
+
+/*
+ * client_get - Send a request for uri to the server, over a connection
+ *     that is closed after the test.
+ */
+void client_get(const char *uri) {
+    struct timeval tv = {TIMEOUT, 0};
+    char buf[512];
+    int n;
+
+    if (client < 0) {
+        if ((client = open_clientfd(host, port)) < 0)
+            app_errq("cannot connect to %s:%s", host, port);
+        if (setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv))
+            != 0)
+            unix_errq("setsockopt error");
+    }
+    n = snprintf(buf, sizeof(buf), "GET %s HTTP/1.1\r\n"
+                                   "Host: localhost\r\n\r\n", uri);
+    if (rio_writen(client, buf, n) < 0)
+        unix_errq("rio_writen error");
+}
+
+void client_close(void) {
+    if (client >= 0)
+        close(client);
+    client = -1;
+}
+
+/*
+ * client_response - Read a response with a Content-Length into resp.
+ *     Returns 0 once it is complete, or -1 if the connection ended or
+ *     nothing came in time before.
+ */
+int client_response(void) {
+    struct http_response head;
+    off_t length = -1;
+    ssize_t n;
+    int hlen = 0;
+
+    resp.status = 0;
+    resp.len = resp.bodylen = 0;
+    http_response_init(&head);
+    while ((n = read(client, resp.buf + resp.len,
+                     MAXRESP - 1 - resp.len)) > 0) {
+        resp.len += n;
+        if (hlen == 0) {
+            if ((hlen = http_parse_response(&head, resp.buf, resp.len)) < 0)
+                return -1;
+            if (hlen == 0)
+                continue;
+            resp.status = head.status;
+            if (http_content_length(head.headers, head.nheaders, &length)
+                <= 0)
+                return -1;
+        }
+        if (resp.len - hlen >= (size_t)length) {
+            resp.bodylen = length;
+            memcpy(resp.body, resp.buf + hlen, length);
+            resp.body[length] = '\0';
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * check_forwarded - Send a request for sent, which the server must pass
+ *     on to the backend for forwarded. Returns -1 if it doesn't.
+ */
+int check_forwarded(const char *sent, const char *forwarded) {
+    struct backconn *bc;
+
+    client_get(sent);
+    if ((bc = backend_next()) == NULL)
+        return fail("%s didn't reach the backend", sent);
+    backend_answer(bc);
+    if (strcmp(target, forwarded) != 0)
+        return fail("%s reached the backend as %s, not %s", sent, target,
+                    forwarded);
+    if (client_response() != 0)
+        return fail("the response to %s didn't end", sent);
+    if (resp.status != 200 || strcmp(resp.body, forwarded) != 0)
+        return fail("%s got status %d and body \"%s\"", sent, resp.status,
+                    resp.body);
+    return 0;
+}
+
+/*
+ * fail - Keep why the test failed for main() to print. Returns -1.
+ */
+int fail(const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(reason, sizeof(reason), fmt, ap);
+    va_end(ap);
+    return -1;
+}
+
+int test_dot_segments(void) {
+    if (check_forwarded("/api/./a//b/../c", "/api/a/c") != 0
+        || check_forwarded("/api/x/..", "/api/") != 0)
+        return -1;
+    return 0;
+}
+
+/* The query isn't a path: dots and slashes in it stay as they are. */
+int test_query(void) {
+    if (check_forwarded("/api/../api/x?q=1", "/api/x?q=1") != 0
+        || check_forwarded("/api/y?next=/a/../b//c", "/api/y?next=/a/../b//c")
+           != 0)
+        return -1;
+    return 0;
+}
+
+/*
+ * test_out_of_route - /api/../admin/secret is /admin/secret, which isn't
+ *     proxied: it is looked for under the document root, where it isn't.
+ *     Were it proxied, the backend would have to answer first.
+ */
+int test_out_of_route(void) {
+    client_get("/api/../admin/secret");
+    if (client_response() != 0)
+        return fail("the response didn't end");
+    if (resp.status != 404)
+        return fail("got status %d, not 404", resp.status);
+    return 0;
+}
+
+/*
+ * test_into_route - A path from outside the route that climbs into it
+ *     reaches the backend without the detour, which a backend guarding
+ *     /api/admin/ by its prefix would not see through.
+ */
+int test_into_route(void) {
+    return check_forwarded("/static/../api/admin/x", "/api/admin/x");
+}
@@ -0,0 +1,1173 @@
+#define _POSIX_C_SOURCE 200809L
+#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE
+
+#include "proxy.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <arpa/inet.h>
+
+#include "error.h"
+#include "http-utils.h"
+#include "http-parser.h"
+#include "metrics.h"
+#include "accesslog.h"
+#include "conn.h"
+
+#define CHECK_TIMEOUT_MS  1000  /* A backend slower than this is down */
+#define UPCONN_KEEP       32    /* Idle connections a worker keeps to one */
+#define UPCONN_SLAB       64    /* Connections allocated at a time */
+
+/*
+ * A connection to a backend, owned by one worker. It is registered with
+ * the worker's epoll while it is open, with the low bit of its pointer
+ * set to tell it from a client. Between requests it waits on the idle
+ * list of its backend, in case the next request goes there too.
+ */
+struct upconn {
+    int fd;                    /* -1 once closed */
+    struct proxy_backend *backend;
+    struct conn *conn;         /* Client it serves, NULL while idle */
+    struct upconn *next;       /* Idle or closed list of the worker */
+    int reused;                /* Served a request before this one */
+    int hup;                   /* The backend closed its side */
+};
+
+enum upreq_state {
+    UP_SEND,   /* Sending the head and the body that came with it */
+    UP_BODY,   /* Splicing the rest of the body from the client */
+    UP_HEAD,   /* Waiting for the response head */
+    UP_RELAY,  /* Sending the head, then splicing the body to the client */
+};
+
+/* How the end of a response body is found. */
+enum framing {
+    FRAME_NONE,     /* There is no body */
+    FRAME_LENGTH,   /* After Content-Length bytes */
+    FRAME_CHUNKED,  /* After the last chunk and the trailer */
+    FRAME_CLOSE,    /* When the backend closes the connection */
+};
+
+/*
+ * A request being proxied. It lives in the arena of its client, so it
+ * goes with the response. The request head is rewritten into wbuf, and
+ * the response head is read into wbuf once that is sent. The bodies
+ * only ever pass through the pipe of the client.
+ */
+struct upreq {
+    enum upreq_state state;
+    struct proxy_route *route;
+    struct proxy_backend *backend;
+    struct upconn *up;         /* Connection it goes over, if any yet */
+    size_t headlen;            /* Request head in rbuf */
+    size_t inbuf;              /* ... and body bytes that came with it */
+    size_t reqlen;             /* Rewritten head in wbuf */
+    size_t sent;               /* Bytes sent of the two */
+    off_t bodyleft;            /* Body bytes still in the client socket */
+    int retry;                 /* May be sent again over a new connection */
+    int head;                  /* A HEAD request, the response has no body */
+    uint64_t start;            /* When it was given a backend */
+    struct http_response resp;
+    enum framing framing;
+    off_t left;                /* Bytes to move before the next chunk head */
+    int trailer;               /* Past the last chunk */
+    int last;                  /* ... and the trailer ends with left */
+    int keep;                  /* The backend keeps the connection open */
+    int more;                  /* Body bytes came with the head */
+};
+
+static struct proxy_route routes[PROXY_MAXROUTES];
+static int nroutes = 0;
+static struct proxy_backend backends[PROXY_MAXBACKENDS];
+static int nbackends = 0;
+
+static const char *checkpath = NULL;  /* NULL to only connect */
+static int stopfd = -1;
+static pthread_t check_tid;
+
+static void *check_thread(void *arg);
+static int proxy_head(struct conn *c, const char *uri,
+                      struct http_request *req, struct proxy_backend *b);
+static int proxy_send(struct worker *w, struct conn *c);
+static int proxy_body(struct conn *c);
+static int proxy_response(struct conn *c);
+static int proxy_relay(struct worker *w, struct conn *c);
+static ssize_t proxy_chunks(struct upreq *px, const char *buf, size_t len);
+static int proxy_fail(struct worker *w, struct conn *c);
+static void proxy_end(struct worker *w, struct conn *c, int keep, int failed);
+static struct upconn *upconn_get(struct worker *w, struct proxy_backend *b,
+                                 struct conn *c, int fresh);
+static void upconn_put(struct worker *w, struct upconn *up, int keep);
+static void upconn_close(struct worker *w, struct upconn *up);
+
+/*
+ * add_backend - Return the backend at name, host:port or [host]:port,
+ *     resolving it if it is new. Returns NULL if name is malformed or
+ *     there are too many backends, with errno set to 0, or if it can't be
+ *     resolved, with errno set to EHOSTUNREACH.
+ */
+static struct proxy_backend *add_backend(const char *name) {
+    struct proxy_backend *b;
+    char host[256], *port;
+    const char *p, *h = name;
+    size_t len;
+    int i;
+
+    for (i = 0; i < nbackends; ++i) {
+        if (strcmp(backends[i].name, name) == 0)
+            return &backends[i];
+    }
+    errno = 0;
+    if (nbackends == PROXY_MAXBACKENDS)
+        return NULL;
+
+    /* An IPv6 address has colons of its own, so it is bracketed. */
+    if (name[0] == '[') {
+        if ((p = strchr(name, ']')) == NULL || p[1] != ':')
+            return NULL;
+        h = name + 1;
+        len = p++ - h;
+    }
+    else {
+        if ((p = strrchr(name, ':')) == NULL)
+            return NULL;
+        len = p - name;
+    }
+    if (len == 0 || len >= sizeof(host) || p[1] == '\0')
+        return NULL;
+    memcpy(host, h, len);
+    host[len] = '\0';
+    port = (char *)p + 1;
+
+    b = &backends[nbackends];
+    memset(b, 0, sizeof(*b));
+    if (resolve_addr(host, port, &b->addr, &b->addrlen) != 0) {
+        errno = EHOSTUNREACH;
+        return NULL;
+    }
+    if ((b->name = strdup(name)) == NULL
+        || (b->host = strdup(host)) == NULL)
+        unix_errq("strdup error");
+    b->id = nbackends++;
+    b->healthy = 1;
+    return b;
+}
+
+/*
+ * proxy_add - Add the route spec, PREFIX=BACKEND[,BACKEND]... where a
+ *     backend is host:port. spec is modified. Returns -1 with errno set
+ *     to 0 if spec is malformed, or to EHOSTUNREACH if a backend can't
+ *     be resolved.
+ */
+int proxy_add(char *spec) {
+    struct proxy_route *r;
+    char *sep, *name, *save;
+
+    errno = 0;
+    if (spec[0] != '/' || (sep = strchr(spec, '=')) == NULL
+        || nroutes == PROXY_MAXROUTES)
+        return -1;
+    *sep = '\0';
+    r = &routes[nroutes];
+    r->prefix = spec;
+    r->nbackends = 0;
+    r->next = 0;
+    for (name = strtok_r(sep + 1, ",", &save); name != NULL;
+         name = strtok_r(NULL, ",", &save)) {
+        if (r->nbackends == PROXY_MAXBACKENDS
+            || (r->backends[r->nbackends] = add_backend(name)) == NULL)
+            return -1;
+        r->nbackends++;
+    }
+    if (r->nbackends == 0)
+        return -1;
+    nroutes++;
+    return 0;
+}
+
+int proxy_active(void) {
+    return nroutes > 0;
+}
+
+int proxy_nbackends(void) {
+    return nbackends;
+}
+
+/*
+ * proxy_match - Return the route with the longest prefix of uri, or NULL
+ *     if uri is served locally.
+ */
+struct proxy_route *proxy_match(const char *uri) {
+    struct proxy_route *best = NULL;
+    size_t len, bestlen = 0;
+    int i;
+
+    for (i = 0; i < nroutes; ++i) {
+        len = strlen(routes[i].prefix);
+        if (len > bestlen && strncmp(uri, routes[i].prefix, len) == 0) {
+            best = &routes[i];
+            bestlen = len;
+        }
+    }
+    return best;
+}
+
+/*
+ * proxy_pick - Choose the backend of r for a request: of the healthy ones
+ *     the one with the fewest requests outstanding, taking turns between
+ *     equals. If none is healthy, they are all tried as if they were.
+ *     The request counts as outstanding until proxy_release().
+ */
+struct proxy_backend *proxy_pick(struct proxy_route *r) {
+    struct proxy_backend *b, *best = NULL;
+    unsigned start;
+    int i, n, bestn = 0, healthy, besthealthy = 0;
+
+    start = __atomic_fetch_add(&r->next, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < r->nbackends; ++i) {
+        b = r->backends[(start + i) % r->nbackends];
+        n = __atomic_load_n(&b->outstanding, __ATOMIC_RELAXED);
+        healthy = __atomic_load_n(&b->healthy, __ATOMIC_RELAXED);
+        if (best == NULL || healthy > besthealthy
+            || (healthy == besthealthy && n < bestn)) {
+            best = b;
+            bestn = n;
+            besthealthy = healthy;
+        }
+    }
+    __atomic_add_fetch(&best->outstanding, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&best->requests, 1, __ATOMIC_RELAXED);
+    return best;
+}
+
+/*
+ * proxy_release - Count the request picked for b as answered. If it
+ *     failed, b is taken out of rotation until it passes a health check.
+ */
+void proxy_release(struct proxy_backend *b, int failed) {
+    __atomic_sub_fetch(&b->outstanding, 1, __ATOMIC_RELAXED);
+    if (failed) {
+        __atomic_add_fetch(&b->failures, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&b->healthy, 0, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * wait_fd - Wait up to CHECK_TIMEOUT_MS for fd to get events. Returns -1
+ *     on timeout or error.
+ */
+static int wait_fd(int fd, short events) {
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = events;
+    if (poll(&pfd, 1, CHECK_TIMEOUT_MS) <= 0)
+        return -1;
+    return 0;
+}
+
+/*
+ * check - Check if b is up: it accepts a connection and, with a check
+ *     path, answers a GET of it with a 2xx or 3xx status. Returns -1 if
+ *     it is down.
+ */
+static int check(struct proxy_backend *b) {
+    char buf[512];
+    int fd, err, rc = -1;
+    socklen_t len = sizeof(err);
+    size_t n = 0;
+    ssize_t m;
+
+    if ((fd = open_clientfd_nb(&b->addr, b->addrlen)) < 0)
+        return -1;
+    if (wait_fd(fd, POLLOUT) != 0
+        || getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0)
+        goto out;
+    if (checkpath == NULL) {
+        rc = 0;
+        goto out;
+    }
+
+    n = snprintf(buf, sizeof(buf),
+                 "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n",
+                 checkpath, b->name);
+    if (n >= sizeof(buf) || send(fd, buf, n, MSG_NOSIGNAL) != (ssize_t)n)
+        goto out;
+    /* All we want is the status code in the first 12 bytes. */
+    for (n = 0; n < 12; n += m) {
+        if (wait_fd(fd, POLLIN) != 0
+            || (m = recv(fd, buf + n, sizeof(buf) - n, 0)) <= 0)
+            goto out;
+    }
+    if (memcmp(buf, "HTTP/1.", 7) == 0 && (buf[9] == '2' || buf[9] == '3'))
+        rc = 0;
+out:
+    close(fd);
+    return rc;
+}
+
+/*
+ * proxy_check_start - Check every backend every PROXY_CHECK_SECS seconds,
+ *     with a GET of path if it isn't NULL. Returns -1 with errno set on
+ *     error.
+ */
+int proxy_check_start(const char *path) {
+    int rc;
+
+    checkpath = path;
+    if ((stopfd = eventfd(0, EFD_CLOEXEC)) < 0)
+        return -1;
+    if ((rc = pthread_create(&check_tid, NULL, check_thread, NULL)) != 0) {
+        close(stopfd);
+        stopfd = -1;
+        errno = rc;
+        return -1;
+    }
+    return 0;
+}
+
+void proxy_check_stop(void) {
+    uint64_t one = 1;
+
+    if (stopfd < 0)
+        return;
+    if (write(stopfd, &one, sizeof(one)) != sizeof(one))
+        unix_errq("eventfd write error");
+    pthread_join(check_tid, NULL);
+    close(stopfd);
+    stopfd = -1;
+}
+
+static void *check_thread(void *arg) {
+    struct pollfd pfd;
+    sigset_t mask;
+    int i, rc, up;
+    /* What the checks said last, failed requests take backends down too. */
+    char wasup[PROXY_MAXBACKENDS];
+
+    /* Block all signals. */
+    sigfillset(&mask);
+    if ((rc = pthread_sigmask(SIG_SETMASK, &mask, NULL)) != 0)
+        posix_errq(rc, "pthread_sigmask error");
+
+    memset(wasup, 1, sizeof(wasup));
+    pfd.fd = stopfd;
+    pfd.events = POLLIN;
+    while (1) {
+        for (i = 0; i < nbackends; ++i) {
+            up = check(&backends[i]) == 0;
+            if (up != wasup[i])
+                app_err("backend %s is %s", backends[i].name,
+                        up ? "up" : "down");
+            wasup[i] = up;
+            __atomic_store_n(&backends[i].healthy, up, __ATOMIC_RELAXED);
+        }
+        if (poll(&pfd, 1, PROXY_CHECK_SECS * 1000) < 0 && errno != EINTR)
+            unix_errq("poll error");
+        if (pfd.revents & POLLIN)
+            break;
+    }
+    return NULL;
+}
+
+/*
+ * proxy_write_metrics - Write the state of every backend to fp in the
+ *     Prometheus text format.
+ */
+void proxy_write_metrics(FILE *fp) {
+    struct proxy_backend *b;
+    int i;
+
+    if (nbackends == 0)
+        return;
+    fprintf(fp, "# HELP httpd_upstream_requests_total Requests proxied, "
+                "by backend.\n"
+                "# TYPE httpd_upstream_requests_total counter\n");
+    for (i = 0, b = backends; i < nbackends; ++i, ++b)
+        fprintf(fp, "httpd_upstream_requests_total{backend=\"%s\"} %lu\n",
+                b->name, __atomic_load_n(&b->requests, __ATOMIC_RELAXED));
+    fprintf(fp, "# HELP httpd_upstream_failures_total Proxied requests "
+                "that got no response, by backend.\n"
+                "# TYPE httpd_upstream_failures_total counter\n");
+    for (i = 0, b = backends; i < nbackends; ++i, ++b)
+        fprintf(fp, "httpd_upstream_failures_total{backend=\"%s\"} %lu\n",
+                b->name, __atomic_load_n(&b->failures, __ATOMIC_RELAXED));
+    fprintf(fp, "# HELP httpd_upstream_outstanding Requests waiting for "
+                "a backend.\n"
+                "# TYPE httpd_upstream_outstanding gauge\n");
+    for (i = 0, b = backends; i < nbackends; ++i, ++b)
+        fprintf(fp, "httpd_upstream_outstanding{backend=\"%s\"} %d\n",
+                b->name, __atomic_load_n(&b->outstanding, __ATOMIC_RELAXED));
+    fprintf(fp, "# HELP httpd_upstream_healthy Whether a backend passed "
+                "its last health check.\n"
+                "# TYPE httpd_upstream_healthy gauge\n");
+    for (i = 0, b = backends; i < nbackends; ++i, ++b)
+        fprintf(fp, "httpd_upstream_healthy{backend=\"%s\"} %d\n",
+                b->name, __atomic_load_n(&b->healthy, __ATOMIC_RELAXED));
+}
+
+/*
+ * proxy_start - Pass request req of c, for path uri, on to a backend of
+ *     route r. The head is rewritten for the backend into wbuf and c is
+ *     left in CONN_PROXY, for proxy_drive() to take it from there. A
+ *     request we can't pass on gets an error response instead.
+ */
+void proxy_start(struct conn *c, struct proxy_route *r, const char *uri,
+                 struct http_request *req) {
+    struct upreq *px;
+    struct proxy_backend *b;
+    off_t len;
+    int n;
+
+    if (body_length(c, req, &len) != 0)
+        return;
+    b = proxy_pick(r);
+    if ((n = proxy_head(c, uri, req, b)) < 0) {
+        proxy_release(b, 0);
+        c->keepalive = 0;
+        clienterror(c, "request head", "431",
+                    "Request Header Fields Too Large",
+                    "The request head doesn't fit our buffer");
+        return;
+    }
+    if ((px = arena_alloc(&c->arena, sizeof(*px))) == NULL) {
+        proxy_release(b, 0);
+        c->keepalive = 0;
+        clienterror(c, "request", "500", "Internal Server Error",
+                    "We couldn't pass the request on");
+        return;
+    }
+    memset(px, 0, sizeof(*px));
+    px->state = UP_SEND;
+    px->route = r;
+    px->backend = b;
+    px->headlen = req->pos;
+    px->inbuf = c->rlen - px->headlen;
+    if ((off_t)px->inbuf > len)
+        px->inbuf = len;
+    px->reqlen = n;
+    px->bodyleft = len - px->inbuf;
+    /* Once the body is read from the socket it can't be sent again. */
+    px->retry = px->bodyleft == 0;
+    px->head = http_slice_eq(&req->method, "HEAD");
+    px->start = metrics_now();
+    http_response_init(&px->resp);
+    c->proxy = px;
+    c->state = CONN_PROXY;
+    if (px->bodyleft > 0)
+        send_continue(c, req);
+}
+
+/*
+ * body_length - Find the length of the body of request req of c, 0 if it
+ *     has none, into *len. Returns -1 and leaves an error response in c
+ *     if we can't tell where the body ends.
+ */
+int body_length(struct conn *c, struct http_request *req, off_t *len) {
+    *len = 0;
+    if (http_find_header(req, "Transfer-Encoding") != NULL) {
+        c->keepalive = 0;
+        clienterror(c, "Transfer-Encoding", "411", "Length Required",
+                    "We only pass on request bodies with a length");
+        return -1;
+    }
+    if (http_content_length(req->headers, req->nheaders, len) < 0) {
+        c->keepalive = 0;
+        clienterror(c, "Content-Length", "400", "Bad Request",
+                    "We couldn't tell the body length");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * send_continue - Let the client of c send the body of request req, if
+ *     it waits to be asked.
+ */
+void send_continue(struct conn *c, struct http_request *req) {
+    const struct http_slice *hdr;
+
+    if ((hdr = http_find_header(req, "Expect")) == NULL
+        || !http_slice_caseeq(hdr, "100-continue"))
+        return;
+    /*
+     * It goes out on its own, into an empty socket buffer. A TLS record
+     * only half written would have to be finished before anything else.
+     */
+    if (c->ssl == NULL || c->ktls)
+        send(c->fd, "HTTP/1.1 100 Continue\r\n\r\n", 25, MSG_DONTWAIT);
+    else if (tls_write(c->ssl, "HTTP/1.1 100 Continue\r\n\r\n", 25) != 25)
+        shutdown(c->fd, SHUT_RDWR);
+}
+
+/*
+ * proxy_head - Rewrite the head of request req of c into wbuf for backend
+ *     b: the target becomes path uri, the one the route was picked by,
+ *     with the query as it came, headers for this hop only are dropped,
+ *     the client address is added to X-Forwarded-For and the connection
+ *     is kept open. Returns its length, or -1 if it doesn't fit.
+ */
+static int proxy_head(struct conn *c, const char *uri,
+                      struct http_request *req, struct proxy_backend *b) {
+    const struct http_slice *conn, *xff;
+    const struct http_header *h;
+    const char *query;
+    char addr[INET6_ADDRSTRLEN];
+    size_t n, querylen = 0;
+    int i;
+
+    peer_name(c, addr);
+
+    /*
+     * A backend must see the path we matched, or /api/../admin would
+     * reach it past whatever it guards /admin with.
+     */
+    if ((query = memchr(req->target.p, '?', req->target.len)) != NULL)
+        querylen = req->target.p + req->target.len - query;
+    /* The version is the client's, so a backend answers what it reads. */
+    n = snprintf(c->wbuf, MAXBUF, "%.*s %s%.*s HTTP/1.%d\r\n",
+                 (int)req->method.len, req->method.p, uri,
+                 (int)querylen, query != NULL ? query : "",
+                 req->minor_version);
+    conn = http_find_header(req, "Connection");
+    for (i = 0, h = req->headers; i < req->nheaders && n < MAXBUF; ++i, ++h) {
+        if (hop_by_hop(&h->name, conn)
+            || http_slice_caseeq(&h->name, "Expect")
+            || http_slice_caseeq(&h->name, "X-Forwarded-For")
+            || http_slice_caseeq(&h->name, "X-Forwarded-Proto"))
+            continue;
+        n += snprintf(c->wbuf + n, MAXBUF - n, "%.*s: %.*s\r\n",
+                      (int)h->name.len, h->name.p,
+                      (int)h->value.len, h->value.p);
+    }
+    if (n < MAXBUF && http_find_header(req, "Host") == NULL)
+        n += snprintf(c->wbuf + n, MAXBUF - n, "Host: %s\r\n", b->name);
+    xff = http_find_header(req, "X-Forwarded-For");
+    if (n < MAXBUF)
+        n += snprintf(c->wbuf + n, MAXBUF - n,
+                      "X-Forwarded-For: %.*s%s%s\r\n"
+                      "X-Forwarded-Proto: %s\r\n"
+                      "Connection: keep-alive\r\n\r\n",
+                      xff != NULL ? (int)xff->len : 0,
+                      xff != NULL ? xff->p : "", xff != NULL ? ", " : "",
+                      addr, c->ssl != NULL ? "https" : "http");
+    return n < MAXBUF ? (int)n : -1;
+}
+
+/*
+ * hop_by_hop - Check if the header called name is only meant for the
+ *     connection it came over: one of the standard ones, or one that the
+ *     Connection header conn, if any, lists.
+ */
+int hop_by_hop(const struct http_slice *name, const struct http_slice *conn) {
+    static const char *hop[] = {
+        "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Upgrade", NULL
+    };
+    char buf[64];
+    int i;
+
+    for (i = 0; hop[i] != NULL; ++i) {
+        if (http_slice_caseeq(name, hop[i]))
+            return 1;
+    }
+    if (conn == NULL || name->len >= sizeof(buf))
+        return 0;
+    memcpy(buf, name->p, name->len);
+    buf[name->len] = '\0';
+    return http_has_token(conn, buf);
+}
+
+/*
+ * proxy_drive - Move the proxied request of c as far as it can go without
+ *     blocking. Events of the client and of its backend connection both
+ *     end up here. Returns 1 to wait for the next one, 0 once c is left
+ *     in CONN_WRITE with the rest of the response, and -1 if c is to be
+ *     closed.
+ */
+int proxy_drive(struct worker *w, struct conn *c) {
+    int rc = 0;
+
+    while (c->state == CONN_PROXY) {
+        switch (c->proxy->state) {
+        case UP_SEND:  rc = proxy_send(w, c); break;
+        case UP_BODY:  rc = proxy_body(c); break;
+        case UP_HEAD:  rc = proxy_response(c); break;
+        case UP_RELAY: rc = proxy_relay(w, c); break;
+        }
+        if (rc == -2)
+            rc = proxy_fail(w, c);
+        if (rc != 0)
+            return rc;
+    }
+    return 0;
+}
+
+/*
+ * proxy_send - Send the rewritten head of the request of c to its
+ *     backend, with the body bytes that came along, over an idle
+ *     connection if there is one. Returns like proxy_drive(), or -2 if
+ *     the backend failed.
+ */
+static int proxy_send(struct worker *w, struct conn *c) {
+    struct upreq *px = c->proxy;
+    struct iovec iov[2];
+    struct msghdr msg;
+    size_t total = px->reqlen + px->inbuf;
+    ssize_t n;
+
+    if (px->up == NULL
+        && (px->up = upconn_get(w, px->backend, c, 0)) == NULL)
+        return -2;
+
+    /* A new connection takes writes once it is up, until then EAGAIN. */
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    while (px->sent < total) {
+        if (px->sent < px->reqlen) {
+            iov[0].iov_base = c->wbuf + px->sent;
+            iov[0].iov_len = px->reqlen - px->sent;
+            iov[1].iov_base = c->rbuf + px->headlen;
+            iov[1].iov_len = px->inbuf;
+            msg.msg_iovlen = 2;
+        }
+        else {
+            iov[0].iov_base = c->rbuf + px->headlen + px->sent - px->reqlen;
+            iov[0].iov_len = total - px->sent;
+            msg.msg_iovlen = 1;
+        }
+        n = sendmsg(px->up->fd, &msg, px->bodyleft > 0 ? MSG_MORE : 0);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 1;
+            if (errno == EINTR)
+                continue;
+            return -2;
+        }
+        px->sent += n;
+    }
+    px->state = px->bodyleft > 0 ? UP_BODY : UP_HEAD;
+    return 0;
+}
+
+/*
+ * proxy_body - Splice the rest of the request body of c from the client
+ *     through the pipe to the backend. Returns like proxy_send().
+ */
+static int proxy_body(struct conn *c) {
+    struct upreq *px = c->proxy;
+    ssize_t n;
+
+    if (c->splicefd[0] < 0 && pipe2(c->splicefd, O_NONBLOCK) < 0) {
+        c->splicefd[0] = c->splicefd[1] = -1;
+        return -1;
+    }
+    while (px->bodyleft > 0 || c->spliced > 0) {
+        /* Drain the pipe into the backend. */
+        if (c->spliced > 0) {
+            n = splice(c->splicefd[0], NULL, px->up->fd, NULL, c->spliced,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK
+                       | (px->bodyleft > 0 ? SPLICE_F_MORE : 0));
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return 1;
+                if (errno == EINTR)
+                    continue;
+                return -2;
+            }
+            c->spliced -= n;
+            continue;
+        }
+
+        /* Refill it from the client. */
+        n = conn_splice_in(c, px->bodyleft);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 1;
+            if (errno == EINTR)
+                continue;
+        }
+        if (n <= 0)
+            return -1; /* The client went away */
+        c->spliced = n;
+        px->bodyleft -= n;
+    }
+    px->state = UP_HEAD;
+    return 0;
+}
+
+/*
+ * proxy_response - Read the response head for c from its backend into
+ *     wbuf, and build the head the client gets from it. The head is only
+ *     peeked at until it is complete, so not a byte of the body is read.
+ *     Interim 1xx responses are dropped. Returns like proxy_send().
+ */
+static int proxy_response(struct conn *c) {
+    struct upreq *px = c->proxy;
+    struct http_response *resp = &px->resp;
+    const struct http_slice *conn, *hdr;
+    const struct http_header *h;
+    char *buf;
+    size_t size;
+    ssize_t n;
+    int i, len, rc;
+
+    while (1) {
+        n = recv(px->up->fd, c->wbuf, MAXBUF, MSG_PEEK);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 1;
+            if (errno == EINTR)
+                continue;
+            return -2;
+        }
+        if (n == 0)
+            return -2; /* Closed without a word */
+        px->retry = 0;
+        if ((len = http_parse_response(resp, c->wbuf, n)) < 0)
+            return -2;
+        if (len == 0)
+            return n == MAXBUF || px->up->hup ? -2 : 1;
+        /* Take the head off the socket, wbuf has it already. */
+        if (recv(px->up->fd, c->wbuf, len, 0) != len)
+            return -2;
+        if (resp->status >= 200)
+            break;
+        if (resp->status == 101)
+            return -2; /* We never ask for an upgrade */
+        http_response_init(resp);
+    }
+    c->wstart = metrics_now();
+    metrics_time(STAGE_UPSTREAM, c->wstart - px->start);
+    c->status = resp->status;
+    c->bodylen = 0;
+
+    conn = http_find(resp->headers, resp->nheaders, "Connection");
+    px->keep = resp->minor_version >= 1;
+    if (conn != NULL) {
+        if (http_has_token(conn, "close"))
+            px->keep = 0;
+        else if (http_has_token(conn, "keep-alive"))
+            px->keep = 1;
+    }
+
+    /* Where the body ends, as in RFC 9112 section 6.3. */
+    px->framing = FRAME_CLOSE;
+    if (px->head || resp->status == 204 || resp->status == 304)
+        px->framing = FRAME_NONE;
+    else if ((hdr = http_find(resp->headers, resp->nheaders,
+                              "Transfer-Encoding")) != NULL) {
+        if (http_has_token(hdr, "chunked"))
+            px->framing = FRAME_CHUNKED;
+    }
+    else if ((rc = http_content_length(resp->headers, resp->nheaders,
+                                       &px->left)) != 0) {
+        if (rc < 0)
+            return -2;
+        px->framing = FRAME_LENGTH;
+    }
+    /* The client can only tell the end by the close too. */
+    if (px->framing == FRAME_CLOSE)
+        px->keep = c->keepalive = 0;
+    /* Then the head can wait for the start of the body to share packets. */
+    px->more = px->framing != FRAME_NONE && n > len;
+
+    /*
+     * The head the client gets is the backend's, but for the version and
+     * what is about the connection. Line ends and spaces added to it take
+     * far less than the room on top.
+     */
+    size = len + MAXLINE / 16;
+    if ((buf = arena_alloc(&c->arena, size)) == NULL)
+        return -2;
+    n = snprintf(buf, size, "HTTP/1.1 %d %.*s\r\n", resp->status,
+                 (int)resp->reason.len, resp->reason.p);
+    for (i = 0, h = resp->headers; i < resp->nheaders; ++i, ++h) {
+        if (!hop_by_hop(&h->name, conn))
+            n += snprintf(buf + n, size - n, "%.*s: %.*s\r\n",
+                          (int)h->name.len, h->name.p,
+                          (int)h->value.len, h->value.p);
+    }
+    n += build_connhdrs(c, buf + n, size - n);
+    c->iov[0].iov_base = buf;
+    c->iov[0].iov_len = n;
+    c->iovcnt = 1;
+    c->iovpos = 0;
+    log("Response headers:\n%s", buf);
+    px->state = UP_RELAY;
+    return 0;
+}
+
+/*
+ * proxy_relay - Send the response head to the client of c, then splice
+ *     the body from the backend through the pipe to it. A chunked body is
+ *     passed on as it is, its chunk heads are only peeked at to find the
+ *     end. Returns like proxy_drive(): once the head is out, a failing
+ *     backend takes the client down with it.
+ */
+static int proxy_relay(struct worker *w, struct conn *c) {
+    struct upreq *px = c->proxy;
+    char peek[256];
+    ssize_t n;
+    size_t len;
+    int rc;
+
+    conn_nodelay(c);
+    if ((rc = conn_flush(c)) != 0)
+        return rc;
+    if (px->framing != FRAME_NONE && c->splicefd[0] < 0
+        && pipe2(c->splicefd, O_NONBLOCK) < 0) {
+        c->splicefd[0] = c->splicefd[1] = -1;
+        return -1;
+    }
+
+    while (1) {
+        /* Drain the pipe into the client. */
+        if (c->spliced > 0) {
+            if ((n = conn_splice_out(c, c->spliced)) < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return 1;
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            metrics_count(COUNTER_BYTES, n);
+            c->bodylen += n;
+            c->spliced -= n;
+            continue;
+        }
+
+        /* Find out how far the next chunk goes. */
+        if (px->framing == FRAME_CHUNKED && px->left == 0 && !px->last) {
+            n = recv(px->up->fd, peek, sizeof(peek), MSG_PEEK);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return 1;
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            if (n == 0 || (rc = proxy_chunks(px, peek, n)) < 0)
+                return -1;
+            if (rc == 0)
+                return n == sizeof(peek) || px->up->hup ? -1 : 1;
+            continue;
+        }
+        if (px->framing == FRAME_NONE
+            || (px->framing != FRAME_CLOSE && px->left == 0))
+            break;
+
+        /* Refill the pipe from the backend. */
+        len = px->framing == FRAME_CLOSE || px->left > INT32_MAX
+              ? INT32_MAX : px->left;
+        n = splice(px->up->fd, NULL, c->splicefd[1], NULL, len,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 1;
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0) {
+            if (px->framing == FRAME_CLOSE)
+                break;
+            return -1; /* The body came up short */
+        }
+        c->spliced = n;
+        if (px->framing != FRAME_CLOSE)
+            px->left -= n;
+    }
+    proxy_end(w, c, px->keep, 0);
+    return 0;
+}
+
+/*
+ * proxy_chunks - Scan the chunk heads at the start of buf[0, len), the
+ *     next bytes of the chunked body of the response of px, and set
+ *     px->left to what is passed on before the next scan: those heads and
+ *     the chunk after them with its CRLF. Returns how many bytes of heads
+ *     there are, 0 if the first one is incomplete, or -1 if it is
+ *     malformed.
+ */
+static ssize_t proxy_chunks(struct upreq *px, const char *buf, size_t len) {
+    const char *p = buf, *start, *q, *nl;
+    off_t size;
+    int d;
+
+    while ((nl = memchr(p, '\n', buf + len - p)) != NULL) {
+        start = q = p;
+        p = nl + 1;
+        if (px->trailer) {
+            /* The trailer ends with an empty line. */
+            if (q == nl || (q + 1 == nl && *q == '\r')) {
+                px->last = 1;
+                break;
+            }
+            continue;
+        }
+
+        for (size = 0; q < nl; ++q) {
+            if (*q >= '0' && *q <= '9')
+                d = *q - '0';
+            else if ((*q | 0x20) >= 'a' && (*q | 0x20) <= 'f')
+                d = (*q | 0x20) - 'a' + 10;
+            else
+                break;
+            if (size > (HTTP_OFF_MAX - 2 - d) / 16)
+                return -1;
+            size = size * 16 + d;
+        }
+        if (q == start || (*q != ';' && *q != '\r' && *q != '\n'
+                           && *q != ' ' && *q != '\t'))
+            return -1;
+        if (size == 0) {
+            px->trailer = 1; /* The last chunk */
+            continue;
+        }
+        px->left = p - buf + size + 2;
+        return p - buf;
+    }
+    px->left = p - buf;
+    return p - buf;
+}
+
+/*
+ * proxy_fail - Handle the backend of c failing before it answered. If
+ *     nothing of the request is lost, it is sent once more over a new
+ *     connection, to whichever backend is best now. Otherwise the client
+ *     gets a 502. A reused connection may just have been closed by its
+ *     backend meanwhile, which doesn't count against it. Returns 0.
+ */
+static int proxy_fail(struct worker *w, struct conn *c) {
+    struct upreq *px = c->proxy;
+    int failed = px->up == NULL || !px->up->reused;
+
+    if (px->up != NULL) {
+        upconn_put(w, px->up, 0);
+        px->up = NULL;
+    }
+    if (px->retry) {
+        px->retry = 0;
+        proxy_release(px->backend, failed);
+        px->backend = proxy_pick(px->route);
+        px->sent = 0;
+        px->state = UP_SEND;
+        http_response_init(&px->resp);
+        if ((px->up = upconn_get(w, px->backend, c, 1)) != NULL)
+            return 0;
+        failed = 1;
+    }
+    log("backend %s failed\n\n", px->backend->name);
+
+    /* The rest of the body would be taken for the next request. */
+    if (px->bodyleft > 0 || c->spliced > 0)
+        c->keepalive = 0;
+    clienterror(c, px->backend->name, "502", "Bad Gateway",
+                "The backend didn't answer");
+    proxy_end(w, c, 0, failed);
+    return 0;
+}
+
+/*
+ * proxy_end - Finish the proxied request of c: give its connection back
+ *     to the worker, to be kept if keep is set, count the request as
+ *     answered by its backend, or failed, and drop it from rbuf. c is
+ *     left in CONN_WRITE with whatever response is left to send.
+ */
+static void proxy_end(struct worker *w, struct conn *c, int keep, int failed) {
+    struct upreq *px = c->proxy;
+
+    if (px->up != NULL) {
+        upconn_put(w, px->up, keep);
+        px->up = NULL;
+    }
+    proxy_release(px->backend, failed);
+    /* Body bytes left in the pipe are no use to the next response. */
+    if (c->spliced > 0) {
+        close(c->splicefd[0]);
+        close(c->splicefd[1]);
+        c->splicefd[0] = c->splicefd[1] = -1;
+        c->spliced = 0;
+    }
+    c->proxy = NULL;
+    conn_consume(c, px->headlen + px->inbuf);
+    c->state = CONN_WRITE;
+}
+
+/*
+ * proxy_abort - Give up the proxied request of c, which is being closed.
+ *     Its backend connection is in the middle of an exchange, so it goes
+ *     too. The request is only logged if the backend answered it.
+ */
+void proxy_abort(struct worker *w, struct conn *c) {
+    struct upreq *px = c->proxy;
+
+    if (px->up != NULL) {
+        upconn_put(w, px->up, 0);
+        px->up = NULL;
+    }
+    proxy_release(px->backend, 0);
+    if (px->state == UP_RELAY)
+        accesslog_request(&c->peer, &c->req, c->status, c->bodylen);
+    c->proxy = NULL;
+}
+
+/*
+ * upconn_get - Return a connection of worker w to backend b for client c:
+ *     an idle one unless fresh is set, or else a new one, which may still
+ *     be connecting. Returns NULL on error.
+ */
+static struct upconn *upconn_get(struct worker *w, struct proxy_backend *b,
+                                 struct conn *c, int fresh) {
+    struct upconn *up;
+    struct epoll_event ev;
+    int fd;
+
+    if (!fresh && (up = w->idle[b->id]) != NULL) {
+        w->idle[b->id] = up->next;
+        w->nidle[b->id]--;
+        up->reused = 1;
+        up->conn = c;
+        return up;
+    }
+    if ((fd = open_clientfd_nb(&b->addr, b->addrlen)) < 0)
+        return NULL;
+    if ((up = pool_get(&w->upconns)) == NULL) {
+        close(fd);
+        return NULL;
+    }
+    up->fd = fd;
+    up->backend = b;
+    up->conn = c;
+    up->next = NULL;
+    up->reused = 0;
+    up->hup = 0;
+
+    /* Registered once and edge-triggered, like a client. */
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = (void *)((uintptr_t)up | 1);
+    if (epoll_ctl(w->epollfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+        unix_errq("epoll_ctl error");
+    return up;
+}
+
+/*
+ * upconn_put - Take backend connection up off its request. If keep is
+ *     set and there is room it waits for the next request to its
+ *     backend, otherwise it is closed.
+ */
+static void upconn_put(struct worker *w, struct upconn *up, int keep) {
+    int id = up->backend->id;
+
+    up->conn = NULL;
+    if (!keep || up->hup || w->nidle[id] >= UPCONN_KEEP) {
+        upconn_close(w, up);
+        return;
+    }
+    up->next = w->idle[id];
+    w->idle[id] = up;
+    w->nidle[id]++;
+}
+
+/*
+ * upconn_close - Close backend connection up, which is on no idle list.
+ *     It is freed by worker_reap().
+ */
+static void upconn_close(struct worker *w, struct upconn *up) {
+    if (close(up->fd) != 0)
+        unix_errq("close upstream error");
+    up->fd = -1;
+    up->next = w->deadups;
+    w->deadups = up;
+}
+
+/*
+ * upconn_event - Handle events on backend connection up of worker w,
+ *     which drive the request it carries. An idle connection has nothing
+ *     to read, so anything but room to write means the backend closed it
+ *     or broke it.
+ */
+void upconn_event(struct worker *w, struct upconn *up, uint32_t events) {
+    struct upconn **p;
+    int id;
+
+    if (up->fd < 0)
+        return;
+    if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+        up->hup = 1;
+    if (up->conn != NULL) {
+        conn_handle(w, up->conn);
+        return;
+    }
+    if (!(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+        return;
+    id = up->backend->id;
+    for (p = &w->idle[id]; *p != up; p = &(*p)->next)
+        ;
+    *p = up->next;
+    w->nidle[id]--;
+    upconn_close(w, up);
+}
+
+/*
+ * proxy_more - Check if body bytes of the backend came right behind the
+ *     response head c is sending, so that the head waits for them.
+ */
+int proxy_more(const struct conn *c) {
+    return c->proxy != NULL && c->proxy->more;
+}
+
+/*
+ * proxy_worker_setup - Set up what worker w keeps of its connections to
+ *     backends. It runs in the thread of w.
+ */
+void proxy_worker_setup(struct worker *w) {
+    pool_init(&w->upconns, sizeof(struct upconn), UPCONN_SLAB, 0);
+    if (proxy_active()
+        && ((w->idle = calloc(proxy_nbackends(), sizeof(*w->idle))) == NULL
+            || (w->nidle = calloc(proxy_nbackends(), sizeof(int))) == NULL))
+        unix_errq("calloc error");
+}
+
+/*
+ * proxy_worker_reap - Free the connections to backends that worker w
+ *     closed in this round.
+ */
+void proxy_worker_reap(struct worker *w) {
+    struct upconn *up;
+
+    while ((up = w->deadups) != NULL) {
+        w->deadups = up->next;
+        pool_put(&w->upconns, up);
+    }
+}
+
+/*
+ * proxy_worker_stop - Close the idle connections of worker w to backends,
+ *     once its clients are gone, and free what it kept of them.
+ */
+void proxy_worker_stop(struct worker *w) {
+    struct upconn *up;
+    int i;
+
+    for (i = 0; i < proxy_nbackends(); ++i) {
+        while ((up = w->idle[i]) != NULL) {
+            w->idle[i] = up->next;
+            upconn_close(w, up);
+        }
+    }
+    proxy_worker_reap(w);
+    free(w->idle);
+    free(w->nidle);
+    pool_destroy(&w->upconns);
+}
@@ -0,0 +1,66 @@
+#ifndef _PROXY_H
+#define _PROXY_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define PROXY_MAXROUTES    16  /* Max --proxy rules */
+#define PROXY_MAXBACKENDS  64  /* Max backends over all rules */
+#define PROXY_CHECK_SECS   2   /* Seconds between health checks */
+
+/*
+ * An upstream server. Its address is resolved once, at startup. The
+ * counters are shared by all workers.
+ */
+struct proxy_backend {
+    int id;                         /* Index, for state kept per worker */
+    char *name;                     /* host:port, as configured */
+    char *host;                     /* ... the host part, for Host */
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int outstanding;                /* Requests sent and not answered */
+    int healthy;                    /* Passed its last health check */
+    unsigned long requests;         /* Requests sent to it */
+    unsigned long failures;         /* ... that got no response */
+};
+
+/* Requests for paths under prefix go to one of its backends. */
+struct proxy_route {
+    char *prefix;
+    struct proxy_backend *backends[PROXY_MAXBACKENDS];
+    int nbackends;
+    unsigned next;                  /* Where ties are broken */
+};
+
+struct conn;
+struct worker;
+struct upconn;
+struct http_request;
+struct http_slice;
+
+int proxy_add(char *spec);
+int proxy_active(void);
+int proxy_nbackends(void);
+struct proxy_route *proxy_match(const char *uri);
+struct proxy_backend *proxy_pick(struct proxy_route *r);
+void proxy_release(struct proxy_backend *b, int failed);
+int proxy_check_start(const char *path);
+void proxy_check_stop(void);
+void proxy_write_metrics(FILE *fp);
+
+void proxy_start(struct conn *c, struct proxy_route *r, const char *uri,
+                 struct http_request *req);
+int body_length(struct conn *c, struct http_request *req, off_t *len);
+void send_continue(struct conn *c, struct http_request *req);
+int proxy_drive(struct worker *w, struct conn *c);
+void proxy_abort(struct worker *w, struct conn *c);
+int hop_by_hop(const struct http_slice *name, const struct http_slice *conn);
+int proxy_more(const struct conn *c);
+void upconn_event(struct worker *w, struct upconn *up, uint32_t events);
+void proxy_worker_setup(struct worker *w);
+void proxy_worker_reap(struct worker *w);
+void proxy_worker_stop(struct worker *w);
+
+#endif
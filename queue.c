@@ -2,91 +2,117 @@
 
 #include <stdlib.h>
 #include <errno.h>
-#include <assert.h>
 
-static int enqueue_nolock(queue_t *q, int item) {
-    struct queue_node *pnew;
-    
-    if ((pnew = malloc(sizeof(struct queue_node))) == NULL)
-        return -1;
+/*
+ * queue_init - Set up an empty queue holding up to capacity items,
+ *     rounded up to a power of 2. Returns -1 with errno set on error.
+ */
+int queue_init(queue_t *q, int capacity) {
+    unsigned long i, size;
 
-    pnew->item = item;
-    pnew->next = NULL;
-    if (q->size == 0)
-        q->front = pnew;
-    else
-        q->rear->next = pnew;
-    q->rear = pnew;
-    q->size++;
-    
-    return 0;
-}
-
-static int dequeue_nolock(queue_t *q, int *item) {
-    struct queue_node *temp;
-    
-    if (q->size == 0)
+    if (capacity <= 0) {
+        errno = EINVAL;
         return -1;
-
-    if (item != NULL)
-        *item = q->front->item;
-    temp = q->front;
-    q->front = q->front->next;
-    free(temp);
-    q->size--;
-    if (q->size == 0)
-        q->rear = NULL;
-    
+    }
+    for (size = 2; size < (unsigned long)capacity; size <<= 1)
+        ;
+    if (posix_memalign((void **)&q->cells, QUEUE_CACHELINE,
+                       size * sizeof(struct queue_cell)) != 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    for (i = 0; i < size; ++i)
+        q->cells[i].seq = i;
+    q->mask = size - 1;
+    q->enqueue_pos = 0;
+    q->dequeue_pos = 0;
     return 0;
 }
 
-int queue_init(queue_t *q) {
-    int rc;
-
-    q->front = q->rear = NULL;
-    q->size = 0;
-    if ((rc = pthread_mutex_init(&q->mutex, NULL)) == 0)
-        return 0;
-    errno = rc;
-    return -1;
-}
-
 void queue_destroy(queue_t *q) {
-    pthread_mutex_lock(&q->mutex);
-    while (q->size != 0)
-        dequeue_nolock(q, NULL);
-    assert(q->front == NULL);
-    assert(q->rear == NULL);
-    pthread_mutex_unlock(&q->mutex);
-    pthread_mutex_destroy(&q->mutex);
+    free(q->cells);
+    q->cells = NULL;
 }
 
-int queue_empty(queue_t *q) {
-    int empty;
+/*
+ * queue_size - Number of items in q. It may be stale by the time the
+ *     caller looks at it, as other threads keep going.
+ */
+int queue_size(queue_t *q) {
+    unsigned long head, tail;
 
-    pthread_mutex_lock(&q->mutex);
-    empty = (q->size == 0);
-    pthread_mutex_unlock(&q->mutex);
+    tail = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+    head = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+    return head > tail ? (int)(head - tail) : 0;
+}
 
-    return empty;
+int queue_empty(queue_t *q) {
+    return queue_size(q) == 0;
 }
 
+/*
+ * enqueue - Add item to q. Returns -1 with errno set to EAGAIN if q is
+ *     full, so that the caller can push back on whoever produces items.
+ */
 int enqueue(queue_t *q, int item) {
-    int ret;
-
-    pthread_mutex_lock(&q->mutex);
-    ret = enqueue_nolock(q, item);
-    pthread_mutex_unlock(&q->mutex);
-
-    return ret;
+    struct queue_cell *cell;
+    unsigned long pos, seq;
+    long diff;
+
+    pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+    while (1) {
+        cell = &q->cells[pos & q->mask];
+        seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        diff = (long)seq - (long)pos;
+        if (diff == 0) {
+            /* The slot is free, claim it. On failure pos is reloaded. */
+            if (__atomic_compare_exchange_n(&q->enqueue_pos, &pos, pos + 1,
+                                            1, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0) {
+            errno = EAGAIN; /* A full lap behind the consumers */
+            return -1;
+        }
+        else
+            pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+    }
+
+    cell->item = item;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
 }
 
+/*
+ * dequeue - Take the oldest item off q. Returns -1 if q is empty.
+ */
 int dequeue(queue_t *q, int *item) {
-    int ret;
-
-    pthread_mutex_lock(&q->mutex);
-    ret = dequeue_nolock(q, item);
-    pthread_mutex_unlock(&q->mutex);
+    struct queue_cell *cell;
+    unsigned long pos, seq;
+    long diff;
+
+    pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+    while (1) {
+        cell = &q->cells[pos & q->mask];
+        seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        diff = (long)seq - (long)(pos + 1);
+        if (diff == 0) {
+            /* The slot is full, claim it. On failure pos is reloaded. */
+            if (__atomic_compare_exchange_n(&q->dequeue_pos, &pos, pos + 1,
+                                            1, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0)
+            return -1; /* Nothing produced at pos yet */
+        else
+            pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+    }
 
-    return ret;
-}
\ No newline at end of file
+    if (item != NULL)
+        *item = cell->item;
+    /* Free the slot for the producer one lap ahead. */
+    __atomic_store_n(&cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+    return 0;
+}
@@ -1,21 +1,32 @@
 #ifndef _QUEUE_H
 #define _QUEUE_H
 
-#include <pthread.h>
+#define QUEUE_CACHELINE 64
 
-struct queue_node {
+/*
+ * One slot of the ring. seq tells producers and consumers whose turn it
+ * is: a slot at position pos is free when seq == pos and full when
+ * seq == pos + 1.
+ */
+struct queue_cell {
+    unsigned long seq;
     int item;
-    struct queue_node *next;
 };
 
+/*
+ * A bounded, lock-free multi-producer multi-consumer queue. The two
+ * positions live on cache lines of their own, so producers and consumers
+ * don't invalidate each other's lines.
+ */
 typedef struct {
-  struct queue_node *front;
-  struct queue_node *rear;
-  int size;
-  pthread_mutex_t mutex;
+    struct queue_cell *cells;
+    unsigned long mask;  /* Capacity - 1, capacity is a power of 2 */
+    unsigned long enqueue_pos __attribute__((aligned(QUEUE_CACHELINE)));
+    unsigned long dequeue_pos __attribute__((aligned(QUEUE_CACHELINE)));
+    char pad[QUEUE_CACHELINE - sizeof(unsigned long)];
 } queue_t;
 
-int queue_init(queue_t *q);
+int queue_init(queue_t *q, int capacity);
 void queue_destroy(queue_t *q);
 int queue_empty(queue_t *q);
 int queue_size(queue_t *q);
@@ -0,0 +1,558 @@
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <zlib.h>
+
+#include "error.h"
+#include "http-utils.h"
+#include "http-parser.h"
+#include "rio.h"
+
+#define WAIT_SERVER  5      /* Seconds to wait for the server to come up */
+#define TIMEOUT      5      /* Seconds the server may take for anything */
+#define MAXLINE      512
+#define MAXFILE      (256 * 1024)  /* Largest file of the tests */
+#define MAXRESP      (MAXFILE + 8192)
+
+/* A response, as a client read it, with its head parsed in buf. */
+struct response {
+    struct http_response head;
+    size_t len;
+    char buf[MAXRESP];
+    char *body;
+    size_t bodylen;
+};
+
+static char *host = "127.0.0.1";
+static char *port = NULL;
+static char *docroot = NULL;
+static int cached = 1;         /* The server has a cache, and variants */
+static struct response resp;
+static char file[MAXFILE];     /* The file the last test asked for */
+static size_t filelen;
+static char reason[512];       /* Why the last test failed */
+
+void show_usage(const char *name);
+void wait_server(void);
+void load(const char *path);
+int get(const char *path, const char *headers);
+const char *header(const char *name, char *buf, size_t size);
+int check_range(const char *path, const char *range, size_t start,
+                size_t end);
+int check_whole(const char *path, const char *headers);
+int check_part(char **p, char *end, const char *boundary, size_t start,
+               size_t last);
+int check_identity(const char *path, const char *accept, int vary);
+int gunzip(const char *src, size_t len, char *dst, size_t *dstlen);
+int fail(const char *fmt, ...);
+int test_single(void);
+int test_multipart(void);
+int test_unsatisfiable(void);
+int test_ignored(void);
+int test_if_range(void);
+int test_gzip(void);
+int test_identity(void);
+int test_gzip_not_modified(void);
+
+static const struct test {
+    const char *name;
+    int (*run)(void);
+} tests[] = {
+    {"single ranges, from the start, the end and clipped", test_single},
+    {"several ranges in a multipart/byteranges body", test_multipart},
+    {"ranges past the end of the file", test_unsatisfiable},
+    {"ranges that aren't taken get the whole file", test_ignored},
+    {"If-Range with the entity tag and the date", test_if_range},
+    {"gzip for a client that takes it, with Vary", test_gzip},
+    {"the file as it is, for the rest and for ranges", test_identity},
+    {"conditional requests for the gzipped file", test_gzip_not_modified},
+};
+#define NTESTS ((int)(sizeof(tests) / sizeof(tests[0])))
+
+int main(int argc, char *argv[]) {
+    int opt, i, nfailed = 0;
+
+    /* Process args. */
+    while (1) {
+        static const char *optstring = "H:p:uh";
+        static const struct option longopts[] = {
+            {"host", required_argument, NULL, 'H'},
+            {"port", required_argument, NULL, 'p'},
+            {"uncached", no_argument, NULL, 'u'},
+            {"help", no_argument, NULL, 'h'},
+            {NULL, 0, NULL, 0}
+        };
+
+        opt = getopt_long(argc, argv, optstring, longopts, NULL);
+        if (opt == -1)
+            break;
+        switch (opt) {
+        case 'H': host = optarg; break;
+        case 'p': port = optarg; break;
+        case 'u': cached = 0; break;
+        case 'h':
+        default: show_usage(argv[0]);
+        }
+    }
+    if (port == NULL || optind != argc - 1)
+        show_usage(argv[0]);
+    docroot = argv[optind];
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+        unix_errq("signal error");
+
+    http_parser_init();
+    wait_server();
+    for (i = 0; i < NTESTS; ++i) {
+        reason[0] = '\0';
+        if (tests[i].run() == 0)
+            printf("ok    %s\n", tests[i].name);
+        else {
+            printf("FAIL  %s: %s\n", tests[i].name, reason);
+            nfailed++;
+        }
+    }
+    printf("%d of %d tests failed\n", nfailed, NTESTS);
+    return nfailed > 0;
+}
+
+void show_usage(const char *name) {
+    printf("Usage: %s [-H HOST, --host HOST] -p PORT, --port PORT\n"
+           "       [-u, --uncached] [-h, --help] DIR\n"
+           "Ask the server at HOST:PORT, which serves DIR, for parts of "
+           "the files in it\nand for them gzipped, which it sends unless "
+           "-u says it runs without the\ncache.\n",
+           name);
+    exit(1);
+}
+
+void wait_server(void) {
+    int fd, i;
+    struct timespec ts = {0, 100 * 1000 * 1000};
+
+    for (i = 0; i < WAIT_SERVER * 10; ++i) {
+        if ((fd = open_clientfd(host, port)) >= 0) {
+            close(fd);
+            return;
+        }
+        if (fd == -2)
+            break;
+        nanosleep(&ts, NULL);
+    }
+    app_errq("cannot connect to %s:%s", host, port);
+}
+
+/*
+ * load - Read the file the server serves for path into file.
+ */
+void load(const char *path) {
+    char filename[MAXLINE];
+    ssize_t n;
+    int fd;
+
+    snprintf(filename, sizeof(filename), "%s%s", docroot, path);
+    if ((fd = open(filename, O_RDONLY, 0)) < 0)
+        unix_errq("open error");
+    for (filelen = 0; filelen < MAXFILE; filelen += n) {
+        if ((n = read(fd, file + filelen, MAXFILE - filelen)) < 0)
+            unix_errq("read error");
+        if (n == 0)
+            break;
+    }
+    if (filelen == MAXFILE)
+        app_errq("%s is too large for the tests", filename);
+    close(fd);
+}
+
+/*
+ * get - Ask for path, with the header lines headers, over a connection
+ *     of its own, and read the response into resp. Returns -1 if it
+ *     doesn't come whole, with a Content-Length unless it is a 304, in
+ *     time.
+ */
+int get(const char *path, const char *headers) {
+    struct timeval tv = {TIMEOUT, 0};
+    char buf[MAXLINE * 2];
+    off_t length = -1;
+    ssize_t n;
+    int fd, len, hlen = 0, rc = -1;
+
+    if ((fd = open_clientfd(host, port)) < 0)
+        app_errq("cannot connect to %s:%s", host, port);
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0)
+        unix_errq("setsockopt error");
+    len = snprintf(buf, sizeof(buf), "GET %s HTTP/1.1\r\n"
+                                     "Host: localhost\r\n"
+                                     "%s\r\n", path, headers);
+    if (rio_writen(fd, buf, len) < 0)
+        unix_errq("rio_writen error");
+
+    resp.len = resp.bodylen = 0;
+    http_response_init(&resp.head);
+    while ((n = read(fd, resp.buf + resp.len, MAXRESP - resp.len)) > 0) {
+        resp.len += n;
+        if (hlen == 0) {
+            if ((hlen = http_parse_response(&resp.head, resp.buf,
+                                            resp.len)) < 0)
+                break;
+            if (hlen == 0)
+                continue;
+            if (resp.head.status == 304)
+                length = 0;
+            else if (http_content_length(resp.head.headers,
+                                         resp.head.nheaders, &length) <= 0)
+                break;
+        }
+        if (resp.len - hlen >= (size_t)length) {
+            resp.body = resp.buf + hlen;
+            resp.bodylen = length;
+            rc = 0;
+            break;
+        }
+    }
+    close(fd);
+    if (rc != 0)
+        return fail("the response to %s didn't come whole", path);
+    return 0;
+}
+
+/*
+ * header - Copy the value of the header name of resp into the size bytes
+ *     of buf, which is left empty if there is no such header. Returns buf.
+ */
+const char *header(const char *name, char *buf, size_t size) {
+    const struct http_slice *s;
+
+    s = http_find(resp.head.headers, resp.head.nheaders, name);
+    snprintf(buf, size, "%.*s", s != NULL ? (int)s->len : 0,
+             s != NULL ? s->p : "");
+    return buf;
+}
+
+/*
+ * check_range - Ask for range of path, which must give the bytes start
+ *     up to but not including end of the file. Returns -1 if not.
+ */
+int check_range(const char *path, const char *range, size_t start,
+                size_t end) {
+    char headers[MAXLINE], want[MAXLINE], buf[MAXLINE];
+
+    load(path);
+    snprintf(headers, sizeof(headers), "Range: %s\r\n", range);
+    if (get(path, headers) != 0)
+        return -1;
+    if (resp.head.status != 206)
+        return fail("%s of %s: status %d, not 206", range, path,
+                    resp.head.status);
+    snprintf(want, sizeof(want), "bytes %zu-%zu/%zu", start, end - 1,
+             filelen);
+    if (strcmp(header("Content-Range", buf, sizeof(buf)), want) != 0)
+        return fail("%s of %s: Content-Range is \"%s\", not \"%s\"",
+                    range, path, buf, want);
+    if (resp.bodylen != end - start
+        || memcmp(resp.body, file + start, end - start) != 0)
+        return fail("%s of %s: %zu bytes that aren't the %zu of the file",
+                    range, path, resp.bodylen, end - start);
+    return 0;
+}
+
+/*
+ * check_whole - Ask for path with headers, which must give all of the
+ *     file with a 200. Returns -1 if not.
+ */
+int check_whole(const char *path, const char *headers) {
+    load(path);
+    if (get(path, headers) != 0)
+        return -1;
+    if (resp.head.status != 200)
+        return fail("%s with %s: status %d, not 200", path, headers,
+                    resp.head.status);
+    if (resp.bodylen != filelen || memcmp(resp.body, file, filelen) != 0)
+        return fail("%s with %s: %zu bytes that aren't the %zu of the file",
+                    path, headers, resp.bodylen, filelen);
+    return 0;
+}
+
+/*
+ * check_part - Check that the part of a multipart body at *p, which ends
+ *     before end, holds the bytes start to last of the file, and move *p
+ *     past it. Returns -1 if not.
+ */
+int check_part(char **p, char *end, const char *boundary, size_t start,
+               size_t last) {
+    char delim[MAXLINE], range[MAXLINE];
+    char *head, *data;
+    size_t len;
+
+    len = snprintf(delim, sizeof(delim), "--%s\r\n", boundary);
+    if ((size_t)(end - *p) < len || memcmp(*p, delim, len) != 0)
+        return fail("no boundary before the part of %zu-%zu", start, last);
+    head = *p + len;
+    if ((data = memmem(head, end - head, "\r\n\r\n", 4)) == NULL)
+        return fail("the head of the part of %zu-%zu doesn't end", start,
+                    last);
+    len = snprintf(range, sizeof(range),
+                   "\r\nContent-Range: bytes %zu-%zu/%zu\r\n", start, last,
+                   filelen);
+    if (memmem(head - 2, data + 4 - (head - 2), range, len) == NULL)
+        return fail("the part of %zu-%zu has no Content-Range for it",
+                    start, last);
+    data += 4;
+    len = last + 1 - start;
+    if ((size_t)(end - data) < len + 2
+        || memcmp(data, file + start, len) != 0
+        || memcmp(data + len, "\r\n", 2) != 0)
+        return fail("the part of %zu-%zu doesn't hold those bytes", start,
+                    last);
+    *p = data + len + 2;
+    return 0;
+}
+
+/*
+ * check_identity - Ask for path with the Accept-Encoding value accept, or
+ *     none if it is NULL, which must give the file as it is, with Vary if
+ *     vary is set. Returns -1 if not.
+ */
+int check_identity(const char *path, const char *accept, int vary) {
+    char headers[MAXLINE], buf[MAXLINE];
+
+    snprintf(headers, sizeof(headers), "%s%s%s",
+             accept != NULL ? "Accept-Encoding: " : "",
+             accept != NULL ? accept : "", accept != NULL ? "\r\n" : "");
+    if (check_whole(path, headers) != 0)
+        return -1;
+    if (header("Content-Encoding", buf, sizeof(buf))[0] != '\0')
+        return fail("%s with %s: Content-Encoding is %s", path, headers,
+                    buf);
+    header("Vary", buf, sizeof(buf));
+    if (vary && strcmp(buf, "Accept-Encoding") != 0)
+        return fail("%s with %s: Vary is \"%s\"", path, headers, buf);
+    if (!vary && buf[0] != '\0')
+        return fail("%s with %s: Vary is there", path, headers);
+    return 0;
+}
+
+/*
+ * gunzip - Decompress the gzip stream of len bytes at src into the
+ *     *dstlen bytes at dst, and set *dstlen to how many it takes. Returns
+ *     -1 if it isn't a whole stream or doesn't fit.
+ */
+int gunzip(const char *src, size_t len, char *dst, size_t *dstlen) {
+    z_stream zs;
+    int rc;
+
+    memset(&zs, 0, sizeof(zs));
+    /* 16 more window bits take a gzip header only. */
+    if (inflateInit2(&zs, 15 + 16) != Z_OK)
+        return -1;
+    zs.next_in = (Bytef *)src;
+    zs.avail_in = len;
+    zs.next_out = (Bytef *)dst;
+    zs.avail_out = *dstlen;
+    rc = inflate(&zs, Z_FINISH);
+    *dstlen = zs.total_out;
+    inflateEnd(&zs);
+    return rc == Z_STREAM_END && zs.avail_in == 0 ? 0 : -1;
+}
+
+/*
+ * fail - Keep why the test failed for main() to print. Returns -1.
+ */
+int fail(const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(reason, sizeof(reason), fmt, ap);
+    va_end(ap);
+    return -1;
+}
+
+/* The file is 953 bytes, bootstrap.min.css is over 100 KB. */
+int test_single(void) {
+    if (check_range("/index.html", "bytes=0-99", 0, 100) != 0
+        || check_range("/index.html", "bytes=900-", 900, 953) != 0
+        || check_range("/index.html", "bytes=-100", 853, 953) != 0
+        || check_range("/index.html", "bytes=-5000", 0, 953) != 0
+        || check_range("/index.html", "bytes=952-5000", 952, 953) != 0
+        || check_range("/index.html", "bytes=0-0", 0, 1) != 0
+        || check_range("/static/bootstrap.min.css", "bytes=70000-99999",
+                       70000, 100000) != 0)
+        return -1;
+    return 0;
+}
+
+/*
+ * test_multipart - Ask for three ranges of the image, one of them past
+ *     its end and one clipped, and read the parts.
+ */
+int test_multipart(void) {
+    char type[MAXLINE], *boundary, *p, *end, delim[MAXLINE];
+    size_t len;
+
+    load("/static/kernel.png");
+    if (get("/static/kernel.png", "Range: bytes=0-9, 1000-1999,"
+                                  "90000-, -7\r\n") != 0)
+        return -1;
+    if (resp.head.status != 206)
+        return fail("status %d, not 206", resp.head.status);
+    header("Content-Type", type, sizeof(type));
+    if (strncmp(type, "multipart/byteranges; boundary=", 31) != 0)
+        return fail("Content-Type is \"%s\"", type);
+    boundary = type + 31;
+    p = resp.body;
+    end = resp.body + resp.bodylen;
+    if (check_part(&p, end, boundary, 0, 9) != 0
+        || check_part(&p, end, boundary, 1000, 1999) != 0
+        || check_part(&p, end, boundary, filelen - 7, filelen - 1) != 0)
+        return -1;
+    len = snprintf(delim, sizeof(delim), "--%s--\r\n", boundary);
+    if ((size_t)(end - p) != len || memcmp(p, delim, len) != 0)
+        return fail("the body doesn't end with the last boundary");
+    return 0;
+}
+
+int test_unsatisfiable(void) {
+    char buf[MAXLINE];
+
+    if (get("/index.html", "Range: bytes=953-\r\n") != 0)
+        return -1;
+    if (resp.head.status != 416)
+        return fail("status %d, not 416", resp.head.status);
+    if (strcmp(header("Content-Range", buf, sizeof(buf)), "bytes */953")
+        != 0)
+        return fail("Content-Range is \"%s\", not \"bytes */953\"", buf);
+    if (resp.bodylen != 0)
+        return fail("%zu bytes of body", resp.bodylen);
+    return 0;
+}
+
+/* Malformed ranges, other units, and more ranges than MAXRANGES. */
+int test_ignored(void) {
+    if (check_whole("/index.html", "Range: bytes=abc\r\n") != 0
+        || check_whole("/index.html", "Range: bytes=10-5\r\n") != 0
+        || check_whole("/index.html", "Range: items=0-1\r\n") != 0
+        || check_whole("/index.html", "Range: bytes=\r\n") != 0
+        || check_whole("/index.html", "Range: bytes=0-1,2-3,4-5,6-7,8-9,"
+                       "10-11,12-13,14-15,16-17,18-19,20-21,22-23,24-25,"
+                       "26-27,28-29,30-31,32-33\r\n") != 0)
+        return -1;
+    return 0;
+}
+
+/*
+ * test_if_range - A range is sent only while the file has the entity tag
+ *     or the Last-Modified date given. A weak tag never matches.
+ */
+int test_if_range(void) {
+    char etag[MAXLINE], date[MAXLINE], headers[MAXLINE * 2];
+
+    if (get("/about.html", "") != 0)
+        return -1;
+    header("ETag", etag, sizeof(etag));
+    header("Last-Modified", date, sizeof(date));
+    if (etag[0] != '"' || date[0] == '\0')
+        return fail("no strong ETag and Last-Modified to test with");
+    snprintf(headers, sizeof(headers), "bytes=10-19\r\nIf-Range: %s",
+             etag);
+    if (check_range("/about.html", headers, 10, 20) != 0)
+        return -1;
+    snprintf(headers, sizeof(headers), "bytes=10-19\r\nIf-Range: %s",
+             date);
+    if (check_range("/about.html", headers, 10, 20) != 0)
+        return -1;
+    snprintf(headers, sizeof(headers), "Range: bytes=10-19\r\n"
+                                       "If-Range: W/%s\r\n", etag);
+    if (check_whole("/about.html", headers) != 0)
+        return -1;
+    return check_whole("/about.html", "Range: bytes=10-19\r\n"
+                       "If-Range: \"0\"\r\n");
+}
+
+/*
+ * test_gzip - A text file comes gzipped to a client that takes gzip, with
+ *     an entity tag of its own, and as it is from a server that has no
+ *     cache to keep the gzipped one in.
+ */
+int test_gzip(void) {
+    static char data[MAXFILE];
+    char etag[MAXLINE], buf[MAXLINE];
+    size_t len = MAXFILE;
+
+    if (!cached)
+        return check_identity("/static/wiki.css", "gzip", 0);
+    if (get("/static/wiki.css", "") != 0)
+        return -1;
+    header("ETag", etag, sizeof(etag));
+    load("/static/wiki.css");
+    if (get("/static/wiki.css", "Accept-Encoding: gzip, deflate\r\n") != 0)
+        return -1;
+    if (resp.head.status != 200)
+        return fail("status %d, not 200", resp.head.status);
+    if (strcmp(header("Content-Encoding", buf, sizeof(buf)), "gzip") != 0)
+        return fail("Content-Encoding is \"%s\", not gzip", buf);
+    if (strcmp(header("Vary", buf, sizeof(buf)), "Accept-Encoding") != 0)
+        return fail("Vary is \"%s\", not Accept-Encoding", buf);
+    if (strcmp(header("ETag", buf, sizeof(buf)), etag) == 0)
+        return fail("the gzipped file has the ETag of the file, %s", etag);
+    if (resp.bodylen >= filelen)
+        return fail("%zu gzipped bytes for a file of %zu", resp.bodylen,
+                    filelen);
+    if (gunzip(resp.body, resp.bodylen, data, &len) != 0 || len != filelen
+        || memcmp(data, file, filelen) != 0)
+        return fail("the body doesn't gunzip to the file");
+    return 0;
+}
+
+/*
+ * test_identity - The file as it is goes to clients that don't take
+ *     gzip, or like it less than the file as it is, and for ranges. It
+ *     has Vary if the file has a gzipped variant. An image has none.
+ */
+int test_identity(void) {
+    if (check_identity("/static/wiki.css", NULL, cached) != 0
+        || check_identity("/static/wiki.css", "gzip;q=0", cached) != 0
+        || check_identity("/static/wiki.css", "br, deflate", cached) != 0
+        || check_identity("/static/wiki.css", "gzip;q=0.5, identity",
+                          cached) != 0
+        || check_identity("/static/wiki.css", "*;q=0", cached) != 0
+        || check_identity("/static/kernel.png", "gzip", 0) != 0)
+        return -1;
+    return check_range("/static/wiki.css",
+                       "bytes=100-199\r\nAccept-Encoding: gzip", 100, 200);
+}
+
+/*
+ * test_gzip_not_modified - The entity tag of the gzipped file gets a 304,
+ *     with Vary, from a client that takes gzip. It is no match for the
+ *     file as it is.
+ */
+int test_gzip_not_modified(void) {
+    char etag[MAXLINE], headers[MAXLINE * 2], buf[MAXLINE];
+
+    if (!cached)
+        return 0;
+    if (get("/static/wiki.css", "Accept-Encoding: gzip\r\n") != 0)
+        return -1;
+    header("ETag", etag, sizeof(etag));
+    snprintf(headers, sizeof(headers), "Accept-Encoding: gzip\r\n"
+                                       "If-None-Match: %s\r\n", etag);
+    if (get("/static/wiki.css", headers) != 0)
+        return -1;
+    if (resp.head.status != 304)
+        return fail("status %d, not 304", resp.head.status);
+    if (strcmp(header("Vary", buf, sizeof(buf)), "Accept-Encoding") != 0)
+        return fail("the 304 has Vary \"%s\"", buf);
+    snprintf(headers, sizeof(headers), "If-None-Match: %s\r\n", etag);
+    return check_whole("/static/wiki.css", headers);
+}
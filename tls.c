@@ -0,0 +1,296 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
+#include "tls.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <string.h>
+#include <openssl/err.h>
+
+/* New connections take ctx under the read lock, a reload swaps it. */
+static SSL_CTX *ctx = NULL;
+static pthread_rwlock_t ctxlock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* What the context is made of, kept for reloads. */
+static const char *certpath = NULL;
+static const char *keypath = NULL;
+static int alpn = 0;
+
+/* Protocols offered with ALPN, best first, in its wire format. */
+static const unsigned char alpn_h2[] = "\x02h2\x08http/1.1";
+
+/* Shared by all workers. */
+static unsigned long handshakes = 0;  /* Completed */
+static unsigned long resumed = 0;     /* ... of them resuming a session */
+static unsigned long offloaded = 0;   /* ... of them sending with kTLS */
+static unsigned long failures = 0;    /* Handshakes that failed */
+
+/*
+ * select_alpn - Pick HTTP/2 if the client offers it, or else HTTP/1.1.
+ *     A client offering neither gets no protocol, which means HTTP/1.1.
+ */
+static int select_alpn(SSL *ssl, const unsigned char **out,
+                       unsigned char *outlen, const unsigned char *in,
+                       unsigned inlen, void *arg) {
+    (void)ssl;
+    (void)arg;
+    if (SSL_select_next_proto((unsigned char **)out, outlen, alpn_h2,
+                              sizeof(alpn_h2) - 1, in, inlen)
+        != OPENSSL_NPN_NEGOTIATED)
+        return SSL_TLSEXT_ERR_NOACK;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+/*
+ * new_ctx - Return a context made of certpath and keypath, or NULL with
+ *     the OpenSSL errors printed on error.
+ */
+static SSL_CTX *new_ctx(void) {
+    static const unsigned char sid_ctx[] = "httpd";
+    SSL_CTX *c;
+
+    if ((c = SSL_CTX_new(TLS_server_method())) == NULL)
+        goto fail;
+    SSL_CTX_set_min_proto_version(c, TLS1_2_VERSION);
+    SSL_CTX_set_options(c, SSL_OP_ENABLE_KTLS
+                           | SSL_OP_IGNORE_UNEXPECTED_EOF
+                           | SSL_OP_NO_RENEGOTIATION
+                           | SSL_OP_CIPHER_SERVER_PREFERENCE);
+    /*
+     * Writes behave like send(2) on a non-blocking socket: they may be
+     * partial, and a retry may come from another buffer with the same
+     * bytes. Idle connections give their buffers back.
+     */
+    SSL_CTX_set_mode(c, SSL_MODE_ENABLE_PARTIAL_WRITE
+                        | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER
+                        | SSL_MODE_RELEASE_BUFFERS);
+    if (SSL_CTX_use_certificate_chain_file(c, certpath) != 1
+        || SSL_CTX_use_PrivateKey_file(c, keypath, SSL_FILETYPE_PEM) != 1
+        || SSL_CTX_check_private_key(c) != 1)
+        goto fail;
+    SSL_CTX_set_session_id_context(c, sid_ctx, sizeof(sid_ctx) - 1);
+    SSL_CTX_set_session_cache_mode(c, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(c, TLS_CACHE_SIZE);
+    if (alpn)
+        SSL_CTX_set_alpn_select_cb(c, select_alpn, NULL);
+    return c;
+
+fail:
+    ERR_print_errors_fp(stderr);
+    SSL_CTX_free(c);
+    return NULL;
+}
+
+/*
+ * tls_init - Set up the context connections are accepted with, from the
+ *     PEM certificate chain in cert and its private key in key, which are
+ *     read again by tls_reload(). Sessions are resumed from a cache, or
+ *     from the tickets clients are given, and once a handshake is done
+ *     the kernel takes over the records if it can. With http2, clients
+ *     may pick HTTP/2 with ALPN. Returns -1 with the OpenSSL errors
+ *     printed on error.
+ */
+int tls_init(const char *cert, const char *key, int http2) {
+    certpath = cert;
+    keypath = key;
+    alpn = http2;
+    return (ctx = new_ctx()) != NULL ? 0 : -1;
+}
+
+/*
+ * tls_reload - Read the certificate and key again, after they were
+ *     renewed. Connections accepted from now on use them, the others go
+ *     on with the ones they have. The tickets clients were given stay
+ *     good, but sessions cached in the old context are dropped. Returns
+ *     -1 with the OpenSSL errors printed, and the old context kept, on
+ *     error.
+ */
+int tls_reload(void) {
+    unsigned char keys[80];
+    SSL_CTX *fresh, *old;
+
+    if (ctx == NULL)
+        return 0;
+    if ((fresh = new_ctx()) == NULL)
+        return -1;
+    if (SSL_CTX_get_tlsext_ticket_keys(ctx, keys, sizeof(keys)) == 1)
+        SSL_CTX_set_tlsext_ticket_keys(fresh, keys, sizeof(keys));
+    OPENSSL_cleanse(keys, sizeof(keys));
+
+    pthread_rwlock_wrlock(&ctxlock);
+    old = ctx;
+    ctx = fresh;
+    pthread_rwlock_unlock(&ctxlock);
+    /* Connections still using it hold a reference. */
+    SSL_CTX_free(old);
+    return 0;
+}
+
+int tls_active(void) {
+    return ctx != NULL;
+}
+
+/*
+ * tls_new - Return the TLS state of the accepted connection fd, or NULL
+ *     on error.
+ */
+SSL *tls_new(int fd) {
+    SSL *ssl;
+
+    pthread_rwlock_rdlock(&ctxlock);
+    ssl = SSL_new(ctx);
+    pthread_rwlock_unlock(&ctxlock);
+    if (ssl == NULL)
+        return NULL;
+    if (SSL_set_fd(ssl, fd) != 1) {
+        SSL_free(ssl);
+        return NULL;
+    }
+    SSL_set_accept_state(ssl);
+    return ssl;
+}
+
+/*
+ * tls_handshake - Go on with the handshake of ssl as far as the socket
+ *     lets it. Once it is done, *ktls tells if the kernel encrypts what is
+ *     written to the socket, so that sendfile(2) and splice(2) work on it
+ *     as on a plain one. Returns 0 when it is done, 1 if it waits for the
+ *     socket and -1 if it failed.
+ */
+int tls_handshake(SSL *ssl, int *ktls) {
+    int rc;
+
+    ERR_clear_error();
+    if ((rc = SSL_do_handshake(ssl)) == 1) {
+#ifndef OPENSSL_NO_KTLS
+        *ktls = BIO_get_ktls_send(SSL_get_wbio(ssl));
+#else
+        *ktls = 0;
+#endif
+        __atomic_add_fetch(&handshakes, 1, __ATOMIC_RELAXED);
+        if (SSL_session_reused(ssl))
+            __atomic_add_fetch(&resumed, 1, __ATOMIC_RELAXED);
+        if (*ktls)
+            __atomic_add_fetch(&offloaded, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    switch (SSL_get_error(ssl, rc)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        return 1;
+    default:
+        __atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+        SSL_set_quiet_shutdown(ssl, 1);
+        return -1;
+    }
+}
+
+/*
+ * tls_alpn_h2 - Check if the client of ssl picked HTTP/2 in the handshake.
+ */
+int tls_alpn_h2(SSL *ssl) {
+    const unsigned char *proto;
+    unsigned len;
+
+    SSL_get0_alpn_selected(ssl, &proto, &len);
+    return len == 2 && memcmp(proto, "h2", 2) == 0;
+}
+
+/*
+ * tls_fail - Turn the error of the SSL_read() or SSL_write() on ssl that
+ *     returned rc into what read(2) or write(2) would have returned: 0
+ *     when the peer closed, else -1 with errno set, to EAGAIN if the
+ *     socket would block.
+ */
+static ssize_t tls_fail(SSL *ssl, int rc) {
+    switch (SSL_get_error(ssl, rc)) {
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_SYSCALL:
+        if (errno == 0)
+            errno = ECONNRESET;
+        break;
+    default:
+        errno = EPROTO;
+        break;
+    }
+    /* The session is broken, nothing more goes out on it. */
+    SSL_set_quiet_shutdown(ssl, 1);
+    return -1;
+}
+
+/*
+ * tls_read - Read up to len bytes of application data from ssl, like
+ *     read(2) on its socket.
+ */
+ssize_t tls_read(SSL *ssl, void *buf, size_t len) {
+    int rc;
+
+    ERR_clear_error();
+    errno = 0;
+    if ((rc = SSL_read(ssl, buf, len > INT_MAX ? INT_MAX : len)) > 0)
+        return rc;
+    return tls_fail(ssl, rc);
+}
+
+/*
+ * tls_write - Write up to len bytes of application data to ssl, like
+ *     write(2) on its socket. After it fails with EAGAIN, the same bytes
+ *     must come first in the next call.
+ */
+ssize_t tls_write(SSL *ssl, const void *buf, size_t len) {
+    int rc;
+
+    if (len == 0)
+        return 0;
+    ERR_clear_error();
+    errno = 0;
+    if ((rc = SSL_write(ssl, buf, len > INT_MAX ? INT_MAX : len)) > 0)
+        return rc;
+    return tls_fail(ssl, rc);
+}
+
+/*
+ * tls_close - Tell the peer of ssl that we are closing, unless the session
+ *     broke, and free ssl. The socket is left to the caller.
+ */
+void tls_close(SSL *ssl) {
+    ERR_clear_error();
+    if (SSL_is_init_finished(ssl) && !SSL_get_quiet_shutdown(ssl))
+        SSL_shutdown(ssl);
+    SSL_free(ssl);
+}
+
+/*
+ * tls_write_metrics - Write the handshake counters to fp in the
+ *     Prometheus text format.
+ */
+void tls_write_metrics(FILE *fp) {
+    if (ctx == NULL)
+        return;
+    fprintf(fp, "# HELP httpd_tls_handshakes_total Completed TLS "
+                "handshakes.\n"
+                "# TYPE httpd_tls_handshakes_total counter\n"
+                "httpd_tls_handshakes_total %lu\n"
+                "# HELP httpd_tls_resumed_total TLS handshakes that resumed "
+                "a session.\n"
+                "# TYPE httpd_tls_resumed_total counter\n"
+                "httpd_tls_resumed_total %lu\n"
+                "# HELP httpd_tls_ktls_total TLS connections the kernel "
+                "encrypts for.\n"
+                "# TYPE httpd_tls_ktls_total counter\n"
+                "httpd_tls_ktls_total %lu\n"
+                "# HELP httpd_tls_failures_total Failed TLS handshakes.\n"
+                "# TYPE httpd_tls_failures_total counter\n"
+                "httpd_tls_failures_total %lu\n",
+                __atomic_load_n(&handshakes, __ATOMIC_RELAXED),
+                __atomic_load_n(&resumed, __ATOMIC_RELAXED),
+                __atomic_load_n(&offloaded, __ATOMIC_RELAXED),
+                __atomic_load_n(&failures, __ATOMIC_RELAXED));
+}
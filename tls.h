@@ -0,0 +1,22 @@
+#ifndef _TLS_H
+#define _TLS_H
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <openssl/ssl.h>
+
+#define TLS_CACHE_SIZE  20480  /* Sessions the server keeps for resumption */
+#define TLS_RECORD      16384  /* Max plaintext in one record */
+
+int tls_init(const char *cert, const char *key, int http2);
+int tls_reload(void);
+int tls_active(void);
+SSL *tls_new(int fd);
+int tls_handshake(SSL *ssl, int *ktls);
+int tls_alpn_h2(SSL *ssl);
+ssize_t tls_read(SSL *ssl, void *buf, size_t len);
+ssize_t tls_write(SSL *ssl, const void *buf, size_t len);
+void tls_close(SSL *ssl);
+void tls_write_metrics(FILE *fp);
+
+#endif
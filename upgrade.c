@@ -0,0 +1,271 @@
+#define _GNU_SOURCE
+
+#include "upgrade.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "error.h"
+
+#ifndef CLOSE_RANGE_CLOEXEC
+#define CLOSE_RANGE_CLOEXEC (1U << 2)
+#endif
+
+extern char **environ;
+
+/* In a new process, the channel to the old one until we are ready. */
+static int chanfd = -1;
+
+/* The binary to start on an upgrade, empty if we couldn't tell. */
+static char selfpath[PATH_MAX];
+
+/* The sockets and a count of them, as one message. */
+union fdmsg {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(UPGRADE_MAXFDS * sizeof(int))];
+};
+
+/*
+ * cloexec_all - Have every descriptor from 3 up closed by execve(2), with
+ *     one system call if the kernel has close_range(2), or else one per
+ *     descriptor below maxfd. Safe between fork(2) and execve(2).
+ */
+static void cloexec_all(int maxfd) {
+    int fd;
+
+#ifdef __NR_close_range
+    if (syscall(__NR_close_range, 3, ~0U, CLOSE_RANGE_CLOEXEC) == 0)
+        return;
+#endif
+    for (fd = 3; fd < maxfd; ++fd)
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
+
+/*
+ * send_fds - Send the n descriptors at fds over the unix socket sock.
+ *     Returns -1 with errno set on error.
+ */
+static int send_fds(int sock, const int *fds, int n) {
+    union fdmsg u;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    ssize_t rc;
+
+    memset(&u, 0, sizeof(u));
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &n;
+    iov.iov_len = sizeof(n);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = u.buf;
+    msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, n * sizeof(int));
+    while ((rc = sendmsg(sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+        ;
+    return rc == sizeof(n) ? 0 : -1;
+}
+
+/*
+ * wait_ready - Wait up to UPGRADE_TIMEOUT ms for the new process at the
+ *     other end of sock to say it serves. Returns -1 with errno set if it
+ *     doesn't, ECHILD if it quit.
+ */
+static int wait_ready(int sock) {
+    struct pollfd pfd;
+    ssize_t n;
+    char c;
+    int rc;
+
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+    while ((rc = poll(&pfd, 1, UPGRADE_TIMEOUT)) < 0 && errno == EINTR)
+        ;
+    if (rc < 0)
+        return -1;
+    if (rc == 0) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    while ((n = read(sock, &c, 1)) < 0 && errno == EINTR)
+        ;
+    if (n == 0)
+        errno = ECHILD;
+    return n == 1 ? 0 : -1;
+}
+
+/*
+ * upgrade_init - Find the binary we were started from, argv0, for
+ *     upgrade_start() to start again: where /proc/self/exe points, or
+ *     else argv0 resolved against the working directory. Returns -1 with
+ *     errno set if neither works, and upgrades fail.
+ */
+int upgrade_init(const char *argv0) {
+    ssize_t n;
+
+    if ((n = readlink("/proc/self/exe", selfpath, sizeof(selfpath) - 1))
+        > 0) {
+        selfpath[n] = '\0';
+        return 0;
+    }
+    if (realpath(argv0, selfpath) != NULL)
+        return 0;
+    selfpath[0] = '\0';
+    return -1;
+}
+
+/*
+ * upgrade_start - Start the binary found by upgrade_init() again with
+ *     argv, which may be a new binary by now, and hand it the n listening
+ *     sockets at fds over a unix socket. The new process finds the socket
+ *     in UPGRADE_ENV and says when it serves, see upgrade_inherit() and
+ *     upgrade_ready().
+ *     Returns its pid then. If it fails or doesn't get ready in time, it
+ *     is killed and -1 returned with errno set, and we go on serving.
+ */
+pid_t upgrade_start(char *const argv[], const int *fds, int n) {
+    char var[sizeof(UPGRADE_ENV) + 16], **envp;
+    struct rlimit rl;
+    sigset_t none;
+    int sv[2], i, nenv, maxfd, err;
+    pid_t pid;
+
+    if (n < 1 || n > UPGRADE_MAXFDS) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (selfpath[0] == '\0') {
+        errno = ENOENT;
+        return -1;
+    }
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0)
+        return -1;
+
+    /* The child may only make async-signal-safe calls, so prepare here. */
+    snprintf(var, sizeof(var), "%s=%d", UPGRADE_ENV, sv[1]);
+    for (nenv = 0; environ[nenv] != NULL; ++nenv)
+        ;
+    if ((envp = malloc((nenv + 2) * sizeof(char *))) == NULL) {
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    envp[0] = var;
+    for (i = 0; i < nenv; ++i)
+        envp[i + 1] = environ[i];
+    envp[nenv + 1] = NULL;
+    maxfd = getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < 1 << 20
+            ? (int)rl.rlim_cur : 1 << 20;
+    sigemptyset(&none);
+    fflush(stdout);
+    fflush(stderr);
+
+    if ((pid = fork()) < 0) {
+        err = errno;
+        free(envp);
+        close(sv[0]);
+        close(sv[1]);
+        errno = err;
+        return -1;
+    }
+    if (pid == 0) {
+        /* Nothing of ours but the channel is left to the new process. */
+        cloexec_all(maxfd);
+        fcntl(sv[1], F_SETFD, 0);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        execve(selfpath, argv, envp);
+        _exit(127);
+    }
+    free(envp);
+    close(sv[1]);
+
+    if (send_fds(sv[0], fds, n) != 0 || wait_ready(sv[0]) != 0) {
+        err = errno;
+        kill(pid, SIGKILL);
+        while (waitpid(pid, NULL, 0) < 0 && errno == EINTR)
+            ;
+        close(sv[0]);
+        errno = err;
+        return -1;
+    }
+    close(sv[0]);
+    return pid;
+}
+
+/*
+ * upgrade_inherit - If we were started by upgrade_start(), store up to max
+ *     of the listening sockets handed over in fds. Returns how many, 0 if
+ *     we weren't, or -1 with errno set on error.
+ */
+int upgrade_inherit(int *fds, int max) {
+    union fdmsg u;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    const char *s;
+    ssize_t rc;
+    int count, fd, i, n;
+
+    if ((s = getenv(UPGRADE_ENV)) == NULL)
+        return 0;
+    chanfd = atoi(s);
+    unsetenv(UPGRADE_ENV);
+    if (fcntl(chanfd, F_SETFD, FD_CLOEXEC) != 0)
+        return -1;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &count;
+    iov.iov_len = sizeof(count);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = u.buf;
+    msg.msg_controllen = sizeof(u.buf);
+    while ((rc = recvmsg(chanfd, &msg, MSG_CMSG_CLOEXEC)) < 0
+           && errno == EINTR)
+        ;
+    if (rc < 0)
+        return -1;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (rc != sizeof(count) || (msg.msg_flags & MSG_CTRUNC) || cmsg == NULL
+        || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        errno = EPROTO;
+        return -1;
+    }
+    n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (i = 0; i < n; ++i) {
+        memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+        if (i < max)
+            fds[i] = fd;
+        else
+            close(fd);
+    }
+    return n < max ? n : max;
+}
+
+/*
+ * upgrade_ready - Tell the process that started us, if one did, that we
+ *     serve now, so that it can stop accepting.
+ */
+void upgrade_ready(void) {
+    if (chanfd < 0)
+        return;
+    if (write(chanfd, "", 1) != 1)
+        unix_err("write error, the old process gives up on us");
+    close(chanfd);
+    chanfd = -1;
+}
@@ -0,0 +1,15 @@
+#ifndef _UPGRADE_H
+#define _UPGRADE_H
+
+#include <sys/types.h>
+
+#define UPGRADE_ENV      "HTTPD_UPGRADE_FD"  /* Channel of a new process */
+#define UPGRADE_MAXFDS   256     /* Listening sockets handed over at most */
+#define UPGRADE_TIMEOUT  10000   /* ms the new process has to get ready */
+
+int upgrade_init(const char *argv0);
+pid_t upgrade_start(char *const argv[], const int *fds, int n);
+int upgrade_inherit(int *fds, int max);
+void upgrade_ready(void);
+
+#endif
@@ -0,0 +1,317 @@
+#define _GNU_SOURCE
+
+#include "uring.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned submit, unsigned wait, unsigned flags,
+                     void *arg, size_t argsz) {
+    return syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, argsz);
+}
+
+static int sys_register(int fd, unsigned opcode, void *arg, unsigned nargs) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nargs);
+}
+
+/*
+ * uring_init - Set up r with room for entries submissions. Only one
+ *     thread may use it. Returns -1 with errno set on error, ENOSYS if
+ *     the kernel is too old for what we need.
+ */
+int uring_init(struct uring *r, unsigned entries) {
+    struct io_uring_params p;
+    char *sq, *cq;
+    int rc;
+
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+    /* Hints for kernels that know them, we never share a ring. */
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    if ((r->fd = sys_setup(entries, &p)) < 0 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        r->fd = sys_setup(entries, &p);
+    }
+    if (r->fd < 0)
+        return -1;
+    if (!(p.features & IORING_FEAT_EXT_ARG)
+        || !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(r->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (r->cq_len > r->sq_len)
+        r->sq_len = r->cq_len;
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED)
+        goto fail;
+    r->cq_ptr = r->sq_ptr;
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        munmap(r->sq_ptr, r->sq_len);
+        goto fail;
+    }
+
+    sq = r->sq_ptr;
+    cq = r->cq_ptr;
+    r->sq_entries = p.sq_entries;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->sq_local = *r->sq_tail;
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+
+fail:
+    rc = errno;
+    close(r->fd);
+    errno = rc;
+    return -1;
+}
+
+/*
+ * uring_supported - Check that the kernel lets us set up a ring. It may
+ *     be too old, or have io_uring turned off.
+ */
+int uring_supported(void) {
+    struct uring r;
+
+    if (uring_init(&r, 8) != 0)
+        return 0;
+    uring_destroy(&r);
+    return 1;
+}
+
+/*
+ * uring_destroy - Tear r down. Requests still in flight are cancelled.
+ */
+void uring_destroy(struct uring *r) {
+    munmap(r->sqes, r->sqes_len);
+    munmap(r->sq_ptr, r->sq_len);
+    close(r->fd);
+}
+
+/*
+ * uring_sqe - Return a cleared submission queue entry, or NULL if the
+ *     queue is full and has to be submitted first.
+ */
+struct io_uring_sqe *uring_sqe(struct uring *r) {
+    struct io_uring_sqe *sqe;
+    unsigned idx;
+
+    if (uring_space(r) == 0)
+        return NULL;
+    idx = r->sq_local & *r->sq_mask;
+    sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+    r->sq_local++;
+    r->pending++;
+    return sqe;
+}
+
+/*
+ * uring_space - Return how many entries uring_sqe() can hand out before
+ *     the queue has to be submitted.
+ */
+unsigned uring_space(struct uring *r) {
+    return r->sq_entries
+           - (r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE));
+}
+
+/*
+ * uring_enter - Submit the pending entries and wait until at least wait
+ *     completions are there or timeout_ms has passed. Returns -1 with
+ *     errno set on error, running out of time is not one.
+ */
+int uring_enter(struct uring *r, unsigned wait, int timeout_ms) {
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned flags = 0;
+    int n;
+
+    __atomic_store_n(r->sq_tail, r->sq_local, __ATOMIC_RELEASE);
+    memset(&arg, 0, sizeof(arg));
+    if (wait > 0) {
+        flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+    n = sys_enter(r->fd, r->pending, wait, flags, wait > 0 ? &arg : NULL,
+                  wait > 0 ? sizeof(arg) : 0);
+    if (n < 0)
+        return (errno == ETIME || errno == EINTR || errno == EBUSY
+                || errno == EAGAIN) ? 0 : -1;
+    r->pending -= n;
+    return 0;
+}
+
+/*
+ * uring_peek - Return the next completion, or NULL if there is none. It
+ *     stays valid until uring_seen().
+ */
+struct io_uring_cqe *uring_peek(struct uring *r) {
+    unsigned head = *r->cq_head;
+
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &r->cqes[head & *r->cq_mask];
+}
+
+void uring_seen(struct uring *r) {
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * uring_bufring_init - Register nbufs buffers of bufsize bytes as group
+ *     bgid of r. nbufs must be a power of two. Returns -1 with errno set
+ *     on error.
+ */
+int uring_bufring_init(struct uring *r, struct uring_bufring *b,
+                       unsigned short bgid, unsigned nbufs, unsigned bufsize) {
+    struct io_uring_buf_reg reg;
+    unsigned i;
+    int rc;
+
+    memset(b, 0, sizeof(*b));
+    b->br = mmap(NULL, nbufs * sizeof(struct io_uring_buf),
+                 PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (b->br == MAP_FAILED)
+        return -1;
+    b->nbufs = nbufs;
+    b->bufsize = bufsize;
+    b->bgid = bgid;
+    if ((b->bufs = malloc((size_t)nbufs * bufsize)) == NULL) {
+        munmap(b->br, nbufs * sizeof(struct io_uring_buf));
+        return -1;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)b->br;
+    reg.ring_entries = nbufs;
+    reg.bgid = bgid;
+    if (sys_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        rc = errno;
+        uring_bufring_destroy(b);
+        errno = rc;
+        return -1;
+    }
+    for (i = 0; i < nbufs; ++i)
+        uring_buf_put(b, i);
+    return 0;
+}
+
+/*
+ * uring_bufring_destroy - Free the buffers of b. Its ring must be gone.
+ */
+void uring_bufring_destroy(struct uring_bufring *b) {
+    munmap(b->br, b->nbufs * sizeof(struct io_uring_buf));
+    free(b->bufs);
+}
+
+char *uring_buf(struct uring_bufring *b, unsigned short bid) {
+    return b->bufs + (size_t)bid * b->bufsize;
+}
+
+/*
+ * uring_buf_put - Give buffer bid back to the kernel, once its data has
+ *     been consumed.
+ */
+void uring_buf_put(struct uring_bufring *b, unsigned short bid) {
+    struct io_uring_buf *buf = &b->br->bufs[b->tail & (b->nbufs - 1)];
+
+    buf->addr = (uint64_t)(uintptr_t)uring_buf(b, bid);
+    buf->len = b->bufsize;
+    buf->bid = bid;
+    b->tail++;
+    __atomic_store_n(&b->br->tail, b->tail, __ATOMIC_RELEASE);
+}
+
+/*
+ * uring_prep_accept - Accept connections on fd until cancelled. Every
+ *     connection completes with IORING_CQE_F_MORE set while the request
+ *     stays armed.
+ */
+void uring_prep_accept(struct io_uring_sqe *sqe, int fd, uint64_t data) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = data;
+}
+
+/*
+ * uring_prep_recv - Receive into buf, or if bgid is not negative into a
+ *     buffer the kernel takes from that group.
+ */
+void uring_prep_recv(struct io_uring_sqe *sqe, int fd, void *buf, size_t len,
+                     int bgid, uint64_t data) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    if (bgid >= 0) {
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = bgid;
+    }
+    else {
+        sqe->addr = (uint64_t)(uintptr_t)buf;
+        sqe->len = len;
+    }
+    sqe->user_data = data;
+}
+
+void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd,
+                        const struct msghdr *msg, int flags, uint64_t data) {
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = flags;
+    sqe->user_data = data;
+}
+
+/*
+ * uring_prep_splice - Move len bytes from fdin at offset offin, or its
+ *     current position if offin is -1, to fdout.
+ */
+void uring_prep_splice(struct io_uring_sqe *sqe, int fdin, int64_t offin,
+                       int fdout, size_t len, uint64_t data) {
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->splice_fd_in = fdin;
+    sqe->splice_off_in = (uint64_t)offin;
+    sqe->fd = fdout;
+    sqe->off = (uint64_t)-1;
+    sqe->len = len;
+    sqe->splice_flags = SPLICE_F_MOVE;
+    sqe->user_data = data;
+}
+
+/*
+ * uring_prep_cancel - Cancel every request on fd.
+ */
+void uring_prep_cancel(struct io_uring_sqe *sqe, int fd, uint64_t data) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = data;
+}
@@ -0,0 +1,59 @@
+#ifndef _URING_H
+#define _URING_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+/*
+ * A minimal io_uring, set up with the raw system calls. Submission queue
+ * entries are filled in with the uring_prep_* functions and go to the
+ * kernel on the next uring_enter().
+ */
+struct uring {
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_local;         /* Our tail, published on uring_enter() */
+    unsigned pending;          /* Entries not submitted yet */
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+};
+
+/* A ring of equally sized buffers the kernel picks receive buffers from. */
+struct uring_bufring {
+    struct io_uring_buf_ring *br;
+    char *bufs;
+    unsigned nbufs, bufsize;
+    unsigned short bgid, tail;
+};
+
+int uring_supported(void);
+int uring_init(struct uring *r, unsigned entries);
+void uring_destroy(struct uring *r);
+struct io_uring_sqe *uring_sqe(struct uring *r);
+unsigned uring_space(struct uring *r);
+int uring_enter(struct uring *r, unsigned wait, int timeout_ms);
+struct io_uring_cqe *uring_peek(struct uring *r);
+void uring_seen(struct uring *r);
+
+int uring_bufring_init(struct uring *r, struct uring_bufring *b,
+                       unsigned short bgid, unsigned nbufs, unsigned bufsize);
+void uring_bufring_destroy(struct uring_bufring *b);
+char *uring_buf(struct uring_bufring *b, unsigned short bid);
+void uring_buf_put(struct uring_bufring *b, unsigned short bid);
+
+void uring_prep_accept(struct io_uring_sqe *sqe, int fd, uint64_t data);
+void uring_prep_recv(struct io_uring_sqe *sqe, int fd, void *buf, size_t len,
+                     int bgid, uint64_t data);
+void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd,
+                        const struct msghdr *msg, int flags, uint64_t data);
+void uring_prep_splice(struct io_uring_sqe *sqe, int fdin, int64_t offin,
+                       int fdout, size_t len, uint64_t data);
+void uring_prep_cancel(struct io_uring_sqe *sqe, int fd, uint64_t data);
+
+#endif
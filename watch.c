@@ -0,0 +1,275 @@
+#define _POSIX_C_SOURCE 200809L
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
+
+#include "watch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <stdint.h>
+
+#include "error.h"
+#include "cache.h"
+
+/* Everything that can make a cached file or directory index stale. */
+#define WATCH_MASK (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE \
+                    | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO \
+                    | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+static int inotifyfd = -1;
+static int stopfd = -1;
+static pthread_t watch_tid;
+static int started = 0;
+static volatile int active = 0;  /* Cleared if watching falls behind */
+
+/* Directory path of every watch descriptor, indexed by it. */
+static char **paths = NULL;
+static int npaths = 0;
+
+static void *watch_thread(void *arg);
+
+/*
+ * join_path - Join dir and name the way request paths are built from
+ *     workdir, so that the result matches cache keys. Returns the length
+ *     the result would have without truncation.
+ */
+static int join_path(char *buf, size_t size, const char *dir,
+                     const char *name) {
+    if (strcmp(dir, "/") == 0)
+        return snprintf(buf, size, "/%s", name);
+    return snprintf(buf, size, "%s/%s", dir, name);
+}
+
+/*
+ * add_tree - Watch directory dir and every directory below it. Returns -1
+ *     if we run out of watches, in which case the caller can't rely on
+ *     inotify any more.
+ */
+static int add_tree(const char *dir) {
+    int wd;
+    DIR *dp;
+    struct dirent *de;
+    struct stat sbuf;
+    char sub[PATH_MAX], **newpaths;
+
+    if ((wd = inotify_add_watch(inotifyfd, dir, WATCH_MASK)) < 0)
+        return (errno == ENOENT || errno == ENOTDIR) ? 0 : -1;
+    if (wd >= npaths) {
+        if ((newpaths = realloc(paths, (wd + 64) * sizeof(char *))) == NULL)
+            return -1;
+        memset(newpaths + npaths, 0, (wd + 64 - npaths) * sizeof(char *));
+        paths = newpaths;
+        npaths = wd + 64;
+    }
+    free(paths[wd]);
+    if ((paths[wd] = strdup(dir)) == NULL)
+        return -1;
+
+    if ((dp = opendir(dir)) == NULL)
+        return 0; /* Gone already, its parent will tell us */
+    while ((de = readdir(dp)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        join_path(sub, sizeof(sub), dir, de->d_name);
+        if (de->d_type == DT_DIR
+            || (de->d_type == DT_UNKNOWN && lstat(sub, &sbuf) == 0
+                && S_ISDIR(sbuf.st_mode))) {
+            if (add_tree(sub) != 0) {
+                closedir(dp);
+                return -1;
+            }
+        }
+    }
+    closedir(dp);
+    return 0;
+}
+
+/*
+ * remove_tree - Stop watching dir and everything below it, because it
+ *     has been moved away and is no longer under the same path.
+ */
+static void remove_tree(const char *dir) {
+    int wd;
+    size_t len = strlen(dir);
+
+    for (wd = 0; wd < npaths; ++wd) {
+        if (paths[wd] != NULL && strncmp(paths[wd], dir, len) == 0
+            && (paths[wd][len] == '\0' || paths[wd][len] == '/'))
+            inotify_rm_watch(inotifyfd, wd);
+    }
+}
+
+/*
+ * invalidate_path - Drop whatever the cache holds for path. If path is a
+ *     directory that covers everything below it, if it is an index the
+ *     directory it serves as well, and if it is a precompressed .gz or
+ *     .br file the file it is a variant of.
+ */
+static void invalidate_path(const char *dir, const char *name, int isdir) {
+    char path[PATH_MAX], prefix[PATH_MAX + 1];
+    size_t len = strlen(name);
+
+    if (!isdir && len > 3 && (strcmp(name + len - 3, ".gz") == 0
+                              || strcmp(name + len - 3, ".br") == 0)) {
+        snprintf(path, sizeof(path), "%.*s", (int)(len - 3), name);
+        invalidate_path(dir, path, 0);
+    }
+
+    join_path(path, sizeof(path), dir, name);
+    cache_invalidate(path);
+    if (isdir) {
+        join_path(prefix, sizeof(prefix), path, "");
+        cache_invalidate_prefix(prefix);
+    }
+    if (strcmp(name, "index.html") == 0) {
+        join_path(prefix, sizeof(prefix), dir, "");
+        cache_invalidate(dir);
+        cache_invalidate(prefix);
+    }
+}
+
+/*
+ * watch_start - Watch the tree under dir and invalidate cached files as
+ *     soon as they change, are renamed or deleted. Returns -1 with errno
+ *     set if inotify can't cover the tree.
+ */
+int watch_start(const char *dir) {
+    int rc;
+
+    if ((inotifyfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+        return -1;
+    if ((stopfd = eventfd(0, EFD_CLOEXEC)) < 0 || add_tree(dir) != 0) {
+        rc = errno;
+        watch_stop();
+        errno = rc;
+        return -1;
+    }
+    if ((rc = pthread_create(&watch_tid, NULL, watch_thread, NULL)) != 0) {
+        watch_stop();
+        errno = rc;
+        return -1;
+    }
+    started = active = 1;
+    return 0;
+}
+
+/*
+ * watch_stop - Stop watching and release everything.
+ */
+void watch_stop(void) {
+    int i;
+    uint64_t one = 1;
+
+    if (started) {
+        if (write(stopfd, &one, sizeof(one)) != sizeof(one))
+            unix_errq("eventfd write error");
+        pthread_join(watch_tid, NULL);
+        started = active = 0;
+    }
+    if (inotifyfd >= 0)
+        close(inotifyfd);
+    if (stopfd >= 0)
+        close(stopfd);
+    inotifyfd = stopfd = -1;
+    for (i = 0; i < npaths; ++i)
+        free(paths[i]);
+    free(paths);
+    paths = NULL;
+    npaths = 0;
+}
+
+/*
+ * watch_active - Nonzero while cached files are known to be current.
+ */
+int watch_active(void) {
+    return active;
+}
+
+static void *watch_thread(void *arg) {
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char path[PATH_MAX];
+    const struct inotify_event *ev;
+    struct pollfd fds[2];
+    sigset_t mask;
+    ssize_t n;
+    char *p;
+    int rc;
+
+    /* Block all signals. */
+    sigfillset(&mask);
+    if ((rc = pthread_sigmask(SIG_SETMASK, &mask, NULL)) != 0)
+        posix_errq(rc, "pthread_sigmask error");
+
+    fds[0].fd = inotifyfd;
+    fds[0].events = POLLIN;
+    fds[1].fd = stopfd;
+    fds[1].events = POLLIN;
+    while (1) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            unix_errq("poll error");
+        }
+        if (fds[1].revents & POLLIN)
+            break;
+
+        if ((n = read(inotifyfd, buf, sizeof(buf))) < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                continue;
+            unix_errq("inotify read error");
+        }
+
+        for (p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+            ev = (const struct inotify_event *)p;
+
+            /* We lost events, so nothing cached can be trusted. */
+            if (ev->mask & IN_Q_OVERFLOW) {
+                cache_invalidate_prefix("");
+                continue;
+            }
+            if (ev->wd < 0 || ev->wd >= npaths || paths[ev->wd] == NULL)
+                continue;
+            if (ev->mask & IN_IGNORED) {
+                free(paths[ev->wd]);
+                paths[ev->wd] = NULL;
+                continue;
+            }
+
+            /* The watched directory itself went away. */
+            if (ev->len == 0) {
+                if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+                    cache_invalidate(paths[ev->wd]);
+                    join_path(path, sizeof(path), paths[ev->wd], "");
+                    cache_invalidate_prefix(path);
+                }
+                continue;
+            }
+
+            invalidate_path(paths[ev->wd], ev->name, ev->mask & IN_ISDIR);
+            if (!(ev->mask & IN_ISDIR))
+                continue;
+            join_path(path, sizeof(path), paths[ev->wd], ev->name);
+            if (ev->mask & IN_MOVED_FROM)
+                remove_tree(path);
+            else if ((ev->mask & (IN_CREATE | IN_MOVED_TO))
+                     && add_tree(path) != 0) {
+                /* Out of watches: fall back to checking files again. */
+                app_err("inotify can't watch %s, revalidating instead", path);
+                cache_invalidate_prefix("");
+                active = 0;
+            }
+        }
+    }
+    return NULL;
+}
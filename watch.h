@@ -0,0 +1,8 @@
+#ifndef _WATCH_H
+#define _WATCH_H
+
+int watch_start(const char *dir);
+void watch_stop(void);
+int watch_active(void);
+
+#endif